@@ -3,6 +3,8 @@ TEMPLATE = subdirs
 SUBDIRS += \
     gryptonite \
     grypto_transforms \
-    grypto_rng
+    grypto_rng \
+    grypto_vaultgen \
+    gryptonite_cli
 
 CONFIG += ordered
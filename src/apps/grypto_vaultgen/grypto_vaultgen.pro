@@ -0,0 +1,31 @@
+#-------------------------------------------------
+#
+# Generates large synthetic vaults for testing and benchmarking
+#
+#-------------------------------------------------
+
+QT       += core sql xml
+QT       -= gui
+
+TOP_DIR = ../../..
+
+TEMPLATE = app
+TARGET = grypto_vaultgen
+CONFIG   += console
+CONFIG   -= app_bundle
+unix: QMAKE_RPATHDIR =
+DESTDIR = $$TOP_DIR/bin
+
+QMAKE_CXXFLAGS += -std=c++11
+
+DEFINES += GUTIL_CORE_QT_ADAPTERS
+
+INCLUDEPATH += $$TOP_DIR/gutil/include $$TOP_DIR/include
+LIBS += -L$$TOP_DIR/lib -L$$TOP_DIR/gutil/lib \
+    -lgrypto_core \
+    -lGUtilQt \
+    -lGUtilCryptoPP \
+    -lGUtil \
+    -lcryptopp
+
+SOURCES += main.cpp
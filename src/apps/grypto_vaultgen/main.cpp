@@ -0,0 +1,320 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include <grypto/common.h>
+#include <grypto/passworddatabase.h>
+#include <grypto/entry.h>
+#include <grypto/tracer.h>
+#include <grypto/sqlprofiler.h>
+#include <gutil/cryptopp_rng.h>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QFile>
+#include <QQueue>
+#include <random>
+#include <cmath>
+#include <cstring>
+using namespace std;
+USING_NAMESPACE_GRYPTO;
+
+// The salts and nonces still come from the crypto RNG; only the
+//  content of the vault comes from the seeded generator
+static GUtil::CryptoPP::RNG __cryptopp_rng;
+static GUtil::RNG_Initializer __rng_init(&__cryptopp_rng);
+
+static const char *VALUE_NAMES[] = {
+    "Username", "Password", "Email", "URL", "PIN", "Security Question", "Account Number"
+};
+
+static const char *WORDS[] = {
+    "bank", "mail", "work", "home", "shopping", "forum", "social", "travel",
+    "school", "router", "server", "games", "music", "news", "cloud", "phone"
+};
+
+#define COUNT_OF(a) (sizeof(a) / sizeof(a[0]))
+
+// EntryIds and FileIds are both this many bytes
+#define ID_SIZE 16
+
+
+/** The settings given on the command line. */
+struct settings_t
+{
+    int entries;
+    int depth;
+    int fanout;
+    int values;
+    double favorite_ratio;
+    double attachment_ratio;
+    int attachment_min;
+    int attachment_max;
+    quint64 seed;
+    int batch_size;
+    bool dump_metrics;
+};
+
+
+/** Generates the content of the vault. The same seed and settings always
+ *  produce the same entries with the same ids.
+*/
+class Generator
+{
+    const settings_t &m_settings;
+    mt19937_64 m_rng;
+public:
+    Generator(const settings_t &s) :m_settings(s), m_rng(s.seed) {}
+
+    QByteArray RandomBytes(int len){
+        QByteArray ret(len, Qt::Uninitialized);
+        for(int i = 0; i < len; i += sizeof(quint64)){
+            quint64 r = m_rng();
+            memcpy(ret.data() + i, &r, qMin<int>(sizeof(r), len - i));
+        }
+        return ret;
+    }
+
+    QString RandomText(int len){
+        static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+                                    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%^&*";
+        uniform_int_distribution<int> d(0, sizeof(chars) - 2);
+        QString ret;
+        ret.reserve(len);
+        for(int i = 0; i < len; ++i)
+            ret.append(QChar(chars[d(m_rng)]));
+        return ret;
+    }
+
+    bool Chance(double ratio){
+        return bernoulli_distribution(ratio)(m_rng);
+    }
+
+    // Attachment sizes are spread evenly over orders of magnitude, so most
+    //  are small and a few are big, like real vaults
+    int AttachmentSize(){
+        uniform_real_distribution<double> d(log((double)qMax(1, m_settings.attachment_min)),
+                                            log((double)qMax(1, m_settings.attachment_max)));
+        return (int)exp(d(m_rng));
+    }
+
+    Entry NewEntry(const EntryId &parent_id, int number, bool is_folder){
+        Entry ret;
+        ret.SetId(RandomBytes(ID_SIZE));
+        ret.SetParentId(parent_id);
+
+        const char *word = WORDS[uniform_int_distribution<int>(0, COUNT_OF(WORDS) - 1)(m_rng)];
+        ret.SetName(is_folder ? QString("%1 folder %2").arg(word).arg(number) :
+                                QString("%1 account %2").arg(word).arg(number));
+        ret.SetDescription(QString("Generated %1 %2").arg(word).arg(RandomText(8)));
+
+        // Spread the modify dates over a few years before a fixed date, so the
+        //  output doesn't depend on when you run it
+        ret.SetModifyDate(QDateTime(QDate(2015, 1, 1), QTime(0, 0), Qt::UTC)
+                          .addSecs(-uniform_int_distribution<int>(0, 5 * 365 * 24 * 3600)(m_rng)));
+
+        if(Chance(m_settings.favorite_ratio))
+            ret.SetFavoriteIndex(0);
+
+        if(!is_folder){
+            // The number of values averages out to the setting
+            int n = uniform_int_distribution<int>(0, 2 * m_settings.values)(m_rng);
+            for(int i = 0; i < n; ++i){
+                SecretValue v;
+                v.SetName(VALUE_NAMES[i % COUNT_OF(VALUE_NAMES)]);
+                v.SetValue(RandomText(16));
+                v.SetIsHidden(1 == i % COUNT_OF(VALUE_NAMES));
+                ret.Values().append(v);
+            }
+        }
+        return ret;
+    }
+
+    FileId NewFileId(){
+        return RandomBytes(ID_SIZE);
+    }
+};
+
+
+static int __generate(const QString &path, const Credentials &creds, const settings_t &s)
+{
+    QTextStream out(stdout);
+    Generator gen(s);
+    PasswordDatabase db(path);
+    db.Open(creds);
+
+    struct parent_t{
+        EntryId id;
+        int level;
+    };
+
+    // The tree is built breadth-first, so a parent is always added before its
+    //  children. If the tree is full at the given depth and fan-out, the root
+    //  gets another set of folders.
+    QQueue<parent_t> parents;
+    parents.enqueue(parent_t{EntryId::Null(), 0});
+
+    parent_t parent;
+    int siblings_left = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    int added = 0;
+    int files = 0;
+    qint64 file_bytes = 0;
+    while(added < s.entries){
+        QList<Entry> batch;
+        QList<QPair<FileId, QByteArray>> attachments;
+        while(batch.length() < s.batch_size && added + batch.length() < s.entries){
+            // A parent may span batches, which is fine since it was already added
+            if(0 == siblings_left){
+                if(parents.isEmpty())
+                    parents.enqueue(parent_t{EntryId::Null(), 0});
+                parent = parents.dequeue();
+                siblings_left = s.fanout;
+            }
+            --siblings_left;
+
+            const bool is_folder = parent.level < s.depth - 1;
+            Entry e = gen.NewEntry(parent.id, added + batch.length(), is_folder);
+            if(is_folder)
+                parents.enqueue(parent_t{e.GetId(), parent.level + 1});
+            else if(gen.Chance(s.attachment_ratio)){
+                FileId fid = gen.NewFileId();
+                e.SetFileId(fid);
+                e.SetFileName(QString("attachment_%1.bin").arg(files + attachments.length()));
+                attachments.append(QPair<FileId, QByteArray>(fid, gen.RandomBytes(gen.AttachmentSize())));
+            }
+            batch.append(e);
+        }
+
+        db.AddEntries(batch, false);
+        for(const auto &a : attachments){
+            db.AddFile(a.first, a.second);
+            file_bytes += a.second.length();
+        }
+        files += attachments.length();
+        added += batch.length();
+
+        db.WaitForThreadIdle();
+        out << QString("%1 / %2 entries, %3 files (%4 MB) in %5 s")
+               .arg(added).arg(s.entries).arg(files)
+               .arg(file_bytes / (1024 * 1024))
+               .arg(timer.elapsed() / 1000.0, 0, 'f', 1)
+            << endl;
+    }
+
+    if(s.dump_metrics)
+        out << endl << db.GetWorkerMetrics().ToString()
+            << endl << SqlProfiler::GetReport();
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("grypto_vaultgen");
+    app.setApplicationVersion(GRYPTO_VERSION_STRING);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Generates a vault full of synthetic entries,"
+                                     " for testing and benchmarking with realistic data sizes.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("output", "The path of the vault to create. It must not exist.");
+    parser.addOptions({
+        {{"n", "entries"}, "The number of entries to generate.", "count", "10000"},
+        {{"d", "depth"}, "The depth of the tree. Entries at the bottom level are"
+                         " accounts, and the ones above them are folders.", "levels", "3"},
+        {{"f", "fanout"}, "The number of children of each folder.", "count", "20"},
+        {"values", "The average number of values per account.", "count", "3"},
+        {"favorites", "The fraction of entries that are favorites.", "ratio", "0.01"},
+        {"attachments", "The fraction of accounts with a file attached.", "ratio", "0"},
+        {"attachment-min", "The smallest attachment size.", "bytes", "1024"},
+        {"attachment-max", "The largest attachment size.", "bytes", "1048576"},
+        {"seed", "Seeds the generator, so you get the same vault every time.", "number", "0"},
+        {"batch", "The number of entries to add in each transaction.", "count", "10000"},
+        {"metrics", "Prints the background worker's metrics and SQL profile when done."},
+        {"trace", "Writes a timeline of the run to a Chrome trace-event file."
+                  " You can also set " GRYPTO_TRACE_VARIABLE ".", "path"},
+        {{"p", "password"}, "The vault's password.", "password", "password"},
+        {{"k", "keyfile"}, "The vault's keyfile, if any.", "path"},
+    });
+    parser.process(app);
+
+    QTextStream err(stderr);
+    if(1 != parser.positionalArguments().length()){
+        err << "You must give exactly one output path" << endl;
+        return 1;
+    }
+    const QString path = parser.positionalArguments()[0];
+    if(QFile::exists(path)){
+        err << "The output file already exists: " << path << endl;
+        return 1;
+    }
+
+    settings_t s;
+    s.entries = parser.value("entries").toInt();
+    s.depth = parser.value("depth").toInt();
+    s.fanout = parser.value("fanout").toInt();
+    s.values = parser.value("values").toInt();
+    s.favorite_ratio = parser.value("favorites").toDouble();
+    s.attachment_ratio = parser.value("attachments").toDouble();
+    s.attachment_min = parser.value("attachment-min").toInt();
+    s.attachment_max = parser.value("attachment-max").toInt();
+    s.seed = parser.value("seed").toULongLong();
+    s.batch_size = parser.value("batch").toInt();
+    s.dump_metrics = parser.isSet("metrics");
+    if(0 > s.entries || 1 > s.depth || 1 > s.fanout || 0 > s.values || 1 > s.batch_size ||
+            0 > s.favorite_ratio || 1 < s.favorite_ratio ||
+            0 > s.attachment_ratio || 1 < s.attachment_ratio ||
+            s.attachment_min > s.attachment_max){
+        err << "Invalid arguments" << endl;
+        parser.showHelp(1);
+    }
+
+    Credentials creds;
+    creds.Password = parser.value("password").toUtf8().constData();
+    if(parser.isSet("keyfile")){
+        creds.Keyfile = parser.value("keyfile").toUtf8().constData();
+        creds.Type = Credentials::PasswordAndKeyfileType;
+    }
+    else{
+        creds.Type = Credentials::PasswordType;
+    }
+
+    if(parser.isSet("trace"))
+        Tracer::Start(parser.value("trace"));
+    else
+        Tracer::StartFromEnvironment();
+
+    int ret = 1;
+    try{
+        ret = __generate(path, creds, s);
+    }
+    catch(const GUtil::Exception<> &ex){
+        err << "Error: " << QString::fromStdString(ex.Message()) << endl;
+    }
+
+    // Write the trace even if we failed, since that's when you want it most
+    try{
+        Tracer::Stop();
+    }
+    catch(const GUtil::Exception<> &ex){
+        err << "Error: " << QString::fromStdString(ex.Message()) << endl;
+        ret = 1;
+    }
+    return ret;
+}
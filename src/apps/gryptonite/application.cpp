@@ -17,6 +17,7 @@ limitations under the License.*/
 #include "about.h"
 #include "settings.h"
 #include <grypto/notifyupdatedialog.h>
+#include <grypto/tracer.h>
 #include <gutil/globallogger.h>
 #include <gutil/grouplogger.h>
 #include <gutil/filelogger.h>
@@ -74,6 +75,10 @@ Application::Application(int &argc, char **argv)
                             .arg(QStandardPaths::writableLocation(QStandardPaths::DataLocation)).toUtf8()),
                     });
 
+    // Set GRYPTO_TRACE to a file path to record a timeline of what the
+    //  application is doing, which is written when it quits
+    Grypt::Tracer::StartFromEnvironment();
+
     CommandLineArgs args(argc, argv);
     QString open_file;
     if(args.Length() > 1){
@@ -121,6 +126,10 @@ void Application::about_to_quit()
         main_window->AboutToQuit();
         main_window->deleteLater();
     }
+    try{
+        Grypt::Tracer::Stop();
+    }
+    catch(...) {}   // We're quitting anyways, so there's nobody to tell
     SetGlobalLogger(NULL);
 }
 
@@ -25,6 +25,7 @@ limitations under the License.*/
 #include <grypto/filtereddatabasemodel.h>
 #include <grypto/entry_edit.h>
 #include <grypto/organizefavoritesdialog.h>
+#include <grypto/diagnosticsdialog.h>
 #include <gutil/qt_settings.h>
 #include <gutil/widget.h>
 #include <gutil/application.h>
@@ -184,6 +185,7 @@ MainWindow::MainWindow(GUtil::Qt::Settings *s, const QString &open_file, QWidget
     connect(ui->action_XML_export, SIGNAL(triggered()), this, SLOT(_export_to_xml()));
     connect(ui->action_XML_import, SIGNAL(triggered()), this, SLOT(_import_from_xml()));
     connect(ui->actionFile_Maintenance, SIGNAL(triggered()), this, SLOT(_file_maintenance()));
+    connect(ui->action_Diagnostics, SIGNAL(triggered()), this, SLOT(_show_diagnostics()));
     connect(ui->action_Close, SIGNAL(triggered()), this, SLOT(_close_database()));
     connect(ui->actionNew_Entry, SIGNAL(triggered()), this, SLOT(_new_entry()));
     connect(ui->action_EditEntry, SIGNAL(triggered()), this, SLOT(_edit_entry()));
@@ -490,7 +492,7 @@ bool MainWindow::eventFilter(QObject *o, QEvent *ev)
             menu->addAction(ui->action_DeleteEntry);
             menu->addSeparator();
 
-            Entry const *e = _get_currently_selected_entry();
+            CompactEntry const *e = _get_currently_selected_entry();
             if(e){
                 m_add_remove_favorites.setData(e->IsFavorite());
                 if(e->IsFavorite())
@@ -514,7 +516,7 @@ bool MainWindow::eventFilter(QObject *o, QEvent *ev)
     return ret;
 }
 
-Entry const *MainWindow::_get_currently_selected_entry() const
+CompactEntry const *MainWindow::_get_currently_selected_entry() const
 {
     return _get_database_model()->GetEntryFromIndex(
                 _get_proxy_model()->mapToSource(
@@ -590,10 +592,13 @@ void MainWindow::_install_new_database_model(DatabaseModel *dbm)
             this, SLOT(_update_trayIcon_menu()));
     connect(dbm, SIGNAL(NotifyUndoStackChanged()),
             this, SLOT(_update_undo_text()));
+    connect(dbm, SIGNAL(NotifyFetchAllEntriesFailed(QString)),
+            this, SLOT(_fetch_all_failed(QString)));
 
     // The model supports lazy-loading, but the data backend loads everything
-    //  up front anyways
-    dbm->FetchAllEntries();
+    //  up front anyways. Decrypt the rest of the tree in the background so
+    //  the window is usable right away.
+    dbm->FetchAllEntriesAsync();
 
     _get_proxy_model()->setSourceModel(dbm);
     _update_ui_file_opened(true);
@@ -915,7 +920,7 @@ void MainWindow::_set_last_keyfile_location(const QString &loc)
         m_keyfileLocation = loc;
 }
 
-bool MainWindow::_verify_credentials()
+bool MainWindow::_verify_credentials(bool unlock_database)
 {
     bool ret = false;
     QString keyfile_loc = _get_keyfile_location();
@@ -928,7 +933,7 @@ bool MainWindow::_verify_credentials()
     {
         creds.Type = Credentials::KeyfileType;
         creds.Keyfile = keyfile_loc;
-        if(!(ret = dbm->CheckCredentials(creds))){
+        if(!(ret = unlock_database ? dbm->Unlock(creds) : dbm->CheckCredentials(creds))){
             QMessageBox::warning(this, tr("Keyfile Incorrect"),
                                  QString(tr("The keyfile at %1 is incorrect or missing"))
                                  .arg(keyfile_loc));
@@ -944,7 +949,8 @@ bool MainWindow::_verify_credentials()
                               this);
 
         if(QDialog::Accepted == dlg.exec()){
-            if((ret = dbm->CheckCredentials(dlg.GetCredentials()))){
+            if((ret = unlock_database ? dbm->Unlock(dlg.GetCredentials()) :
+                                        dbm->CheckCredentials(dlg.GetCredentials()))){
                 _set_last_keyfile_location(dlg.GetKeyfileLocation());
             }
             else{
@@ -1133,6 +1139,15 @@ void MainWindow::_file_maintenance()
     _update_undo_text();
 }
 
+void MainWindow::_show_diagnostics()
+{
+    if(!IsFileOpen())
+        return;
+
+    modal_dialog_helper_t mh(this);
+    DiagnosticsDialog(_get_database_model(), this).exec();
+}
+
 void MainWindow::_new_entry()
 {
     if(!IsFileOpen())
@@ -1142,7 +1157,7 @@ void MainWindow::_new_entry()
 
     DatabaseModel *model = _get_database_model();
     QModelIndex ind = _get_proxy_model()->mapToSource(ui->treeView->currentIndex());
-    Entry const *selected = model->GetEntryFromIndex(ind);
+    CompactEntry const *selected = model->GetEntryFromIndex(ind);
 
     EntryEdit dlg(this);
     if(QDialog::Accepted == dlg.exec()){
@@ -1164,7 +1179,7 @@ void MainWindow::_new_child_entry()
 
     DatabaseModel *model = _get_database_model();
     QModelIndex ind = _get_proxy_model()->mapToSource(ui->treeView->currentIndex());
-    Entry const *selected = model->GetEntryFromIndex(ind);
+    CompactEntry const *selected = model->GetEntryFromIndex(ind);
 
     EntryEdit dlg(this);
     if(QDialog::Accepted == dlg.exec())
@@ -1205,6 +1220,7 @@ void MainWindow::_update_ui_file_opened(bool b)
     ui->menu_Export->setEnabled(b);
     ui->menu_Import->setEnabled(b);
     ui->actionFile_Maintenance->setEnabled(b);
+    ui->action_Diagnostics->setEnabled(b);
 
     if(b){
         ui->statusbar->showMessage(tr("Database opened successfully"), STATUSBAR_MSG_TIMEOUT);
@@ -1242,7 +1258,7 @@ void MainWindow::_favorite_action_clicked(QAction *a)
 
 static QMenu *__create_menu(DatabaseModel *dbm, QActionGroup &ag, const QModelIndex &ind, QWidget *parent)
 {
-    Entry const *e = dbm->GetEntryFromIndex(ind);
+    CompactEntry const *e = dbm->GetEntryFromIndex(ind);
     GASSERT(e);
     SmartPointer<QMenu> ret;
 
@@ -1334,9 +1350,9 @@ DatabaseModel *MainWindow::_get_database_model() const
 
 void MainWindow::_edit_entry()
 {
-    Entry const *e = _get_currently_selected_entry();
+    CompactEntry const *e = _get_currently_selected_entry();
     if(e)
-        _edit_entry(*e);
+        _edit_entry(_get_database_model()->FindEntryById(e->GetId()));
 }
 
 void MainWindow::_delete_entry()
@@ -1347,13 +1363,13 @@ void MainWindow::_delete_entry()
     QModelIndex ind = ui->treeView->currentIndex();
     if(ind.isValid()){
         DatabaseModel *model = _get_database_model();
-        Entry const *e = model->GetEntryFromIndex(_get_proxy_model()->mapToSource(ind));
+        CompactEntry const *e = model->GetEntryFromIndex(_get_proxy_model()->mapToSource(ind));
         if(QMessageBox::Yes == QMessageBox::question(
                     this, tr("Really?"),
                     QString(tr("Confirm that you really want to delete this and all child entries of: %1")).arg(e->GetName()),
                     QMessageBox::Yes | QMessageBox::Cancel, QMessageBox::Cancel))
         {
-            model->RemoveEntry(*e);
+            model->RemoveEntry(e->ToEntry());
         }
     }
 }
@@ -1361,7 +1377,7 @@ void MainWindow::_delete_entry()
 void MainWindow::_add_remove_favorite()
 {
     bool is_favorite = m_add_remove_favorites.data().toBool();
-    Entry const *e = _get_currently_selected_entry();
+    CompactEntry const *e = _get_currently_selected_entry();
     if(NULL == e)
         return;
 
@@ -1398,7 +1414,7 @@ void MainWindow::_treeview_doubleclicked(const QModelIndex &ind)
 
 void MainWindow::_treeview_currentindex_changed(const QModelIndex &ind)
 {
-    Entry const *e = _get_database_model()->GetEntryFromIndex(_get_proxy_model()->mapToSource(ind));
+    CompactEntry const *e = _get_database_model()->GetEntryFromIndex(_get_proxy_model()->mapToSource(ind));
     ui->action_EditEntry->setEnabled(!IsReadOnly() && e);
     ui->action_DeleteEntry->setEnabled(!IsReadOnly() && e);
     m_btn_pop_out.setEnabled(e);
@@ -1614,6 +1630,9 @@ void MainWindow::_filter_updated(const FilterInfo_t &fi)
 
         if(fi.FilterResults)
             title.append(tr(" (filter applied)"));
+
+        if(!fm->GetQueryError().isEmpty())
+            ui->statusbar->showMessage(fm->GetQueryError(), STATUSBAR_MSG_TIMEOUT);
     }
     else
     {
@@ -1638,6 +1657,19 @@ void MainWindow::_search()
     ui->searchWidget->setFocus();
 }
 
+// Appends the ids of the expanded entries, parents before their children
+static void __append_expanded_ids(QTreeView *tv, const QModelIndex &parent, QList<EntryId> &ids)
+{
+    QAbstractItemModel *m = tv->model();
+    for(int r = 0; r < m->rowCount(parent); ++r){
+        QModelIndex ind = m->index(r, 0, parent);
+        if(tv->isExpanded(ind)){
+            ids.append(ind.data(DatabaseModel::EntryIdRole).value<EntryId>());
+            __append_expanded_ids(tv, ind, ids);
+        }
+    }
+}
+
 void MainWindow::Lock()
 {
     _lock_unlock_interface(true);
@@ -1660,6 +1692,20 @@ void MainWindow::_lock_unlock_interface(bool lock)
             m_savedState.clear();
         }
 
+        // Remember where the user was, then drop the decrypted data so
+        //  none of it stays in memory while we're locked
+        DatabaseModel *dbm = _get_database_model();
+        m_lockedExpanded.clear();
+        m_lockedCurrentId = EntryId::Null();
+        if(dbm){
+            __append_expanded_ids(ui->treeView, QModelIndex(), m_lockedExpanded);
+            QModelIndex cur = ui->treeView->currentIndex();
+            if(cur.isValid())
+                m_lockedCurrentId = cur.data(DatabaseModel::EntryIdRole).value<EntryId>();
+            ui->view_entry->SetEntry(Entry());
+            dbm->Lock();
+        }
+
         ui->dw_treeView->hide();
         ui->dw_search->hide();
         ui->toolBar->hide();
@@ -1694,6 +1740,26 @@ void MainWindow::_lock_unlock_interface(bool lock)
         restoreState(m_lockedState);
         m_lockedState.clear();
         GASSERT(m_savedState.isEmpty());
+
+        // The model reloads lazily, so we only fetch the branches that were open
+        DatabaseModel *dbm = _get_database_model();
+        if(dbm && !dbm->IsLocked()){
+            for(const EntryId &id : m_lockedExpanded){
+                QModelIndex ind = dbm->FindIndexById(id);
+                if(!ind.isValid())
+                    continue;
+                if(dbm->canFetchMore(ind))
+                    dbm->fetchMore(ind);
+                ui->treeView->expand(_get_proxy_model()->mapFromSource(ind));
+            }
+            if(!m_lockedCurrentId.IsNull()){
+                QModelIndex ind = dbm->FindIndexById(m_lockedCurrentId);
+                if(ind.isValid())
+                    ui->treeView->setCurrentIndex(_get_proxy_model()->mapFromSource(ind));
+            }
+        }
+        m_lockedExpanded.clear();
+        m_lockedCurrentId = EntryId::Null();
         ui->stackedWidget->setCurrentIndex(1);
         ui->actionLockUnlock->setText(tr("&Lock Application"));
         ui->actionLockUnlock->setData(true);
@@ -1770,7 +1836,7 @@ QString MainWindow::_get_keyfile_location() const
 
 void MainWindow::RequestUnlock()
 {
-    if(_verify_credentials())
+    if(_verify_credentials(true))
         _lock_unlock_interface(false);
 }
 
@@ -1841,9 +1907,9 @@ void MainWindow::_progress_updated(int progress, bool cancellable, const QString
 
         // Refresh the entry in the view, because maybe its status changed
         //  now that the task is complete
-        Entry const *e = _get_currently_selected_entry();
+        CompactEntry const *e = _get_currently_selected_entry();
         if(e)
-            ui->view_entry->SetEntry(*e);
+            ui->view_entry->SetEntry(_get_database_model()->FindEntryById(e->GetId()));
 
 #ifdef Q_OS_WIN
         m_taskbarButton.progress()->hide();
@@ -1919,11 +1985,36 @@ void MainWindow::_tray_icon_activated(QSystemTrayIcon::ActivationReason ar)
 
 void MainWindow::_expand_all()
 {
+    // Make sure everything is loaded first, otherwise the view would
+    //  fetch (and decrypt) one node at a time
+    DatabaseModel *dbm = _get_database_model();
+    if(dbm){
+        connect(dbm, SIGNAL(NotifyAllEntriesFetched()),
+                this, SLOT(_expand_all_fetched()), ::Qt::UniqueConnection);
+        dbm->FetchAllEntriesAsync();
+    }
+}
+
+void MainWindow::_expand_all_fetched()
+{
+    disconnect(_get_database_model(), SIGNAL(NotifyAllEntriesFetched()),
+               this, SLOT(_expand_all_fetched()));
+
     disable_column_auroresize_t d(ui->treeView);
     ui->treeView->expandAll();
     ui->treeView->ResizeColumnsToContents();
 }
 
+void MainWindow::_fetch_all_failed(const QString &msg)
+{
+    // Expand all will not happen now
+    disconnect(_get_database_model(), SIGNAL(NotifyAllEntriesFetched()),
+               this, SLOT(_expand_all_fetched()));
+
+    QMessageBox::warning(this, tr("Error"),
+                         QString(tr("Unable to load all entries: %1")).arg(msg));
+}
+
 void MainWindow::_collapse_all()
 {
     disable_column_auroresize_t d(ui->treeView);
@@ -123,6 +123,7 @@ private slots:
     void _export_to_xml();
     void _import_from_xml();
     void _file_maintenance();
+    void _show_diagnostics();
 
     void _new_entry();
     void _new_child_entry();
@@ -137,6 +138,8 @@ private slots:
     void _undo();
     void _redo();
     void _expand_all();
+    void _expand_all_fetched();
+    void _fetch_all_failed(const QString &);
     void _collapse_all();
 
     void _update_trayIcon_menu();
@@ -188,6 +191,8 @@ private:
     bool m_isLocked;
     bool m_readonlyTransaction;
     QByteArray m_lockedState;
+    QList<Grypt::EntryId> m_lockedExpanded;
+    Grypt::EntryId m_lockedCurrentId;
     QByteArray m_savedState;
     QString m_keyfileLocation;
     QProcess m_grypto_transforms;
@@ -212,11 +217,11 @@ private:
     void _update_time_format();
     Grypt::FilteredDatabaseModel *_get_proxy_model() const;
     Grypt::DatabaseModel *_get_database_model() const;
-    bool _verify_credentials();
+    bool _verify_credentials(bool unlock_database = false);
     QString _get_keyfile_location() const;
 
     void _select_entry(const Grypt::EntryId &);
-    Grypt::Entry const *_get_currently_selected_entry() const;
+    Grypt::CompactEntry const *_get_currently_selected_entry() const;
     void _edit_entry(const Grypt::Entry &);
     bool _handle_key_pressed(QKeyEvent *);
     void _prepare_ui_for_readonly_transaction();
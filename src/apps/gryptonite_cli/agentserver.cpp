@@ -0,0 +1,400 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "agentserver.h"
+#include "entryjson.h"
+#include <QLocalSocket>
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QStringList>
+#include <QDir>
+#include <QFile>
+#include <chrono>
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#endif
+using namespace std;
+USING_NAMESPACE_GRYPTO;
+
+// We drop clients that send a line longer than this
+#define MAX_REQUEST_SIZE    (64 * 1024)
+
+// The number of search results if the client doesn't say
+#define DEFAULT_SEARCH_LIMIT    100
+
+static const char *LOOKUP_NAMES[] = { "get", "list", "search" };
+
+
+// Compares the strings in the same time no matter where they differ,
+//  so you can't guess the token one byte at a time
+static bool __constant_time_equals(const QByteArray &a, const QByteArray &b)
+{
+    if(a.length() != b.length())
+        return false;
+    char diff = 0;
+    for(int i = 0; i < a.length(); ++i)
+        diff |= a[i] ^ b[i];
+    return 0 == diff;
+}
+
+// Removes the socket of an agent that didn't exit cleanly. We only remove a
+//  socket that the user owns and that nobody is listening on, so a mistyped
+//  --socket can't delete anything else.
+static void __remove_stale_socket(const QString &path)
+{
+#ifdef Q_OS_UNIX
+    // Qt puts relative socket names in the temp directory
+    const QString full_path = QDir::isAbsolutePath(path) ?
+                path : QDir(QDir::tempPath()).absoluteFilePath(path);
+    struct stat st;
+    if(0 != lstat(QFile::encodeName(full_path).constData(), &st))
+        return;     // There's nothing there
+    if(!S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+        throw GUtil::Exception<>(QString("Refusing to replace %1, which is not a socket you own")
+                                 .arg(path).toUtf8());
+#endif
+
+    QLocalSocket s;
+    s.connectToServer(path);
+    if(s.waitForConnected(1000))
+        throw GUtil::Exception<>(QString("Another agent is already listening on %1")
+                                 .arg(path).toUtf8());
+    QLocalServer::removeServer(path);
+}
+
+static QByteArray __random_hex(int id_count)
+{
+    QByteArray ret;
+    for(int i = 0; i < id_count; ++i)
+        ret.append(EntryId::NewId().ToQByteArray());
+    return ret.toHex();
+}
+
+
+#ifdef Q_OS_LINUX
+bool AgentServer::IsSameUser(QLocalSocket *s)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(0 != getsockopt(s->socketDescriptor(), SOL_SOCKET, SO_PEERCRED, &cred, &len))
+        return false;
+    return cred.uid == getuid();
+}
+#else
+// Elsewhere we rely on the socket being accessible by the user only
+bool AgentServer::IsSameUser(QLocalSocket *){ return true; }
+#endif
+
+
+AgentServer::AgentServer(const QString &vault_path, int idle_minutes, QObject *parent)
+    :QObject(parent),
+      m_vaultPath(vault_path),
+      m_idleMinutes(idle_minutes),
+      m_lockout(this),
+      m_token(__random_hex(2)),
+      m_stopping(false)
+{
+    connect(&m_lockout, SIGNAL(Lock()), this, SLOT(Lock()));
+    connect(&m_server, SIGNAL(newConnection()), this, SLOT(_new_connection()));
+}
+
+AgentServer::~AgentServer()
+{
+    m_server.close();
+    if(!m_privateDir.isEmpty())
+        QDir().rmdir(m_privateDir);
+}
+
+void AgentServer::Start(const Credentials &creds, const QString &socket_path)
+{
+    // Check the socket first, so we don't unlock for nothing
+    if(!socket_path.isEmpty())
+        __remove_stale_socket(socket_path);
+
+    _unlock(creds);
+
+    // Remember how to unlock again, but not the password
+    m_creds = creds;
+    m_creds.Password = "";
+
+    QString path = socket_path;
+    if(path.isEmpty()){
+        m_privateDir = QDir::temp().filePath("grypto-agent-" + QString::fromLatin1(__random_hex(1).left(12)));
+        if(!QDir().mkdir(m_privateDir) ||
+                !QFile::setPermissions(m_privateDir, QFile::ReadOwner | QFile::WriteOwner | QFile::ExeOwner))
+            throw GUtil::Exception<>(QString("Unable to create the directory %1")
+                                     .arg(m_privateDir).toUtf8());
+        path = QDir(m_privateDir).filePath(QString("agent.%1").arg(QCoreApplication::applicationPid()));
+    }
+
+    m_server.setSocketOptions(QLocalServer::UserAccessOption);
+    if(!m_server.listen(path))
+        throw GUtil::Exception<>(QString("Unable to listen on %1: %2")
+                                 .arg(path).arg(m_server.errorString()).toUtf8());
+}
+
+void AgentServer::_unlock(const Credentials &creds)
+{
+    unique_ptr<PasswordDatabase> db(new PasswordDatabase(m_vaultPath));
+    db->Open(creds);
+
+    // We only read the cache from now on, so load it all now
+    m_entries.clear();
+    m_children.clear();
+    m_index.Clear();
+    for(const auto &p : db->FindEntrySubtree()){
+        const CompactEntry ce(p.first);
+        m_entries.insert(ce.GetId(), ce);
+        m_children[ce.GetParentId()].append(ce.GetId());
+        m_index.Insert(ce);
+    }
+    m_index.Finalize();
+    m_db.swap(db);
+
+    if(0 < m_idleMinutes)
+        m_lockout.StartLockoutTimer(m_idleMinutes);
+}
+
+void AgentServer::Lock()
+{
+    m_lockout.StopLockoutTimer();
+    m_entries.clear();
+    m_children.clear();
+    m_index.Clear();
+    m_db.reset();
+}
+
+void AgentServer::_new_connection()
+{
+    while(QLocalSocket *s = m_server.nextPendingConnection()){
+        if(!IsSameUser(s)){
+            s->abort();
+            s->deleteLater();
+            continue;
+        }
+        m_authenticated.insert(s, false);
+        connect(s, SIGNAL(readyRead()), this, SLOT(_ready_read()));
+        connect(s, SIGNAL(disconnected()), this, SLOT(_disconnected()));
+    }
+}
+
+void AgentServer::_disconnected()
+{
+    QLocalSocket *s = qobject_cast<QLocalSocket *>(sender());
+    m_authenticated.remove(s);
+    s->deleteLater();
+}
+
+void AgentServer::_ready_read()
+{
+    QLocalSocket *s = qobject_cast<QLocalSocket *>(sender());
+
+    // Answer every complete request we have, and send the answers together
+    QByteArray responses;
+    while(s->canReadLine()){
+        responses.append(QJsonDocument(_handle(s, s->readLine())).toJson(QJsonDocument::Compact));
+        responses.append('\n');
+
+        // Don't listen to a client that failed to authenticate
+        if(!m_authenticated.value(s)){
+            s->write(responses);
+            s->disconnectFromServer();
+            return;
+        }
+    }
+    if(!responses.isEmpty())
+        s->write(responses);
+
+    if(m_stopping){
+        s->waitForBytesWritten(1000);
+        QCoreApplication::quit();
+    }
+    else if(MAX_REQUEST_SIZE < s->bytesAvailable()){
+        s->abort();
+    }
+}
+
+QJsonObject AgentServer::_handle(QLocalSocket *s, const QByteArray &request)
+{
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    QJsonObject ret;
+    QString op;
+    try{
+        QJsonParseError err;
+        const QJsonDocument doc = QJsonDocument::fromJson(request, &err);
+        if(QJsonParseError::NoError != err.error || !doc.isObject())
+            throw GUtil::Exception<>("The request must be a JSON object");
+        const QJsonObject o = doc.object();
+        if(o.contains("id"))
+            ret["id"] = o["id"];
+        op = o["op"].toString();
+
+        if(!m_authenticated.value(s)){
+            if(op != "auth" || !__constant_time_equals(o["token"].toString().toLatin1(), m_token))
+                throw GUtil::Exception<>("Not authenticated");
+            m_authenticated[s] = true;
+        }
+        else{
+            // Any request counts as activity
+            if(0 < m_idleMinutes)
+                m_lockout.ResetLockoutTimer(m_idleMinutes);
+
+            const QJsonObject result = _dispatch(op, o);
+            for(auto iter = result.begin(); iter != result.end(); ++iter)
+                ret[iter.key()] = iter.value();
+        }
+        ret["ok"] = true;
+    }
+    catch(const GUtil::Exception<> &ex){
+        ret["ok"] = false;
+        ret["error"] = QString::fromStdString(ex.Message());
+    }
+
+    const quint64 us = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+    ret["us"] = (double)us;
+    for(int i = 0; i < LookupCount; ++i){
+        if(op == LOOKUP_NAMES[i])
+            m_latency[i].Record(us);
+    }
+    return ret;
+}
+
+QJsonObject AgentServer::_dispatch(const QString &op, const QJsonObject &o)
+{
+    QJsonObject ret;
+    if(op == "get"){
+        _fail_if_locked();
+        const EntryId id = _find(o);
+        if(id.IsNull())
+            throw GUtil::Exception<>("You must give an entry or a path");
+        ret["entry"] = EntryJson::ToJson(m_db->FindEntry(id), _path_of(id));
+    }
+    else if(op == "list"){
+        _fail_if_locked();
+        QJsonArray children;
+        for(const EntryId &child : m_children.value(_find(o)))
+            children.append(_summary(child));
+        ret["entries"] = children;
+    }
+    else if(op == "search"){
+        _fail_if_locked();
+        const EntryQuery q = EntryQuery::Parse(o["query"].toString());
+        if(!q.IsValid())
+            throw GUtil::Exception<>(q.ErrorString().toUtf8());
+        const int limit = o["limit"].toInt(DEFAULT_SEARCH_LIMIT);
+        const QVector<EntryId> ids = m_index.Execute(q);
+        QJsonArray entries;
+        for(int i = 0; i < ids.count() && i < limit; ++i){
+            QJsonObject e = _summary(ids[i]);
+            e["path"] = _path_of(ids[i]);
+            entries.append(e);
+        }
+        ret["entries"] = entries;
+        ret["total"] = ids.count();
+    }
+    else if(op == "stats"){
+        for(int i = 0; i < LookupCount; ++i){
+            const LatencyHistogram::Snapshot ss = m_latency[i].GetSnapshot();
+            QJsonObject st;
+            st["count"] = (double)ss.Count;
+            st["mean_us"] = ss.MeanMicroseconds();
+            st["p50_us"] = (double)ss.Percentile(50);
+            st["p99_us"] = (double)ss.Percentile(99);
+            st["max_us"] = (double)ss.MaxMicroseconds;
+            ret[LOOKUP_NAMES[i]] = st;
+        }
+        ret["entries"] = m_entries.count();
+        ret["locked"] = IsLocked();
+    }
+    else if(op == "lock"){
+        Lock();
+    }
+    else if(op == "unlock"){
+        if(IsLocked()){
+            Credentials creds = m_creds;
+            QByteArray password = o["password"].toString().toUtf8();
+            creds.Password = password.constData();
+            password.fill(0);
+            _unlock(creds);
+        }
+    }
+    else if(op == "stop"){
+        Lock();
+        m_stopping = true;
+    }
+    else{
+        throw GUtil::Exception<>(QString("Unknown op: %1").arg(op).toUtf8());
+    }
+    return ret;
+}
+
+void AgentServer::_fail_if_locked() const
+{
+    if(IsLocked())
+        throw GUtil::Exception<>("The vault is locked");
+}
+
+EntryId AgentServer::_find(const QJsonObject &o) const
+{
+    if(o.contains("entry")){
+        const EntryId id = EntryJson::IdFromString(o["entry"].toString());
+        if(!m_entries.contains(id))
+            throw GUtil::Exception<>("No such entry");
+        return id;
+    }
+
+    // Walk down the path one name at a time, from the root
+    EntryId ret;
+    for(const QString &name : o["path"].toString().split(PATH_SEPARATOR, QString::SkipEmptyParts)){
+        EntryId found;
+        for(const EntryId &child : m_children.value(ret)){
+            if(m_entries.constFind(child)->GetName() == name){
+                if(!found.IsNull())
+                    throw GUtil::Exception<>(QString("The path is ambiguous at '%1'")
+                                             .arg(name).toUtf8());
+                found = child;
+            }
+        }
+        if(found.IsNull())
+            throw GUtil::Exception<>(QString("Entry not found: %1").arg(name).toUtf8());
+        ret = found;
+    }
+    return ret;
+}
+
+QString AgentServer::_path_of(const EntryId &id) const
+{
+    QStringList names;
+    for(auto iter = m_entries.find(id); iter != m_entries.end();
+        iter = m_entries.find(iter->GetParentId()))
+        names.prepend(iter->GetName());
+    return names.join(PATH_SEPARATOR);
+}
+
+QJsonObject AgentServer::_summary(const EntryId &id) const
+{
+    const CompactEntry &ce = *m_entries.constFind(id);
+    QJsonObject ret;
+    ret["id"] = EntryJson::IdToString(id);
+    ret["name"] = ce.GetName();
+    ret["description"] = ce.GetDescription();
+    ret["children"] = m_children.value(id).count();
+    return ret;
+}
@@ -0,0 +1,152 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef AGENTSERVER_H
+#define AGENTSERVER_H
+
+#include <grypto/passworddatabase.h>
+#include <grypto/compactentry.h>
+#include <grypto/entryquery.h>
+#include <grypto/lockout.h>
+#include <grypto/workermetrics.h>
+#include <QObject>
+#include <QHash>
+#include <QVector>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <memory>
+
+class QLocalSocket;
+
+/** The environment variables that tell clients where the agent is. */
+#define GRYPTO_AGENT_SOCKET_VARIABLE "GRYPTO_AGENT_SOCK"
+#define GRYPTO_AGENT_TOKEN_VARIABLE  "GRYPTO_AGENT_TOKEN"
+
+
+/** Keeps one vault unlocked in memory and answers lookups over a local
+ *  socket, like ssh-agent does for keys. The key derivation and cache load
+ *  happen once, when it unlocks, so a lookup only costs one decryption.
+ *
+ *  The protocol is JSON Lines. Each request is an object with an "op", and
+ *  an optional "id" which is echoed back in the response. Every response has
+ *  "ok", the "error" if it failed, and "us", the time it took to handle in
+ *  microseconds. Clients may send many requests without waiting, and they
+ *  are answered in order.
+ *
+ *  The socket is only accessible by the user, and on Linux the peer must
+ *  run as the same user. The first request on a connection must also be
+ *  {"op":"auth","token":...} with the token from Token().
+ *
+ *  The ops are:
+ *   * get      The entry given by "entry" (its id) or "path", with its secret values
+ *   * list     The children of the entry given by "entry" or "path", or the root
+ *   * search   The entries matching the EntryQuery in "query", up to "limit"
+ *   * stats    The latency of each kind of lookup
+ *   * lock     Closes the vault and forgets everything
+ *   * unlock   Opens the vault again with the "password"
+ *   * stop     Stops the agent
+ *
+ *  The agent locks itself when there were no requests for the idle time.
+*/
+class AgentServer : public QObject
+{
+    Q_OBJECT
+public:
+
+    /** \param idle_minutes Lock after this many minutes without a request,
+     *      or never if it's 0.
+    */
+    AgentServer(const QString &vault_path, int idle_minutes, QObject *parent = 0);
+    ~AgentServer();
+
+    /** Unlocks the vault and starts listening. If the socket path is empty,
+     *  a new one is made in a private temporary directory. If there is a
+     *  stale socket at the path it is replaced, but only if the user owns it.
+     *  \throws An exception if the vault can't be opened, if something else
+     *      is at the socket path or if we can't listen
+    */
+    void Start(const Grypt::Credentials &, const QString &socket_path = QString());
+
+    QString SocketPath() const{ return m_server.fullServerName(); }
+
+    /** The secret that clients must give to authenticate. */
+    QByteArray const &Token() const{ return m_token; }
+
+    bool IsLocked() const{ return !m_db; }
+
+    /** Returns true if the peer runs as the same user as we do. This is only
+     *  checked on Linux; elsewhere it's always true.
+    */
+    static bool IsSameUser(QLocalSocket *);
+
+
+public slots:
+
+    /** Closes the vault and clears the cache. */
+    void Lock();
+
+
+private slots:
+
+    void _new_connection();
+    void _ready_read();
+    void _disconnected();
+
+
+private:
+
+    // The lookups whose latencies we keep track of
+    enum LookupEnum{
+        LookupGet,
+        LookupList,
+        LookupSearch,
+
+        LookupCount
+    };
+
+    const QString m_vaultPath;
+    const int m_idleMinutes;
+
+    // The credentials without the password, to unlock again later
+    Grypt::Credentials m_creds;
+
+    std::unique_ptr<Grypt::PasswordDatabase> m_db;
+
+    // A copy of every entry without the secrets, so we can find them by
+    //  path and by query without decrypting anything
+    QHash<Grypt::EntryId, Grypt::CompactEntry> m_entries;
+    QHash<Grypt::EntryId, QVector<Grypt::EntryId>> m_children;
+    Grypt::EntryIndex m_index;
+
+    Grypt::Lockout m_lockout;
+    QLocalServer m_server;
+    QString m_privateDir;
+    QByteArray m_token;
+    QHash<QLocalSocket *, bool> m_authenticated;
+    bool m_stopping;
+    Grypt::LatencyHistogram m_latency[LookupCount];
+
+    void _unlock(const Grypt::Credentials &);
+    QJsonObject _handle(QLocalSocket *, const QByteArray &request);
+    QJsonObject _dispatch(const QString &op, const QJsonObject &request);
+    void _fail_if_locked() const;
+
+    Grypt::EntryId _find(const QJsonObject &) const;
+    QString _path_of(const Grypt::EntryId &) const;
+    QJsonObject _summary(const Grypt::EntryId &) const;
+
+};
+
+
+#endif // AGENTSERVER_H
@@ -0,0 +1,92 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "entryjson.h"
+#include <QJsonArray>
+USING_NAMESPACE_GRYPTO;
+
+
+QString EntryJson::IdToString(const EntryId &id)
+{
+    return QString::fromLatin1(id.ToQByteArray().toHex());
+}
+
+EntryId EntryJson::IdFromString(const QString &s)
+{
+    const QByteArray b = QByteArray::fromHex(s.toLatin1());
+    if(EntryId::Size != b.length())
+        throw GUtil::Exception<>(QString("Invalid id: %1").arg(s).toUtf8());
+    return b;
+}
+
+QJsonObject EntryJson::ToJson(const Entry &e, const QString &path)
+{
+    QJsonObject ret;
+    ret["id"] = IdToString(e.GetId());
+    ret["parent"] = e.GetParentId().IsNull() ? QJsonValue() : QJsonValue(IdToString(e.GetParentId()));
+    ret["path"] = path;
+    ret["name"] = e.GetName();
+    ret["description"] = e.GetDescription();
+    ret["favorite"] = e.IsFavorite();
+    ret["modified"] = e.GetModifyDate().toUTC().toString(Qt::ISODate);
+    if(!e.GetFileId().IsNull()){
+        ret["file_id"] = IdToString(e.GetFileId());
+        ret["file_name"] = e.GetFileName();
+    }
+
+    QJsonArray values;
+    for(const SecretValue &sv : e.Values()){
+        QJsonObject v;
+        v["name"] = sv.GetName();
+        v["value"] = sv.GetValue();
+        if(!sv.GetNotes().isEmpty())
+            v["notes"] = sv.GetNotes();
+        v["hidden"] = sv.GetIsHidden();
+        values.append(v);
+    }
+    ret["values"] = values;
+    return ret;
+}
+
+void EntryJson::ApplyFields(Entry &e, const QJsonObject &o)
+{
+    if(o.contains("parent") || o.contains("parent_path"))
+        throw GUtil::Exception<>("Moving entries is not supported; delete and add them instead");
+
+    if(o.contains("name"))
+        e.SetName(o["name"].toString());
+    if(o.contains("description"))
+        e.SetDescription(o["description"].toString());
+    if(o.contains("favorite")){
+        if(!o["favorite"].toBool())
+            e.SetFavoriteIndex(-1);
+        else if(!e.IsFavorite())
+            e.SetFavoriteIndex(0);
+    }
+    if(o.contains("values")){
+        if(!o["values"].isArray())
+            throw GUtil::Exception<>("The values must be an array");
+        e.Values().clear();
+        for(const QJsonValue &v : o["values"].toArray()){
+            const QJsonObject vo = v.toObject();
+            SecretValue sv;
+            sv.SetName(vo["name"].toString());
+            sv.SetValue(vo["value"].toString());
+            sv.SetNotes(vo["notes"].toString());
+            sv.SetIsHidden(vo["hidden"].toBool());
+            e.Values().append(sv);
+        }
+    }
+    e.SetModifyDate(QDateTime::currentDateTime());
+}
@@ -0,0 +1,46 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef ENTRYJSON_H
+#define ENTRYJSON_H
+
+#include <grypto/entry.h>
+#include <QJsonObject>
+
+/** Separates the names in an entry path, like "Work/Email". */
+#define PATH_SEPARATOR '/'
+
+/** Converts entries to and from the JSON used by the command line and
+ *  the agent. Ids are written in hex.
+*/
+class EntryJson
+{
+public:
+
+    static QString IdToString(const Grypt::EntryId &);
+
+    /** \throws An exception if the string is not a valid id */
+    static Grypt::EntryId IdFromString(const QString &);
+
+    /** Returns the entry as a JSON object, including its secret values. */
+    static QJsonObject ToJson(const Grypt::Entry &, const QString &path);
+
+    /** Sets the fields that are present in the object, and leaves the rest alone.
+     *  \throws An exception if a field is invalid
+    */
+    static void ApplyFields(Grypt::Entry &, const QJsonObject &);
+
+};
+
+#endif // ENTRYJSON_H
@@ -0,0 +1,37 @@
+#-------------------------------------------------
+#
+# A headless client for scripting bulk changes to a vault
+#
+#-------------------------------------------------
+
+QT       += core sql xml network
+QT       -= gui
+
+TOP_DIR = ../../..
+
+TEMPLATE = app
+TARGET = gryptonite-cli
+CONFIG   += console
+CONFIG   -= app_bundle
+unix: QMAKE_RPATHDIR =
+DESTDIR = $$TOP_DIR/bin
+
+QMAKE_CXXFLAGS += -std=c++11
+
+DEFINES += GUTIL_CORE_QT_ADAPTERS
+
+INCLUDEPATH += $$TOP_DIR/gutil/include $$TOP_DIR/include
+LIBS += -L$$TOP_DIR/lib -L$$TOP_DIR/gutil/lib \
+    -lgrypto_core \
+    -lGUtilQt \
+    -lGUtilCryptoPP \
+    -lGUtil \
+    -lcryptopp
+
+SOURCES += main.cpp \
+    entryjson.cpp \
+    agentserver.cpp
+
+HEADERS += \
+    entryjson.h \
+    agentserver.h
@@ -0,0 +1,659 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "entryjson.h"
+#include "agentserver.h"
+#include <grypto/common.h>
+#include <grypto/passworddatabase.h>
+#include <grypto/entry.h>
+#include <gutil/cryptopp_rng.h>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QLocalSocket>
+#include <QTextStream>
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <mutex>
+#include <functional>
+#include <cstdio>
+using namespace std;
+USING_NAMESPACE_GRYPTO;
+
+static GUtil::CryptoPP::RNG __cryptopp_rng;
+static GUtil::RNG_Initializer __rng_init(&__cryptopp_rng);
+
+// Exit codes
+#define EXIT_ERROR  1
+#define EXIT_USAGE  2
+
+// How long the agent client waits for an answer
+#define AGENT_TIMEOUT_MS    30000
+
+
+static QString __join_path(const QString &parent_path, const QString &name)
+{
+    return parent_path.isEmpty() ? name : parent_path + PATH_SEPARATOR + name;
+}
+
+// Returns the path of names from the root to the entry
+static QString __path_of(const PasswordDatabase &db, const Entry &e)
+{
+    QStringList names(e.GetName());
+    for(EntryId pid = e.GetParentId(); !pid.IsNull();){
+        Entry p = db.FindEntry(pid);
+        names.prepend(p.GetName());
+        pid = p.GetParentId();
+    }
+    return names.join(PATH_SEPARATOR);
+}
+
+static QByteArray __entry_to_json(const Entry &e, const QString &path)
+{
+    return QJsonDocument(EntryJson::ToJson(e, path)).toJson(QJsonDocument::Compact);
+}
+
+
+/** Finds entries by their path of names, like "Work/Email". It remembers
+ *  the names it has seen, and also knows about the changes in the batch
+ *  that haven't been applied yet.
+*/
+class PathResolver
+{
+    const PasswordDatabase &m_db;
+    QHash<EntryId, QList<QPair<QString, EntryId>>> m_children;
+public:
+    PathResolver(const PasswordDatabase &db) :m_db(db) {}
+
+    /** Returns the id of the entry at the path, or a null id for the root.
+     *  \throws An exception if the path is not found or if it's ambiguous
+    */
+    EntryId Find(const QString &path){
+        EntryId ret;
+        for(const QString &name : path.split(PATH_SEPARATOR, QString::SkipEmptyParts)){
+            EntryId found;
+            int matches = 0;
+            for(const auto &c : _children(ret)){
+                if(c.first == name){
+                    found = c.second;
+                    ++matches;
+                }
+            }
+            if(0 == matches)
+                throw GUtil::Exception<>(QString("Path not found: %1").arg(path).toUtf8());
+            else if(1 < matches)
+                throw GUtil::Exception<>(QString("Path is ambiguous, use the id instead: %1")
+                                         .arg(path).toUtf8());
+            ret = found;
+        }
+        return ret;
+    }
+
+    void Added(const Entry &e){
+        _children(e.GetParentId()).append(QPair<QString, EntryId>(e.GetName(), e.GetId()));
+    }
+
+    void Renamed(const Entry &e){
+        for(auto &c : _children(e.GetParentId())){
+            if(c.second == e.GetId())
+                c.first = e.GetName();
+        }
+    }
+
+    void Removed(const Entry &e){
+        QList<QPair<QString, EntryId>> &children = _children(e.GetParentId());
+        for(int i = children.length() - 1; i >= 0; --i){
+            if(children[i].second == e.GetId())
+                children.removeAt(i);
+        }
+    }
+
+private:
+    QList<QPair<QString, EntryId>> &_children(const EntryId &pid){
+        auto iter = m_children.find(pid);
+        if(iter == m_children.end()){
+            QList<QPair<QString, EntryId>> names;
+            for(const Entry &e : m_db.FindEntriesByParentId(pid))
+                names.append(QPair<QString, EntryId>(e.GetName(), e.GetId()));
+            iter = m_children.insert(pid, names);
+        }
+        return *iter;
+    }
+};
+
+
+/** The changes read from the input, which are applied in one transaction. */
+struct batch_t
+{
+    QList<Entry> added;
+    QList<Entry> updated;
+    QList<EntryId> deleted;
+
+    // Where each entry is in the lists above
+    QHash<EntryId, int> added_index;
+    QHash<EntryId, int> updated_index;
+    QSet<EntryId> deleted_ids;
+};
+
+static bool __entry_exists(const PasswordDatabase &db, const EntryId &id)
+{
+    try{
+        db.FindEntry(id);
+    }
+    catch(const GUtil::Exception<> &){
+        return false;
+    }
+    return true;
+}
+
+// Returns the entry given by "id" or "path"
+static EntryId __target_id(PathResolver &r, const QJsonObject &o)
+{
+    EntryId ret;
+    if(o.contains("id"))
+        ret = EntryJson::IdFromString(o["id"].toString());
+    else if(o.contains("path"))
+        ret = r.Find(o["path"].toString());
+    if(ret.IsNull())
+        throw GUtil::Exception<>("You must give the id or path of an entry");
+    return ret;
+}
+
+static void __parse_change(const PasswordDatabase &db, PathResolver &r, batch_t &b,
+                           const QByteArray &line)
+{
+    QJsonParseError err;
+    const QJsonDocument doc = QJsonDocument::fromJson(line, &err);
+    if(QJsonParseError::NoError != err.error)
+        throw GUtil::Exception<>(QString("Invalid JSON: %1").arg(err.errorString()).toUtf8());
+    if(!doc.isObject())
+        throw GUtil::Exception<>("Each line must be a JSON object");
+
+    const QJsonObject o = doc.object();
+    const QString op = o["op"].toString();
+    if(op == "add"){
+        Entry e;
+        e.SetId(o.contains("id") ? EntryJson::IdFromString(o["id"].toString()) : EntryId::NewId());
+        if(b.added_index.contains(e.GetId()) || __entry_exists(db, e.GetId()))
+            throw GUtil::Exception<>("An entry with that id already exists");
+
+        QJsonObject fields(o);
+        if(fields.contains("parent"))
+            e.SetParentId(EntryJson::IdFromString(fields.take("parent").toString()));
+        else if(fields.contains("parent_path"))
+            e.SetParentId(r.Find(fields.take("parent_path").toString()));
+        if(!e.GetParentId().IsNull() && !b.added_index.contains(e.GetParentId()) &&
+                !__entry_exists(db, e.GetParentId()))
+            throw GUtil::Exception<>("Parent entry not found");
+        if(b.deleted_ids.contains(e.GetParentId()))
+            throw GUtil::Exception<>("The parent was deleted earlier in the input");
+
+        EntryJson::ApplyFields(e, fields);
+        b.added_index.insert(e.GetId(), b.added.length());
+        b.added.append(e);
+        r.Added(e);
+    }
+    else if(op == "update"){
+        const EntryId id = __target_id(r, o);
+        if(b.deleted_ids.contains(id))
+            throw GUtil::Exception<>("The entry was deleted earlier in the input");
+
+        QJsonObject fields(o);
+        fields.remove("id");
+        fields.remove("path");
+
+        // Fold updates to new entries into the add, and merge repeated updates
+        Entry *e;
+        auto ai = b.added_index.find(id);
+        if(ai != b.added_index.end())
+            e = &b.added[*ai];
+        else{
+            auto ui = b.updated_index.find(id);
+            if(ui == b.updated_index.end()){
+                b.updated.append(db.FindEntry(id));
+                ui = b.updated_index.insert(id, b.updated.length() - 1);
+            }
+            e = &b.updated[*ui];
+        }
+        EntryJson::ApplyFields(*e, fields);
+        r.Renamed(*e);
+    }
+    else if(op == "delete"){
+        const EntryId id = __target_id(r, o);
+        if(b.deleted_ids.contains(id))
+            return;
+        if(b.added_index.contains(id) || b.updated_index.contains(id))
+            throw GUtil::Exception<>("Cannot delete an entry that was added or updated earlier in the input");
+
+        const Entry e = db.FindEntry(id);
+        b.deleted.append(id);
+        b.deleted_ids.insert(id);
+        r.Removed(e);
+    }
+    else{
+        throw GUtil::Exception<>(QString("Unknown operation: \"%1\"").arg(op).toUtf8());
+    }
+}
+
+// The worker_error function returns the first error from the worker thread
+static int __apply(PasswordDatabase &db, function<QString()> worker_error)
+{
+    QTextStream err(stderr);
+    QFile in;
+    if(!in.open(stdin, QIODevice::ReadOnly))
+        throw GUtil::Exception<>("Unable to read the standard input");
+
+    // Read and check everything before we change anything
+    PathResolver r(db);
+    batch_t b;
+    int line_number = 0;
+    while(!in.atEnd()){
+        const QByteArray line = in.readLine().trimmed();
+        ++line_number;
+        if(line.isEmpty())
+            continue;
+        try{
+            __parse_change(db, r, b, line);
+        }
+        catch(const GUtil::Exception<> &ex){
+            throw GUtil::Exception<>(QString("Line %1: %2").arg(line_number)
+                                     .arg(QString::fromStdString(ex.Message())).toUtf8());
+        }
+    }
+
+    db.ApplyChanges(b.added, b.updated, b.deleted, false);
+
+    // The children of deleted entries are orphans now, so clean them up
+    if(!b.deleted.isEmpty())
+        db.DeleteOrphans();
+    db.WaitForThreadIdle();
+
+    // Don't report anything if it didn't make it to the vault; the caller
+    //  prints the error
+    if(!worker_error().isEmpty())
+        return EXIT_ERROR;
+
+    // Report the ids of new entries, since they may have been generated
+    QFile out;
+    out.open(stdout, QIODevice::WriteOnly);
+    for(const Entry &e : b.added){
+        QJsonObject o;
+        o["id"] = EntryJson::IdToString(e.GetId());
+        o["name"] = e.GetName();
+        out.write(QJsonDocument(o).toJson(QJsonDocument::Compact) + '\n');
+    }
+    out.flush();
+
+    err << QString("Added %1, updated %2 and deleted %3 entries")
+           .arg(b.added.length()).arg(b.updated.length()).arg(b.deleted.length())
+        << endl;
+    return 0;
+}
+
+// Writes one line per entry in depth-first order. Only the children of the
+//  entries on the path to the current one are in memory at once.
+static int __export(PasswordDatabase &db, const EntryId &root_id)
+{
+    QFile out;
+    if(!out.open(stdout, QIODevice::WriteOnly))
+        throw GUtil::Exception<>("Unable to write the standard output");
+
+    struct pending_t{
+        Entry entry;
+        int child_count;
+        QString path;
+    };
+    QList<pending_t> stack;
+    auto push_children = [&](const EntryId &pid, const QString &parent_path){
+        const QList<QPair<Entry, int>> children = db.FindEntriesAndChildCountsByParentId(pid);
+        for(int i = children.length() - 1; i >= 0; --i)
+            stack.append(pending_t{children[i].first, children[i].second,
+                                   __join_path(parent_path, children[i].first.GetName())});
+    };
+
+    if(root_id.IsNull())
+        push_children(root_id, QString());
+    else{
+        const Entry root = db.FindEntry(root_id);
+        stack.append(pending_t{root, db.CountEntriesByParentId(root_id), __path_of(db, root)});
+    }
+
+    while(!stack.isEmpty()){
+        const pending_t p = stack.takeLast();
+        out.write(__entry_to_json(p.entry, p.path) + '\n');
+        if(0 < p.child_count)
+            push_children(p.entry.GetId(), p.path);
+    }
+    out.flush();
+    return 0;
+}
+
+static int __get(PasswordDatabase &db, const EntryId &id)
+{
+    if(id.IsNull())
+        throw GUtil::Exception<>("You must give the path or id of an entry");
+
+    const Entry e = db.FindEntry(id);
+    QFile out;
+    out.open(stdout, QIODevice::WriteOnly);
+    out.write(__entry_to_json(e, __path_of(db, e)) + '\n');
+    return 0;
+}
+
+// Reads the first line from the file descriptor, without echoing anything
+static QByteArray __read_password(int fd)
+{
+    QFile f;
+    if(!f.open(fd, QIODevice::ReadOnly))
+        throw GUtil::Exception<>(QString("Unable to read the password from file descriptor %1")
+                                 .arg(fd).toUtf8());
+    QByteArray ret = f.readLine();
+    while(ret.endsWith('\n') || ret.endsWith('\r'))
+        ret.chop(1);
+    return ret;
+}
+
+
+// Runs the agent until it's told to stop. It prints the variables that
+//  clients need in a form that you can source in a shell, like ssh-agent.
+static int __agent(QCoreApplication &app, const QString &vault_path,
+                   const Credentials &creds, const QCommandLineParser &parser)
+{
+    bool ok = true;
+    const int idle_minutes = parser.isSet("idle-minutes") ?
+                parser.value("idle-minutes").toInt(&ok) : 15;
+    if(!ok || 0 > idle_minutes)
+        throw GUtil::Exception<>("Invalid number of idle minutes");
+
+    AgentServer agent(vault_path, idle_minutes);
+    agent.Start(creds, parser.value("socket"));
+
+    QTextStream out(stdout);
+    out << GRYPTO_AGENT_SOCKET_VARIABLE "=" << agent.SocketPath()
+        << "; export " GRYPTO_AGENT_SOCKET_VARIABLE ";" << endl;
+    out << GRYPTO_AGENT_TOKEN_VARIABLE "=" << agent.Token()
+        << "; export " GRYPTO_AGENT_TOKEN_VARIABLE ";" << endl;
+    out << "echo Agent pid " << QCoreApplication::applicationPid() << ";" << endl;
+    return app.exec();
+}
+
+// Sends the requests in one write and returns the answers in order
+static QList<QJsonObject> __agent_requests(const QString &socket_path,
+                                           const QList<QJsonObject> &requests)
+{
+    QLocalSocket s;
+    s.connectToServer(socket_path);
+    if(!s.waitForConnected(AGENT_TIMEOUT_MS))
+        throw GUtil::Exception<>(QString("Unable to connect to the agent: %1")
+                                 .arg(s.errorString()).toUtf8());
+
+    QByteArray data;
+    for(const QJsonObject &r : requests)
+        data.append(QJsonDocument(r).toJson(QJsonDocument::Compact)).append('\n');
+    s.write(data);
+
+    QList<QJsonObject> ret;
+    while(ret.length() < requests.length()){
+        while(!s.canReadLine()){
+            if(!s.waitForReadyRead(AGENT_TIMEOUT_MS))
+                throw GUtil::Exception<>("The agent did not answer");
+        }
+        const QJsonObject o = QJsonDocument::fromJson(s.readLine()).object();
+        if(!o["ok"].toBool())
+            throw GUtil::Exception<>(o["error"].toString().toUtf8());
+        ret.append(o);
+    }
+    return ret;
+}
+
+static int __agent_client(const QString &command, const QString &arg,
+                          const QCommandLineParser &parser)
+{
+    QString socket_path = parser.value("socket");
+    if(socket_path.isEmpty())
+        socket_path = QString::fromLocal8Bit(qgetenv(GRYPTO_AGENT_SOCKET_VARIABLE));
+    if(socket_path.isEmpty())
+        throw GUtil::Exception<>("Use --socket or set " GRYPTO_AGENT_SOCKET_VARIABLE);
+
+    QJsonObject auth;
+    auth["op"] = "auth";
+    auth["token"] = QString::fromLatin1(qgetenv(GRYPTO_AGENT_TOKEN_VARIABLE));
+
+    QJsonObject r;
+    r["op"] = command;
+    if(command == "get" || command == "list"){
+        if(!arg.isEmpty())
+            r[parser.isSet("id") ? "entry" : "path"] = arg;
+    }
+    else if(command == "search"){
+        r["query"] = arg;
+    }
+    else if(command == "unlock"){
+        if(!parser.isSet("password-fd"))
+            throw GUtil::Exception<>("You must give --password-fd to unlock");
+        QByteArray password = __read_password(parser.value("password-fd").toInt());
+        r["password"] = QString::fromUtf8(password);
+        password.fill(0);
+    }
+
+    const QJsonObject o = __agent_requests(socket_path, {auth, r})[1];
+
+    // Print the entries one per line like the other commands, so the
+    //  output doesn't depend on whether you use the agent
+    QFile out;
+    out.open(stdout, QIODevice::WriteOnly);
+    if(command == "get"){
+        out.write(QJsonDocument(o["entry"].toObject()).toJson(QJsonDocument::Compact) + '\n');
+    }
+    else if(command == "list" || command == "search"){
+        for(const QJsonValue &e : o["entries"].toArray())
+            out.write(QJsonDocument(e.toObject()).toJson(QJsonDocument::Compact) + '\n');
+    }
+    else{
+        QJsonObject result = o;
+        result.remove("ok");
+        out.write(QJsonDocument(result).toJson(QJsonDocument::Compact) + '\n');
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("gryptonite-cli");
+    app.setApplicationVersion(GRYPTO_VERSION_STRING);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+                "Reads and changes a vault without the GUI, for scripts.\n"
+                "\n"
+                "Commands:\n"
+                "  apply          Applies the JSON Lines changes on stdin in one transaction.\n"
+                "                 Each line has an \"op\" of \"add\", \"update\" or \"delete\".\n"
+                "                 Entries are given by \"id\" or \"path\", and new entries go\n"
+                "                 under \"parent\" or \"parent_path\". The fields are \"name\",\n"
+                "                 \"description\", \"favorite\" and \"values\", which is a list of\n"
+                "                 {\"name\", \"value\", \"notes\", \"hidden\"}. Nothing is changed\n"
+                "                 if any line is invalid. Prints the ids of the new entries.\n"
+                "  export [path]  Writes the entry and everything below it as JSON Lines,\n"
+                "                 or the whole vault if there is no path.\n"
+                "  get <path>     Writes the entry as one line of JSON.\n"
+                "  backup <file>  Writes an encrypted backup of the vault to the file and\n"
+                "                 prints a token. With --since and the token from an earlier\n"
+                "                 backup, it only writes what changed since that one.\n"
+                "  restore <file>...\n"
+                "                 Makes the vault from a full backup and the backups made\n"
+                "                 after it, in order. The vault must not exist.\n"
+                "  agent          Keeps the vault unlocked and answers lookups on a local\n"
+                "                 socket. It prints the variables for the clients in shell\n"
+                "                 syntax and runs until it's stopped, so run it in the\n"
+                "                 background and source what it prints.\n"
+                "\n"
+                "With --agent, there is no vault argument and the commands go to a running\n"
+                "agent instead:\n"
+                "  get <path>, list [path], search <query>, stats, lock, unlock, stop\n"
+                "\n"
+                "Paths are entry names separated by '/'. Use --id if a name contains a '/'\n"
+                "or if there are siblings with the same name.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("vault", "The path of the vault.");
+    parser.addPositionalArgument("command", "One of apply, export, get, backup, restore or agent.");
+    parser.addPositionalArgument("path", "The path of the entry.", "[path]");
+    parser.addOptions({
+        {"password-fd", "Reads the password from the first line of this file descriptor,"
+                        " so it doesn't show up in the process list.", "fd"},
+        {{"k", "keyfile"}, "The vault's keyfile, if any.", "path"},
+        {"since", "Only back up what changed since the backup that printed this token.", "token"},
+        {"id", "The path argument is an entry id in hex."},
+        {"create", "Creates the vault if it doesn't exist."},
+        {"agent", "Sends the command to the agent instead of opening a vault."},
+        {"socket", "The agent's socket, instead of $" GRYPTO_AGENT_SOCKET_VARIABLE ".", "path"},
+        {"idle-minutes", "The agent locks after this many minutes without a request,"
+                         " or never if it's 0. The default is 15.", "minutes"},
+    });
+    parser.process(app);
+
+    QTextStream err(stderr);
+    const QStringList args = parser.positionalArguments();
+    if(parser.isSet("agent")){
+        const QStringList agent_commands{"get", "list", "search", "stats", "lock", "unlock", "stop"};
+        if(1 > args.length() || 2 < args.length() || !agent_commands.contains(args[0])){
+            err << "You must give an agent command" << endl;
+            parser.showHelp(EXIT_USAGE);
+        }
+        try{
+            return __agent_client(args[0], 2 == args.length() ? args[1] : QString(), parser);
+        }
+        catch(const GUtil::Exception<> &ex){
+            err << "Error: " << QString::fromStdString(ex.Message()) << endl;
+            return EXIT_ERROR;
+        }
+    }
+
+    // Restore takes any number of backups, the others take at most one argument
+    if(2 > args.length() || (3 < args.length() && args[1] != "restore")){
+        err << "You must give a vault and a command" << endl;
+        parser.showHelp(EXIT_USAGE);
+    }
+    const QString vault_path = args[0];
+    const QString command = args[1];
+    const QString entry_path = 3 == args.length() ? args[2] : QString();
+    const QStringList commands{"apply", "export", "get", "backup", "restore", "agent"};
+    if(!commands.contains(command)){
+        err << "Unknown command: " << command << endl;
+        parser.showHelp(EXIT_USAGE);
+    }
+    if((command == "backup" || command == "restore") && 3 > args.length()){
+        err << "You must give the backup file" << endl;
+        parser.showHelp(EXIT_USAGE);
+    }
+    if(command == "restore"){
+        if(QFile::exists(vault_path)){
+            err << "The vault already exists: " << vault_path << endl;
+            return EXIT_ERROR;
+        }
+    }
+    else if(!QFile::exists(vault_path) && !parser.isSet("create")){
+        err << "The vault does not exist: " << vault_path << endl;
+        return EXIT_ERROR;
+    }
+
+    int ret = EXIT_ERROR;
+    try{
+        Credentials creds;
+        if(parser.isSet("password-fd")){
+            bool ok;
+            const int fd = parser.value("password-fd").toInt(&ok);
+            if(!ok || 0 > fd){
+                err << "Invalid file descriptor" << endl;
+                return EXIT_USAGE;
+            }
+            QByteArray password = __read_password(fd);
+            creds.Password = password.constData();
+            password.fill(0);
+            creds.Type = parser.isSet("keyfile") ?
+                        Credentials::PasswordAndKeyfileType : Credentials::PasswordType;
+        }
+        else if(parser.isSet("keyfile")){
+            creds.Type = Credentials::KeyfileType;
+        }
+        else{
+            err << "You must give --password-fd, --keyfile or both" << endl;
+            return EXIT_USAGE;
+        }
+        if(parser.isSet("keyfile"))
+            creds.Keyfile = parser.value("keyfile").toUtf8().constData();
+
+        if(command == "agent")
+            return __agent(app, vault_path, creds, parser);
+        if(command == "restore"){
+            PasswordDatabase::RestoreBackup(vault_path, args.mid(2), creds);
+            return 0;
+        }
+
+        // The default is to never override the lock, since there's nobody to ask
+        PasswordDatabase db(vault_path);
+
+        // Errors on the worker thread are reported with a signal. We don't
+        //  have an event loop, so catch it on the worker thread itself.
+        mutex worker_error_lock;
+        QString worker_error;
+        QObject::connect(&db, &PasswordDatabase::NotifyExceptionOnBackgroundThread,
+                         &db, [&](const shared_ptr<exception> &ex){
+            GUtil::Exception<> *gex = dynamic_cast<GUtil::Exception<> *>(ex.get());
+            lock_guard<mutex> lkr(worker_error_lock);
+            if(worker_error.isEmpty())
+                worker_error = gex ? QString::fromStdString(gex->Message()) : QString(ex->what());
+        }, Qt::DirectConnection);
+
+        db.Open(creds);
+
+        EntryId id;
+        if(command == "export" || command == "get")
+            id = parser.isSet("id") ? EntryJson::IdFromString(entry_path) :
+                                      PathResolver(db).Find(entry_path);
+
+        if(command == "apply")
+            ret = __apply(db, [&]{
+                lock_guard<mutex> lkr(worker_error_lock);
+                return worker_error;
+            });
+        else if(command == "backup"){
+            // The token goes on stdout, so a script can keep it for next time
+            QTextStream(stdout) << db.Backup(entry_path, creds, parser.value("since")) << endl;
+            ret = 0;
+        }
+        else if(command == "export")
+            ret = __export(db, id);
+        else
+            ret = __get(db, id);
+
+        db.WaitForThreadIdle();
+        lock_guard<mutex> lkr(worker_error_lock);
+        if(!worker_error.isEmpty()){
+            err << "Error: " << worker_error << endl;
+            ret = EXIT_ERROR;
+        }
+    }
+    catch(const GUtil::Exception<> &ex){
+        err << "Error: " << QString::fromStdString(ex.Message()) << endl;
+        ret = EXIT_ERROR;
+    }
+    return ret;
+}
@@ -0,0 +1,40 @@
+#-------------------------------------------------
+#
+# Tests for the command line client and its agent. Build the client
+#  first, because the tests run it.
+#
+#-------------------------------------------------
+
+QT       += sql network testlib
+
+QT       -= gui
+
+TOP_DIR = ../../../../..
+
+QMAKE_CXXFLAGS += -std=c++11
+DEFINES += GUTIL_CORE_QT_ADAPTERS
+
+TARGET = tst_clitest
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+INCLUDEPATH += $$TOP_DIR/include $$TOP_DIR/gutil/include
+LIBS += -L$$TOP_DIR/lib -L$$TOP_DIR/gutil/lib \
+    -lgrypto_core \
+    -lGUtil \
+    -lGUtilQt \
+    -lGUtilCryptoPP \
+    -lcryptopp
+
+INCLUDEPATH += ../..
+
+SOURCES += tst_clitest.cpp \
+    ../../agentserver.cpp \
+    ../../entryjson.cpp
+
+HEADERS += \
+    ../../agentserver.h \
+    ../../entryjson.h
+DEFINES += SRCDIR=\\\"$$PWD/\\\"
+DEFINES += CLI_PATH=\\\"$$OUT_PWD/$$TOP_DIR/bin/gryptonite-cli\\\"
@@ -0,0 +1,350 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "agentserver.h"
+#include <grypto_passworddatabase.h>
+#include <grypto_entry.h>
+#include <grypto_lockout.h>
+#include <gutil/cryptopp_rng.h>
+#include <QString>
+#include <QFile>
+#include <QProcess>
+#include <QLocalSocket>
+#include <QLocalServer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QtTest>
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+using namespace std;
+USING_NAMESPACE_GRYPTO;
+
+#define TEST_VAULT      "tst_cli.sqlite"
+#define TEST_KEYFILE    "tst_cli_keyfile.txt"
+#define TEST_SOCKET     "tst_cli_agent.sock"
+
+static GUtil::CryptoPP::RNG __cryptopp_rng;
+static GUtil::RNG_Initializer __rng_init(&__cryptopp_rng);
+
+
+// Sends one request to the agent and waits for the answer, while letting
+//  the agent run in our event loop
+static QJsonObject __request(QLocalSocket &s, const QJsonObject &r)
+{
+    s.write(QJsonDocument(r).toJson(QJsonDocument::Compact) + '\n');
+    s.flush();
+    for(int i = 0; i < 500 && !s.canReadLine(); ++i)
+        QTest::qWait(10);
+    return QJsonDocument::fromJson(s.readLine()).object();
+}
+
+static QJsonObject __auth(const QByteArray &token)
+{
+    QJsonObject ret;
+    ret["op"] = "auth";
+    ret["token"] = QString::fromLatin1(token);
+    return ret;
+}
+
+static QJsonObject __op(const QString &op)
+{
+    QJsonObject ret;
+    ret["op"] = op;
+    return ret;
+}
+
+
+class CliTest : public QObject
+{
+    Q_OBJECT
+    Credentials creds;
+
+public:
+    CliTest();
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+    void test_apply();
+    void test_apply_invalid();
+    void test_agent_token();
+    void test_agent_peer_credentials();
+    void test_agent_idle_lock();
+    void test_agent_socket_path();
+    void cleanupTestCase();
+
+private:
+    // Runs the client with the vault and keyfile, and the input on stdin
+    int _run(const QStringList &args, const QByteArray &input,
+             QByteArray *out = NULL, QByteArray *err = NULL);
+};
+
+CliTest::CliTest()
+    :creds(Credentials::KeyfileType)
+{
+    creds.Keyfile = TEST_KEYFILE;
+}
+
+void CliTest::initTestCase()
+{
+    QFile f(TEST_KEYFILE);
+    QVERIFY(f.open(QFile::WriteOnly | QFile::Truncate));
+    f.write("The keyfile for the command line tests");
+}
+
+void CliTest::init()
+{
+    // Every test starts with a vault that has one entry
+    QFile::remove(TEST_VAULT);
+    PasswordDatabase db(TEST_VAULT);
+    db.Open(creds);
+    Entry e;
+    e.SetName("Email");
+    e.SetDescription("old description");
+    db.AddEntry(e);
+    db.WaitForThreadIdle();
+}
+
+int CliTest::_run(const QStringList &args, const QByteArray &input,
+                  QByteArray *out, QByteArray *err)
+{
+    QProcess p;
+    p.start(CLI_PATH, QStringList(TEST_VAULT) << args << "-k" << TEST_KEYFILE);
+    if(!p.waitForStarted())
+        qFatal("Unable to start the client at %s", CLI_PATH);
+    p.write(input);
+    p.closeWriteChannel();
+    p.waitForFinished(60000);
+    if(out)
+        *out = p.readAllStandardOutput();
+    if(err)
+        *err = p.readAllStandardError();
+    return QProcess::NormalExit == p.exitStatus() ? p.exitCode() : -1;
+}
+
+void CliTest::test_apply()
+{
+    QByteArray out, err;
+    const QByteArray input =
+            "{\"op\": \"add\", \"name\": \"Bank\", \"description\": \"checking\"}\n"
+            "{\"op\": \"add\", \"parent_path\": \"Bank\", \"name\": \"Login\"}\n"
+            "{\"op\": \"update\", \"path\": \"Email\", \"description\": \"new description\"}\n";
+    QVERIFY(0 == _run({"apply"}, input, &out, &err));
+
+    // It prints one line for each new entry
+    const QList<QByteArray> lines = out.trimmed().split('\n');
+    QVERIFY(2 == lines.length());
+    QVERIFY(QJsonDocument::fromJson(lines[0]).object()["name"].toString() == "Bank");
+    QVERIFY(QJsonDocument::fromJson(lines[1]).object()["name"].toString() == "Login");
+    QVERIFY(err.contains("Added 2, updated 1 and deleted 0 entries"));
+
+    PasswordDatabase db(TEST_VAULT);
+    db.Open(creds);
+    const QList<Entry> root = db.FindEntriesByParentId(EntryId::Null());
+    QVERIFY(2 == root.length());
+    QVERIFY(root[0].GetName() == "Email");
+    QVERIFY(root[0].GetDescription() == "new description");
+    QVERIFY(root[1].GetName() == "Bank");
+    QVERIFY(root[1].GetDescription() == "checking");
+    const QList<Entry> children = db.FindEntriesByParentId(root[1].GetId());
+    QVERIFY(1 == children.length() && children[0].GetName() == "Login");
+}
+
+void CliTest::test_apply_invalid()
+{
+    // The second line is bad, so nothing changes and nothing is printed
+    QByteArray out, err;
+    const QByteArray input =
+            "{\"op\": \"add\", \"name\": \"Bank\"}\n"
+            "{\"op\": \"delete\", \"path\": \"Nothing/Here\"}\n";
+    QVERIFY(0 != _run({"apply"}, input, &out, &err));
+    QVERIFY(out.isEmpty());
+    QVERIFY(err.contains("Line 2"));
+
+    PasswordDatabase db(TEST_VAULT);
+    db.Open(creds);
+    QVERIFY(1 == db.CountEntriesByParentId(EntryId::Null()));
+}
+
+void CliTest::test_agent_token()
+{
+    AgentServer agent(TEST_VAULT, 0);
+    agent.Start(creds);
+
+    // Nothing is answered before you authenticate, and then it hangs up
+    {
+        QLocalSocket s;
+        s.connectToServer(agent.SocketPath());
+        QVERIFY(s.waitForConnected(1000));
+        const QJsonObject o = __request(s, __op("list"));
+        QVERIFY(!o["ok"].toBool());
+        QVERIFY(o["error"].toString() == "Not authenticated");
+        QVERIFY(!o.contains("entries"));
+        QTRY_VERIFY(QLocalSocket::UnconnectedState == s.state());
+    }
+
+    // A wrong token is no better
+    {
+        QLocalSocket s;
+        s.connectToServer(agent.SocketPath());
+        QVERIFY(s.waitForConnected(1000));
+        QByteArray token = agent.Token();
+        token[0] = token[0] == '0' ? '1' : '0';
+        QVERIFY(!__request(s, __auth(token))["ok"].toBool());
+        QTRY_VERIFY(QLocalSocket::UnconnectedState == s.state());
+    }
+
+    // With the right token you get answers
+    {
+        QLocalSocket s;
+        s.connectToServer(agent.SocketPath());
+        QVERIFY(s.waitForConnected(1000));
+        QVERIFY(__request(s, __auth(agent.Token()))["ok"].toBool());
+        const QJsonObject o = __request(s, __op("list"));
+        QVERIFY(o["ok"].toBool());
+        const QJsonArray entries = o["entries"].toArray();
+        QVERIFY(1 == entries.count());
+        QVERIFY(entries[0].toObject()["name"].toString() == "Email");
+    }
+}
+
+void CliTest::test_agent_peer_credentials()
+{
+    AgentServer agent(TEST_VAULT, 0);
+    agent.Start(creds);
+
+    // We run as ourselves, so the agent accepts us
+    QLocalSocket s;
+    s.connectToServer(agent.SocketPath());
+    QVERIFY(s.waitForConnected(1000));
+    QVERIFY(AgentServer::IsSameUser(&s));
+    QVERIFY(__request(s, __auth(agent.Token()))["ok"].toBool());
+
+#ifdef Q_OS_LINUX
+    // If we can't get the peer's credentials we don't trust it
+    QLocalSocket unconnected;
+    QVERIFY(!AgentServer::IsSameUser(&unconnected));
+#endif
+}
+
+void CliTest::test_agent_idle_lock()
+{
+    AgentServer agent(TEST_VAULT, 1);
+    agent.Start(creds);
+    QVERIFY(!agent.IsLocked());
+
+    // The agent locks when its idle timer runs out, so pretend it did
+    Lockout *lockout = agent.findChild<Lockout *>();
+    QVERIFY(lockout != NULL);
+    QVERIFY(1 == lockout->Minutes());
+    emit lockout->Lock();
+    QVERIFY(agent.IsLocked());
+
+    QLocalSocket s;
+    s.connectToServer(agent.SocketPath());
+    QVERIFY(s.waitForConnected(1000));
+    QVERIFY(__request(s, __auth(agent.Token()))["ok"].toBool());
+    QJsonObject o = __request(s, __op("list"));
+    QVERIFY(!o["ok"].toBool());
+    QVERIFY(o["error"].toString() == "The vault is locked");
+    QVERIFY(__request(s, __op("stats"))["locked"].toBool());
+
+    // It remembers the keyfile, so it unlocks again without a password
+    QVERIFY(__request(s, __op("unlock"))["ok"].toBool());
+    QVERIFY(!agent.IsLocked());
+    QVERIFY(__request(s, __op("list"))["ok"].toBool());
+}
+
+void CliTest::test_agent_socket_path()
+{
+    // Qt would put a relative name in the temp directory
+    const QString socket_path = QDir::current().absoluteFilePath(TEST_SOCKET);
+    QFile::remove(socket_path);
+
+#ifdef Q_OS_UNIX
+    // It won't delete a file that isn't a socket
+    {
+        QFile f(socket_path);
+        QVERIFY(f.open(QFile::WriteOnly));
+        f.write("not a socket");
+    }
+    {
+        AgentServer agent(TEST_VAULT, 0);
+        bool exception_hit = false;
+        try{
+            agent.Start(creds, socket_path);
+        }
+        catch(const GUtil::Exception<> &){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+        QVERIFY(agent.IsLocked());
+        QVERIFY(QFile::exists(socket_path));
+    }
+    QFile::remove(socket_path);
+#endif
+
+    // It won't take over a socket that somebody is listening on
+    {
+        QLocalServer other;
+        QVERIFY(other.listen(socket_path));
+        AgentServer agent(TEST_VAULT, 0);
+        bool exception_hit = false;
+        try{
+            agent.Start(creds, socket_path);
+        }
+        catch(const GUtil::Exception<> &){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+    }
+
+#ifdef Q_OS_UNIX
+    // But it replaces the socket of an agent that died
+    {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        QVERIFY(0 <= fd);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, QFile::encodeName(socket_path).constData(), sizeof(addr.sun_path) - 1);
+        QVERIFY(0 == ::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)));
+        ::close(fd);
+        QVERIFY(QFile::exists(socket_path));
+
+        AgentServer agent(TEST_VAULT, 0);
+        agent.Start(creds, socket_path);
+        QLocalSocket s;
+        s.connectToServer(agent.SocketPath());
+        QVERIFY(s.waitForConnected(1000));
+        QVERIFY(__request(s, __auth(agent.Token()))["ok"].toBool());
+    }
+#endif
+    QFile::remove(socket_path);
+}
+
+void CliTest::cleanupTestCase()
+{
+    QFile::remove(TEST_VAULT);
+    QFile::remove(TEST_KEYFILE);
+    QFile::remove(QDir::current().absoluteFilePath(TEST_SOCKET));
+}
+
+QTEST_GUILESS_MAIN(CliTest)
+
+#include "tst_clitest.moc"
@@ -25,13 +25,19 @@ DEFINES += GUTIL_CORE_QT_ADAPTERS
 
 INCLUDEPATH += $$TOP_DIR/gutil/include $$TOP_DIR/include
 
+# The hot backup and file export call SQLite on the handles under Qt's
+#  connections, so Qt must be built with -system-sqlite and share the SQLite
+#  library we link. On Windows there is no system SQLite, so that is the
+#  sqlite3 import library in $$TOP_DIR/lib that Qt was built against.
 win32{
 LIBS += -L$$TOP_DIR/lib -L$$TOP_DIR/gutil/lib \
     -lGUtilQt \
     -lGUtilCryptoPP \
     -lGUtil \
-    -lcryptopp
+    -lcryptopp \
+    -lsqlite3
 }
+unix: LIBS += -lsqlite3
 
 SOURCES +=
 
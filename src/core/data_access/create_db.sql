@@ -2,7 +2,8 @@
 CREATE TABLE IF NOT EXISTS Version (
     Version     TEXT NOT NULL,
     Salt        BLOB NOT NULL,
-    KeyCheck    BLOB NOT NULL
+    KeyCheck    BLOB NOT NULL,
+    KdfIterations INTEGER NOT NULL DEFAULT 0
 );
 
 CREATE TABLE IF NOT EXISTS Entry (
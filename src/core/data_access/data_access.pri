@@ -1,11 +1,19 @@
 
 HEADERS += \
     data_access/passworddatabase.h \
-    data_access/xmlconverter.h
+    data_access/xmlconverter.h \
+    data_access/sqlprofiler.h \
+    data_access/sqlstatementcache.h \
+    data_access/keyderivation.h \
+    data_access/filecryptopool.h
 
 SOURCES += \
     data_access/passworddatabase.cpp \
-    data_access/xmlconverter.cpp
+    data_access/xmlconverter.cpp \
+    data_access/sqlprofiler.cpp \
+    data_access/sqlstatementcache.cpp \
+    data_access/keyderivation.cpp \
+    data_access/filecryptopool.cpp
 
 
 RESOURCES += \
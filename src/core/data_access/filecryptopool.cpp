@@ -0,0 +1,209 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "filecryptopool.h"
+#include <grypto/tracer.h>
+#include <gutil/qtsourcesandsinks.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+#include <deque>
+#include <queue>
+#include <vector>
+USING_NAMESPACE_GUTIL1(Qt);
+USING_NAMESPACE_GUTIL1(CryptoPP);
+USING_NAMESPACE_GUTIL;
+using namespace std;
+
+// More threads than this just fight over the disk and the memory bus
+#define MAX_THREAD_COUNT 4
+
+namespace Grypt{
+
+
+namespace{
+
+struct slot_t
+{
+    QByteArray Input;
+    quint64 InputLength;
+    FileCryptoJob Result;
+    bool Done;
+    exception_ptr Error;
+
+    slot_t() :InputLength(0), Done(false) {}
+};
+
+}
+
+struct FileCryptoPool::d_t
+{
+    const OperationEnum operation;
+    const quint64 window_bytes;
+    int window_count;
+
+    // Everything below is guarded by the lock
+    mutable mutex lock;
+    condition_variable wc_work;
+    condition_variable wc_done;
+
+    // The files in the order they were pushed, and the ones not started yet
+    deque<shared_ptr<slot_t>> in_flight;
+    queue<shared_ptr<slot_t>> pending;
+    quint64 in_flight_bytes;
+    bool closing;
+
+    vector<thread> threads;
+
+    d_t(OperationEnum op, quint64 wb)
+        :operation(op),
+          window_bytes(wb),
+          window_count(0),
+          in_flight_bytes(0),
+          closing(false)
+    {}
+};
+
+const quint64 FileCryptoPool::DefaultWindowBytes = 64 * 1024 * 1024;
+
+FileCryptoPool::FileCryptoPool(const Cryptor &cryptor,
+                               OperationEnum op,
+                               int thread_count,
+                               quint64 window_bytes)
+    :d(new d_t(op, window_bytes))
+{
+    if(0 >= thread_count)
+        thread_count = qBound<int>(1, thread::hardware_concurrency(), MAX_THREAD_COUNT);
+
+    // Keep enough in flight that the threads don't wait while we write
+    d->window_count = 2 * thread_count;
+    for(int i = 0; i < thread_count; ++i)
+        d->threads.push_back(thread(&FileCryptoPool::_worker, this, new Cryptor(cryptor)));
+}
+
+FileCryptoPool::~FileCryptoPool()
+{
+    {
+        lock_guard<mutex> lkr(d->lock);
+        d->closing = true;
+    }
+    d->wc_work.notify_all();
+    for(thread &t : d->threads)
+        t.join();
+}
+
+void FileCryptoPool::Push(const QByteArray &tag, const QByteArray &data)
+{
+    shared_ptr<slot_t> s(new slot_t);
+    s->Input = data;
+    s->InputLength = data.length();
+    s->Result.Tag = tag;
+    {
+        lock_guard<mutex> lkr(d->lock);
+        d->in_flight.push_back(s);
+        d->pending.push(s);
+        d->in_flight_bytes += s->InputLength;
+    }
+    d->wc_work.notify_one();
+}
+
+FileCryptoJob FileCryptoPool::Pop()
+{
+    shared_ptr<slot_t> s;
+    {
+        unique_lock<mutex> lkr(d->lock);
+        if(d->in_flight.empty())
+            throw Exception<>("There is nothing in the pool");
+        s = d->in_flight.front();
+        d->wc_done.wait(lkr, [&]{ return s->Done; });
+        d->in_flight.pop_front();
+        d->in_flight_bytes -= s->InputLength;
+    }
+    if(s->Error)
+        rethrow_exception(s->Error);
+    return s->Result;
+}
+
+bool FileCryptoPool::IsFull() const
+{
+    lock_guard<mutex> lkr(d->lock);
+    return !d->in_flight.empty() &&
+            ((int)d->in_flight.size() >= d->window_count ||
+             d->in_flight_bytes >= d->window_bytes);
+}
+
+bool FileCryptoPool::IsEmpty() const
+{
+    lock_guard<mutex> lkr(d->lock);
+    return d->in_flight.empty();
+}
+
+int FileCryptoPool::ThreadCount() const
+{
+    return d->threads.size();
+}
+
+void FileCryptoPool::_worker(Cryptor *c)
+{
+    unique_ptr<Cryptor> cryptor(c);
+    Tracer::SetThreadName("File crypto");
+
+    unique_lock<mutex> lkr(d->lock);
+    forever{
+        d->wc_work.wait(lkr, [&]{ return d->closing || !d->pending.empty(); });
+        if(d->closing)
+            break;
+
+        shared_ptr<slot_t> s = d->pending.front();
+        d->pending.pop();
+        lkr.unlock();
+
+        try{
+            const chrono::steady_clock::time_point started = chrono::steady_clock::now();
+            QByteArrayInput i(s->Input);
+            QByteArrayOutput o(s->Result.Output);
+            if(Encrypt == d->operation){
+                GRYPTO_TRACE_SCOPE("crypto", "EncryptFile");
+                s->Result.Output.reserve(s->Input.length() +
+                                         cryptor->GetNonceSize() + cryptor->TagLength);
+                cryptor->EncryptData(&o, &i);
+                s->Result.PlaintextLength = s->Input.length();
+            }
+            else{
+                GRYPTO_TRACE_SCOPE("crypto", "DecryptFile");
+                s->Result.Output.reserve(qMax(0, s->Input.length() -
+                                              (int)(cryptor->GetNonceSize() + cryptor->TagLength)));
+                cryptor->DecryptData(&o, &i);
+                s->Result.PlaintextLength = s->Result.Output.length();
+            }
+            s->Result.Microseconds = chrono::duration_cast<chrono::microseconds>(
+                        chrono::steady_clock::now() - started).count();
+        }
+        catch(...){
+            s->Error = current_exception();
+        }
+
+        // We're done with the input, so don't keep it around until it's popped
+        s->Input.clear();
+
+        lkr.lock();
+        s->Done = true;
+        d->wc_done.notify_all();
+    }
+}
+
+
+}
@@ -0,0 +1,116 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_FILECRYPTOPOOL_H
+#define GRYPTO_FILECRYPTOPOOL_H
+
+#include <grypto/common.h>
+#include <QByteArray>
+#include <memory>
+
+namespace Grypt{
+
+
+/** One file that went through the pool. */
+struct FileCryptoJob
+{
+    /** Whatever you want to identify the file by, i.e. its id. */
+    QByteArray Tag;
+
+    /** The encrypted or decrypted data. */
+    QByteArray Output;
+
+    /** The length of the plaintext, whichever way we went. */
+    quint64 PlaintextLength;
+
+    /** How long the crypto took on the worker thread. */
+    quint64 Microseconds;
+
+    FileCryptoJob() :PlaintextLength(0), Microseconds(0) {}
+};
+
+
+/** Encrypts or decrypts files on a few threads at once, and gives you the
+ *  results back in the order you pushed them.
+ *
+ *  It only holds a bounded window of files at a time, both by count and by
+ *  size, so you have to pop the oldest result whenever it's full:
+ *
+ *      for(...){
+ *          while(pool.IsFull())
+ *              write(pool.Pop());
+ *          pool.Push(tag, data);
+ *      }
+ *      while(!pool.IsEmpty())
+ *          write(pool.Pop());
+ *
+ *  Every thread has its own copy of the cryptor. Push and Pop must be
+ *  called from the same thread. Destroying the pool throws away anything
+ *  that's left, so you can just let it go out of scope if you're cancelled.
+*/
+class FileCryptoPool
+{
+public:
+
+    enum OperationEnum
+    {
+        Encrypt,
+        Decrypt
+    };
+
+    /** The window never holds more than this many bytes, unless one file
+     *  is bigger than that by itself.
+    */
+    static const quint64 DefaultWindowBytes;
+
+    /** \param thread_count The number of worker threads, or 0 to use one
+     *          per core (up to a limit)
+     *  \param window_bytes The most input data to have in flight at once
+    */
+    FileCryptoPool(const GUtil::CryptoPP::Cryptor &,
+                   OperationEnum,
+                   int thread_count = 0,
+                   quint64 window_bytes = DefaultWindowBytes);
+    ~FileCryptoPool();
+
+    /** Queues the data to be processed. Don't push if the pool is full. */
+    void Push(const QByteArray &tag, const QByteArray &data);
+
+    /** Waits for the oldest file to finish and returns it.
+     *  \throws The exception from the worker thread, if it failed
+    */
+    FileCryptoJob Pop();
+
+    /** True if you should Pop() before you Push() another. */
+    bool IsFull() const;
+
+    /** True if there's nothing left to Pop(). */
+    bool IsEmpty() const;
+
+    /** The number of worker threads. */
+    int ThreadCount() const;
+
+
+private:
+    struct d_t;
+    std::unique_ptr<d_t> d;
+
+    void _worker(GUtil::CryptoPP::Cryptor *);
+
+};
+
+
+}
+
+#endif // GRYPTO_FILECRYPTOPOOL_H
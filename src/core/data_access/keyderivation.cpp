@@ -0,0 +1,118 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "keyderivation.h"
+#include <cryptopp/pwdbased.h>
+#include <cryptopp/sha.h>
+#include <QByteArray>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+using namespace std;
+
+// We benchmark until a sample takes at least this long, so the timer
+//  resolution doesn't matter
+#define MINIMUM_SAMPLE_MILLISECONDS 25
+
+// The first sample size, which doubles until it's long enough
+#define INITIAL_SAMPLE_ITERATIONS   1000
+
+// The length of the stretched password, in bytes before hex encoding
+#define STRETCHED_LENGTH    32
+
+namespace Grypt{
+
+
+const int KeyDerivation::DefaultTargetMilliseconds;
+const quint32 KeyDerivation::MinimumIterations;
+
+static atomic<int> __target_ms(KeyDerivation::DefaultTargetMilliseconds);
+
+// A fixed input, so calibration doesn't depend on the real password
+static const char *__benchmark_password = "Gryptonite KDF calibration";
+
+static void __pbkdf2(byte *out, size_t out_len,
+                     const byte *password, size_t password_len,
+                     const byte *salt, size_t salt_len, quint32 iterations)
+{
+    ::CryptoPP::PKCS5_PBKDF2_HMAC< ::CryptoPP::SHA256> pbkdf;
+    pbkdf.DeriveKey(out, out_len, 0,
+                    password, password_len,
+                    salt, salt_len,
+                    iterations);
+}
+
+int KeyDerivation::TargetMilliseconds()
+{
+    return __target_ms.load();
+}
+
+void KeyDerivation::SetTargetMilliseconds(int ms)
+{
+    __target_ms.store(qMax(0, ms));
+}
+
+KdfBenchmark KeyDerivation::Calibrate(int target_ms)
+{
+    KdfBenchmark ret;
+    ret.TargetMilliseconds = target_ms;
+    if(0 >= target_ms)
+        return ret;
+
+    byte out[STRETCHED_LENGTH];
+    byte salt[STRETCHED_LENGTH] = {};
+    quint32 iterations = INITIAL_SAMPLE_ITERATIONS;
+    for(;;){
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        __pbkdf2(out, sizeof(out), (const byte *)__benchmark_password, strlen(__benchmark_password),
+                 salt, sizeof(salt), iterations);
+        const qint64 us = chrono::duration_cast<chrono::microseconds>(
+                    chrono::steady_clock::now() - start).count();
+
+        if(MINIMUM_SAMPLE_MILLISECONDS * 1000 <= us || target_ms * 1000 <= us){
+            ret.IterationsPerSecond = iterations * 1000000.0 / qMax<qint64>(1, us);
+            break;
+        }
+        iterations *= 2;
+    }
+
+    // Round to a thousand, because nobody needs more precision than that
+    const double wanted = ret.IterationsPerSecond * target_ms / 1000.0;
+    ret.Parameters.Iterations = qMax(MinimumIterations, (quint32)(wanted / 1000) * 1000);
+    return ret;
+}
+
+Credentials KeyDerivation::Stretch(const Credentials &creds,
+                                   const KdfParameters &params,
+                                   const byte *salt, GUINT32 salt_len)
+{
+    if(0 == params.Iterations ||
+            (creds.Type != Credentials::PasswordType &&
+             creds.Type != Credentials::PasswordAndKeyfileType))
+        return creds;
+
+    byte out[STRETCHED_LENGTH];
+    __pbkdf2(out, sizeof(out), (const byte *)creds.Password.ConstData(), creds.Password.Length(),
+             salt, salt_len, params.Iterations);
+
+    QByteArray hex = QByteArray::fromRawData((const char *)out, sizeof(out)).toHex();
+    Credentials ret(creds);
+    ret.Password = hex.constData();
+    hex.fill(0);
+    memset(out, 0, sizeof(out));
+    return ret;
+}
+
+
+}
@@ -0,0 +1,103 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_KEYDERIVATION_H
+#define GRYPTO_KEYDERIVATION_H
+
+#include <grypto/common.h>
+
+namespace Grypt{
+
+
+/** The parameters of the password stretching, which are stored next to
+ *  the salt in the Version table.
+*/
+struct KdfParameters
+{
+    /** The number of PBKDF2-HMAC-SHA256 iterations, or 0 if the password
+     *  isn't stretched at all (which is how older vaults were made).
+    */
+    quint32 Iterations;
+
+    KdfParameters() :Iterations(0) {}
+};
+
+
+/** What we measured about the key derivation on this machine. */
+struct KdfBenchmark
+{
+    KdfParameters Parameters;
+
+    /** The unlock time that the parameters were chosen for, or 0 if they
+     *  were read from an existing vault.
+    */
+    int TargetMilliseconds;
+
+    /** How many iterations this machine does per second, or 0 if we
+     *  didn't calibrate.
+    */
+    double IterationsPerSecond;
+
+    /** How long the whole key derivation took the last time we unlocked,
+     *  including the cryptor's own derivation.
+    */
+    double UnlockMilliseconds;
+
+    KdfBenchmark() :TargetMilliseconds(0), IterationsPerSecond(0), UnlockMilliseconds(0) {}
+};
+
+
+/** Makes unlocking take about the same time on every machine, by stretching
+ *  the password with a number of iterations that we calibrate when a vault
+ *  is created. The stretched password is then given to the cryptor, which
+ *  derives the key from it as usual.
+ *
+ *  A keyfile alone is not stretched, because it has plenty of entropy.
+*/
+class KeyDerivation
+{
+public:
+
+    /** The default unlock time that new vaults are calibrated for. */
+    static const int DefaultTargetMilliseconds = 500;
+
+    /** We never stretch with fewer iterations than this, however fast the
+     *  machine is, unless the target is 0.
+    */
+    static const quint32 MinimumIterations = 10000;
+
+    /** The unlock time that new vaults are calibrated for. You can lower
+     *  it to make tests fast; 0 turns stretching off.
+    */
+    static int TargetMilliseconds();
+    static void SetTargetMilliseconds(int);
+
+    /** Benchmarks PBKDF2 on this machine and chooses the iterations that
+     *  take the target time. This takes a fraction of the target time.
+    */
+    static KdfBenchmark Calibrate(int target_ms = TargetMilliseconds());
+
+    /** Returns the credentials with the password replaced by its stretched
+     *  form, or the same credentials if there is nothing to stretch.
+    */
+    static Credentials Stretch(const Credentials &,
+                               const KdfParameters &,
+                               const byte *salt, GUINT32 salt_len);
+
+};
+
+
+}
+
+#endif // GRYPTO_KEYDERIVATION_H
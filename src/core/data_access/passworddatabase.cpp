@@ -14,7 +14,15 @@ limitations under the License.*/
 
 #include "passworddatabase.h"
 #include "xmlconverter.h"
+#include "sqlprofiler.h"
+#include "sqlstatementcache.h"
+#include "keyderivation.h"
+#include "filecryptopool.h"
 #include <grypto/entry.h>
+#include <grypto/securearena.h>
+#include <grypto/idhash.h>
+#include <grypto/bytearena.h>
+#include <grypto/tracer.h>
 #include <gutil/cryptopp_rng.h>
 #include <gutil/gpsutils.h>
 #include <gutil/databaseutils.h>
@@ -24,6 +32,7 @@ limitations under the License.*/
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 #include <QString>
 #include <QSet>
 #include <QQueue>
@@ -34,11 +43,15 @@ limitations under the License.*/
 #include <QSqlQuery>
 #include <QSqlRecord>
 #include <QSqlError>
+#include <QSqlDriver>
 #include <QDomDocument>
 #include <QLockFile>
 #include <QXmlStreamWriter>
 #include <QXmlStreamReader>
-#include <QTemporaryFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <sqlite3.h>
 USING_NAMESPACE_GUTIL1(Qt);
 USING_NAMESPACE_GUTIL1(CryptoPP);
 USING_NAMESPACE_GUTIL;
@@ -53,9 +66,20 @@ using namespace std;
 // The length of the nonce used by the cryptor
 #define NONCE_LENGTH 10
 
-#define GRYPTO_DATABASE_VERSION "3.0.0"
+#define GRYPTO_DATABASE_VERSION "3.1.0"
 
-#define GRYPTO_XML_VERSION  "3.0"
+// Vaults from before the key derivation was calibrated and the change log was
+//  added. We upgrade them when they're opened, but their password stays
+//  unstretched until they're saved as a new file.
+#define GRYPTO_DATABASE_VERSION_3_0 "3.0.0"
+
+#define GRYPTO_XML_VERSION  "3.1"
+
+// Files in XML version 3.0 were compressed in one piece, so we can still read it
+#define GRYPTO_XML_VERSION_3_0  "3.0"
+
+// Files are compressed in blocks of this size when exported to XML
+#define XML_FILE_BLOCK_SIZE  (1024 * 1024)
 
 #define MAX_TRY_COUNT 20
 
@@ -69,7 +93,7 @@ struct entry_cache{
     Grypt::FileId file_id;
     int row;
     int favoriteindex;
-    QByteArray crypttext;
+    Grypt::ByteArena::Slice crypttext;
     bool exists = true;
 
     entry_cache() {}
@@ -98,6 +122,24 @@ struct file_cache{
         :id(fid), length(len) {}
 };
 
+// The names of the background commands for the metrics, in the same
+//  order as bg_worker_command::CommandTypeEnum
+static const char *BG_COMMAND_NAMES[] = {
+    "AddEntry", "AddEntries", "EditEntry", "DeleteEntry", "MoveEntry", "ApplyChanges",
+    "RefreshFavoriteEntries", "SetFavoriteEntries", "AddFavoriteEntry", "RemoveFavoriteEntry",
+    "AddFile", "DeleteFile", "ExportFile", "ExportToPS", "ImportFromPS",
+    "ExportToXML", "ImportFromXML",
+    "DispatchOrphans", "CheckAndRepair"
+};
+
+static QStringList __command_names()
+{
+    QStringList ret;
+    for(const char *n : BG_COMMAND_NAMES)
+        ret.append(n);
+    return ret;
+}
+
 namespace
 {
 struct d_t
@@ -121,19 +163,40 @@ struct d_t
 
     // The index variables are maintained by both the main thread and
     //  the background threads.
-    QHash<Grypt::EntryId, entry_cache> index;
-    QHash<Grypt::EntryId, parent_cache> parent_index;
-    QHash<Grypt::FileId, file_cache> file_index;
+    Grypt::IdHash<Grypt::EntryId, entry_cache> index;
+    Grypt::IdHash<Grypt::EntryId, parent_cache> parent_index;
+    Grypt::IdHash<Grypt::FileId, file_cache> file_index;
+
+    // Holds the crypttext of every entry in the index
+    Grypt::ByteArena crypttext_arena;
     QSet<Grypt::EntryId> deleted_entries;
     QList<Grypt::EntryId> favorite_index;
     mutex index_lock;
     condition_variable wc_index;
 
+    // Counts what the background thread is doing. This is only written
+    //  by the worker thread and __queue_command.
+    Grypt::WorkerMetricsCollector metrics;
+
+    // The background thread's prepared statements, which only exist
+    //  while it has its connection open.
+    unique_ptr<Grypt::SqlStatementCache> statements;
+
+    // How the password is stretched, and how long it took. This is only
+    //  used by the main thread.
+    Grypt::KdfBenchmark kdf;
+
+    // What we need to make the cryptor again after it was locked away
+    QByteArray salt;
+    Credentials::TypeEnum credentials_type;
+
     d_t()
         :cancel_thread(false),
           thread_cancellable(false),
           thread_idle(false),
-          closing(false)
+          closing(false),
+          metrics(__command_names()),
+          credentials_type(Credentials::NoType)
     {}
 };
 }
@@ -156,6 +219,213 @@ public:
 };
 
 
+// Collects decrypted data in locked memory from the secure arena
+class SecureBufferOutput : public GUtil::IOutput
+{
+    Grypt::SecureBuffer &ref;
+public:
+    SecureBufferOutput(Grypt::SecureBuffer &b) :ref(b) {}
+    virtual GUINT32 WriteBytes(const byte *data, GUINT32 len){
+        ref.Append(data, len);
+        return len;
+    }
+    virtual void Flush(){}
+};
+
+
+// Compresses the data in blocks and writes it into the XML stream as base64,
+//  so exporting a file of any size only needs a block's worth of memory. Each
+//  block is the length of its qCompress output as a 32-bit big-endian integer,
+//  followed by the output. Call Finish() after the last write.
+class XmlFileOutput : public GUtil::IOutput
+{
+    QXmlStreamWriter &sw;
+    QByteArray block;
+
+    // Base64 has to be encoded in multiples of 3 bytes until the very end
+    QByteArray encode_pending;
+public:
+    XmlFileOutput(QXmlStreamWriter &w) :sw(w) { block.reserve(XML_FILE_BLOCK_SIZE); }
+    virtual GUINT32 WriteBytes(const byte *data, GUINT32 len){
+        GUINT32 remaining = len;
+        while(0 < remaining){
+            const GUINT32 n = Min<GUINT32>(remaining, XML_FILE_BLOCK_SIZE - block.length());
+            block.append((const char *)data, n);
+            data += n, remaining -= n;
+            if(XML_FILE_BLOCK_SIZE == block.length())
+                _write_block();
+        }
+        return len;
+    }
+    virtual void Flush(){}
+
+    void Finish(){
+        if(!block.isEmpty())
+            _write_block();
+        sw.writeCharacters(QString::fromLatin1(encode_pending.toBase64()));
+        encode_pending.clear();
+    }
+
+private:
+    void _write_block(){
+        const QByteArray compressed = qCompress(block, 9);
+        block.fill(0);
+        block.resize(0);
+
+        const quint32 len = compressed.length();
+        encode_pending.append((char)(len >> 24)).append((char)(len >> 16))
+                .append((char)(len >> 8)).append((char)len);
+        encode_pending.append(compressed);
+
+        const int n = encode_pending.length() - encode_pending.length() % 3;
+        sw.writeCharacters(QString::fromLatin1(encode_pending.left(n).toBase64()));
+        encode_pending.remove(0, n);
+    }
+};
+
+// Decodes a file's text from the XML as it's read, which reverses
+//  XmlFileOutput. Blocks are uncompressed as soon as they're complete, so we
+//  never hold the whole base64 text or all the compressed blocks at once.
+class XmlFileInput
+{
+    const int compression;
+
+    // Base64 has to be decoded in multiples of 4 characters until the end
+    QByteArray decode_pending;
+
+    // Decoded bytes that aren't a whole block yet
+    QByteArray block;
+public:
+    // The plaintext of the file
+    QByteArray Data;
+
+    XmlFileInput(int comp) :compression(comp) {}
+
+    void Append(const QStringRef &text){
+        decode_pending.append(text.toLatin1());
+        const int n = decode_pending.length() - decode_pending.length() % 4;
+        _decoded(QByteArray::fromBase64(decode_pending.left(n)));
+        decode_pending.remove(0, n);
+    }
+
+    void Finish(){
+        _decoded(QByteArray::fromBase64(decode_pending));
+        decode_pending.clear();
+        if(0 == compression)
+            Data = block;
+        else if(1 == compression)
+            Data = qUncompress(block);
+        else if(!block.isEmpty())
+            throw Exception<>("File data in the XML is truncated");
+        block.clear();
+    }
+
+private:
+    void _decoded(const QByteArray &data){
+        block.append(data);
+        if(2 != compression)
+            return;
+
+        // Uncompress every whole block we have
+        int pos = 0;
+        while(4 <= block.length() - pos){
+            const quint32 len = ((quint32)(uchar)block[pos] << 24) | ((quint32)(uchar)block[pos + 1] << 16) |
+                    ((quint32)(uchar)block[pos + 2] << 8) | (quint32)(uchar)block[pos + 3];
+            if((quint32)(block.length() - pos - 4) < len)
+                break;
+            Data.append(qUncompress((const uchar *)block.constData() + pos + 4, len));
+            pos += 4 + len;
+        }
+        block.remove(0, pos);
+    }
+};
+
+
+// Executes the query through the profiler, with a span for it if tracing is on
+static void __execute_query(QSqlQuery &q)
+{
+    Grypt::TraceSpan span("sql", "ExecuteQuery");
+    if(span.IsRecording())
+        span.AddArg("sql", q.lastQuery());
+    Grypt::SqlProfiler::Execute(q);
+}
+
+// Returns the SQLite connection under the Qt one. We call SQLite directly
+//  through the library we link, so Qt must have been built with -system-sqlite
+//  to use that same library. Throws if it obviously wasn't.
+static sqlite3 *__sqlite_handle(const QSqlDatabase &db)
+{
+    const QVariant v = db.driver()->handle();
+    if(!v.isValid() || 0 != qstrcmp(v.typeName(), "sqlite3*"))
+        throw Exception<>("The database driver is not SQLite");
+
+    QSqlQuery q("SELECT sqlite_version()", db);
+    if(!q.next() || q.value(0).toString() != QString::fromLatin1(sqlite3_libversion()))
+        throw Exception<>(QString("Qt's SQLite (%1) is not the one we link (%2)")
+                          .arg(q.value(0).toString())
+                          .arg(sqlite3_libversion()).toUtf8());
+    return *static_cast<sqlite3 * const *>(v.constData());
+}
+
+// Reads a file's crypttext out of the database a chunk at a time with
+//  SQLite's incremental blob I/O, so we never hold the whole blob in memory.
+//  It must be used on the thread that owns the connection.
+class FileBlobInput : public GUtil::IInput
+{
+    sqlite3_blob *blob;
+    GUINT32 length;
+    GUINT32 pos;
+public:
+    FileBlobInput(const QSqlDatabase &db, const Grypt::FileId &fid)
+        :blob(NULL), length(0), pos(0)
+    {
+        QSqlQuery q(db);
+        q.prepare("SELECT rowid FROM File WHERE ID=?");
+        q.addBindValue((QByteArray)fid);
+        __execute_query(q);
+        if(!q.next())
+            throw Exception<>("File ID not found");
+        const sqlite3_int64 rowid = q.value(0).toLongLong();
+        q.finish();
+
+        sqlite3 *handle = __sqlite_handle(db);
+        if(SQLITE_OK != sqlite3_blob_open(handle, "main", "File", "Data", rowid, 0, &blob)){
+            const QString err = sqlite3_errmsg(handle);
+            sqlite3_blob_close(blob);
+            throw Exception<>(QString("Cannot read file: %1").arg(err).toUtf8());
+        }
+        length = sqlite3_blob_bytes(blob);
+    }
+
+    ~FileBlobInput(){ sqlite3_blob_close(blob); }
+
+    GUINT32 Length() const{ return length; }
+
+    virtual GUINT32 ReadBytes(byte *buffer, GUINT32 buffer_len, GUINT32 bytes_to_read){
+        const GUINT32 n = Min(Min(buffer_len, bytes_to_read), length - pos);
+        if(0 == n)
+            return 0;
+
+        // This fails with SQLITE_ABORT if the row changed since we opened it
+        if(SQLITE_OK != sqlite3_blob_read(blob, buffer, n, pos))
+            throw Exception<>("File changed while reading it");
+        pos += n;
+        return n;
+    }
+
+    virtual GUINT32 BytesAvailable() const{ return length - pos; }
+
+private:
+    FileBlobInput(const FileBlobInput &);
+    FileBlobInput &operator = (const FileBlobInput &);
+};
+
+static void __commit_transaction(QSqlDatabase &db)
+{
+    if(!db.commit())
+        throw Exception<>(db.lastError().text().toUtf8().constData());
+}
+
 static void __open_file_or_die(QFile &f, QFile::OpenMode mode)
 {
     if(!f.open(mode))
@@ -194,7 +464,7 @@ static int __count_entries_by_parent_id(QSqlQuery &q, const EntryId &id)
               .arg(isnull ? " IS NULL" : "=?"));
     if(!isnull)
         q.addBindValue((QByteArray)id);
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
     if(q.next())
         ret = q.record().value(0).toInt();
     return ret;
@@ -214,14 +484,22 @@ static entry_cache __convert_record_to_entry_cache(const QSqlRecord &rec)
 
 static Entry __convert_cache_to_entry(const entry_cache &er, Cryptor &cryptor)
 {
-    QByteArray pt;
-    pt.reserve(er.crypttext.length() - cryptor.TagLength - cryptor.GetNonceSize());
+    GRYPTO_TRACE_SCOPE("crypto", "DecryptEntry");
+
+    // The plaintext never touches the general heap, and the buffer is
+    //  zeroed when it goes out of scope
+    const QByteArray ct = er.crypttext.Data();
+    const int overhead = cryptor.TagLength + cryptor.GetNonceSize();
+    if(ct.length() < overhead)
+        throw Exception<>("Entry crypttext is truncated");
+    SecureBuffer pt(ct.length() - overhead);
     {
-        QByteArrayOutput ba_out(pt);
-        QByteArrayInput bai_ct(er.crypttext);
-        cryptor.DecryptData(&ba_out, &bai_ct);
+        SecureBufferOutput sb_out(pt);
+        QByteArrayInput bai_ct(ct);
+        cryptor.DecryptData(&sb_out, &bai_ct);
     }
-    Entry ret = XmlConverter::FromXmlString<Entry>(pt);
+    Entry ret = XmlConverter::FromXmlString<Entry>(
+                QByteArray::fromRawData(pt.ConstData(), pt.Length()));
 
     ret.SetParentId(er.parentid);
     ret.SetId(er.id);
@@ -233,10 +511,13 @@ static Entry __convert_cache_to_entry(const entry_cache &er, Cryptor &cryptor)
 
 static QByteArray __generate_crypttext(Cryptor &cryptor, const Entry &e)
 {
+    GRYPTO_TRACE_SCOPE("crypto", "EncryptEntry");
     QByteArray crypttext;
-    QByteArrayInput i(XmlConverter::ToXmlString(e));
+    QByteArray pt = XmlConverter::ToXmlString(e);
+    QByteArrayInput i(pt);
     QByteArrayOutput o(crypttext);
     cryptor.EncryptData(&o, &i);
+    pt.fill(0);
     return crypttext;
 }
 
@@ -252,7 +533,7 @@ static entry_cache __fetch_entry_row_by_id(QSqlQuery &q, const EntryId &id)
     entry_cache ret;
     q.prepare("SELECT * FROM Entry WHERE Id=?");
     q.addBindValue((QByteArray)id);
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
     if(q.next())
         ret = __convert_record_to_entry_cache(q.record());
     return ret;
@@ -266,7 +547,7 @@ static QList<entry_cache> __fetch_entry_rows_by_parentid(QSqlQuery &q, const Ent
               .arg(isnull ? " IS NULL" : "=?"));
     if(!isnull)
         q.addBindValue((QByteArray)id);
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
     while(q.next())
         ret.append(__convert_record_to_entry_cache(q.record()));
     return ret;
@@ -287,7 +568,7 @@ static void __delete_file_by_id(const QString &conn_str, const FileId &id)
     QSqlQuery q(QSqlDatabase::database(conn_str));
     q.prepare("DELETE FROM File WHERE ID=?");
     q.addBindValue((QByteArray)id);
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
 }
 
 
@@ -298,9 +579,11 @@ public:
     {
         // Entry commands
         AddEntry,
+        AddEntries,
         EditEntry,
         DeleteEntry,
         MoveEntry,
+        ApplyChanges,
         RefreshFavoriteEntries,
         SetFavoriteEntries,
         AddFavoriteEntry,
@@ -317,14 +600,27 @@ public:
 
         // Misc commands
         DispatchOrphans,
-        CheckAndRepair
+        CheckAndRepair,
+
+        CommandTypeCount
     } CommandType;
 
+    // When the command was queued, so we can tell how long it waited
+    chrono::steady_clock::time_point QueuedAt;
+
     virtual ~bg_worker_command(){}
 protected:
     bg_worker_command(CommandTypeEnum c) :CommandType(c) {}
 };
 
+static_assert(sizeof(BG_COMMAND_NAMES) / sizeof(BG_COMMAND_NAMES[0]) == bg_worker_command::CommandTypeCount,
+              "There must be a name for every background command");
+
+static quint64 __microseconds_since(const chrono::steady_clock::time_point &start)
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
 class add_entry_command : public bg_worker_command
 {
 public:
@@ -335,6 +631,16 @@ public:
     const Entry entry;
 };
 
+class add_entries_command : public bg_worker_command
+{
+public:
+    add_entries_command(const QList<Entry> &e)
+        :bg_worker_command(AddEntries),
+          entries(e)
+    {}
+    const QList<Entry> entries;
+};
+
 class update_entry_command : public bg_worker_command
 {
 public:
@@ -368,6 +674,19 @@ public:
     quint32 RowFirst, RowLast, RowDest;
 };
 
+class apply_changes_command : public bg_worker_command
+{
+public:
+    apply_changes_command(const QList<Entry> &added, const QList<Entry> &updated,
+                          const QList<EntryId> &deleted)
+        :bg_worker_command(ApplyChanges),
+          Added(added), Updated(updated), Deleted(deleted)
+    {}
+    const QList<Entry> Added;
+    const QList<Entry> Updated;
+    const QList<EntryId> Deleted;
+};
+
 class refresh_favorite_entries_command : public bg_worker_command
 {
 public:
@@ -529,18 +848,36 @@ static void __init_cryptor(d_t *d, GUtil::CryptoPP::Cryptor *ctor)
     d->cryptor.reset(ctor);
 }
 
+// Stretches the password with the vault's parameters and derives the key,
+//  and records how long it took in the benchmark.
 static GUtil::CryptoPP::Cryptor *__produce_cryptor(const Credentials &creds,
                                                    const byte *salt,
-                                                   GUINT32 salt_len)
+                                                   GUINT32 salt_len,
+                                                   Grypt::KdfBenchmark &kdf)
+{
+    GRYPTO_TRACE_SCOPE("crypto", "DeriveKey");
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    const Credentials s = Grypt::KeyDerivation::Stretch(creds, kdf.Parameters, salt, salt_len);
+    GUtil::CryptoPP::Cryptor *ret =
+            new GUtil::CryptoPP::Cryptor(s, NONCE_LENGTH,
+                                         new Cryptor::DefaultKeyDerivation(salt, salt_len));
+    kdf.UnlockMilliseconds = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count() / 1000.0;
+    return ret;
+}
+
+// Returns the cryptor, or throws if it was locked away
+static GUtil::CryptoPP::Cryptor &__cryptor(d_t *d)
 {
-    return new GUtil::CryptoPP::Cryptor(creds, NONCE_LENGTH,
-                                        new Cryptor::DefaultKeyDerivation(salt, salt_len));
+    if(!d->cryptor)
+        throw Exception<>("Database is locked");
+    return *d->cryptor;
 }
 
 void PasswordDatabase::_init_cryptor(const Credentials &creds, const byte *s, GUINT32 s_l)
 {
     G_D;
-    __init_cryptor(d, __produce_cryptor(creds, s, s_l));
+    __init_cryptor(d, __produce_cryptor(creds, s, s_l, d->kdf));
 }
 
 void PasswordDatabase::_init_cryptor(const GUtil::CryptoPP::Cryptor &cryptor)
@@ -551,29 +888,40 @@ void PasswordDatabase::_init_cryptor(const GUtil::CryptoPP::Cryptor &cryptor)
 
 static void __queue_command(d_t *d, bg_worker_command *cmd)
 {
+    // Nobody is there to do it while we're locked
+    if(!d->cryptor){
+        delete cmd;
+        throw Exception<>("Database is locked");
+    }
+
+    cmd->QueuedAt = chrono::steady_clock::now();
     unique_lock<mutex> lkr(d->thread_lock);
     d->thread_commands.push(cmd);
+    d->metrics.RecordQueued(d->thread_commands.size());
     d->thread_idle = false;
     d->wc_thread.notify_one();
 }
 
-static void __check_version(const QString &dbstring)
+// Returns the version of the database, or throws if it's not one we can open
+static QString __check_version(const QString &dbstring)
 {
     QSqlQuery q(QSqlDatabase::database(dbstring));
     q.prepare("SELECT Version FROM Version");
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
 
     int cnt = 0;
+    QString ver;
     while(q.next()){
         if(++cnt > 1)
             throw Exception<>("Found multiple version rows; there should be exactly one");
 
-        QString ver = q.record().value("Version").toString();
-        if(ver != GRYPTO_DATABASE_VERSION)
+        ver = q.record().value("Version").toString();
+        if(ver != GRYPTO_DATABASE_VERSION && ver != GRYPTO_DATABASE_VERSION_3_0)
             throw Exception<>(String::Format("Wrong database version: %s", ver.toUtf8().constData()));
     }
     if(cnt == 0)
         throw Exception<>("Did not find a version row");
+    return ver;
 }
 
 void PasswordDatabase::ValidateDatabase(const char *filepath)
@@ -617,6 +965,10 @@ PasswordDatabase::PasswordDatabase(const QString &file_path,
 {
     G_D_INIT();
 
+    // The change set is emitted from the background thread, so it must be
+    //  registered to be queued to the main thread
+    qRegisterMetaType<EntryChangeSet>("Grypt::PasswordDatabase::EntryChangeSet");
+
     // Note: Here we don't even check that the file exists, because maybe it wasn't created yet,
     //  but we can still lock the future location of the file path so it's ready when we want to create it.
 
@@ -644,11 +996,53 @@ PasswordDatabase::PasswordDatabase(const QString &file_path,
     }
 }
 
+// Moves the crypttext of all live entries into new chunks if most of the
+//  arena is taken up by deleted or replaced entries.
+// You must hold the index lock.
+static void __compact_crypttext(d_t *d)
+{
+    if(!d->crypttext_arena.ShouldCompact())
+        return;
+
+    d->crypttext_arena.Compact();
+    for(auto iter = d->index.begin(); iter != d->index.end(); ++iter)
+        iter->crypttext = d->crypttext_arena.Intern(iter->crypttext);
+}
+
+// Inserts or replaces the entry in the index, with its crypttext in the arena.
+// You must hold the index lock.
+static void __index_insert(d_t *d, const entry_cache &ec)
+{
+    auto iter = d->index.find(ec.id);
+    if(iter != d->index.end())
+        d->crypttext_arena.Release(iter->crypttext);
+
+    entry_cache &dest = d->index[ec.id];
+    dest = ec;
+    dest.crypttext = d->crypttext_arena.Intern(ec.crypttext);
+    __compact_crypttext(d);
+}
+
+// Removes the entry from the index and releases its crypttext.
+// You must hold the index lock.
+static void __index_remove(d_t *d, const Grypt::EntryId &id)
+{
+    auto iter = d->index.find(id);
+    if(iter != d->index.end()){
+        d->crypttext_arena.Release(iter->crypttext);
+        d->index.erase(iter);
+        __compact_crypttext(d);
+    }
+}
+
 static void __initialize_cache(d_t *d)
 {
+    GRYPTO_TRACE_SCOPE("database", "InitializeCache");
+
     // Cache the entire entry table in one query
-    QSqlQuery q("SELECT * FROM Entry ORDER BY ParentId,Row ASC",
-                QSqlDatabase::database(d->dbString));
+    QSqlQuery q(QSqlDatabase::database(d->dbString));
+    q.prepare("SELECT * FROM Entry ORDER BY ParentId,Row ASC");
+    __execute_query(q);
     {
         QHash<EntryId, QList<EntryId>> hierarchy;
         QHash<EntryId, entry_cache> entries;
@@ -657,6 +1051,8 @@ static void __initialize_cache(d_t *d)
             hierarchy[ec.parentid].append(ec.id);
             entries[ec.id] = ec;
         }
+        d->index.reserve(entries.count());
+        d->parent_index.reserve(entries.count() + 1);
 
         // Load all entries connected to the root
         function<void(const EntryId &)> parse_child_entries;
@@ -669,7 +1065,7 @@ static void __initialize_cache(d_t *d)
 
                 // Add the entry to the cache
                 const entry_cache &ec = entries[cid];
-                d->index.insert(cid, ec);
+                __index_insert(d, ec);
 
                 // We'll sort the favorites at the end
                 if(0 <= ec.favoriteindex)
@@ -711,8 +1107,11 @@ void PasswordDatabase::Open(const Credentials &creds)
             memcpy(s.data(), salt, SALT_LENGTH);
         }
         else{
-            // Generate new random salt
+            // Generate new random salt, and choose how hard the password
+            //  is to guess on this machine
             GUtil::CryptoPP::RNG().Fill(s.data(), SALT_LENGTH);
+            G_D;
+            d->kdf = KeyDerivation::Calibrate();
         }
         _init_cryptor(creds, s.data(), s.size());
     });
@@ -726,21 +1125,81 @@ void PasswordDatabase::Open(const GUtil::CryptoPP::Cryptor &c)
     });
 }
 
-static void __insert_entry(const entry_cache &ec, QSqlQuery &q)
+static void __prepare_entry_insert(QSqlQuery &q)
 {
     q.prepare("INSERT INTO Entry (ID,ParentID,Row,Favorite,FileID,Data)"
               " VALUES (?,?,?,?,?,?)");
-    q.addBindValue((QByteArray)ec.id);
-    q.addBindValue((QByteArray)ec.parentid);
-    q.addBindValue(ec.row);
-    q.addBindValue(ec.favoriteindex);
-    q.addBindValue((QByteArray)ec.file_id);
-    q.addBindValue(ec.crypttext);
-    DatabaseUtils::ExecuteQuery(q);
 }
 
-static void __create_new_database(QSqlDatabase &db,
-                                  GUtil::CryptoPP::Cryptor &cryptor)
+// Executes an insert that was prepared by __prepare_entry_insert, so
+//  you can prepare once and insert many times
+static void __exec_entry_insert(const entry_cache &ec, QSqlQuery &q)
+{
+    q.bindValue(0, (QByteArray)ec.id);
+    q.bindValue(1, (QByteArray)ec.parentid);
+    q.bindValue(2, ec.row);
+    q.bindValue(3, ec.favoriteindex);
+    q.bindValue(4, (QByteArray)ec.file_id);
+    q.bindValue(5, ec.crypttext.Data());
+    __execute_query(q);
+}
+
+static void __insert_entry(const entry_cache &ec, QSqlQuery &q)
+{
+    __prepare_entry_insert(q);
+    __exec_entry_insert(ec, q);
+}
+
+// The kinds of rows in the change log
+#define CHANGE_KIND_ENTRY   0
+#define CHANGE_KIND_FILE    1
+
+// An entry that only changed row, i.e. because a sibling moved. Backups need
+//  these, but a sync shouldn't treat them as edits.
+#define CHANGE_KIND_ENTRY_ROW   2
+
+// The change log gives every insert, update and delete of an entry or file an
+//  increasing sequence number, so a backup can find what changed since the
+//  last one. It only keeps the latest change to each row, and deleted rows
+//  stay in it. The triggers have semicolons in them, so we can't put them in
+//  the script. They're created with a new vault, or by __upgrade_from_3_0().
+static const char *__change_log_sql[] = {
+    "CREATE TABLE IF NOT EXISTS ChangeLog ("
+    "ID BLOB NOT NULL, Kind INTEGER NOT NULL, Seq INTEGER NOT NULL, PRIMARY KEY (ID,Kind))",
+    "CREATE INDEX IF NOT EXISTS idx_ChangeLog_Seq ON ChangeLog (Seq ASC)",
+    "CREATE TRIGGER IF NOT EXISTS trg_Entry_Insert AFTER INSERT ON Entry BEGIN "
+    "INSERT OR REPLACE INTO ChangeLog (ID,Kind,Seq) VALUES "
+    "(NEW.ID,0,(SELECT IFNULL(MAX(Seq),0)+1 FROM ChangeLog)); END",
+    "CREATE TRIGGER IF NOT EXISTS trg_Entry_Update AFTER UPDATE OF ParentID,FileID,Favorite,Data"
+    " ON Entry BEGIN "
+    "INSERT OR REPLACE INTO ChangeLog (ID,Kind,Seq) VALUES "
+    "(NEW.ID,0,(SELECT IFNULL(MAX(Seq),0)+1 FROM ChangeLog)); END",
+    "CREATE TRIGGER IF NOT EXISTS trg_Entry_Row AFTER UPDATE OF Row ON Entry BEGIN "
+    "INSERT OR REPLACE INTO ChangeLog (ID,Kind,Seq) VALUES "
+    "(NEW.ID,2,(SELECT IFNULL(MAX(Seq),0)+1 FROM ChangeLog)); END",
+    "CREATE TRIGGER IF NOT EXISTS trg_Entry_Delete AFTER DELETE ON Entry BEGIN "
+    "INSERT OR REPLACE INTO ChangeLog (ID,Kind,Seq) VALUES "
+    "(OLD.ID,0,(SELECT IFNULL(MAX(Seq),0)+1 FROM ChangeLog)); END",
+    "CREATE TRIGGER IF NOT EXISTS trg_File_Insert AFTER INSERT ON File BEGIN "
+    "INSERT OR REPLACE INTO ChangeLog (ID,Kind,Seq) VALUES "
+    "(NEW.ID,1,(SELECT IFNULL(MAX(Seq),0)+1 FROM ChangeLog)); END",
+    "CREATE TRIGGER IF NOT EXISTS trg_File_Update AFTER UPDATE ON File BEGIN "
+    "INSERT OR REPLACE INTO ChangeLog (ID,Kind,Seq) VALUES "
+    "(NEW.ID,1,(SELECT IFNULL(MAX(Seq),0)+1 FROM ChangeLog)); END",
+    "CREATE TRIGGER IF NOT EXISTS trg_File_Delete AFTER DELETE ON File BEGIN "
+    "INSERT OR REPLACE INTO ChangeLog (ID,Kind,Seq) VALUES "
+    "(OLD.ID,1,(SELECT IFNULL(MAX(Seq),0)+1 FROM ChangeLog)); END",
+};
+
+static void __create_change_log(QSqlQuery &q)
+{
+    for(const char *sql : __change_log_sql){
+        q.prepare(sql);
+        __execute_query(q);
+    }
+}
+
+static void __create_tables(QSqlDatabase &db)
 {
     __init_sql_resources();
     QResource rs(":/grypto/sql/create_db.sql");
@@ -752,6 +1211,62 @@ static void __create_new_database(QSqlDatabase &db,
     else
         sql = QByteArray((const char *)rs.data(), rs.size());
     DatabaseUtils::ExecuteScript(db, sql);
+}
+
+// Upgrades a 3.0.0 vault to the current version. It gets the KdfIterations
+//  column, which stays 0 because its password was never stretched, and the
+//  change log. Every entry and file that's there already goes in the log, so
+//  the first backup that uses a token after this has them.
+static void __upgrade_from_3_0(QSqlDatabase &db)
+{
+    GRYPTO_TRACE_SCOPE("database", "Upgrade");
+    db.transaction();
+    try
+    {
+        QSqlQuery q(db);
+        if(0 > db.record("Version").indexOf("KdfIterations")){
+            q.prepare("ALTER TABLE Version ADD COLUMN KdfIterations INTEGER NOT NULL DEFAULT 0");
+            __execute_query(q);
+        }
+        __create_change_log(q);
+
+        // Number the rows after anything that's in the log already
+        auto seed_change_log = [&](const char *table, int kind){
+            q.prepare("SELECT IFNULL(MAX(Seq),0) FROM ChangeLog");
+            __execute_query(q);
+            q.next();
+            const qint64 max_seq = q.value(0).toLongLong();
+            q.finish();
+
+            q.prepare(QString("INSERT OR IGNORE INTO ChangeLog (ID,Kind,Seq)"
+                              " SELECT ID,%1,rowid+? FROM %2").arg(kind).arg(table));
+            q.addBindValue(max_seq);
+            __execute_query(q);
+        };
+        seed_change_log("Entry", CHANGE_KIND_ENTRY);
+        seed_change_log("File", CHANGE_KIND_FILE);
+
+        q.prepare("UPDATE Version SET Version=?");
+        q.addBindValue(GRYPTO_DATABASE_VERSION);
+        __execute_query(q);
+    }
+    catch(...)
+    {
+        db.rollback();
+        throw;
+    }
+    __commit_transaction(db);
+}
+
+static void __create_new_database(QSqlDatabase &db,
+                                  GUtil::CryptoPP::Cryptor &cryptor,
+                                  const Grypt::KdfParameters &kdf_params)
+{
+    __create_tables(db);
+    {
+        QSqlQuery q(db);
+        __create_change_log(q);
+    }
 
     // Prepare the keycheck data
     QByteArray keycheck_ct;
@@ -766,16 +1281,18 @@ static void __create_new_database(QSqlDatabase &db,
 
     // Insert a version record
     QSqlQuery q(db);
-    q.prepare("INSERT INTO Version (Version,Salt,KeyCheck)"
-                " VALUES (?,?,?)");
+    q.prepare("INSERT INTO Version (Version,Salt,KeyCheck,KdfIterations)"
+                " VALUES (?,?,?,?)");
     q.addBindValue(GRYPTO_DATABASE_VERSION);
     q.addBindValue(QByteArray((const char *)kdf.Salt(), kdf.SaltLength()));
     q.addBindValue(keycheck_ct);
-    DatabaseUtils::ExecuteQuery(q);
+    q.addBindValue(kdf_params.Iterations);
+    __execute_query(q);
 }
 
 void PasswordDatabase::_open(function<void(byte const *)> init_cryptor)
 {
+    GRYPTO_TRACE_SCOPE("database", "Open");
     if(IsOpen())
         throw Exception<>("Database already opened");
 
@@ -790,17 +1307,22 @@ void PasswordDatabase::_open(function<void(byte const *)> init_cryptor)
         if(!file_exists){
             // Initialize the new database if it doesn't exist
             init_cryptor(NULL);
-            __create_new_database(db, *d->cryptor);
+            __create_new_database(db, *d->cryptor, d->kdf.Parameters);
         }
 
         // Check the version record to see if it is valid
-        __check_version(dbstring);
+        const QString version = __check_version(dbstring);
 
         // Validate the keycheck information
-        q.prepare("SELECT KeyCheck,Salt FROM Version");
-        DatabaseUtils::ExecuteQuery(q);
+        q.prepare("SELECT * FROM Version");
+        __execute_query(q);
 
         if(q.next()){
+            // Vaults from before calibration don't have the column
+            const int kdf_index = q.record().indexOf("KdfIterations");
+            if(0 <= kdf_index)
+                d->kdf.Parameters.Iterations = q.value(kdf_index).toUInt();
+
             if(!d->cryptor){
                 QByteArray salt_ba = q.record().value("Salt").toByteArray();
                 init_cryptor((byte const *)salt_ba.constData());
@@ -810,8 +1332,14 @@ void PasswordDatabase::_open(function<void(byte const *)> init_cryptor)
             ByteArrayInput auth_in(__keycheck_string, strlen(__keycheck_string));
 
             // This will throw an exception if the key was bad
+            GRYPTO_TRACE_SCOPE("crypto", "CheckKey");
             d->cryptor->DecryptData(NULL, &bai_ct, &auth_in);
         }
+        q.finish();
+
+        // Only upgrade once we know they have the key
+        if(version == GRYPTO_DATABASE_VERSION_3_0)
+            __upgrade_from_3_0(db);
     }
     catch(...)
     {
@@ -826,21 +1354,138 @@ void PasswordDatabase::_open(function<void(byte const *)> init_cryptor)
     // Initialize the cache before starting the workers
     __initialize_cache(d);
 
-    // Start up the background threads
+    _start_worker();
+}
+
+void PasswordDatabase::_start_worker()
+{
+    G_D;
+    d->thread_idle = false;
     d->worker = std::thread(&PasswordDatabase::_background_worker, this, new GUtil::CryptoPP::Cryptor(*d->cryptor));
 
     // We must wait for the background thread to idle to avoid a race condition
     WaitForThreadIdle();
 }
 
+// Tells the background thread to finish what's in the queue and exit,
+//  without waiting for it
+static void __release_worker(d_t *d)
+{
+    d->thread_lock.lock();
+    d->closing = true;
+    d->wc_thread.notify_one();
+    d->thread_lock.unlock();
+}
+
+// Waits for the background thread to exit, if there is one
+static void __join_worker(d_t *d)
+{
+    if(d->worker.joinable())
+        d->worker.join();
+    d->closing = false;
+}
+
+// Tells the background thread to finish what's in the queue and exit
+static void __stop_worker(d_t *d)
+{
+    __release_worker(d);
+    __join_worker(d);
+}
+
+// Returns true if the cryptor has the vault's key
+static bool __key_matches(const QString &dbstring, GUtil::CryptoPP::Cryptor &cryptor)
+{
+    QSqlQuery q(QSqlDatabase::database(dbstring));
+    q.prepare("SELECT KeyCheck FROM Version");
+    __execute_query(q);
+    if(!q.next())
+        return false;
+
+    QByteArrayInput bai_ct(q.record().value("KeyCheck").toByteArray());
+    ByteArrayInput auth_in(__keycheck_string, strlen(__keycheck_string));
+    try{
+        GRYPTO_TRACE_SCOPE("crypto", "CheckKey");
+        cryptor.DecryptData(NULL, &bai_ct, &auth_in);
+    }
+    catch(const Exception<> &){
+        return false;
+    }
+    return true;
+}
+
+// Makes the cryptor again from the credentials while we're locked, or
+//  returns null if they're wrong. We stretch the password again, because
+//  keeping anything around that's quicker to attack would defeat the point.
+static GUtil::CryptoPP::Cryptor *__unlocked_cryptor(d_t *d, const Credentials &creds)
+{
+    GRYPTO_TRACE_SCOPE("crypto", "Unlock");
+    unique_ptr<GUtil::CryptoPP::Cryptor> ret(
+                __produce_cryptor(creds, (const byte *)d->salt.constData(), d->salt.length(), d->kdf));
+    return __key_matches(d->dbString, *ret) ? ret.release() : NULL;
+}
+
+void PasswordDatabase::Lock()
+{
+    GRYPTO_TRACE_SCOPE("database", "Lock");
+    FailIfNotOpen();
+    if(IsLocked())
+        return;
+    G_D;
+
+    // The worker finishes what's queued with its own copy of the key, which
+    //  goes away when it exits. We don't wait for it, because this is called
+    //  on the GUI thread; we join it when we unlock or close.
+    __release_worker(d);
+
+    Cryptor::DefaultKeyDerivation const &kdf =
+        (const Cryptor::DefaultKeyDerivation &)d->cryptor->GetKeyDerivationFunction();
+    d->salt = QByteArray((const char *)kdf.Salt(), kdf.SaltLength());
+    d->credentials_type = d->cryptor->GetCredentialsType();
+    d->cryptor.reset();
+}
+
+bool PasswordDatabase::Unlock(const Credentials &creds)
+{
+    GRYPTO_TRACE_SCOPE("database", "Unlock");
+    FailIfNotOpen();
+    if(!IsLocked())
+        return CheckCredentials(creds);
+    G_D;
+
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    GUtil::CryptoPP::Cryptor *c = __unlocked_cryptor(d, creds);
+    if(!c)
+        return false;
+    __join_worker(d);
+    __init_cryptor(d, c);
+    d->kdf.UnlockMilliseconds = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count() / 1000.0;
+    _start_worker();
+    return true;
+}
+
+bool PasswordDatabase::IsLocked() const
+{
+    G_D;
+    return IsOpen() && !d->cryptor;
+}
+
 bool PasswordDatabase::IsOpen() const
 {
     G_D;
     return !d->dbString.isEmpty();
 }
 
+QString const &PasswordDatabase::_connection_string() const
+{
+    G_D;
+    return d->dbString;
+}
+
 void PasswordDatabase::SaveAs(const QString &filename, const Credentials &creds)
 {
+    GRYPTO_TRACE_SCOPE("database", "SaveAs");
+    FailIfLocked();
     G_D;
     QString file_path = QFileInfo(filename).absoluteFilePath();
     if(file_path == QFileInfo(m_filepath).absoluteFilePath())
@@ -858,9 +1503,12 @@ void PasswordDatabase::SaveAs(const QString &filename, const Credentials &creds)
     // Make sure the background thread has finished whatever it's working on
     WaitForThreadIdle();
 
+    // Calibrate again, because we may be on a different machine than
+    //  the one that made the original
     byte salt[SALT_LENGTH];
     GUtil::CryptoPP::RNG().Fill(salt, SALT_LENGTH);
-    unique_ptr<GUtil::CryptoPP::Cryptor> cryptor(__produce_cryptor(creds, salt, SALT_LENGTH));
+    KdfBenchmark kdf = KeyDerivation::Calibrate();
+    unique_ptr<GUtil::CryptoPP::Cryptor> cryptor(__produce_cryptor(creds, salt, SALT_LENGTH, kdf));
 
     QString dbString = __create_connection(file_path);
     try
@@ -870,7 +1518,7 @@ void PasswordDatabase::SaveAs(const QString &filename, const Credentials &creds)
         QSqlQuery q_new(db);
 
         // Create a blank new database
-        __create_new_database(db, *cryptor);
+        __create_new_database(db, *cryptor, kdf.Parameters);
 
         db.transaction();
         try{
@@ -882,7 +1530,7 @@ void PasswordDatabase::SaveAs(const QString &filename, const Credentials &creds)
             write_child_entries = [&](const EntryId &pid){
                 for(const EntryId &cid : d->parent_index[pid].children){
                     // Decrypt the entry with the old cryptor
-                    Entry e = __convert_cache_to_entry(d->index[cid], *d->cryptor);
+                    Entry e = __convert_cache_to_entry(d->index[cid], __cryptor(d));
 
                     // Encrypt the entry with the new cryptor and insert
                     __insert_entry(__convert_entry_to_cache(e, *cryptor), q_new);
@@ -898,9 +1546,10 @@ void PasswordDatabase::SaveAs(const QString &filename, const Credentials &creds)
             for(const FileId &fid : file_list){
                 q.prepare("SELECT Length,Data FROM File WHERE Id=?");
                 q.addBindValue((QByteArray)fid);
-                DatabaseUtils::ExecuteQuery(q);
+                __execute_query(q);
 
                 if(q.next()){
+                    GRYPTO_TRACE_SCOPE("crypto", "ReencryptFile");
                     QByteArray crypttext = q.value("Data").toByteArray();
                     QByteArray tmp;
                     {
@@ -922,7 +1571,7 @@ void PasswordDatabase::SaveAs(const QString &filename, const Credentials &creds)
                     q_new.addBindValue((QByteArray)fid);
                     q_new.addBindValue(q.value("Length").toInt());
                     q_new.addBindValue(crypttext);
-                    DatabaseUtils::ExecuteQuery(q_new);
+                    __execute_query(q_new);
                 }
             }
         } catch(...) {
@@ -948,21 +1597,25 @@ void PasswordDatabase::SaveAs(const QString &filename, const Credentials &creds)
         throw Exception<>("Unable to lock newly saved file??");
 
     Open(*cryptor);
+
+    // Opening with a cryptor doesn't derive the key, so keep the figures
+    //  from above
+    {
+        G_D;
+        d->kdf = kdf;
+    }
 }
 
 void PasswordDatabase::_close()
 {
     G_D;
     if(IsOpen()){
-        // Let's clean up any orphaned entries/files
-        DeleteOrphans();
-
-        d->thread_lock.lock();
-        d->closing = true;
-        d->wc_thread.notify_one();
-        d->thread_lock.unlock();
-
-        d->worker.join();
+        // The worker was already told to stop if we're locked
+        if(!IsLocked()){
+            // Let's clean up any orphaned entries/files
+            DeleteOrphans();
+        }
+        __stop_worker(d);
 
         QSqlDatabase::removeDatabase(d->dbString);
     }
@@ -985,41 +1638,121 @@ bool PasswordDatabase::CheckCredentials(const Credentials &creds) const
 {
     G_D;
     FailIfNotOpen();
-    return d->cryptor->CheckCredentials(creds);
+    if(IsLocked()){
+        unique_ptr<GUtil::CryptoPP::Cryptor> c(__unlocked_cryptor(d, creds));
+        return (bool)c;
+    }
+
+    Cryptor::DefaultKeyDerivation const &kdf =
+        (const Cryptor::DefaultKeyDerivation &)d->cryptor->GetKeyDerivationFunction();
+    return d->cryptor->CheckCredentials(
+                KeyDerivation::Stretch(creds, d->kdf.Parameters, kdf.Salt(), kdf.SaltLength()));
+}
+
+KdfBenchmark PasswordDatabase::GetKdfBenchmark() const
+{
+    G_D;
+    FailIfNotOpen();
+    return d->kdf;
 }
 
 Credentials::TypeEnum PasswordDatabase::GetCredentialsType() const
 {
     G_D;
     FailIfNotOpen();
-    return d->cryptor->GetCredentialsType();
+    return d->cryptor ? d->cryptor->GetCredentialsType() : d->credentials_type;
 }
 
-static void __commit_transaction(QSqlDatabase &db)
+// Returns the cached statement that changes the row of a child of the parent.
+//  Bind the new row at index 0 and the old row at old_row_index.
+static QSqlQuery &__prepare_row_update(Grypt::SqlStatementCache &statements,
+                                       const Grypt::EntryId &pid,
+                                       int &old_row_index)
 {
-    if(!db.commit())
-        throw Exception<>(db.lastError().text().toUtf8().constData());
+    const bool pid_isnull = pid.IsNull();
+    QSqlQuery &ret = statements.Prepare(QString("UPDATE Entry SET Row=? WHERE ParentID%1 AND Row=?")
+                                        .arg(pid_isnull ? " IS NULL" : "=?"));
+    if(!pid_isnull)
+        ret.bindValue(1, (QByteArray)pid);
+    old_row_index = pid_isnull ? 1 : 2;
+    return ret;
 }
 
-void PasswordDatabase::_bw_add_entry(const QString &conn_str, const Entry &e)
+// Writes the entry's crypttext, favorite index and file id from the index
+//  to the database. Returns false if it's no longer in the index, which
+//  means it was deleted after the update was queued.
+static bool __update_entry_row(d_t *d, const EntryId &id)
 {
-    G_D;
-    QSqlDatabase db = QSqlDatabase::database(conn_str);
-    QSqlQuery q(db);
-    QString task_string = tr("Adding entry");
-    db.transaction();
-    emit NotifyProgressUpdated(0, false, task_string);
+    entry_cache er;
     {
-        bool success = false;
-        finally([&]{
-            TryFinally([&]{
-                if(success) __commit_transaction(db);
-                else        db.rollback();
-            }, [](std::exception &){},
-            [&]{
-                emit NotifyProgressUpdated(100, false, task_string);
-            });
-        });
+        lock_guard<mutex> lkr(d->index_lock);
+        auto iter = d->index.find(id);
+        if(iter == d->index.end())
+            return false;
+        er = *iter;
+    }
+
+    QSqlQuery &q = d->statements->Prepare("UPDATE Entry SET Data=?,Favorite=?,FileID=? WHERE Id=?");
+    q.bindValue(0, er.crypttext.Data());
+    q.bindValue(1, er.favoriteindex);
+    q.bindValue(2, (QByteArray)er.file_id);
+    q.bindValue(3, (QByteArray)id);
+    __execute_query(q);
+    return true;
+}
+
+// Deletes the entry row and shifts its siblings up. The entry is already
+//  gone from the index, so we get its position from the database.
+static void __delete_entry_row(d_t *d, QSqlQuery &q, const EntryId &id)
+{
+    q.prepare("SELECT ParentId,Row FROM Entry WHERE Id=?");
+    q.addBindValue((QByteArray)id);
+    __execute_query(q);
+    if(!q.next())
+        throw Exception<>("Entry not found");
+
+    const EntryId pid = q.record().value("ParentId").toByteArray();
+    const uint row = q.record().value("Row").toInt();
+    const uint child_count = __count_entries_by_parent_id(q, pid);
+
+    QSqlQuery &q_delete = d->statements->Prepare("DELETE FROM Entry WHERE ID=?");
+    q_delete.bindValue(0, (QByteArray)id);
+    __execute_query(q_delete);
+
+    // Do not delete any files; the user has to manually clean them up
+
+    // Update the surrounding entries' rows after deletion
+    if(row + 1 < child_count){
+        int old_row_index;
+        QSqlQuery &q_shift = __prepare_row_update(*d->statements, pid, old_row_index);
+        for(uint i = row + 1; i < child_count; ++i)
+        {
+            q_shift.bindValue(0, i - 1);
+            q_shift.bindValue(old_row_index, i);
+            __execute_query(q_shift);
+        }
+    }
+}
+
+void PasswordDatabase::_bw_add_entry(const QString &conn_str, const Entry &e)
+{
+    G_D;
+    QSqlDatabase db = QSqlDatabase::database(conn_str);
+    QSqlQuery q(db);
+    QString task_string = tr("Adding entry");
+    db.transaction();
+    emit NotifyProgressUpdated(0, false, task_string);
+    {
+        bool success = false;
+        finally([&]{
+            TryFinally([&]{
+                if(success) __commit_transaction(db);
+                else        db.rollback();
+            }, [](std::exception &){},
+            [&]{
+                emit NotifyProgressUpdated(100, false, task_string);
+            });
+        });
 
         // Update the surrounding entries' rows before insertion
         int child_count = __count_entries_by_parent_id(q, e.GetParentId());
@@ -1027,16 +1760,15 @@ void PasswordDatabase::_bw_add_entry(const QString &conn_str, const Entry &e)
         if(0 > row || row > child_count)
             row = child_count;
 
-        bool pid_isnull = e.GetParentId().IsNull();
-        for(int i = child_count - 1; i >= row; --i)
-        {
-            q.prepare(QString("UPDATE Entry SET Row=? WHERE ParentID%1 AND Row=?")
-                      .arg(pid_isnull ? " IS NULL" : "=?"));
-            q.addBindValue(i + 1);
-            if(!pid_isnull)
-                q.addBindValue((QByteArray)e.GetParentId());
-            q.addBindValue(i);
-            DatabaseUtils::ExecuteQuery(q);
+        if(row < child_count){
+            int old_row_index;
+            QSqlQuery &q_shift = __prepare_row_update(*d->statements, e.GetParentId(), old_row_index);
+            for(int i = child_count - 1; i >= row; --i)
+            {
+                q_shift.bindValue(0, i + 1);
+                q_shift.bindValue(old_row_index, i);
+                __execute_query(q_shift);
+            }
         }
         emit NotifyProgressUpdated(35, false, task_string);
 
@@ -1064,6 +1796,53 @@ void PasswordDatabase::_bw_add_entry(const QString &conn_str, const Entry &e)
     __add_new_files(this, e);
 }
 
+void PasswordDatabase::_bw_add_entries(const QString &conn_str, const QList<Entry> &entries)
+{
+    G_D;
+    QSqlDatabase db = QSqlDatabase::database(conn_str);
+    QSqlQuery q(db);
+    QString task_string = tr("Adding entries");
+    db.transaction();
+    emit NotifyProgressUpdated(0, false, task_string);
+    {
+        bool success = false;
+        finally([&]{
+            TryFinally([&]{
+                if(success) __commit_transaction(db);
+                else        db.rollback();
+            }, [](std::exception &){},
+            [&]{
+                emit NotifyProgressUpdated(100, false, task_string);
+            });
+        });
+
+        // The entries were appended to their parents, so we don't have to
+        //  shift any siblings; just insert them all with the same statement
+        __prepare_entry_insert(q);
+        for(int i = 0; i < entries.length(); ++i){
+            entry_cache ec;
+            {
+                lock_guard<mutex> lkr(d->index_lock);
+
+                // If the index is not present, then it was already deleted
+                auto iter = d->index.find(entries[i].GetId());
+                if(iter == d->index.end())
+                    continue;
+                ec = *iter;
+            }
+            __exec_entry_insert(ec, q);
+
+            if(0 == i % 1000)
+                emit NotifyProgressUpdated(90 * i / entries.length(), false, task_string);
+        }
+        success = true;
+    }
+
+    // Add any new files to the database
+    for(const Entry &e : entries)
+        __add_new_files(this, e);
+}
+
 void PasswordDatabase::_bw_update_entry(const QString &conn_str, const Entry &e)
 {
     G_D;
@@ -1073,25 +1852,10 @@ void PasswordDatabase::_bw_update_entry(const QString &conn_str, const Entry &e)
     {
         finally([&]{ emit NotifyProgressUpdated(100, false, task_string); });
 
-        // First get the entry out of the cache
-        entry_cache er;
-        d->index_lock.lock();
-        {
-            GASSERT(d->index.find(e.GetId()) != d->index.end());
-            er = d->index[e.GetId()];
-        }
-        d->index_lock.unlock();
-
-        // Then update the database
+        // Write the cached entry to the database
         db.transaction();
         try{
-            QSqlQuery q(db);
-            q.prepare("UPDATE Entry SET Data=?,Favorite=?,FileID=? WHERE Id=?");
-            q.addBindValue(er.crypttext);
-            q.addBindValue(er.favoriteindex);
-            q.addBindValue((QByteArray)e.GetFileId());
-            q.addBindValue((QByteArray)e.GetId());
-            DatabaseUtils::ExecuteQuery(q);
+            __update_entry_row(d, e.GetId());
         } catch(...) {
             db.rollback();
             throw;
@@ -1106,12 +1870,10 @@ void PasswordDatabase::_bw_update_entry(const QString &conn_str, const Entry &e)
 void PasswordDatabase::_bw_delete_entry(const QString &conn_str,
                                         const EntryId &id)
 {
+    G_D;
     QSqlDatabase db = QSqlDatabase::database(conn_str);
     QSqlQuery q(db);
     QString task_string = tr("Deleting entry");
-    EntryId pid;
-    uint row;
-    uint child_count;
 
     db.transaction();
     emit NotifyProgressUpdated(0, false, task_string);
@@ -1127,52 +1889,84 @@ void PasswordDatabase::_bw_delete_entry(const QString &conn_str,
             });
         });
 
-        q.prepare("SELECT ParentId,Row FROM Entry WHERE Id=?");
-        q.addBindValue((QByteArray)id);
-        DatabaseUtils::ExecuteQuery(q);
-        if(!q.next())
-            throw Exception<>("Entry not found");
-
-        emit NotifyProgressUpdated(10, false, task_string);
-
-        pid = q.record().value("ParentId").toByteArray();
-        row = q.record().value("Row").toInt();
-
-        // We have to manually count the children, because at this point the entry
-        //  has been deleted from the index
-        child_count = __count_entries_by_parent_id(q, pid);
+        __delete_entry_row(d, q, id);
+        success = true;
+    }
+}
 
-        emit NotifyProgressUpdated(25, false, task_string);
+void PasswordDatabase::_bw_apply_changes(const QString &conn_str,
+                                         const QList<Entry> &added,
+                                         const QList<Entry> &updated,
+                                         const QList<EntryId> &deleted)
+{
+    G_D;
+    QSqlDatabase db = QSqlDatabase::database(conn_str);
+    QSqlQuery q(db);
+    QString task_string = tr("Applying changes");
+    db.transaction();
+    emit NotifyProgressUpdated(0, false, task_string);
+    {
+        bool success = false;
+        finally([&]{
+            TryFinally([&]{
+                if(success) __commit_transaction(db);
+                else        db.rollback();
+            }, [](std::exception &){},
+            [&]{
+                emit NotifyProgressUpdated(100, false, task_string);
+            });
+        });
 
-        q.prepare("DELETE FROM Entry WHERE ID=?");
-        q.addBindValue((QByteArray)id);
-        DatabaseUtils::ExecuteQuery(q);
+        // Do it in the same order as the index was updated, so the rows
+        //  come out the same. Deleting first means the new entries are
+        //  appended after the siblings have already been shifted.
+        const int total = qMax(1, added.length() + updated.length() + deleted.length());
+        int done = 0;
+        for(const EntryId &id : deleted){
+            __delete_entry_row(d, q, id);
+            if(0 == ++done % 1000)
+                emit NotifyProgressUpdated(90 * done / total, false, task_string);
+        }
 
-        emit NotifyProgressUpdated(65, false, task_string);
+        for(const Entry &e : updated){
+            __update_entry_row(d, e.GetId());
+            if(0 == ++done % 1000)
+                emit NotifyProgressUpdated(90 * done / total, false, task_string);
+        }
 
-        // Do not delete any files; the user has to manually clean them up
+        if(!added.isEmpty()){
+            __prepare_entry_insert(q);
+            for(const Entry &e : added){
+                entry_cache ec;
+                {
+                    lock_guard<mutex> lkr(d->index_lock);
 
-        // Update the surrounding entries' rows after deletion
-        bool pid_isnull = pid.IsNull();
-        for(uint i = row + 1; i < child_count; ++i)
-        {
-            q.prepare(QString("UPDATE Entry SET Row=? WHERE ParentID%1 AND Row=?")
-                      .arg(pid_isnull ? " IS NULL" : "=?"));
-            q.addBindValue(i - 1);
-            if(!pid_isnull)
-                q.addBindValue((QByteArray)pid);
-            q.addBindValue(i);
-            DatabaseUtils::ExecuteQuery(q);
+                    // If the index is not present, then it was already deleted
+                    auto iter = d->index.find(e.GetId());
+                    if(iter == d->index.end())
+                        continue;
+                    ec = *iter;
+                }
+                __exec_entry_insert(ec, q);
+                if(0 == ++done % 1000)
+                    emit NotifyProgressUpdated(90 * done / total, false, task_string);
+            }
         }
-
         success = true;
     }
+
+    // Add any new files to the database
+    for(const Entry &e : added)
+        __add_new_files(this, e);
+    for(const Entry &e : updated)
+        __add_new_files(this, e);
 }
 
 void PasswordDatabase::_bw_move_entry(const QString &conn_str,
                                       const EntryId &src_parent, quint32 row_first, quint32 row_last,
                                       const EntryId &dest_parent, quint32 row_dest)
 {
+    G_D;
     int row_cnt = row_last - row_first + 1;
     GASSERT(row_cnt > 0);
 
@@ -1204,15 +1998,19 @@ void PasswordDatabase::_bw_move_entry(const QString &conn_str,
         int src_siblings_cnt = __count_entries_by_parent_id(q, src_parent);
 
         // First move the source rows to a dummy parent with ID=0
-        for(int i = 0; i < row_cnt; ++i){
-            q.prepare(QString("UPDATE Entry SET ParentID=?,Row=? WHERE ParentID%1 AND Row=?")
-                      .arg(src_parent.IsNull() ? " IS NULL" : "=?"));
-            q.addBindValue(special_zero_id);
-            q.addBindValue(row_dest + i);
+        {
+            QSqlQuery &q_move = d->statements->Prepare(
+                        QString("UPDATE Entry SET ParentID=?,Row=? WHERE ParentID%1 AND Row=?")
+                        .arg(src_parent.IsNull() ? " IS NULL" : "=?"));
+            q_move.bindValue(0, special_zero_id);
             if(!src_parent.IsNull())
-                q.addBindValue(src_parent.ToQByteArray());
-            q.addBindValue(row_first + i);
-            DatabaseUtils::ExecuteQuery(q);
+                q_move.bindValue(2, src_parent.ToQByteArray());
+            const int old_row_index = src_parent.IsNull() ? 2 : 3;
+            for(int i = 0; i < row_cnt; ++i){
+                q_move.bindValue(1, row_dest + i);
+                q_move.bindValue(old_row_index, row_first + i);
+                __execute_query(q_move);
+            }
         }
 
         emit NotifyProgressUpdated(15, false, task_string);
@@ -1222,27 +2020,27 @@ void PasswordDatabase::_bw_move_entry(const QString &conn_str,
         int dest_siblings_cnt = __count_entries_by_parent_id(q, dest_parent);
 
         // Update the siblings at the source
-        for(int i = row_last + 1; i < src_siblings_cnt; ++i){
-            q.prepare(QString("UPDATE Entry SET Row=? WHERE ParentID%1 AND Row=?")
-                      .arg(src_parent.IsNull() ? " IS NULL" : "=?"));
-            q.addBindValue(i - row_cnt);
-            if(!src_parent.IsNull())
-                q.addBindValue(src_parent.ToQByteArray());
-            q.addBindValue(i);
-            DatabaseUtils::ExecuteQuery(q);
+        if((int)row_last + 1 < src_siblings_cnt){
+            int old_row_index;
+            QSqlQuery &q_shift = __prepare_row_update(*d->statements, src_parent, old_row_index);
+            for(int i = row_last + 1; i < src_siblings_cnt; ++i){
+                q_shift.bindValue(0, i - row_cnt);
+                q_shift.bindValue(old_row_index, i);
+                __execute_query(q_shift);
+            }
         }
 
         emit NotifyProgressUpdated(40, false, task_string);
 
         // Update the siblings at the dest
-        for(int i = dest_siblings_cnt - 1; i >= (int)row_dest; --i){
-            q.prepare(QString("UPDATE Entry SET Row=? WHERE ParentID%1 AND Row=?")
-                      .arg(dest_parent.IsNull() ? " IS NULL" : "=?"));
-            q.addBindValue(i + row_cnt);
-            if(!dest_parent.IsNull())
-                q.addBindValue(dest_parent.ToQByteArray());
-            q.addBindValue(i);
-            DatabaseUtils::ExecuteQuery(q);
+        if((int)row_dest < dest_siblings_cnt){
+            int old_row_index;
+            QSqlQuery &q_shift = __prepare_row_update(*d->statements, dest_parent, old_row_index);
+            for(int i = dest_siblings_cnt - 1; i >= (int)row_dest; --i){
+                q_shift.bindValue(0, i + row_cnt);
+                q_shift.bindValue(old_row_index, i);
+                __execute_query(q_shift);
+            }
         }
 
         emit NotifyProgressUpdated(65, false, task_string);
@@ -1251,7 +2049,7 @@ void PasswordDatabase::_bw_move_entry(const QString &conn_str,
         q.prepare("UPDATE Entry SET ParentID=? WHERE ParentID=?");
         q.addBindValue((QByteArray)dest_parent);
         q.addBindValue(special_zero_id);
-        DatabaseUtils::ExecuteQuery(q);
+        __execute_query(q);
 
         emit NotifyProgressUpdated(85, false, task_string);
         success = true;
@@ -1261,13 +2059,14 @@ void PasswordDatabase::_bw_move_entry(const QString &conn_str,
 void PasswordDatabase::AddEntry(Entry &e, bool gen_id)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
 
     if(gen_id)
         e.SetId(EntryId::NewId());
 
     // Generate the entry cache
-    entry_cache ec(__convert_entry_to_cache(e, *d->cryptor));
+    entry_cache ec(__convert_entry_to_cache(e, __cryptor(d)));
 
     // Update the index
     bool favs_updated = false;
@@ -1288,7 +2087,7 @@ void PasswordDatabase::AddEntry(Entry &e, bool gen_id)
                 iter->row = i;
         }
 
-        d->index[e.GetId()] = ec;
+        __index_insert(d, ec);
         if(d->deleted_entries.contains(e.GetId())){
             d->deleted_entries.remove(e.GetId());
 
@@ -1343,27 +2142,94 @@ void PasswordDatabase::AddEntry(Entry &e, bool gen_id)
         emit NotifyFavoritesUpdated();
 }
 
+// Encrypts the new entries, generating their ids if requested
+static QList<entry_cache> __convert_new_entries(d_t *d, QList<Entry> &entries, bool gen_ids)
+{
+    QList<entry_cache> ret;
+    ret.reserve(entries.length());
+    for(Entry &e : entries){
+        if(gen_ids)
+            e.SetId(EntryId::NewId());
+        ret.append(__convert_entry_to_cache(e, __cryptor(d)));
+    }
+    return ret;
+}
+
+// Makes sure every parent is either in the index or earlier in the list.
+// You must hold the index lock.
+static void __check_new_parents(d_t *d, const QList<Entry> &entries)
+{
+    QSet<EntryId> new_ids;
+    for(const Entry &e : entries){
+        if(!e.GetParentId().IsNull() && !new_ids.contains(e.GetParentId()) &&
+                d->parent_index.find(e.GetParentId()) == d->parent_index.end())
+            throw Exception<>("Parent entry not found");
+        new_ids.insert(e.GetId());
+    }
+}
+
+// Appends the entries to their parents in the index, in list order.
+// You must hold the index lock.
+static void __index_append_entries(d_t *d, QList<Entry> &entries, QList<entry_cache> &caches)
+{
+    for(int i = 0; i < entries.length(); ++i){
+        Entry &e = entries[i];
+        QList<EntryId> &child_ids = d->parent_index[e.GetParentId()].children;
+        e.SetRow(child_ids.length());
+        child_ids.append(e.GetId());
+
+        caches[i].row = e.GetRow();
+        __index_insert(d, caches[i]);
+        d->parent_index[e.GetId()];
+    }
+}
+
+static void __clear_added_entries(QList<Entry> &entries)
+{
+    for(Entry &e : entries){
+        // Clear the file path so we don't add the same file twice
+        e.SetFilePath(QString::null);
+
+        // New favorites must be unordered when added to the database
+        if(e.IsFavorite())
+            e.SetFavoriteIndex(0);
+    }
+}
+
+void PasswordDatabase::AddEntries(QList<Entry> &entries, bool gen_ids)
+{
+    FailIfNotOpen();
+    FailIfLocked();
+    G_D;
+
+    // Encrypt everything before taking the lock
+    QList<entry_cache> caches = __convert_new_entries(d, entries, gen_ids);
+
+    unique_lock<mutex> lkr(d->index_lock);
+
+    // Check the parents before we change anything
+    __check_new_parents(d, entries);
+    __index_append_entries(d, entries, caches);
+    lkr.unlock();
+    d->wc_index.notify_all();
+
+    // Tell the worker thread to add them all to the database
+    __queue_command(d, new add_entries_command(entries));
+    __clear_added_entries(entries);
+}
+
 void PasswordDatabase::UpdateEntry(Entry &e)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
 
     // Update the index
-    int old_favorite_index;
-    QByteArray crypttext = __generate_crypttext(*d->cryptor, e);
+    bool favs_updated;
+    QByteArray crypttext = __generate_crypttext(__cryptor(d), e);
     {
         unique_lock<mutex> lkr(d->index_lock);
-
-        old_favorite_index = d->index[e.GetId()].favoriteindex;
-
-        d->index[e.GetId()] = e;
-        d->index[e.GetId()].crypttext = crypttext;
-        if(old_favorite_index != e.GetFavoriteIndex()){
-            if(e.IsFavorite() && old_favorite_index < 0)
-                d->favorite_index.append(e.GetId());
-            else if(!e.IsFavorite() && old_favorite_index >= 0)
-                d->favorite_index.removeOne(e.GetId());
-        }
+        favs_updated = _index_update_entry(e, crypttext);
     }
 
     __queue_command(d, new update_entry_command(e));
@@ -1371,10 +2237,28 @@ void PasswordDatabase::UpdateEntry(Entry &e)
     // Clear the file path so we don't add the same file twice
     e.SetFilePath(QString::null);
 
-    if(old_favorite_index != e.GetFavoriteIndex())
+    if(favs_updated)
         emit NotifyFavoritesUpdated();
 }
 
+bool PasswordDatabase::_index_update_entry(const Entry &e, const QByteArray &crypttext)
+{
+    G_D;
+    const int old_favorite_index = d->index[e.GetId()].favoriteindex;
+
+    entry_cache ec(e);
+    ec.crypttext = crypttext;
+    __index_insert(d, ec);
+    if(old_favorite_index != e.GetFavoriteIndex()){
+        if(e.IsFavorite() && old_favorite_index < 0)
+            d->favorite_index.append(e.GetId());
+        else if(!e.IsFavorite() && old_favorite_index >= 0)
+            d->favorite_index.removeOne(e.GetId());
+        return true;
+    }
+    return false;
+}
+
 bool PasswordDatabase::HasAncestor(const EntryId &child, const EntryId &ancestor) const
 {
     G_D;
@@ -1398,13 +2282,28 @@ bool PasswordDatabase::_has_ancestor(const EntryId &child, const EntryId &ancest
 void PasswordDatabase::DeleteEntry(const EntryId &id)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     if(id.IsNull())
         return;
 
     // Update the index
-    bool favs_updated = false;
     unique_lock<mutex> lkr(d->index_lock);
+    bool favs_updated = _index_delete_entry(id);
+    lkr.unlock();
+    d->wc_index.notify_all();
+
+    // Remove it from the database
+    __queue_command(d, new delete_entry_command(id));
+
+    if(favs_updated)
+        emit NotifyFavoritesUpdated();
+}
+
+bool PasswordDatabase::_index_delete_entry(const EntryId &id)
+{
+    G_D;
+    bool favs_updated = false;
     auto iter = d->index.find(id);
     if(iter != d->index.end()){
         auto piter = d->parent_index.find(iter->parentid);
@@ -1425,17 +2324,96 @@ void PasswordDatabase::DeleteEntry(const EntryId &id)
             }
         }
 
-        d->index.erase(iter);
+        __index_remove(d, id);
         d->deleted_entries.insert(id);
 
         // Don't remove from the parent index, because they may un-delete it
         //d->parent_index.remove(id);
     }
+    return favs_updated;
+}
+
+void PasswordDatabase::ApplyChanges(QList<Entry> &added, QList<Entry> &updated,
+                                    const QList<EntryId> &deleted, bool gen_ids)
+{
+    FailIfNotOpen();
+    FailIfLocked();
+    G_D;
+
+    // Encrypt everything before taking the lock
+    QList<entry_cache> caches = __convert_new_entries(d, added, gen_ids);
+    QList<QByteArray> crypttexts;
+    crypttexts.reserve(updated.length());
+    for(const Entry &e : updated)
+        crypttexts.append(__generate_crypttext(__cryptor(d), e));
+
+    bool favs_updated = false;
+    unique_lock<mutex> lkr(d->index_lock);
+
+    // Check everything before we change anything
+    QList<EntryId> to_delete;
+    {
+        auto exists = [&](const EntryId &id){
+            return d->index.find(id) != d->index.end() &&
+                    !d->deleted_entries.contains(id);
+        };
+        const QSet<EntryId> deleted_ids = deleted.toSet();
+
+        // Returns true if the entry or one of its ancestors is being deleted
+        auto being_deleted = [&](EntryId id){
+            while(!id.IsNull()){
+                if(deleted_ids.contains(id))
+                    return true;
+                auto iter = d->index.find(id);
+                if(iter == d->index.end())
+                    return false;
+                id = iter->parentid;
+            }
+            return false;
+        };
+
+        // Deleting an entry deletes its subtree, so we skip duplicates and
+        //  entries whose ancestor is also being deleted
+        QSet<EntryId> seen;
+        for(const EntryId &id : deleted){
+            if(!exists(id))
+                throw Exception<>("Entry to delete not found");
+            if(seen.contains(id))
+                continue;
+            seen.insert(id);
+            if(!being_deleted(d->index.find(id)->parentid))
+                to_delete.append(id);
+        }
+        for(const Entry &e : updated){
+            if(!exists(e.GetId()))
+                throw Exception<>("Entry to update not found");
+            if(being_deleted(e.GetId()))
+                throw Exception<>("Cannot update an entry that is being deleted");
+        }
+        for(const Entry &e : added){
+            if(being_deleted(e.GetParentId()))
+                throw Exception<>("Cannot add an entry to a parent that is being deleted");
+        }
+        __check_new_parents(d, added);
+    }
+
+    // Delete first, so the new entries are appended after the siblings shift
+    for(const EntryId &id : to_delete)
+        favs_updated = _index_delete_entry(id) || favs_updated;
+    for(int i = 0; i < updated.length(); ++i)
+        favs_updated = _index_update_entry(updated[i], crypttexts[i]) || favs_updated;
+    __index_append_entries(d, added, caches);
     lkr.unlock();
     d->wc_index.notify_all();
 
-    // Remove it from the database
-    __queue_command(d, new delete_entry_command(id));
+    // Tell the worker thread to do it all in one transaction
+    __queue_command(d, new apply_changes_command(added, updated, to_delete));
+
+    __clear_added_entries(added);
+    for(Entry &e : updated){
+        // Clear the file path so we don't add the same file twice
+        e.SetFilePath(QString::null);
+    }
 
     if(favs_updated)
         emit NotifyFavoritesUpdated();
@@ -1445,6 +2423,7 @@ void PasswordDatabase::MoveEntries(const EntryId &parentId_src, quint32 row_firs
                                    const EntryId &parentId_dest, quint32 row_dest)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     int move_cnt = row_last - row_first + 1;
     quint32 row_dest_orig = row_dest;
@@ -1511,7 +2490,7 @@ Entry PasswordDatabase::FindEntry(const EntryId &id) const
             exit_not_found();
         ec = *i;
     }
-    return __convert_cache_to_entry(ec, *d->cryptor);
+    return __convert_cache_to_entry(ec, __cryptor(d));
 }
 
 int PasswordDatabase::CountEntriesByParentId(const EntryId &id) const
@@ -1528,6 +2507,7 @@ int PasswordDatabase::CountEntriesByParentId(const EntryId &id) const
 
 QList<Entry> PasswordDatabase::FindEntriesByParentId(const EntryId &pid) const
 {
+    GRYPTO_TRACE_SCOPE("database", "FindEntriesByParentId");
     FailIfNotOpen();
     G_D;
 
@@ -1537,15 +2517,90 @@ QList<Entry> PasswordDatabase::FindEntriesByParentId(const EntryId &pid) const
 
         foreach(const EntryId &child_id, d->parent_index[pid].children){
             GASSERT(d->index.find(child_id) != d->index.end());
-            ret.append(__convert_cache_to_entry(d->index[child_id], *d->cryptor));
+            ret.append(__convert_cache_to_entry(d->index[child_id], __cryptor(d)));
         }
     }
     return ret;
 }
 
+// Decrypts the entries outside the index lock
+static QList<QPair<Entry, int>> __convert_caches_to_entries(const QList<QPair<entry_cache, int>> &caches,
+                                                            Cryptor &cryptor)
+{
+    QList<QPair<Entry, int>> ret;
+    ret.reserve(caches.length());
+    for(const auto &p : caches)
+        ret.append(QPair<Entry, int>(__convert_cache_to_entry(p.first, cryptor), p.second));
+    return ret;
+}
+
+QList<QPair<Entry, int>> PasswordDatabase::FindEntriesAndChildCountsByParentId(const EntryId &pid) const
+{
+    FailIfNotOpen();
+    G_D;
+
+    // Copy the cache records while we hold the lock (the crypttext is implicitly shared)
+    QList<QPair<entry_cache, int>> caches;
+    {
+        unique_lock<mutex> lkr(d->index_lock);
+        auto pi = d->parent_index.find(pid);
+        if(pi != d->parent_index.end()){
+            caches.reserve(pi->children.length());
+            for(const EntryId &child_id : pi->children){
+                GASSERT(d->index.find(child_id) != d->index.end());
+                auto ci = d->parent_index.find(child_id);
+                caches.append(QPair<entry_cache, int>(
+                                  d->index.value(child_id),
+                                  ci == d->parent_index.end() ? 0 : ci->children.length()));
+            }
+        }
+    }
+    return __convert_caches_to_entries(caches, __cryptor(d));
+}
+
+QList<QPair<Entry, int>> PasswordDatabase::FindEntrySubtree(const EntryId &pid) const
+{
+    FailIfNotOpen();
+    G_D;
+    return FindEntrySubtree(pid, __cryptor(d));
+}
+
+QList<QPair<Entry, int>> PasswordDatabase::FindEntrySubtree(const EntryId &pid, Cryptor &cryptor) const
+{
+    FailIfNotOpen();
+    G_D;
+
+    QList<QPair<entry_cache, int>> caches;
+    {
+        unique_lock<mutex> lkr(d->index_lock);
+
+        // Walk the tree depth-first, pushing children in reverse so they pop in row order
+        QVector<EntryId> stack;
+        auto push_children = [&](const EntryId &id){
+            auto pi = d->parent_index.find(id);
+            if(pi != d->parent_index.end()){
+                for(int i = pi->children.length() - 1; i >= 0; --i)
+                    stack.append(pi->children[i]);
+                return pi->children.length();
+            }
+            return 0;
+        };
+
+        push_children(pid);
+        while(!stack.isEmpty()){
+            const EntryId cur = stack.takeLast();
+            GASSERT(d->index.find(cur) != d->index.end());
+            caches.append(QPair<entry_cache, int>(d->index.value(cur), 0));
+            caches.last().second = push_children(cur);
+        }
+    }
+    return __convert_caches_to_entries(caches, cryptor);
+}
+
 void PasswordDatabase::RefreshFavorites()
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new refresh_favorite_entries_command);
 }
@@ -1553,6 +2608,7 @@ void PasswordDatabase::RefreshFavorites()
 void PasswordDatabase::SetFavoriteEntries(const QList<EntryId> &favs)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new set_favorite_entries_command(favs));
 
@@ -1584,6 +2640,7 @@ void PasswordDatabase::SetFavoriteEntries(const QList<EntryId> &favs)
 void PasswordDatabase::AddFavoriteEntry(const EntryId &id)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new add_favorite_entry(id));
 
@@ -1603,6 +2660,7 @@ void PasswordDatabase::AddFavoriteEntry(const EntryId &id)
 void PasswordDatabase::RemoveFavoriteEntry(const EntryId &id)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new remove_favorite_entry(id));
 
@@ -1641,7 +2699,7 @@ QList<Entry> PasswordDatabase::FindFavoriteEntries() const
 
     QList<Entry> ret;
     for(const entry_cache &row : rows)
-        ret.append(__convert_cache_to_entry(row, *d->cryptor));
+        ret.append(__convert_cache_to_entry(row, __cryptor(d)));
     return ret;
 }
 
@@ -1656,6 +2714,7 @@ QList<EntryId> PasswordDatabase::FindFavoriteIds() const
 void PasswordDatabase::DeleteOrphans()
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new dispatch_orphans_command);
 }
@@ -1737,6 +2796,7 @@ QSet<FileId> PasswordDatabase::GetReferencedFileIds() const
 void PasswordDatabase::AddFile(const FileId &id, const char *filename)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new add_file_command(id, filename));
 }
@@ -1744,6 +2804,7 @@ void PasswordDatabase::AddFile(const FileId &id, const char *filename)
 void PasswordDatabase::AddFile(const FileId &id, const QByteArray &contents)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new add_file_command(id, contents));
 }
@@ -1751,6 +2812,7 @@ void PasswordDatabase::AddFile(const FileId &id, const QByteArray &contents)
 void PasswordDatabase::DeleteFile(const FileId &id)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     d->index_lock.lock();
     d->file_index.remove(id);
@@ -1774,12 +2836,12 @@ QByteArray PasswordDatabase::GetFile(const FileId &id) const
     QSqlQuery q(QSqlDatabase::database(d->dbString));
     q.prepare("SELECT Data FROM File WHERE ID=?");
     q.addBindValue((QByteArray)id);
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
     if(q.next()){
         const QByteArray encrypted = q.value(0).toByteArray();
         QByteArrayInput i(encrypted);
         QByteArrayOutput o(ret);
-        d->cryptor->DecryptData(&o, &i);
+        __cryptor(d).DecryptData(&o, &i);
     }
     return ret;
 }
@@ -1796,6 +2858,7 @@ void PasswordDatabase::ImportFromPortableSafe(const QString &import_filename,
                                               const Credentials &creds)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new import_from_ps_command(import_filename, creds));
 }
@@ -1810,30 +2873,685 @@ void PasswordDatabase::ExportToXml(const QString &export_filename)
 void PasswordDatabase::ImportFromXml(const QString &import_filename)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     __queue_command(d, new import_from_xml_command(import_filename));
 }
 
-/** Recursively counts all children of the parent. */
-static void __count_child_entries(QSqlDatabase &db, int &count, const EntryId &parent_id)
+// Identifies the vault in backup tokens. The salt is random and never changes.
+static QString __backup_vault_id(const QByteArray &salt)
 {
-    QSqlQuery q(db);
-    QList<EntryId> child_ids;
-    q.prepare(QString("SELECT ID FROM Entry WHERE ParentID%1")
-              .arg(parent_id.IsNull() ? " IS NULL" : "=?"));
-    if(!parent_id.IsNull())
-        q.addBindValue((QByteArray)parent_id);
-    DatabaseUtils::ExecuteQuery(q);
+    return QString::fromLatin1(salt.left(8).toHex());
+}
 
-    while(q.next()){
-        EntryId cid = q.value("ID").toByteArray();
-        child_ids.append(cid);
-        __count_child_entries(db, count, cid);
-    }
-    count += child_ids.length();
+// Blobs in a backup are base64, and NULL stays null
+static QJsonValue __backup_blob(const QVariant &v)
+{
+    return v.isNull() ? QJsonValue() : QJsonValue(QString::fromLatin1(v.toByteArray().toBase64()));
 }
 
-int PasswordDatabase::CountAllEntries() const
+static QVariant __restore_blob(const QJsonValue &v)
+{
+    return v.isNull() ? QVariant(QVariant::ByteArray) :
+                        QVariant(QByteArray::fromBase64(v.toString().toLatin1()));
+}
+
+QString PasswordDatabase::Backup(const QString &backup_filename,
+                                 const Credentials &creds,
+                                 const QString &since_token)
+{
+    GRYPTO_TRACE_SCOPE("database", "Backup");
+    FailIfNotOpen();
+    if(!CheckCredentials(creds))
+        throw AuthenticationException<>("The credentials are incorrect");
+    G_D;
+
+    // Everything that was queued has to be in the database first
+    WaitForThreadIdle();
+
+    QSqlDatabase db(QSqlDatabase::database(d->dbString));
+    QSqlQuery q(db);
+
+    // Nothing can change while we're reading, even though we don't write
+    db.transaction();
+    finally([&]{ db.rollback(); });
+
+    q.prepare("SELECT * FROM Version");
+    __execute_query(q);
+    if(!q.next())
+        throw Exception<>("Did not find a version row");
+    const QSqlRecord version = q.record();
+    const QString vault_id = __backup_vault_id(version.value("Salt").toByteArray());
+
+    // A token is the vault id and the last sequence number it covered
+    const bool full = since_token.isEmpty();
+    qint64 from = 0;
+    if(!full){
+        const QStringList parts = since_token.split(':');
+        bool ok = false;
+        if(2 == parts.length())
+            from = parts[1].toLongLong(&ok);
+        if(!ok || 0 > from)
+            throw Exception<>("Invalid backup token");
+        if(parts[0] != vault_id)
+            throw Exception<>("The backup token is from a different vault");
+    }
+
+    q.prepare("SELECT IFNULL(MAX(Seq),0) FROM ChangeLog");
+    __execute_query(q);
+    q.next();
+    const qint64 to = q.value(0).toLongLong();
+    if(to < from)
+        throw Exception<>("The backup token is newer than the vault; is it from another copy?");
+
+    QJsonObject manifest;
+    manifest["format"] = "GryptoBackup";
+    manifest["vault"] = vault_id;
+    manifest["from"] = full ? -1 : from;
+    manifest["to"] = to;
+    if(full){
+        QJsonObject v;
+        v["version"] = version.value("Version").toString();
+        v["salt"] = __backup_blob(version.value("Salt"));
+        v["keycheck"] = __backup_blob(version.value("KeyCheck"));
+        if(0 <= version.indexOf("KdfIterations"))
+            v["kdf_iterations"] = version.value("KdfIterations").toLongLong();
+        manifest["version_row"] = v;
+    }
+
+    // The rows that changed, or all of them for a full backup. The ids in the
+    //  change log that aren't in the table any more were deleted.
+    //  An entry can be in the log twice, if its row changed too.
+    const QString entry_kinds = QString("%1,%2").arg(CHANGE_KIND_ENTRY).arg(CHANGE_KIND_ENTRY_ROW);
+    const QString file_kinds = QString::number(CHANGE_KIND_FILE);
+    auto changed_rows = [&](const QString &table, const QString &kinds, const QString &columns){
+        if(full)
+            q.prepare(QString("SELECT %1 FROM %2 t").arg(columns).arg(table));
+        else{
+            q.prepare(QString("SELECT %1 FROM %2 t WHERE t.ID IN"
+                              " (SELECT ID FROM ChangeLog WHERE Kind IN (%3) AND Seq>?)")
+                      .arg(columns).arg(table).arg(kinds));
+            q.addBindValue(from);
+        }
+        __execute_query(q);
+    };
+    auto deleted_ids = [&](const QString &table, const QString &kinds){
+        QJsonArray ret;
+        if(!full){
+            q.prepare(QString("SELECT DISTINCT c.ID FROM ChangeLog c LEFT JOIN %1 t ON t.ID=c.ID"
+                              " WHERE c.Kind IN (%2) AND c.Seq>? AND t.ID IS NULL")
+                      .arg(table).arg(kinds));
+            q.addBindValue(from);
+            __execute_query(q);
+            while(q.next())
+                ret.append(__backup_blob(q.value(0)));
+        }
+        return ret;
+    };
+
+    QJsonArray entries;
+    changed_rows("Entry", entry_kinds, "t.ID,t.ParentID,t.Row,t.Favorite,t.FileID,t.Data");
+    while(q.next()){
+        QJsonObject e;
+        e["id"] = __backup_blob(q.value(0));
+        e["pid"] = __backup_blob(q.value(1));
+        e["row"] = q.value(2).toInt();
+        e["fav"] = q.value(3).toInt();
+        e["fid"] = __backup_blob(q.value(4));
+        e["data"] = __backup_blob(q.value(5));
+        entries.append(e);
+    }
+    manifest["entries"] = entries;
+    manifest["deleted_entries"] = deleted_ids("Entry", entry_kinds);
+
+    // The file data goes in separate payloads, in the same order as this list
+    QJsonArray files;
+    QList<QByteArray> file_ids;
+    changed_rows("File", file_kinds, "t.ID,t.Length");
+    while(q.next()){
+        QJsonObject f;
+        f["id"] = __backup_blob(q.value(0));
+        f["length"] = q.value(1).toLongLong();
+        files.append(f);
+        file_ids.append(q.value(0).toByteArray());
+    }
+    manifest["files"] = files;
+    manifest["deleted_files"] = deleted_ids("File", file_kinds);
+
+    GPSFile_Export gps_file(backup_filename.toUtf8(), creds, FileId::Size);
+    {
+        const QByteArray manifest_compressed(
+                    qCompress(QJsonDocument(manifest).toJson(QJsonDocument::Compact), 9));
+        gps_file.AppendPayload((byte const *)manifest_compressed.constData(),
+                               manifest_compressed.length());
+    }
+
+    // The files are still encrypted with the vault's key, so we copy them as they are
+    q.prepare("SELECT Data FROM File WHERE ID=?");
+    for(const QByteArray &fid : file_ids){
+        q.bindValue(0, fid);
+        __execute_query(q);
+        if(!q.next())
+            throw Exception<>("File ID not found");
+        const QByteArray data = q.value(0).toByteArray();
+        q.finish();
+        gps_file.AppendPayload((byte const *)data.constData(), data.length());
+    }
+
+    return QString("%1:%2").arg(vault_id).arg(to);
+}
+
+void PasswordDatabase::RestoreBackup(const QString &target_filename,
+                                     const QStringList &backup_filenames,
+                                     const Credentials &creds)
+{
+    GRYPTO_TRACE_SCOPE("database", "RestoreBackup");
+    if(backup_filenames.isEmpty())
+        throw Exception<>("You must give at least one backup");
+    if(QFile::exists(target_filename))
+        throw Exception<>(QString("The restore target already exists: %1")
+                          .arg(target_filename).toUtf8());
+
+    bool success = false;
+    QString dbstring = __create_connection(target_filename);
+    finally([&]{
+        QSqlDatabase::removeDatabase(dbstring);
+        if(!success)
+            QFile::remove(target_filename);
+    });
+
+    {
+        QSqlDatabase db(QSqlDatabase::database(dbstring));
+        __create_tables(db);
+        QSqlQuery q(db);
+        __create_change_log(q);
+
+        db.transaction();
+        try
+        {
+            QString vault_id;
+            qint64 last_to = -1;
+            for(int i = 0; i < backup_filenames.length(); ++i){
+                const QString &filename = backup_filenames[i];
+                GPSFile_Import gps_import(filename.toUtf8(), creds, true);
+                if(!gps_import.NextPayload())
+                    throw Exception<>(QString("The backup is empty: %1").arg(filename).toUtf8());
+
+                QJsonObject manifest;
+                {
+                    QByteArray ba;
+                    ba.resize(gps_import.CurrentPayloadSize());
+                    gps_import.GetCurrentPayload((byte *)ba.data());
+                    manifest = QJsonDocument::fromJson(qUncompress(ba)).object();
+                }
+                if(manifest["format"].toString() != "GryptoBackup")
+                    throw Exception<>(QString("Not a backup: %1").arg(filename).toUtf8());
+
+                // The first one must be a full backup, and every one after it
+                //  must start where the one before it left off
+                const qint64 from = manifest["from"].toVariant().toLongLong();
+                if(0 == i){
+                    if(-1 != from)
+                        throw Exception<>(QString("The first backup must be a full backup: %1")
+                                          .arg(filename).toUtf8());
+                    vault_id = manifest["vault"].toString();
+
+                    const QJsonObject v = manifest["version_row"].toObject();
+                    q.prepare("INSERT INTO Version (Version,Salt,KeyCheck,KdfIterations)"
+                              " VALUES (?,?,?,?)");
+                    q.addBindValue(v["version"].toString());
+                    q.addBindValue(__restore_blob(v["salt"]));
+                    q.addBindValue(__restore_blob(v["keycheck"]));
+                    q.addBindValue(v["kdf_iterations"].toVariant().toLongLong());
+                    __execute_query(q);
+                }
+                else if(manifest["vault"].toString() != vault_id)
+                    throw Exception<>(QString("The backup is from a different vault: %1")
+                                      .arg(filename).toUtf8());
+                else if(from != last_to)
+                    throw Exception<>(QString("The backup doesn't follow the one before it: %1")
+                                      .arg(filename).toUtf8());
+                last_to = manifest["to"].toVariant().toLongLong();
+
+                q.prepare("INSERT OR REPLACE INTO Entry (ID,ParentID,Row,Favorite,FileID,Data)"
+                          " VALUES (?,?,?,?,?,?)");
+                for(const QJsonValue &val : manifest["entries"].toArray()){
+                    const QJsonObject e = val.toObject();
+                    q.bindValue(0, __restore_blob(e["id"]));
+                    q.bindValue(1, __restore_blob(e["pid"]));
+                    q.bindValue(2, e["row"].toInt());
+                    q.bindValue(3, e["fav"].toInt());
+                    q.bindValue(4, __restore_blob(e["fid"]));
+                    q.bindValue(5, __restore_blob(e["data"]));
+                    __execute_query(q);
+                }
+                q.prepare("DELETE FROM Entry WHERE ID=?");
+                for(const QJsonValue &val : manifest["deleted_entries"].toArray()){
+                    q.bindValue(0, __restore_blob(val));
+                    __execute_query(q);
+                }
+
+                q.prepare("INSERT OR REPLACE INTO File (ID,Length,Data) VALUES (?,?,?)");
+                for(const QJsonValue &val : manifest["files"].toArray()){
+                    if(!gps_import.NextPayload())
+                        throw Exception<>(QString("The backup is missing files: %1")
+                                          .arg(filename).toUtf8());
+                    QByteArray data;
+                    data.resize(gps_import.CurrentPayloadSize());
+                    gps_import.GetCurrentPayload((byte *)data.data());
+
+                    const QJsonObject f = val.toObject();
+                    q.bindValue(0, __restore_blob(f["id"]));
+                    q.bindValue(1, f["length"].toVariant().toLongLong());
+                    q.bindValue(2, data);
+                    __execute_query(q);
+                }
+                q.prepare("DELETE FROM File WHERE ID=?");
+                for(const QJsonValue &val : manifest["deleted_files"].toArray()){
+                    q.bindValue(0, __restore_blob(val));
+                    __execute_query(q);
+                }
+            }
+
+            // Replaying the backups went through the change log too, so make it
+            //  look like the last backup, so its token works with the new vault
+            q.prepare("UPDATE ChangeLog SET Seq=?");
+            q.addBindValue(last_to);
+            __execute_query(q);
+        }
+        catch(...)
+        {
+            db.rollback();
+            throw;
+        }
+        __commit_transaction(db);
+    }
+    __check_version(dbstring);
+    success = true;
+}
+
+void PasswordDatabase::HotBackup(const QString &backup_filename,
+                                 int pages_per_step,
+                                 int pause_ms)
+{
+    GRYPTO_TRACE_SCOPE("database", "HotBackup");
+    FailIfNotOpen();
+    const QString file_path = QFileInfo(backup_filename).absoluteFilePath();
+    if(file_path == QFileInfo(m_filepath).absoluteFilePath())
+        throw Exception<>("Cannot back up to the current file");
+    if(0 >= pages_per_step)
+        throw Exception<>("You must copy at least one page at a time");
+
+    // We copy to a file next to the target and rename it at the end, so
+    //  there's never half a backup at the target
+    const QString part_path = file_path + ".part";
+    QFile::remove(part_path);
+
+    const QString task_string = tr("Backing up vault");
+    QString src_str;
+    QString dest_str;
+    bool success = false;
+    finally([&]{
+        if(!dest_str.isEmpty())
+            QSqlDatabase::removeDatabase(dest_str);
+        if(!src_str.isEmpty())
+            QSqlDatabase::removeDatabase(src_str);
+        if(!success)
+            QFile::remove(part_path);
+        emit NotifyProgressUpdated(100, false, task_string);
+    });
+
+    // We read the vault on a connection of our own, because the others
+    //  belong to other threads
+    src_str = __create_connection(m_filepath);
+    dest_str = __create_connection(part_path);
+    {
+        QSqlDatabase src_db(QSqlDatabase::database(src_str));
+        QSqlDatabase dest_db(QSqlDatabase::database(dest_str));
+        sqlite3 *dest = __sqlite_handle(dest_db);
+
+        // When the background thread writes to the vault between our steps, the
+        //  next step starts the copy over, so the backup is always the vault as
+        //  it was at one moment. A vault that's written to all the time may take
+        //  a while to finish.
+        sqlite3_backup *backup = sqlite3_backup_init(dest, "main", __sqlite_handle(src_db), "main");
+        if(!backup)
+            throw Exception<>(QString("Unable to start the backup: %1")
+                              .arg(sqlite3_errmsg(dest)).toUtf8());
+        finally([&]{
+            if(backup)
+                sqlite3_backup_finish(backup);
+        });
+
+        // Each step only locks the vault for a few pages, and we pause between
+        //  them so the background thread can get in with its writes
+        emit NotifyProgressUpdated(0, false, task_string);
+        int rc;
+        forever{
+            rc = sqlite3_backup_step(backup, pages_per_step);
+            if(SQLITE_OK != rc && SQLITE_BUSY != rc && SQLITE_LOCKED != rc)
+                break;
+
+            const int total = sqlite3_backup_pagecount(backup);
+            if(0 < total)
+                emit NotifyProgressUpdated((total - sqlite3_backup_remaining(backup)) * 100 / total,
+                                           false, task_string);
+            if(0 < pause_ms)
+                this_thread::sleep_for(chrono::milliseconds(pause_ms));
+        }
+        if(SQLITE_DONE != rc)
+            throw Exception<>(QString("The backup failed: %1")
+                              .arg(sqlite3_errstr(rc)).toUtf8());
+
+        rc = sqlite3_backup_finish(backup);
+        backup = NULL;
+        if(SQLITE_OK != rc)
+            throw Exception<>(QString("The backup failed: %1")
+                              .arg(sqlite3_errmsg(dest)).toUtf8());
+    }
+
+    // Close the backup before we move it
+    QSqlDatabase::removeDatabase(dest_str);
+    dest_str.clear();
+    QSqlDatabase::removeDatabase(src_str);
+    src_str.clear();
+
+    {
+        QFile f(file_path);
+        if(f.exists() && !f.remove())
+            throw Exception<>(QString(tr("Unable to remove existing file: %1"))
+                              .arg(f.errorString()).toUtf8());
+    }
+    if(!QFile::rename(part_path, file_path))
+        throw Exception<>(QString("Unable to move the backup to %1").arg(file_path).toUtf8());
+    success = true;
+}
+
+// Copies of a vault have the same salt, and different vaults never do
+static QString __vault_id(const QString &dbstring)
+{
+    QSqlQuery q(QSqlDatabase::database(dbstring));
+    q.prepare("SELECT Salt FROM Version");
+    __execute_query(q);
+    if(!q.next())
+        throw Exception<>("Did not find a version row");
+    return __backup_vault_id(q.value(0).toByteArray());
+}
+
+static qint64 __latest_change(const QString &dbstring)
+{
+    QSqlQuery q(QSqlDatabase::database(dbstring));
+    q.prepare("SELECT IFNULL(MAX(Seq),0) FROM ChangeLog");
+    __execute_query(q);
+    q.next();
+    return q.value(0).toLongLong();
+}
+
+// Finds the entries and files that changed after the sequence number, and
+//  returns the latest sequence number
+static qint64 __changes_since(const QString &dbstring, qint64 since,
+                              QSet<EntryId> &entries, QSet<FileId> &files)
+{
+    QSqlQuery q(QSqlDatabase::database(dbstring));
+    q.prepare("SELECT ID,Kind FROM ChangeLog WHERE Seq>?");
+    q.addBindValue(since);
+    __execute_query(q);
+    while(q.next()){
+        switch(q.value(1).toInt()){
+        case CHANGE_KIND_ENTRY:
+            entries.insert(q.value(0).toByteArray());
+            break;
+        case CHANGE_KIND_FILE:
+            files.insert(q.value(0).toByteArray());
+            break;
+        default:
+            // The order of siblings isn't synced
+            break;
+        }
+    }
+    return __latest_change(dbstring);
+}
+
+static bool __find_entry(const PasswordDatabase &db, const EntryId &id, Entry &e)
+{
+    try{
+        e = db.FindEntry(id);
+    }
+    catch(const Exception<> &){
+        return false;
+    }
+    return true;
+}
+
+// Writes the entries from the other copy into the target and deletes the
+//  others. New entries are appended to their parents, and entries that moved
+//  are moved to the end of their new parents. If a parent isn't in the target
+//  anymore, the entry goes at the top and is reported as a conflict.
+static void __sync_apply(PasswordDatabase &target,
+                         const QList<Entry> &entries,
+                         const QList<EntryId> &deleted,
+                         QList<EntryId> &conflicts)
+{
+    const QSet<EntryId> deleted_ids = deleted.toSet();
+    QSet<EntryId> added_ids;
+    QList<Entry> added, updated, moved, pending;
+    for(const Entry &e : entries){
+        Entry cur;
+        if(__find_entry(target, e.GetId(), cur)){
+            // Updates don't move entries, so that's done separately
+            Entry u(e);
+            u.SetParentId(cur.GetParentId());
+            u.SetRow(cur.GetRow());
+            updated.append(u);
+            if(cur.GetParentId() != e.GetParentId())
+                moved.append(e);
+        }
+        else
+            pending.append(e);
+    }
+
+    Entry unused;
+    auto parent_exists = [&](const EntryId &pid){
+        return pid.IsNull() || added_ids.contains(pid) ||
+                (!deleted_ids.contains(pid) && __find_entry(target, pid, unused));
+    };
+
+    // Parents have to come before their children
+    for(bool progress = true; progress && !pending.isEmpty();){
+        progress = false;
+        for(int i = 0; i < pending.length();){
+            if(parent_exists(pending[i].GetParentId())){
+                added_ids.insert(pending[i].GetId());
+                added.append(pending.takeAt(i));
+                progress = true;
+            }
+            else
+                ++i;
+        }
+    }
+    for(Entry &e : pending){
+        e.SetParentId(EntryId::Null());
+        conflicts.append(e.GetId());
+        added.append(e);
+    }
+
+    target.ApplyChanges(added, updated, deleted, false);
+
+    for(const Entry &e : moved){
+        EntryId pid = e.GetParentId();
+        if(!parent_exists(pid)){
+            pid = EntryId::Null();
+            conflicts.append(e.GetId());
+        }
+        const Entry cur = target.FindEntry(e.GetId());
+        target.MoveEntries(cur.GetParentId(), cur.GetRow(), cur.GetRow(),
+                           pid, target.CountEntriesByParentId(pid));
+    }
+}
+
+PasswordDatabase::SyncResult PasswordDatabase::Sync(PasswordDatabase &other,
+                                                    const QString &token)
+{
+    GRYPTO_TRACE_SCOPE("database", "Sync");
+    FailIfLocked();
+    other.FailIfLocked();
+    if(this == &other)
+        throw Exception<>("Cannot sync a vault with itself");
+    G_D;
+    const QString &other_dbstring = other._connection_string();
+
+    // Everything that was queued has to be in the databases first
+    WaitForThreadIdle();
+    other.WaitForThreadIdle();
+
+    // The entries are copied as they are, so it must be the same key
+    if(__vault_id(d->dbString) != __vault_id(other_dbstring))
+        throw Exception<>("You can only sync copies of the same vault");
+
+    // The token is the last change in each copy that was synced
+    qint64 since = 0, other_since = 0;
+    if(!token.isEmpty()){
+        const QStringList parts = token.split(':');
+        bool ok1 = false, ok2 = false;
+        if(2 == parts.length()){
+            since = parts[0].toLongLong(&ok1);
+            other_since = parts[1].toLongLong(&ok2);
+        }
+        if(!ok1 || !ok2 || 0 > since || 0 > other_since)
+            throw Exception<>("Invalid sync token");
+    }
+
+    QSet<EntryId> entries, other_entries;
+    QSet<FileId> files, other_files;
+    if(__changes_since(d->dbString, since, entries, files) < since ||
+            __changes_since(other_dbstring, other_since, other_entries, other_files) < other_since)
+        throw Exception<>("The sync token is newer than the vault; is it from another copy?");
+
+    // Decide which way each changed entry goes. When it changed in both, the
+    //  one with the later modify date wins, and an edit wins over a delete.
+    //  The same modify date means they're the same, like after the last sync.
+    SyncResult ret;
+    QList<Entry> to_other, to_this;
+    QList<EntryId> delete_other, delete_this;
+    QSet<EntryId> all_entries(entries);
+    all_entries.unite(other_entries);
+    for(const EntryId &id : all_entries){
+        Entry e, oe;
+        const bool in_this = __find_entry(*this, id, e);
+        const bool in_other = __find_entry(other, id, oe);
+        const bool changed = entries.contains(id);
+        const bool other_changed = other_entries.contains(id);
+        if(changed && other_changed){
+            if(in_this && in_other){
+                if(e.GetModifyDate() == oe.GetModifyDate() && e.GetParentId() == oe.GetParentId())
+                    continue;
+                ret.Conflicts.append(id);
+                if(oe.GetModifyDate() > e.GetModifyDate())
+                    to_this.append(oe);
+                else
+                    to_other.append(e);
+            }
+            else if(in_this){
+                ret.Conflicts.append(id);
+                to_other.append(e);
+            }
+            else if(in_other){
+                ret.Conflicts.append(id);
+                to_this.append(oe);
+            }
+        }
+        else if(changed){
+            if(in_this)
+                to_other.append(e);
+            else if(in_other)
+                delete_other.append(id);
+        }
+        else{
+            if(in_other)
+                to_this.append(oe);
+            else if(in_this)
+                delete_this.append(id);
+        }
+    }
+
+    // A file's id is new every time it's added, so if it changed in both
+    //  copies it's the same file
+    QSet<FileId> all_files(files);
+    all_files.unite(other_files);
+    for(const FileId &fid : all_files){
+        const bool in_this = FileExists(fid);
+        const bool in_other = other.FileExists(fid);
+        const bool changed = files.contains(fid);
+        const bool other_changed = other_files.contains(fid);
+        if(in_this && in_other){
+            // If only one of them changed it, it was replaced there
+            if(changed && !other_changed){
+                other.AddFile(fid, GetFile(fid));
+                ++ret.FilesSent;
+            }
+            else if(other_changed && !changed){
+                AddFile(fid, other.GetFile(fid));
+                ++ret.FilesReceived;
+            }
+        }
+        else if(in_this){
+            // It was deleted there, unless it's new here
+            if(other_changed && !changed){
+                DeleteFile(fid);
+                ++ret.FilesReceived;
+            }
+            else{
+                other.AddFile(fid, GetFile(fid));
+                ++ret.FilesSent;
+            }
+        }
+        else if(in_other){
+            if(changed && !other_changed){
+                other.DeleteFile(fid);
+                ++ret.FilesSent;
+            }
+            else{
+                AddFile(fid, other.GetFile(fid));
+                ++ret.FilesReceived;
+            }
+        }
+    }
+
+    __sync_apply(other, to_other, delete_other, ret.Conflicts);
+    __sync_apply(*this, to_this, delete_this, ret.Conflicts);
+    ret.EntriesSent = to_other.length() + delete_other.length();
+    ret.EntriesReceived = to_this.length() + delete_this.length();
+
+    // The changes we just made are in the change logs too, so the next
+    //  sync starts after them
+    WaitForThreadIdle();
+    other.WaitForThreadIdle();
+    ret.Token = QString("%1:%2")
+            .arg(__latest_change(d->dbString))
+            .arg(__latest_change(other_dbstring));
+    return ret;
+}
+
+/** Recursively counts all children of the parent. */
+static void __count_child_entries(QSqlDatabase &db, int &count, const EntryId &parent_id)
+{
+    QSqlQuery q(db);
+    QList<EntryId> child_ids;
+    q.prepare(QString("SELECT ID FROM Entry WHERE ParentID%1")
+              .arg(parent_id.IsNull() ? " IS NULL" : "=?"));
+    if(!parent_id.IsNull())
+        q.addBindValue((QByteArray)parent_id);
+    __execute_query(q);
+
+    while(q.next()){
+        EntryId cid = q.value("ID").toByteArray();
+        child_ids.append(cid);
+        __count_child_entries(db, count, cid);
+    }
+    count += child_ids.length();
+}
+
+int PasswordDatabase::CountAllEntries() const
 {
     FailIfNotOpen();
     G_D;
@@ -1875,6 +3593,7 @@ static void __import_children(d_t *d,
 void PasswordDatabase::ImportFromDatabase(const PasswordDatabase &other)
 {
     FailIfNotOpen();
+    FailIfLocked();
     G_D;
     QString progress_label(QString(tr("Importing entries from %1")).arg(other.FilePath()));
     emit NotifyProgressUpdated(0, false, progress_label);
@@ -1927,7 +3646,7 @@ void PasswordDatabase::_bw_refresh_favorites(const QString &conn_str)
     d->favorite_index = ids;
     for(const entry_cache &ec : rows){
         if(d->index.find(ec.id) == d->index.end())
-            d->index.insert(ec.id, ec);
+            __index_insert(d, ec);
     }
     lkr.unlock();
     d->wc_index.notify_all();
@@ -1936,6 +3655,7 @@ void PasswordDatabase::_bw_refresh_favorites(const QString &conn_str)
 
 void PasswordDatabase::_bw_set_favorites(const QString &conn_str, const QList<EntryId> &favs)
 {
+    G_D;
     QString task_string = tr("Setting favorites");
     emit NotifyProgressUpdated(0, false, task_string);
     finally([&]{ emit NotifyProgressUpdated(100, false, task_string); });
@@ -1948,11 +3668,11 @@ void PasswordDatabase::_bw_set_favorites(const QString &conn_str, const QList<En
         emit NotifyProgressUpdated(50, false, task_string);
 
         // Then apply favorites in the order they were given
+        QSqlQuery &q_fav = d->statements->Prepare("UPDATE Entry SET Favorite=? WHERE Id=?");
         for(int i = 0; i < favs.length(); ++i){
-            q.prepare("UPDATE Entry SET Favorite=? WHERE Id=?");
-            q.addBindValue(i + 1);
-            q.addBindValue((QByteArray)favs[i]);
-            DatabaseUtils::ExecuteQuery(q);
+            q_fav.bindValue(0, i + 1);
+            q_fav.bindValue(1, (QByteArray)favs[i]);
+            __execute_query(q_fav);
         }
     }
     catch(...){
@@ -1971,7 +3691,7 @@ void PasswordDatabase::_bw_add_favorite(const QString &conn_str, const EntryId &
     QSqlQuery q(QSqlDatabase::database(conn_str));
     q.prepare("SELECT Favorite FROM Entry WHERE ID=?");
     q.addBindValue((QByteArray)id);
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
     if(!q.next())
         return;
 
@@ -1980,12 +3700,13 @@ void PasswordDatabase::_bw_add_favorite(const QString &conn_str, const EntryId &
     if(0 > q.value(0).toInt()){
         q.prepare("UPDATE Entry SET Favorite=0 WHERE ID=?");
         q.addBindValue((QByteArray)id);
-        DatabaseUtils::ExecuteQuery(q);
+        __execute_query(q);
     }
 }
 
 void PasswordDatabase::_bw_remove_favorite(const QString &conn_str, const EntryId &id)
 {
+    G_D;
     QString task_string = tr("Removing favorite");
     emit NotifyProgressUpdated(0, false, task_string);
     finally([&]{ emit NotifyProgressUpdated(100, false, task_string); });
@@ -2002,17 +3723,16 @@ void PasswordDatabase::_bw_remove_favorite(const QString &conn_str, const EntryI
         if(0 != ec.favoriteindex){
             q.prepare("SELECT ID FROM Entry WHERE Favorite>? ORDER BY Favorite ASC");
             q.addBindValue(ec.favoriteindex);
-            DatabaseUtils::ExecuteQuery(q);
+            __execute_query(q);
 
             emit NotifyProgressUpdated(10, false, task_string);
 
             int ctr = 0;
-            QSqlQuery q2(db);
+            QSqlQuery &q2 = d->statements->Prepare("UPDATE Entry SET Favorite=? WHERE ID=?");
             while(q.next()){
-                q2.prepare("UPDATE Entry SET Favorite=? WHERE ID=?");
-                q2.addBindValue(ec.favoriteindex + ctr);
-                q2.addBindValue(q.value("ID").toByteArray());
-                DatabaseUtils::ExecuteQuery(q2);
+                q2.bindValue(0, ec.favoriteindex + ctr);
+                q2.bindValue(1, q.value("ID").toByteArray());
+                __execute_query(q2);
                 ctr++;
             }
         }
@@ -2020,7 +3740,7 @@ void PasswordDatabase::_bw_remove_favorite(const QString &conn_str, const EntryI
 
         q.prepare("UPDATE Entry SET Favorite=-1 WHERE ID=?");
         q.addBindValue((QByteArray)id);
-        DatabaseUtils::ExecuteQuery(q);
+        __execute_query(q);
     }
     catch(...){
         db.rollback();
@@ -2035,6 +3755,8 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
     QList<EntryId> deleted_entries;
     QList<FileId> deleted_files;
     QList<EntryId> sorted_favorites;
+    QHash<EntryId, int> renumbered_favorites;
+    EntryChangeSet changes;
 
     QSqlDatabase db(QSqlDatabase::database(conn_str));
     db.transaction();
@@ -2042,6 +3764,7 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
     {
         struct entry_row{
             EntryId id;
+            EntryId parent_id;
             FileId file_id;
             int favorite;
         };
@@ -2060,7 +3783,7 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
             EntryId pid = q.value("ParentID").toByteArray();
             FileId  fid = q.value("FileID").toByteArray();
             int     fav = q.value("Favorite").toInt();
-            entries.insert(eid, {eid, fid, fav});
+            entries.insert(eid, {eid, pid, fid, fav});
             parent_index[pid].insert(eid);
             if(0 <= fav)
                 favorites.insert(eid);
@@ -2091,9 +3814,10 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
             if(!claimed_entries.contains(eid)){
                 q.prepare("DELETE FROM Entry WHERE ID=?");
                 q.addBindValue((QByteArray)eid);
-                DatabaseUtils::ExecuteQuery(q);
+                __execute_query(q);
 
                 deleted_entries.append(eid);
+                changes.Removed.append(EntryChange(eid, entries[eid].parent_id));
                 if(0 <= entries[eid].favorite)
                     favorites.remove(eid);
             }
@@ -2114,7 +3838,8 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
                     q.prepare("UPDATE Entry SET Favorite=? WHERE ID=?");
                     q.addBindValue(cur_fav);
                     q.addBindValue((QByteArray)eid);
-                    DatabaseUtils::ExecuteQuery(q);
+                    __execute_query(q);
+                    renumbered_favorites.insert(eid, cur_fav);
                 }
                 cur_fav++;
             }
@@ -2128,7 +3853,7 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
             if(!claimed_files.contains(fid)){
                 q.prepare("DELETE FROM File WHERE ID=?");
                 q.addBindValue((QByteArray)fid);
-                DatabaseUtils::ExecuteQuery(q);
+                __execute_query(q);
                 deleted_files.append(fid);
             }
         }
@@ -2145,11 +3870,18 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
     db.commit();
 
     // Update the index:
-    lock_guard<mutex> lkr(d->index_lock);
+    unique_lock<mutex> lkr(d->index_lock);
     for(const EntryId &eid : deleted_entries){
-        d->index.remove(eid);
+        __index_remove(d, eid);
         d->parent_index.remove(eid);
     }
+    for(auto iter = renumbered_favorites.begin(); iter != renumbered_favorites.end(); ++iter){
+        auto ec = d->index.find(iter.key());
+        if(ec != d->index.end()){
+            ec->favoriteindex = iter.value();
+            changes.Updated.append(EntryChange(ec->id, ec->parentid, ec->row));
+        }
+    }
     for(const FileId &fid : deleted_files){
         d->file_index.remove(fid);
     }
@@ -2160,6 +3892,10 @@ void PasswordDatabase::_bw_dispatch_orphans(const QString &conn_str)
     d->deleted_entries.clear();
     d->favorite_index = sorted_favorites;
     d->wc_index.notify_all();
+    lkr.unlock();
+
+    if(!changes.IsEmpty())
+        emit NotifyEntriesChanged(changes);
 }
 
 
@@ -2169,6 +3905,8 @@ void PasswordDatabase::_background_worker(GUtil::CryptoPP::Cryptor *c)
     // We will delete the cryptor
     SmartPointer<GUtil::CryptoPP::Cryptor> bgCryptor(c);
     const QString conn_str = __create_connection(m_filepath);
+    d->statements.reset(new SqlStatementCache(conn_str));
+    Tracer::SetThreadName("Background worker");
 
     unique_lock<mutex> lkr(d->thread_lock);
     while(!d->closing)
@@ -2200,8 +3938,13 @@ void PasswordDatabase::_background_worker(GUtil::CryptoPP::Cryptor *c)
                 continue;
 
             lkr.unlock();
+            const quint64 wait_us = __microseconds_since(cmd->QueuedAt);
+            const chrono::steady_clock::time_point started = chrono::steady_clock::now();
+            bool failed = false;
             try
             {
+                TraceSpan span("worker", BG_COMMAND_NAMES[cmd->CommandType]);
+
                 // Process the command (long task)
                 switch(cmd->CommandType)
                 {
@@ -2211,6 +3954,18 @@ void PasswordDatabase::_background_worker(GUtil::CryptoPP::Cryptor *c)
                     _bw_add_entry(conn_str, aec->entry);
                 }
                     break;
+                case bg_worker_command::AddEntries:
+                {
+                    add_entries_command *aec = static_cast<add_entries_command *>(cmd.Data());
+                    _bw_add_entries(conn_str, aec->entries);
+                }
+                    break;
+                case bg_worker_command::ApplyChanges:
+                {
+                    apply_changes_command *acc = static_cast<apply_changes_command *>(cmd.Data());
+                    _bw_apply_changes(conn_str, acc->Added, acc->Updated, acc->Deleted);
+                }
+                    break;
                 case bg_worker_command::EditEntry:
                 {
                     update_entry_command *uec = static_cast<update_entry_command *>(cmd.Data());
@@ -2317,12 +4072,18 @@ void PasswordDatabase::_background_worker(GUtil::CryptoPP::Cryptor *c)
 //                                             });
             }
             catch(const GUtil::Exception<> &ex){
+                failed = true;
                 _convert_to_readonly_exception_and_notify(ex);
             }
-            catch(...) {}
+            catch(...) { failed = true; }
+            d->metrics.RecordCommand(cmd->CommandType, wait_us,
+                                     __microseconds_since(started), failed);
             lkr.lock();
         }
     }
+
+    // The statements have to go before the connection does
+    d->statements.reset();
     QSqlDatabase::removeDatabase(conn_str);
     d->thread_idle = true;
 }
@@ -2399,8 +4160,11 @@ void PasswordDatabase::_bw_add_file(const QString &conn_str,
             m_progressMin = 0, m_progressMax = 75;
             m_curTaskString = QString("Download and encrypt file");
             d->thread_cancellable = true;
+            GRYPTO_TRACE_SCOPE("crypto", "EncryptFile");
+            const chrono::steady_clock::time_point started = chrono::steady_clock::now();
             cryptor.EncryptData(&o, data_in, NULL, NULL, DEFAULT_CHUNK_SIZE,
                                 [&](int p){ return _progress_callback(p); });
+            d->metrics.RecordEncryption(plaintext_length, __microseconds_since(started));
         }
 
         _bw_fail_if_cancelled();
@@ -2414,7 +4178,7 @@ void PasswordDatabase::_bw_add_file(const QString &conn_str,
         q.addBindValue(plaintext_length);
         q.addBindValue(encrypted_data);
         q.addBindValue((QByteArray)id);
-        DatabaseUtils::ExecuteQuery(q);
+        __execute_query(q);
 
         // One last chance before we commit
         emit NotifyProgressUpdated(m_progressMax + 10, true, m_curTaskString);
@@ -2452,7 +4216,7 @@ void PasswordDatabase::_bw_exp_file(const QString &conn_str,
     // First fetch the file from the database
     q.prepare("SELECT Data FROM File WHERE ID=?");
     q.addBindValue((QByteArray)id);
-    DatabaseUtils::ExecuteQuery(q);
+    __execute_query(q);
 
     if(!q.next())
         throw Exception<>("File ID not found");
@@ -2471,8 +4235,11 @@ void PasswordDatabase::_bw_exp_file(const QString &conn_str,
 
         m_progressMin = 35, m_progressMax = 100;
         d->thread_cancellable = true;
+        GRYPTO_TRACE_SCOPE("crypto", "DecryptFile");
+        const chrono::steady_clock::time_point started = chrono::steady_clock::now();
         cryptor.DecryptData(&fio, &i, NULL, DEFAULT_CHUNK_SIZE,
                             [&](int p){ return _progress_callback(p); });
+        d->metrics.RecordDecryption(f.size(), __microseconds_since(started));
     }
 }
 
@@ -2481,16 +4248,17 @@ void PasswordDatabase::_bw_del_file(const QString &conn_str, const FileId &id)
     __delete_file_by_id(conn_str, id);
 }
 
-static void __append_children_to_xml(QDomDocument &xdoc, QDomNode &n,
-                                     QSqlQuery &q,
-                                     GUtil::CryptoPP::Cryptor &cryptor,
-                                     const EntryId &eid)
+// Writes the children of the entry to the stream, depth first
+static void __write_children_to_xml(QXmlStreamWriter &sw,
+                                    QSqlQuery &q,
+                                    GUtil::CryptoPP::Cryptor &cryptor,
+                                    const EntryId &eid)
 {
-    // Find my children and add them to xml
     QList<Entry> child_list = __find_entries_by_parent_id(q, cryptor, eid);
     foreach(const Entry &e, child_list){
-        QDomNode new_node = XmlConverter::AppendToXmlNode(e, n, xdoc, true);
-        __append_children_to_xml(xdoc, new_node, q, cryptor, e.GetId());
+        XmlConverter::WriteStartElement(e, sw, true);
+        __write_children_to_xml(sw, q, cryptor, e.GetId());
+        sw.writeEndElement();
     }
 }
 
@@ -2499,6 +4267,7 @@ void PasswordDatabase::_bw_export_to_gps(const QString &conn_str,
                                          const QString &ps_filepath,
                                          const Credentials &creds)
 {
+    G_D;
     int progress_counter = 0;
     m_curTaskString = QString(tr("Exporting to Portable Safe: %1"))
                             .arg(QFileInfo(ps_filepath).fileName());
@@ -2517,10 +4286,16 @@ void PasswordDatabase::_bw_export_to_gps(const QString &conn_str,
     try{
         emit NotifyProgressUpdated(progress_counter+=5, true, m_curTaskString);
 
-        // First get the main payload: the entire entry structure in XML
-        QDomDocument xdoc;
-        QDomNode root = xdoc.appendChild(xdoc.createElement("Grypto_XML"));
-        __append_children_to_xml(xdoc, root, q, my_cryptor, EntryId::Null());
+        // First get the main payload: the entire entry structure in XML. We
+        //  write it straight out as we go, rather than building a document
+        QByteArray xml;
+        {
+            GRYPTO_TRACE_SCOPE("xml", "Serialize");
+            QXmlStreamWriter sw(&xml);
+            sw.writeStartElement("Grypto_XML");
+            __write_children_to_xml(sw, q, my_cryptor, EntryId::Null());
+            sw.writeEndElement();
+        }
 
         emit NotifyProgressUpdated(progress_counter+=15, true, m_curTaskString);
         _bw_fail_if_cancelled();
@@ -2532,52 +4307,57 @@ void PasswordDatabase::_bw_export_to_gps(const QString &conn_str,
 
         // Compress the entry data and write it as the main payload
         {
-            const QByteArray xml_compressed(qCompress(xdoc.toByteArray(-1), 9));
+            GRYPTO_TRACE_SCOPE("xml", "Compress");
+            const QByteArray xml_compressed(qCompress(xml, 9));
+            xml.clear();
             gps_file.AppendPayload((byte const *)xml_compressed.constData(),
                                    xml_compressed.length());
         }
         emit NotifyProgressUpdated(progress_counter+=10, true, m_curTaskString);
         _bw_fail_if_cancelled();
 
-        // Now let's export all the files as attachments
+        // Now let's export all the files as attachments. They're decrypted on
+        //  a few threads at once, and we write them in order as they finish.
+        //  The pool only holds a few of them, so big vaults don't fill memory.
         int file_cnt = 0;
         const int remaining_progress = 100 - progress_counter;
-        const QHash<FileId, FileInfo_t> files = QueryFileSummary();
-        for(const FileId &fid : files.keys())
-        {
-            // Select a file from the database
-            q.prepare("SELECT Data FROM File WHERE ID=?");
-            q.addBindValue((QByteArray)fid);
-            DatabaseUtils::ExecuteQuery(q);
-            _bw_fail_if_cancelled();
-
-            if(!q.next())
-                continue;
-
-            // Decrypt it in memory
-            Vector<byte> pt;
-            {
-                const QByteArray ct(q.record().value(0).toByteArray());
-                pt.ReserveExactly(ct.length() -
-                                  (my_cryptor.GetNonceSize() +
-                                   my_cryptor.TagLength));
-                QByteArrayInput i(ct);
-                VectorByteArrayOutput o(pt);
-                my_cryptor.DecryptData(&o, &i);
-            }
-            _bw_fail_if_cancelled();
+        const QList<FileId> file_ids = QueryFileSummary().keys();
+        FileCryptoPool pool(my_cryptor, FileCryptoPool::Decrypt);
+        auto write_next_file = [&]{
+            const FileCryptoJob job = pool.Pop();
+            d->metrics.RecordDecryption(job.PlaintextLength, job.Microseconds);
 
             // Write it to the GPS, with the file ID in the metadata
-            gps_file.AppendPayload((byte const *)pt.ConstData(), pt.Length(),
-                                   (byte const *)fid.ConstData(), fid.Size);
+            gps_file.AppendPayload((byte const *)job.Output.constData(), job.Output.length(),
+                                   (byte const *)job.Tag.constData(), job.Tag.length());
 
             ++file_cnt;
             emit NotifyProgressUpdated(
-                        progress_counter + (remaining_progress*((float)file_cnt/files.size())),
+                        progress_counter + (remaining_progress*((float)file_cnt/file_ids.size())),
                         true,
                         m_curTaskString);
             _bw_fail_if_cancelled();
+        };
+
+        q.prepare("SELECT Data FROM File WHERE ID=?");
+        for(const FileId &fid : file_ids)
+        {
+            while(pool.IsFull())
+                write_next_file();
+
+            // Select a file from the database
+            q.bindValue(0, (QByteArray)fid);
+            __execute_query(q);
+            _bw_fail_if_cancelled();
+
+            if(!q.next())
+                continue;
+
+            pool.Push((QByteArray)fid, q.record().value(0).toByteArray());
+            q.finish();
         }
+        while(!pool.IsEmpty())
+            write_next_file();
     }
     catch(...){
         db.rollback();
@@ -2586,43 +4366,259 @@ void PasswordDatabase::_bw_export_to_gps(const QString &conn_str,
     __commit_transaction(db);    // Nothing should have changed, is a rollback better here?
 }
 
+// Adds imported entries and files to the index and returns the changes to
+//  report, parents first. The entries are keyed by a local id which the
+//  hierarchy refers to, and the root of the import is -1.
+static EntryChangeSet __index_imported_entries(d_t *d,
+                                               const QHash<int, entry_cache> &entry_caches,
+                                               const QHash<int, QList<int>> &hierarchy,
+                                               const QList<file_cache> &files)
+{
+    unique_lock<mutex> lkr(d->index_lock);
+    for(const entry_cache &ec : entry_caches.values()){
+        GASSERT(d->index.find(ec.id) == d->index.end());
+        __index_insert(d, ec);
+
+        // We should have cleared the ordering of imported favorites
+        GASSERT(0 >= ec.favoriteindex);
+        if(0 <= ec.favoriteindex)
+            d->favorite_index.append(ec.id);
+    }
+
+    // Populate the parent index now that all keys are inserted
+    function<void(int)> populate_parent_index;
+    populate_parent_index = [&](int local_pid){
+        for(int cid : hierarchy[local_pid])
+        {
+            d->parent_index[entry_caches[local_pid].id]
+                    .children.append(entry_caches[cid].id);
+
+            if(hierarchy.contains(cid))
+                populate_parent_index(cid);
+        }
+    };
+    d->parent_index[EntryId::Null()].children.append(entry_caches[-1].id);
+    populate_parent_index(-1);
+
+    // Finally update the file index
+    for(const file_cache &fc : files)
+        d->file_index.insert(fc.id, fc);
+
+    d->wc_index.notify_all();
+    lkr.unlock();
+
+    EntryChangeSet changes;
+    function<void(int)> add_changes;
+    add_changes = [&](int local_id){
+        const entry_cache &ec = entry_caches[local_id];
+        changes.Added.append(EntryChange(ec.id, ec.parentid, ec.row));
+        for(int cid : hierarchy.value(local_id))
+            add_changes(cid);
+    };
+    add_changes(-1);
+    return changes;
+}
+
+// Reads the entries from the main payload of a Portable Safe, as written by
+//  __write_children_to_xml. They're given local ids in document order, and
+//  the top level entries are the children of -1.
+static void __parse_gps_entries(QXmlStreamReader &sr,
+                                QList<Entry> &entries,
+                                QHash<int, QList<int>> &hierarchy)
+{
+    GRYPTO_TRACE_SCOPE("xml", "ParseEntries");
+    QList<int> open_entries;
+    while(!sr.atEnd()){
+        switch(sr.readNext()){
+        case QXmlStreamReader::StartElement:
+            if(sr.name() == "entry"){
+                hierarchy[open_entries.isEmpty() ? -1 : open_entries.last()]
+                        .append(entries.length());
+                open_entries.append(entries.length());
+                entries.append(XmlConverter::ReadStartElement<Entry>(sr));
+            }
+            else if(sr.name() == "value" && !open_entries.isEmpty()){
+                entries[open_entries.last()].Values()
+                        .append(XmlConverter::ReadStartElement<SecretValue>(sr));
+            }
+            break;
+        case QXmlStreamReader::EndElement:
+            if(sr.name() == "entry")
+                open_entries.removeLast();
+            break;
+        default:
+            break;
+        }
+    }
+    if(sr.hasError())
+        throw Exception<>(QString("XML has errors: %1").arg(sr.errorString()).toUtf8());
+}
+
 void PasswordDatabase::_bw_import_from_gps(const QString &conn_str,
-                                           GUtil::CryptoPP::Cryptor &,
+                                           GUtil::CryptoPP::Cryptor &my_cryptor,
                                            const QString &ps_filepath,
                                            const Credentials &creds)
 {
+    G_D;
     int progress_counter = 0;
-    m_curTaskString = QString(tr("Importing from Portable Safe: %1"))
-                            .arg(QFileInfo(ps_filepath).fileName());
+    const QString file_name = QFileInfo(ps_filepath).fileName();
+    m_curTaskString = QString(tr("Importing from Portable Safe: %1")).arg(file_name);
     emit NotifyProgressUpdated(progress_counter, true, m_curTaskString);
 
     // Always notify that the task is complete, even if it's an error
     finally([&]{ emit NotifyProgressUpdated(100, false, m_curTaskString); });
 
-    QSqlDatabase db(QSqlDatabase::database(conn_str));
-    GASSERT(db.isValid());
-    QSqlQuery q(db);
-
     GPSFile_Import gps_import(ps_filepath.toUtf8(), creds, true);
     if(!gps_import.NextPayload())
         throw Exception<>("GPS file is empty");
 
-    // Get the main payload, which has all the entries
-    QByteArray ba;
-    ba.resize(gps_import.CurrentPayloadSize());
-    gps_import.GetCurrentPayload((byte *)ba.data());
+    // Get the main payload, which has all the entries, and parse it as a
+    //  stream so we never have the whole document in memory
+    QList<Entry> entries;
+    QHash<int, QList<int>> hierarchy;
+    {
+        QByteArray ba;
+        ba.resize(gps_import.CurrentPayloadSize());
+        gps_import.GetCurrentPayload((byte *)ba.data());
+        ba = qUncompress(ba);
 
-    // Decompress the xml data
-    ba = qUncompress(ba);
+        QXmlStreamReader sr(ba);
+        __parse_gps_entries(sr, entries, hierarchy);
+    }
+    emit NotifyProgressUpdated(progress_counter+=10, true, m_curTaskString);
+    _bw_fail_if_cancelled();
 
-    QDomDocument xdoc;
-    xdoc.setContent(ba);
+    // The files get new ids, so they can't collide with the ones we have
+    QHash<FileId, file_cache> file_mapping;
+    for(Entry &e : entries){
+        if(e.GetFileId().IsNull())
+            continue;
+        auto iter = file_mapping.find(e.GetFileId());
+        if(iter == file_mapping.end())
+            iter = file_mapping.insert(e.GetFileId(), file_cache(FileId::NewId()));
+        e.SetFileId(iter->id);
+    }
 
     // Add a root node, under which to put the imported data
     Entry tmp_root;
+    tmp_root.SetId(EntryId::NewId());
     tmp_root.SetName(tr("Newly imported entries"));
-    tmp_root.SetDescription(QString(tr("Imported from GPS file: %1")).arg(ps_filepath));
-    AddEntry(tmp_root);
+    tmp_root.SetDescription(QString(tr("Imported from GPS file: %1")).arg(file_name));
+    tmp_root.SetModifyDate(QDateTime::currentDateTime());
+
+    QSqlDatabase db(QSqlDatabase::database(conn_str));
+    GASSERT(db.isValid());
+    QHash<int, entry_cache> entry_caches;
+    QList<file_cache> imported_files;
+
+    // Everything goes in one transaction, so we either import it all or nothing
+    db.transaction();
+    try
+    {
+        QSqlQuery q(db);
+        tmp_root.SetRow(__count_entries_by_parent_id(q, EntryId::Null()));
+        entry_caches.insert(-1, __convert_entry_to_cache(tmp_root, my_cryptor));
+
+        // Give the entries their ids parents first, then encrypt them on the
+        //  pool and insert them in the same order as they come back
+        QList<int> ordered_ids;
+        function<void(int, const EntryId &)> assign_ids;
+        assign_ids = [&](int local_pid, const EntryId &pid){
+            const QList<int> child_ids = hierarchy.value(local_pid);
+            for(int i = 0; i < child_ids.length(); ++i){
+                Entry &e = entries[child_ids[i]];
+                e.SetId(EntryId::NewId());
+                e.SetParentId(pid);
+                e.SetRow(i);
+                if(e.IsFavorite()){
+                    // Imported favorites lose their ordering
+                    e.SetFavoriteIndex(0);
+                }
+                ordered_ids.append(child_ids[i]);
+                assign_ids(child_ids[i], e.GetId());
+            }
+        };
+        assign_ids(-1, tmp_root.GetId());
+
+        __prepare_entry_insert(q);
+        __exec_entry_insert(entry_caches[-1], q);
+        {
+            FileCryptoPool pool(my_cryptor, FileCryptoPool::Encrypt);
+            auto insert_next_entry = [&]{
+                const FileCryptoJob job = pool.Pop();
+                const int local_id = job.Tag.toInt();
+                entry_cache ec(entries[local_id]);
+                ec.crypttext = job.Output;
+                __exec_entry_insert(ec, q);
+                entry_caches.insert(local_id, ec);
+            };
+            for(int local_id : ordered_ids){
+                while(pool.IsFull())
+                    insert_next_entry();
+                pool.Push(QByteArray::number(local_id),
+                          XmlConverter::ToXmlString(entries[local_id]));
+            }
+            while(!pool.IsEmpty())
+                insert_next_entry();
+        }
+        entries.clear();
+        emit NotifyProgressUpdated(progress_counter+=20, true, m_curTaskString);
+        _bw_fail_if_cancelled();
+
+        // The rest of the payloads are the files, with the file id in the
+        //  metadata. We read them one at a time and encrypt them on the pool,
+        //  which only holds a few at once.
+        int file_cnt = 0;
+        const int remaining_progress = 100 - progress_counter;
+        QSqlQuery fq(db);
+        fq.prepare("INSERT INTO File (Length,Data,ID) VALUES (?,?,?)");
+        FileCryptoPool pool(my_cryptor, FileCryptoPool::Encrypt);
+        auto insert_next_file = [&]{
+            const FileCryptoJob job = pool.Pop();
+            d->metrics.RecordEncryption(job.PlaintextLength, job.Microseconds);
+
+            file_cache &fc = file_mapping[FileId(job.Tag)];
+            fc.length = job.PlaintextLength;
+            fq.bindValue(0, fc.length);
+            fq.bindValue(1, job.Output);
+            fq.bindValue(2, (QByteArray)fc.id);
+            __execute_query(fq);
+            imported_files.append(fc);
+
+            ++file_cnt;
+            emit NotifyProgressUpdated(
+                        progress_counter + (remaining_progress*((float)file_cnt/qMax(1, file_mapping.size()))),
+                        true,
+                        m_curTaskString);
+            _bw_fail_if_cancelled();
+        };
+        while(gps_import.NextPayload()){
+            QByteArray old_id(FileId::Size, 0);
+            gps_import.GetCurrentUserData((byte *)old_id.data());
+
+            // Nothing refers to this file, so it would just be an orphan
+            if(!file_mapping.contains(FileId(old_id)))
+                continue;
+
+            QByteArray data;
+            data.resize(gps_import.CurrentPayloadSize());
+            gps_import.GetCurrentPayload((byte *)data.data());
+
+            while(pool.IsFull())
+                insert_next_file();
+            pool.Push(old_id, data);
+        }
+        while(!pool.IsEmpty())
+            insert_next_file();
+    }
+    catch(...)
+    {
+        db.rollback();
+        throw;
+    }
+    __commit_transaction(db);
+
+    emit NotifyEntriesChanged(__index_imported_entries(d, entry_caches, hierarchy, imported_files));
 }
 
 static void __write_entry_to_xml_writer(QXmlStreamWriter &sw, const Entry &e,
@@ -2697,7 +4693,6 @@ void PasswordDatabase::_bw_export_to_xml(const QString &conn_str, GUtil::CryptoP
         QHash<EntryId, int> entry_mapping;
         QSet<FileId> referenced_files;
         QList<entry_cache> entries;
-        QHash<EntryId, parent_cache> parent_index_cpy;
 
         // Define a helper function for recursively adding entries
         int tmpid = 0;
@@ -2722,7 +4717,6 @@ void PasswordDatabase::_bw_export_to_xml(const QString &conn_str, GUtil::CryptoP
         tmpid = 0;
         for(const FileId &fid : d->file_index.keys())
             file_mapping.insert(fid, tmpid++);
-        parent_index_cpy = d->parent_index;
         d->index_lock.unlock();
 
         // Write all entries in no particular order
@@ -2737,37 +4731,27 @@ void PasswordDatabase::_bw_export_to_xml(const QString &conn_str, GUtil::CryptoP
 
         // Write the files
         if(0 < referenced_files.count()){
+            QSqlDatabase db(QSqlDatabase::database(conn_str));
             sw.writeStartElement("files");
             for(const FileId &fid : referenced_files){
                 sw.writeStartElement("f");
                 sw.writeAttribute("id", QVariant(file_mapping[fid]).toString());
 
-                // Export the file to a temp file, then read in the temp file and add it to xml
-                QTemporaryFile tf;
-                if(!tf.open())
-                    throw Exception<>(QString(tr("Cannot open temp file: %1")).arg(tf.errorString()).toUtf8());
+                sw.writeAttribute("comp", "2");
 
-                _bw_exp_file(conn_str, my_cryptor, fid, tf.fileName().toUtf8());
-                QByteArray file_data;
-                bool compressed = false;
+                // Decrypt the file straight from the database into the XML,
+                //  a chunk at a time
                 {
-                    QFile f(tf.fileName());
-                    f.open(QFile::ReadOnly);
-                    file_data = f.readAll();
-
-                    // Try compressing it to see if it gets smaller
-                    QByteArray file_data_comp = qCompress(file_data, 9);
-                    if(file_data_comp.length() < file_data.length()){
-                        file_data = file_data_comp;
-                        compressed = true;
-                    }
+                    GRYPTO_TRACE_SCOPE("crypto", "DecryptFile");
+                    FileBlobInput i(db, fid);
+                    XmlFileOutput o(sw);
+                    const chrono::steady_clock::time_point started = chrono::steady_clock::now();
+                    my_cryptor.DecryptData(&o, &i, NULL, DEFAULT_CHUNK_SIZE);
+                    o.Finish();
+                    d->metrics.RecordDecryption(i.Length() - my_cryptor.GetCrypttextSizeDiff(),
+                                                __microseconds_since(started));
                 }
-                tf.remove();
-
-                if(compressed)
-                    sw.writeAttribute("comp", "1");
-
-                sw.writeCharacters(file_data.toBase64());
+                _bw_fail_if_cancelled();
                 sw.writeEndElement();
             }
             sw.writeEndElement();
@@ -2781,47 +4765,33 @@ void PasswordDatabase::_bw_export_to_xml(const QString &conn_str, GUtil::CryptoP
     }
 }
 
-static void __parse_xml_entries(QXmlStreamReader &sr,
-                                QHash<int, Entry> &entries,
-                                QHash<int, QList<int>> &hierarchy,
-                                QHash<int, file_cache> &file_mapping)
+// Reads the "e" element the stream is on, up to its end element
+static Entry __read_xml_entry(QXmlStreamReader &sr,
+                              int &local_id, int &local_pid, int &local_fid)
 {
+    Entry ret;
+    const QXmlStreamAttributes attrs = sr.attributes();
+    ret.SetName(attrs.value("name").toString());
+    if(attrs.hasAttribute("desc"))
+        ret.SetDescription(attrs.value("desc").toString());
+    ret.SetModifyDate(QDateTime::fromString(attrs.value("date").toString()));
+    if(attrs.hasAttribute("fav"))
+        ret.SetFavoriteIndex(attrs.value("fav").toInt());
+    local_fid = -1;
+    if(attrs.hasAttribute("fid")){
+        ret.SetFileName(attrs.value("fname").toString());
+        local_fid = attrs.value("fid").toInt();
+    }
+    local_id = attrs.value("id").toInt();
+    local_pid = attrs.hasAttribute("pid") ? attrs.value("pid").toInt() : -1;
+    ret.SetRow(attrs.value("row").toInt());
+
     int depth = 0;
-    int cur_id = -1;
-    Entry tmp_entry;
-    while(0 <= depth){
+    while(0 <= depth && !sr.atEnd()){
         switch(sr.readNext()){
         case QXmlStreamReader::StartElement:
             depth++;
-            if(sr.name() == "e"){
-                tmp_entry.SetName(sr.attributes().value("name").toString());
-                if(sr.attributes().hasAttribute("desc"))
-                    tmp_entry.SetDescription(sr.attributes().value("desc").toString());
-                tmp_entry.SetModifyDate(QDateTime::fromString(sr.attributes().value("date").toString()));
-                if(sr.attributes().hasAttribute("fav"))
-                    tmp_entry.SetFavoriteIndex(sr.attributes().value("fav").toInt());
-                if(sr.attributes().hasAttribute("fid")){
-                    tmp_entry.SetFileName(sr.attributes().value("fname").toString());
-
-                    int fid_local = sr.attributes().value("fid").toInt();
-                    if(file_mapping.contains(fid_local)){
-                        tmp_entry.SetFileId(file_mapping[fid_local].id);
-                    }
-                    else{
-                        FileId fid(true);
-                        file_mapping.insert(fid_local, fid);
-                        tmp_entry.SetFileId(fid);
-                    }
-                }
-                cur_id = sr.attributes().value("id").toInt();
-                tmp_entry.SetRow(sr.attributes().value("row").toInt());
-
-                int pid = -1;
-                if(sr.attributes().hasAttribute("pid"))
-                    pid = sr.attributes().value("pid").toInt();
-                hierarchy[pid].append(cur_id);
-            }
-            else if(sr.name() == "s"){
+            if(sr.name() == "s"){
                 SecretValue sv;
                 sv.SetName(sr.attributes().value("key").toString());
                 sv.SetValue(sr.attributes().value("val").toString());
@@ -2829,272 +4799,249 @@ static void __parse_xml_entries(QXmlStreamReader &sr,
                     sv.SetNotes(sr.attributes().value("note").toString());
                 if(sr.attributes().hasAttribute("hide"))
                     sv.SetIsHidden(0 != sr.attributes().value("hide").toInt());
-                tmp_entry.Values().append(sv);
+                ret.Values().append(sv);
             }
             break;
         case QXmlStreamReader::EndElement:
             depth--;
-            if(0 == depth){
-                entries.insert(cur_id, tmp_entry);
-
-                tmp_entry = Entry();
-                cur_id = -1;
-            }
             break;
         default:
             break;
         }
     }
-}
-
-static void __parse_xml_files(QXmlStreamReader &sr, QHash<int, QString> &files)
-{
-    int depth = 0;
-    int cur_id = -1;
-    bool compressed = false;
-    QString cur_path;
-    while(0 <= depth){
-        switch(sr.readNext()){
-        case QXmlStreamReader::StartElement:
-            depth++;
-            if(sr.name() == "f"){
-                cur_id = sr.attributes().value("id").toInt();
-                if(sr.attributes().hasAttribute("comp"))
-                    compressed = (0 != sr.attributes().value("comp").toInt());
-            }
-            break;
-        case QXmlStreamReader::Characters:
-            if(cur_id != -1)
-            {
-                QTemporaryFile tf;
-                tf.setAutoRemove(false);
-                if(!tf.open())
-                    throw Exception<>("Cannot open temporary file");
-
-                cur_path = tf.fileName();
-                QByteArray data = QByteArray::fromBase64(sr.text().toLatin1());
-                if(compressed)
-                    data = qUncompress(data);
-                tf.write(data);
-            }
-            break;
-        case QXmlStreamReader::EndElement:
-            depth--;
-            if(0 == depth){
-                files.insert(cur_id, cur_path);
-                cur_id = -1;
-                compressed = false;
-                cur_path.clear();
-            }
-            break;
-        default:
-            break;
-        }
-    }
-}
-
-// Adds the children of the given parent to the database recursively
-static void __add_children_from_xml(
-        QHash<int, Entry> &entries,
-        QHash<int, entry_cache> &entry_caches,
-        const QHash<int, QList<int>> &hierarchy,
-        const EntryId &parent_id,
-        int local_parent_id,
-        GUtil::CryptoPP::Cryptor &cryptor,
-        QSqlQuery &q)
-{
-    const QList<int> &child_ids = hierarchy[local_parent_id];
-    for(int i = 0; i < child_ids.length(); ++i){
-        Entry &e = entries[child_ids[i]];
-        e.SetId(EntryId::NewId());
-        e.SetParentId(parent_id);
-        e.SetRow(i);
-        if(e.IsFavorite()){
-            // Imported favorites lose their ordering
-            e.SetFavoriteIndex(0);
-        }
-
-        auto iter = entry_caches.insert(child_ids[i], __convert_entry_to_cache(e, cryptor));
-        __insert_entry(*iter, q);
-        __add_children_from_xml(entries, entry_caches,
-                                hierarchy,
-                                e.GetId(), child_ids[i],
-                                cryptor, q);
-    }
-}
-
-static void __add_files_from_xml(const QHash<int, QString> &files,
-                                 QHash<int, file_cache> &file_mapping,
-                                 GUtil::CryptoPP::Cryptor &cryptor,
-                                 QSqlQuery &q)
-{
-    for(int fid_local : files.keys()){
-        QByteArray crypttext;
-        {
-            // Encrypt the file and move it into memory
-            QFile f(files[fid_local]);
-            QFileIO fio(f);
-            QByteArrayOutput bao(crypttext);
-            __open_file_or_die(f, QFile::ReadOnly);
-            cryptor.EncryptData(&bao, &fio);
-        }
-
-        int pt_len = crypttext.length() - cryptor.GetCrypttextSizeDiff();
-        file_mapping[fid_local].length = pt_len;
-
-        q.prepare("INSERT INTO File (Length,Data,ID) VALUES (?,?,?)");
-        q.addBindValue(pt_len);
-        q.addBindValue(crypttext);
-        q.addBindValue((QByteArray)file_mapping[fid_local].id);
-        DatabaseUtils::ExecuteQuery(q);
-    }
+    return ret;
 }
 
 void PasswordDatabase::_bw_import_from_xml(const QString &conn_str,
                                            GUtil::CryptoPP::Cryptor &my_cryptor,
                                            const QString &filepath)
 {
+    G_D;
     int progress_counter = 0;
     const QString file_name = QFileInfo(filepath).fileName();
     m_curTaskString = QString(tr("Importing from XML: %1")).arg(file_name);
     emit NotifyProgressUpdated(progress_counter, true, m_curTaskString);
 
+    // Always notify that the task is complete, even if it's an error
+    finally([&]{ emit NotifyProgressUpdated(100, false, m_curTaskString); });
+
     QFile f(filepath);
     if(!f.open(QFile::ReadOnly))
         throw Exception<>(QString(tr("Cannot open \"%1\"\n%2"))
                           .arg(QFileInfo(filepath).absoluteFilePath())
                           .arg(f.errorString()).toUtf8());
 
-    QHash<int, Entry> entries;
-    QHash<int, entry_cache> entry_caches;
-    QHash<int, QList<int>> hierarchy;
-    QHash<int, QString> files;
-    QHash<int, file_cache> file_mapping;
-    bool xml_recognized = false;
+    // Add a root node, under which to put the imported data
+    Entry tmp_root;
+    tmp_root.SetId(EntryId::NewId());
+    tmp_root.SetName(tr("Newly imported entries"));
+    tmp_root.SetDescription(QString(tr("Imported from XML document: %1")).arg(file_name));
+    tmp_root.SetModifyDate(QDateTime::currentDateTime());
 
-    auto throw_xml_format_error = []{
-        throw Exception<>("Unknown XML format");
+    // The XML refers to entries and files by local ids, which may be used
+    //  before they're defined, so we give them their new ids when we first see them
+    QHash<int, EntryId> entry_ids;
+    QHash<int, file_cache> file_mapping;
+    auto entry_id = [&](int local_id) -> EntryId{
+        auto iter = entry_ids.find(local_id);
+        if(iter == entry_ids.end())
+            iter = entry_ids.insert(local_id, EntryId::NewId());
+        return *iter;
+    };
+    auto file_id = [&](int local_id) -> FileId{
+        auto iter = file_mapping.find(local_id);
+        if(iter == file_mapping.end())
+            iter = file_mapping.insert(local_id, file_cache(FileId::NewId()));
+        return iter->id;
     };
 
-    QXmlStreamReader sr(&f);
-    while(!sr.atEnd()){
-        switch(sr.readNext()){
-        case QXmlStreamReader::StartElement:
-            if(sr.name() == "grypto_data"){
-                if(sr.attributes().at(0).value() == GRYPTO_XML_VERSION)
-                    xml_recognized = true;
-                else{
-                    emit NotifyProgressUpdated(100, true, m_curTaskString);
-                    throw_xml_format_error();
-                }
-            }
-            else if(sr.name() == "entries"){
-                if(!xml_recognized)
-                    throw_xml_format_error();
-                __parse_xml_entries(sr, entries, hierarchy, file_mapping);
-            }
-            else if(sr.name() == "files"){
-                if(!xml_recognized)
-                    throw_xml_format_error();
-                __parse_xml_files(sr, files);
-            }
-            break;
-        default:
-            break;
-        }
-    }
-
-    // The hierarchy index child lists are unsorted, so
-    //  sort them by the entrys' rows
-    for(int pid : hierarchy.keys()){
-        QList<int> &child_list = hierarchy[pid];
-        sort(child_list.begin(), child_list.end(),
-          [&](int lhs, int rhs) -> bool{
-            return entries[lhs].GetRow() < entries[rhs].GetRow();
-        });
-
-        // The parent id's could not be resolved earlier, due to the arbitrary
-        //  ordering of the entries in the XML, so set the parent id's now
-        for(int cid : child_list)
-            entries[cid].SetParentId(entries[pid].GetId());
-    }
-
-
-    // Cleanup code should always execute, even in case of exception
-    finally([&]{
-        // Make sure the temp files are cleaned up (no plaintext data left in /tmp)
-        for(const QString &f : files.values())
-            QFile::remove(f);
-
-        emit NotifyProgressUpdated(100, false, m_curTaskString);
-    });
-
-    if(sr.hasError())
-        throw Exception<>(QString(tr("XML has errors: %1").arg(sr.errorString())).toUtf8());
+    QHash<int, entry_cache> entry_caches;
+    QHash<int, QList<int>> hierarchy;
+    QList<file_cache> imported_files;
 
-    // Now update the database
     QSqlDatabase db(QSqlDatabase::database(conn_str));
     GASSERT(db.isValid());
 
+    // It's all one transaction, so a failed import leaves nothing behind
     db.transaction();
     try
     {
         QSqlQuery q(db);
-
-        // Add a root node, under which to put the imported data
-        Entry tmp_root;
-        tmp_root.SetId(EntryId::NewId());
-        tmp_root.SetName(tr("Newly imported entries"));
-        tmp_root.SetDescription(QString(tr("Imported from XML document: %1")).arg(file_name));
-        tmp_root.SetModifyDate(QDateTime::currentDateTime());
         tmp_root.SetRow(__count_entries_by_parent_id(q, EntryId::Null()));
+        entry_caches.insert(-1, __convert_entry_to_cache(tmp_root, my_cryptor));
+        __prepare_entry_insert(q);
+        __exec_entry_insert(entry_caches[-1], q);
+
+        QSqlQuery fq(db);
+        fq.prepare("INSERT INTO File (Length,Data,ID) VALUES (?,?,?)");
+
+        // Entries and files are encrypted on the pool while we parse, and
+        //  inserted in the order we read them. The pool only holds a few at
+        //  once, so memory doesn't grow with the size of the document.
+        FileCryptoPool pool(my_cryptor, FileCryptoPool::Encrypt);
+        auto insert_next = [&]{
+            const FileCryptoJob job = pool.Pop();
+            const int local_id = job.Tag.mid(1).toInt();
+            if('e' == job.Tag[0]){
+                entry_cache &ec = entry_caches[local_id];
+                ec.crypttext = job.Output;
+                __exec_entry_insert(ec, q);
+            }
+            else{
+                d->metrics.RecordEncryption(job.PlaintextLength, job.Microseconds);
+                file_cache &fc = file_mapping[local_id];
+                fc.length = job.PlaintextLength;
+                fq.bindValue(0, fc.length);
+                fq.bindValue(1, job.Output);
+                fq.bindValue(2, (QByteArray)fc.id);
+                __execute_query(fq);
+                imported_files.append(fc);
+            }
+        };
+        auto push = [&](const QByteArray &tag, const QByteArray &data){
+            while(pool.IsFull())
+                insert_next();
+            pool.Push(tag, data);
+        };
+
+        bool xml_recognized = false;
+        auto throw_xml_format_error = []{
+            throw Exception<>("Unknown XML format");
+        };
+        int cur_file = -1;
+        unique_ptr<XmlFileInput> file_input;
+        QSet<int> defined_files;
+
+        QXmlStreamReader sr(&f);
+        while(!sr.atEnd()){
+            switch(sr.readNext()){
+            case QXmlStreamReader::StartElement:
+                if(sr.name() == "grypto_data"){
+                    if(sr.attributes().at(0).value() == GRYPTO_XML_VERSION ||
+                            sr.attributes().at(0).value() == GRYPTO_XML_VERSION_3_0)
+                        xml_recognized = true;
+                    else
+                        throw_xml_format_error();
+                }
+                else if(sr.name() == "e"){
+                    if(!xml_recognized)
+                        throw_xml_format_error();
+
+                    int local_id, local_pid, local_fid;
+                    Entry e = __read_xml_entry(sr, local_id, local_pid, local_fid);
+                    if(entry_caches.contains(local_id))
+                        throw Exception<>(QString("Entry %1 is defined twice").arg(local_id).toUtf8());
+                    e.SetId(entry_id(local_id));
+                    e.SetParentId(-1 == local_pid ? tmp_root.GetId() : entry_id(local_pid));
+                    if(-1 != local_fid)
+                        e.SetFileId(file_id(local_fid));
+                    if(e.IsFavorite()){
+                        // Imported favorites lose their ordering
+                        e.SetFavoriteIndex(0);
+                    }
+
+                    hierarchy[local_pid].append(local_id);
+                    entry_caches.insert(local_id, entry_cache(e));
+                    push("e" + QByteArray::number(local_id), XmlConverter::ToXmlString(e));
+                }
+                else if(sr.name() == "f"){
+                    if(!xml_recognized)
+                        throw_xml_format_error();
+                    cur_file = sr.attributes().value("id").toInt();
+                    file_input.reset(new XmlFileInput(sr.attributes().hasAttribute("comp") ?
+                                                          sr.attributes().value("comp").toInt() : 0));
+                }
+                break;
+            case QXmlStreamReader::Characters:
+                // The reader may give us the text in several pieces
+                if(file_input)
+                    file_input->Append(sr.text());
+                break;
+            case QXmlStreamReader::EndElement:
+                if(sr.name() == "f" && file_input){
+                    file_input->Finish();
+                    if(defined_files.contains(cur_file))
+                        throw Exception<>(QString("File %1 is defined twice").arg(cur_file).toUtf8());
+                    defined_files.insert(cur_file);
+                    file_id(cur_file);
+                    push("f" + QByteArray::number(cur_file), file_input->Data);
+                    file_input.reset();
+                    cur_file = -1;
+
+                    emit NotifyProgressUpdated(90 * f.pos() / qMax<qint64>(1, f.size()),
+                                               true, m_curTaskString);
+                    _bw_fail_if_cancelled();
+                }
+                break;
+            default:
+                break;
+            }
+        }
 
-        auto iter = entry_caches.insert(-1, __convert_entry_to_cache(tmp_root, my_cryptor));
-        __insert_entry(*iter, q);
+        if(sr.hasError())
+            throw Exception<>(QString(tr("XML has errors: %1").arg(sr.errorString())).toUtf8());
+        if(!xml_recognized)
+            throw_xml_format_error();
+
+        // Everything that was referred to must have been defined, or we'd
+        //  insert entries that nothing can reach and references to files
+        //  that don't exist. The transaction rolls it all back.
+        for(int local_pid : hierarchy.keys()){
+            if(!entry_caches.contains(local_pid))
+                throw Exception<>(QString("Parent entry %1 is not defined").arg(local_pid).toUtf8());
+        }
+        for(int local_fid : file_mapping.keys()){
+            if(!defined_files.contains(local_fid))
+                throw Exception<>(QString("File %1 is not defined").arg(local_fid).toUtf8());
+        }
 
-        __add_children_from_xml(entries, entry_caches, hierarchy, tmp_root.GetId(), -1, my_cryptor, q);
-        __add_files_from_xml(files, file_mapping, my_cryptor, q);
+        // Every entry must descend from the import root, which it doesn't
+        //  if the parents go around in a circle
+        int reachable = 0;
+        function<void(int)> count_reachable;
+        count_reachable = [&](int local_pid){
+            for(int cid : hierarchy.value(local_pid)){
+                ++reachable;
+                count_reachable(cid);
+            }
+        };
+        count_reachable(-1);
+        if(reachable != entry_caches.count() - 1)
+            throw Exception<>("The entries' parents go around in a circle");
+
+        while(!pool.IsEmpty())
+            insert_next();
+        emit NotifyProgressUpdated(90, true, m_curTaskString);
+
+        // The entries come in no particular order, so sort the children by
+        //  their rows and fix any rows that don't count up from zero
+        QSqlQuery rq(db);
+        rq.prepare("UPDATE Entry SET Row=? WHERE ID=?");
+        for(auto iter = hierarchy.begin(); iter != hierarchy.end(); ++iter){
+            QList<int> &child_list = iter.value();
+            sort(child_list.begin(), child_list.end(),
+              [&](int lhs, int rhs) -> bool{
+                return entry_caches[lhs].row < entry_caches[rhs].row;
+            });
+            for(int i = 0; i < child_list.length(); ++i){
+                entry_cache &ec = entry_caches[child_list[i]];
+                if(ec.row != i){
+                    ec.row = i;
+                    rq.bindValue(0, i);
+                    rq.bindValue(1, (QByteArray)ec.id);
+                    __execute_query(rq);
+                }
+            }
+        }
     }
     catch(...)
     {
         db.rollback();
         throw;
     }
-    db.commit();
-
-    // Now update the index
-    G_D;
-    unique_lock<mutex> lkr(d->index_lock);
-    for(const entry_cache &ec : entry_caches.values()){
-        GASSERT(d->index.find(ec.id) == d->index.end());
-        d->index.insert(ec.id, ec);
-
-        // We should have cleared the ordering of imported favorites
-        GASSERT(0 >= ec.favoriteindex);
-        if(0 <= ec.favoriteindex)
-            d->favorite_index.append(ec.id);
-    }
-
-    // Populate the parent index now that all keys are inserted
-    function<void(int)> populate_parent_index;
-    populate_parent_index = [&](int local_pid){
-        for(int cid : hierarchy[local_pid])
-        {
-            d->parent_index[entry_caches[local_pid].id]
-                    .children.append(entry_caches[cid].id);
-
-            if(hierarchy.contains(cid))
-                populate_parent_index(cid);
-        }
-    };
-    d->parent_index[EntryId::Null()].children.append(entry_caches[-1].id);
-    populate_parent_index(-1);
-
-    // Finally update the file index
-    for(const file_cache &fc : file_mapping.values())
-        d->file_index.insert(fc.id, fc);
+    __commit_transaction(db);
 
-    d->wc_index.notify_all();
+    emit NotifyEntriesChanged(__index_imported_entries(d, entry_caches, hierarchy, imported_files));
 }
 
 void PasswordDatabase::_bw_check_and_repair(const QString &conn_str, GUtil::CryptoPP::Cryptor&)
@@ -3149,7 +5096,7 @@ void PasswordDatabase::_bw_check_and_repair(const QString &conn_str, GUtil::Cryp
                     q.prepare("UPDATE Entry SET Row=? WHERE ID=?");
                     q.addBindValue(i);
                     q.addBindValue((QByteArray)parent_index[pid][i]);
-                    DatabaseUtils::ExecuteQuery(q);
+                    __execute_query(q);
                 }
             }
         }
@@ -3162,18 +5109,24 @@ void PasswordDatabase::_bw_check_and_repair(const QString &conn_str, GUtil::Cryp
             db.commit();
 
         // Update the index to make sure it matches what's in the database
-        lock_guard<mutex> lkr(d->index_lock);
-        for(const EntryId &pid : reorder_parents){
-            for(int i = 0; i < parent_index[pid].length(); i++)
-                d->index[parent_index[pid][i]].row = i;
-
-            sort(d->parent_index[pid].children.begin(),
-                 d->parent_index[pid].children.end(),
-              [&](const EntryId &lhs, const EntryId &rhs){
-                 return d->index[lhs].row < d->index[rhs].row;
-            });
+        EntryChangeSet changes;
+        {
+            lock_guard<mutex> lkr(d->index_lock);
+            for(const EntryId &pid : reorder_parents){
+                for(int i = 0; i < parent_index[pid].length(); i++){
+                    d->index[parent_index[pid][i]].row = i;
+                    changes.Moved.append(EntryChange(parent_index[pid][i], pid, i));
+                }
+
+                sort(d->parent_index[pid].children.begin(),
+                     d->parent_index[pid].children.end(),
+                  [&](const EntryId &lhs, const EntryId &rhs){
+                     return d->index[lhs].row < d->index[rhs].row;
+                });
+            }
+            d->wc_index.notify_all();
         }
-        d->wc_index.notify_all();
+        emit NotifyEntriesChanged(changes);
 
         final_report.append(QString("Child ordering fixed for %1 parent entries")
                             .arg(reorder_parents.length()));
@@ -3217,7 +5170,7 @@ GUtil::CryptoPP::Cryptor const &PasswordDatabase::Cryptor() const
 {
     FailIfNotOpen();
     G_D;
-    return *d->cryptor;
+    return __cryptor(d);
 }
 
 void PasswordDatabase::WaitForThreadIdle() const
@@ -3230,6 +5183,23 @@ void PasswordDatabase::WaitForThreadIdle() const
     });
 }
 
+WorkerMetrics PasswordDatabase::GetWorkerMetrics() const
+{
+    G_D;
+    int depth;
+    {
+        lock_guard<mutex> lkr(d->thread_lock);
+        depth = d->thread_commands.size();
+    }
+    return d->metrics.GetSnapshot(depth);
+}
+
+void PasswordDatabase::ResetWorkerMetrics()
+{
+    G_D;
+    d->metrics.Reset();
+}
+
 
 END_NAMESPACE_GRYPTO;
 
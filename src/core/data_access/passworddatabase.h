@@ -16,9 +16,15 @@ limitations under the License.*/
 #define GRYPTO_PASSWORDDATABASE_H
 
 #include <grypto/common.h>
+#include <grypto/workermetrics.h>
+#include <grypto/keyderivation.h>
 #include <gutil/exception.h>
 #include <QString>
+#include <QStringList>
 #include <QObject>
+#include <QPair>
+#include <QList>
+#include <QMetaType>
 #include <memory>
 #include <functional>
 #include <map>
@@ -59,6 +65,60 @@ public:
         FileInfo_t(uint size = 0) :Size(size) {}
     };
 
+    /** Identifies an entry that changed, and where it is in the hierarchy. */
+    struct EntryChange
+    {
+        EntryId Id;
+        EntryId ParentId;
+        int Row;
+
+        EntryChange(const EntryId &id = EntryId(), const EntryId &pid = EntryId(), int row = -1)
+            :Id(id), ParentId(pid), Row(row) {}
+    };
+
+    /** A batch of changes made to the entry hierarchy by the background thread,
+     *  for example by an import or a repair. Views can apply these directly rather
+     *  than reloading every entry.
+    */
+    struct EntryChangeSet
+    {
+        /** New entries, with parents always listed before their children. */
+        QList<EntryChange> Added;
+
+        /** Entries whose data changed, but which did not move. */
+        QList<EntryChange> Updated;
+
+        /** Entries that were removed, with their former parent ids. */
+        QList<EntryChange> Removed;
+
+        /** Entries that changed position, with their new parent ids and rows. */
+        QList<EntryChange> Moved;
+
+        bool IsEmpty() const{
+            return Added.isEmpty() && Updated.isEmpty() && Removed.isEmpty() && Moved.isEmpty();
+        }
+    };
+
+    /** The outcome of Sync(). */
+    struct SyncResult
+    {
+        /** Give this to the next Sync() between the same two copies. */
+        QString Token;
+
+        /** The number of entries added, changed or deleted in each copy. */
+        int EntriesSent = 0;
+        int EntriesReceived = 0;
+
+        /** The number of files added, changed or deleted in each copy. */
+        int FilesSent = 0;
+        int FilesReceived = 0;
+
+        /** Entries that changed in both copies, or that lost their parent.
+         *  They were resolved automatically, but the user may want to check them.
+        */
+        QList<EntryId> Conflicts;
+    };
+
     /** Creates a new PasswordDatabase object. Before you use it, you must call Open() with the
      *  proper credentials.
      *
@@ -78,6 +138,7 @@ public:
 
     /** Opens or creates the database with the given credentials.
      *  Throws an Exception if the password is wrong, or if something else goes wrong.
+     *  Creating a database benchmarks the key derivation first, see GetKdfBenchmark().
      *
      *  This class' behavior is undefined until you call this function without it throwing an exception.
      *
@@ -98,6 +159,26 @@ public:
     /** Returns true if the database was already opened. */
     bool IsOpen() const;
 
+    /** Forgets the key and stops the background thread, so nothing can be
+     *  decrypted until you Unlock() again. The cache only holds crypttext, so
+     *  it stays loaded. This doesn't block: the background thread finishes
+     *  what was queued with its own copy of the key, then exits.
+     *
+     *  While locked, anything that needs the key or changes the database
+     *  throws an exception.
+    */
+    void Lock();
+
+    /** Makes the key again and restarts the background thread. This takes
+     *  as long as opening the vault did, because the password is stretched
+     *  again; we don't keep anything that's quicker to attack.
+     *  \returns false if the credentials are wrong
+    */
+    bool Unlock(const Credentials &);
+
+    /** Returns true if the database is open but locked. */
+    bool IsLocked() const;
+
     /** Saves the database to the new file location and with new credentials.
      *  (existing files will be overwritten). It works on the main thread
      *  so it will block until finished. Upon finishing
@@ -117,6 +198,9 @@ public:
     /** Throws an exception if the database is not opened. */
     void FailIfNotOpen() const{ if(!IsOpen()) throw GUtil::Exception<>("Database not open"); }
 
+    /** Throws an exception if the database is locked. */
+    void FailIfLocked() const{ if(IsLocked()) throw GUtil::Exception<>("Database is locked"); }
+
     /** Returns the filepath. */
     QString const &FilePath() const{ return m_filepath; }
 
@@ -126,6 +210,12 @@ public:
     /** Returns the credentials used to unlock the database. */
     Credentials::TypeEnum GetCredentialsType() const;
 
+    /** Returns how the password is stretched before the key is derived, and
+     *  how long it took to unlock. New vaults, and the ones made by SaveAs(),
+     *  are calibrated for KeyDerivation::TargetMilliseconds() on this machine.
+    */
+    KdfBenchmark GetKdfBenchmark() const;
+
     /** Returns a reference to the cryptor for you to use (but not change). */
     GUtil::CryptoPP::Cryptor const &Cryptor() const;
 
@@ -144,6 +234,15 @@ public:
     */
     void WaitForThreadIdle() const;
 
+    /** Returns a snapshot of what the background thread has been doing: the
+     *  queue depth, how long each type of command waited and ran, and how fast
+     *  files were encrypted and decrypted. You can call this from any thread.
+    */
+    WorkerMetrics GetWorkerMetrics() const;
+
+    /** Starts the worker metrics over from zero. */
+    void ResetWorkerMetrics();
+
 
     /** \name Entry Access
         \{
@@ -152,6 +251,18 @@ public:
     /** Adds the entry to the database and shifts the surrounding entries in the hierarchy. */
     void AddEntry(Entry &, bool generate_id = true);
 
+    /** Adds many entries at once, which is much faster than calling AddEntry()
+     *  in a loop because they are encrypted up front and inserted in a single
+     *  transaction. Each entry is appended to its parent in list order, so
+     *  the rows you set are ignored.
+     *
+     *  A parent must either exist already or come earlier in the list. If you
+     *  want entries to refer to other new entries then set the ids yourself
+     *  and pass generate_ids = false.
+     *  \throws An exception if a parent is not found, before anything is added.
+    */
+    void AddEntries(QList<Entry> &, bool generate_ids = true);
+
     /** Returns the entry given by id or throws an exception if it can't be found. */
     Entry FindEntry(const EntryId &) const;
 
@@ -161,6 +272,24 @@ public:
     /** Returns a list of entries for the given parent id sorted by row number. */
     QList<Entry> FindEntriesByParentId(const EntryId &) const;
 
+    /** Returns the same list as FindEntriesByParentId(), but each entry is paired with
+     *  its number of children. This only takes the index lock once, so it's much faster
+     *  than calling CountEntriesByParentId() for each child.
+    */
+    QList<QPair<Entry, int>> FindEntriesAndChildCountsByParentId(const EntryId &) const;
+
+    /** Returns every entry below the given parent id, each paired with its number of
+     *  children. The list is in depth-first order, with parents appearing before their
+     *  children and siblings sorted by row number. The parent itself is not included.
+    */
+    QList<QPair<Entry, int>> FindEntrySubtree(const EntryId &parent_id = EntryId::Null()) const;
+
+    /** The same as above, except it decrypts with the given cryptor rather than the
+     *  database's own. The cryptor is not thread-safe, so use this version with a copy
+     *  of Cryptor() to load the tree from a different thread.
+    */
+    QList<QPair<Entry, int>> FindEntrySubtree(const EntryId &parent_id, GUtil::CryptoPP::Cryptor &) const;
+
     /** Returns a sorted list of the user's favorite entries. */
     QList<Entry> FindFavoriteEntries() const;
 
@@ -200,6 +329,17 @@ public:
     */
     void DeleteEntry(const EntryId &id);
 
+    /** Deletes, updates and adds entries in a single database transaction,
+     *  so either all of the changes are written or none of them are. The
+     *  entries are deleted like DeleteEntry(), then updated like UpdateEntry(),
+     *  then added like AddEntries(), so the new entries are appended to their
+     *  parents and any parent must exist already or come earlier in the list.
+     *  \throws An exception if an entry to update or delete is not found, or if
+     *      a parent is not found, before anything is changed.
+    */
+    void ApplyChanges(QList<Entry> &added, QList<Entry> &updated,
+                      const QList<EntryId> &deleted, bool generate_ids = true);
+
     /** \} */
 
 
@@ -246,7 +386,11 @@ public:
     void ExportToPortableSafe(const QString &export_filename,
                               const Credentials &) const;
 
-    /** Imports data from the portable safe file. */
+    /** Imports the entries and files from the portable safe file, under a
+     *  new entry at the root. The files get new ids. This works on a
+     *  background thread, and it's all in one transaction, so if it fails
+     *  nothing is imported.
+    */
     void ImportFromPortableSafe(const QString &import_filename,
                                 const Credentials &);
 
@@ -256,6 +400,76 @@ public:
     /** Imports the XML data that was generated using ExportToXml(). */
     void ImportFromXml(const QString &import_filename);
 
+    /** Writes a backup of the vault to the file, encrypted with the credentials.
+     *  The entries and files are copied as they are in the vault, so you need
+     *  the same credentials to open the restored vault.
+     *
+     *  If you give it the token returned by an earlier backup, it only writes
+     *  the entries and files that were added, changed or deleted since then.
+     *  Otherwise it writes the whole vault. It waits for the background thread
+     *  to finish first, then works on the main thread.
+     *
+     *  The entries, with their crypttext, go in a manifest that's built as one
+     *  JSON document in memory, so a backup needs a few times the size of the
+     *  entries in memory, and Qt can't make a JSON document bigger than about
+     *  128 MB. The files are copied one at a time, so they don't count.
+     *
+     *  \returns The token to give the next backup
+     *  \throws An exception if the credentials are wrong, or the token is
+     *      not from this vault
+    */
+    QString Backup(const QString &backup_filename,
+                   const Credentials &,
+                   const QString &since_token = QString());
+
+    /** Makes a new vault from a full backup followed by the differential
+     *  backups that were made after it, in order. The backup tokens of the
+     *  original vault continue to work with the restored one, as of the
+     *  last backup in the list.
+     *
+     *  Each backup's manifest is read into memory whole, with the same limits
+     *  as in Backup(); the files are restored one at a time.
+     *  \throws An exception if the target exists or the backups don't follow
+     *      each other. Nothing is left at the target if it fails.
+    */
+    static void RestoreBackup(const QString &target_filename,
+                              const QStringList &backup_filenames,
+                              const Credentials &);
+
+    /** Copies the vault file page by page while it's open, using SQLite's
+     *  online backup. Nothing is decrypted or re-encrypted, so the copy
+     *  opens with the same credentials. It runs on the calling thread with
+     *  its own connection and progress, and the background thread can keep
+     *  writing between the steps. A write makes the copy start over, so it
+     *  includes those writes when it's done.
+     *
+     *  Qt must use the same SQLite library that we link (-system-sqlite).
+     *  \throws An exception if it doesn't, or if the backup fails.
+     *
+     *  \param pages_per_step How many pages to copy at a time while the vault
+     *          is locked; fewer pages means shorter waits for edits
+     *  \param pause_ms How long to wait between the steps
+    */
+    void HotBackup(const QString &backup_filename,
+                   int pages_per_step = 64,
+                   int pause_ms = 10);
+
+    /** Merges the changes between this vault and another copy of it, so they
+     *  end up the same. Unlike ImportFromDatabase(), entries and files are
+     *  matched by id, and only the ones that changed since the last sync are
+     *  looked at, so it takes time in proportion to the changes.
+     *
+     *  If an entry changed in both copies, the one with the later modify date
+     *  wins, and an edit wins over a delete. These are listed as conflicts.
+     *  Entries that are moved go to the end of their new parents.
+     *
+     *  \param token The token from the last sync between these two copies,
+     *          or empty for the first one
+     *  \throws An exception if the other vault is not a copy of this one,
+     *      or if the token is invalid
+    */
+    SyncResult Sync(PasswordDatabase &other, const QString &token = QString());
+
     /** Imports data from the other database. New ID's will be given to
      *  every entry and file, so there is no possibility of collision.
     */
@@ -292,16 +506,26 @@ signals:
     /** Notifies that the background thread is no longer busy with tasks. */
     void NotifyThreadIdle();
 
+    /** Notifies that the background thread changed entries, for example after
+     *  an import or a repair. Changes made through the entry access functions
+     *  on the main thread are not reported here.
+    */
+    void NotifyEntriesChanged(const Grypt::PasswordDatabase::EntryChangeSet &);
+
 
 private:
 
     // Main thread methods
     void _init_cryptor(const Credentials &, const byte *salt, GUINT32 salt_len);
     void _init_cryptor(const GUtil::CryptoPP::Cryptor &);
+    void _start_worker();
     bool _try_lock_file();
     void _open(std::function<void(byte const *)> init_cryptor);
     void _close();
 
+    // The name of the main thread's connection, so we can query another vault
+    QString const &_connection_string() const;
+
     // Worker thread bodies
     void _background_worker(GUtil::CryptoPP::Cryptor *);
 
@@ -314,11 +538,18 @@ private:
     // Returns true if the second id is an ancestor of the first
     bool _has_ancestor(const EntryId &child, const EntryId &ancestor) const;
 
+    // These update the index for the entry, and return true if the favorites changed
+    bool _index_update_entry(const Entry &, const QByteArray &crypttext);
+    bool _index_delete_entry(const EntryId &);
+
     // Background worker methods
     void _bw_add_entry(const QString &, const Entry &);
+    void _bw_add_entries(const QString &, const QList<Entry> &);
     void _bw_update_entry(const QString &, const Entry &);
     void _bw_delete_entry(const QString &, const EntryId &);
     void _bw_move_entry(const QString &, const EntryId &, quint32, quint32, const EntryId &, quint32);
+    void _bw_apply_changes(const QString &, const QList<Entry> &added,
+                           const QList<Entry> &updated, const QList<EntryId> &deleted);
     void _bw_cache_entries_by_parentid(const QString &, const EntryId &);
     void _bw_cache_all_entries(const QString &);
     void _bw_refresh_favorites(const QString &);
@@ -344,4 +575,6 @@ private:
 
 }
 
+Q_DECLARE_METATYPE(Grypt::PasswordDatabase::EntryChangeSet)
+
 #endif // GRYPTO_PASSWORDDATABASE_H
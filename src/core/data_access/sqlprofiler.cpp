@@ -0,0 +1,181 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "sqlprofiler.h"
+#include <gutil/databaseutils.h>
+#include <QSqlQuery>
+#include <QSqlDriver>
+#include <QSqlResult>
+#include <QSqlRecord>
+#include <QTextStream>
+#include <QHash>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+USING_NAMESPACE_GUTIL1(Qt);
+USING_NAMESPACE_GUTIL;
+
+namespace Grypt{
+
+
+namespace{
+
+struct profiler_state_t
+{
+    mutex lock;
+    QHash<QString, SqlStatementStats> statements;
+};
+
+profiler_state_t &__state()
+{
+    static profiler_state_t s;
+    return s;
+}
+
+// Asks SQLite how it will execute the statement. We run it on a new result
+//  from the same driver, so it's on the same connection and thread as the query.
+void __explain(const QSqlQuery &q, SqlStatementStats &stats)
+{
+    const QString sql = q.lastQuery().trimmed();
+    if(!sql.startsWith("SELECT", ::Qt::CaseInsensitive) &&
+            !sql.startsWith("UPDATE", ::Qt::CaseInsensitive) &&
+            !sql.startsWith("DELETE", ::Qt::CaseInsensitive) &&
+            !sql.startsWith("INSERT", ::Qt::CaseInsensitive))
+        return;
+
+    QSqlQuery eq(q.driver()->createResult());
+    if(!eq.prepare("EXPLAIN QUERY PLAN " + sql))
+        return;
+
+    // The plan doesn't depend on the values, but they must all be bound
+    for(int i = 0; i < q.boundValues().count(); ++i)
+        eq.addBindValue(QVariant());
+    if(!eq.exec())
+        return;
+
+    // The last column is the detail in every version of SQLite
+    while(eq.next()){
+        const QString detail = eq.value(eq.record().count() - 1).toString();
+        stats.QueryPlan.append(detail);
+
+        // Scans that use an index say so, i.e. "SCAN TABLE Entry USING INDEX ..."
+        if(detail.startsWith("SCAN") && !detail.contains("USING"))
+            stats.IsFullScan = true;
+    }
+}
+
+}
+
+
+void SqlProfiler::Execute(QSqlQuery &q)
+{
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    DatabaseUtils::ExecuteQuery(q);
+    const quint64 us = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+
+    profiler_state_t &s = __state();
+    const QString sql = q.lastQuery();
+    bool is_new;
+    {
+        lock_guard<mutex> lkr(s.lock);
+        auto iter = s.statements.find(sql);
+        is_new = iter == s.statements.end();
+        if(!is_new){
+            iter->Count++;
+            iter->TotalMicroseconds += us;
+            iter->MaxMicroseconds = qMax(iter->MaxMicroseconds, us);
+        }
+    }
+
+    if(is_new){
+        // Don't hold the lock while we talk to the database
+        SqlStatementStats stats;
+        stats.Sql = sql;
+        __explain(q, stats);
+
+        lock_guard<mutex> lkr(s.lock);
+        SqlStatementStats &ss = s.statements[sql];
+        if(ss.Sql.isEmpty()){
+            ss.Sql = sql;
+            ss.QueryPlan = stats.QueryPlan;
+            ss.IsFullScan = stats.IsFullScan;
+        }
+        ss.Count++;
+        ss.TotalMicroseconds += us;
+        ss.MaxMicroseconds = qMax(ss.MaxMicroseconds, us);
+    }
+}
+
+QList<SqlStatementStats> SqlProfiler::GetStatements()
+{
+    QList<SqlStatementStats> ret;
+    {
+        profiler_state_t &s = __state();
+        lock_guard<mutex> lkr(s.lock);
+        ret = s.statements.values();
+    }
+    std::sort(ret.begin(), ret.end(), [](const SqlStatementStats &a, const SqlStatementStats &b){
+        return a.TotalMicroseconds > b.TotalMicroseconds;
+    });
+    return ret;
+}
+
+QString SqlProfiler::GetReport(int top)
+{
+    const QList<SqlStatementStats> statements = GetStatements();
+    QString ret;
+    QTextStream s(&ret);
+
+    s << QString("Top %1 of %2 SQL statements by total time:\n")
+         .arg(qMin(top, statements.length())).arg(statements.length());
+    s << QString("%1 %2 %3 %4  %5\n")
+         .arg("Total ms", 10).arg("Count", 8).arg("Avg us", 8).arg("Max us", 8).arg("Statement");
+    for(int i = 0; i < statements.length() && i < top; ++i){
+        const SqlStatementStats &st = statements[i];
+        s << QString("%1 %2 %3 %4  %5%6\n")
+             .arg(st.TotalMicroseconds / 1000.0, 10, 'f', 1)
+             .arg(st.Count, 8)
+             .arg(st.TotalMicroseconds / qMax<quint64>(1, st.Count), 8)
+             .arg(st.MaxMicroseconds, 8)
+             .arg(st.IsFullScan ? "[SCAN] " : "")
+             .arg(st.Sql.simplified());
+    }
+
+    s << "\nFull table scans:\n";
+    bool any = false;
+    for(const SqlStatementStats &st : statements){
+        if(st.IsFullScan){
+            any = true;
+            s << "  " << st.Sql.simplified() << "\n";
+            for(const QString &p : st.QueryPlan)
+                s << "      " << p << "\n";
+        }
+    }
+    if(!any)
+        s << "  (none)\n";
+    s.flush();
+    return ret;
+}
+
+void SqlProfiler::Reset()
+{
+    profiler_state_t &s = __state();
+    lock_guard<mutex> lkr(s.lock);
+    s.statements.clear();
+}
+
+
+}
@@ -0,0 +1,81 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_SQLPROFILER_H
+#define GRYPTO_SQLPROFILER_H
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+
+class QSqlQuery;
+
+namespace Grypt{
+
+
+/** The execution statistics of one SQL statement. */
+struct SqlStatementStats
+{
+    /** The statement text, with placeholders for the bound values. */
+    QString Sql;
+
+    quint64 Count;
+    quint64 TotalMicroseconds;
+    quint64 MaxMicroseconds;
+
+    /** The output of EXPLAIN QUERY PLAN, captured the first time it ran. */
+    QStringList QueryPlan;
+
+    /** True if the query plan scans a whole table without an index. */
+    bool IsFullScan;
+
+    SqlStatementStats() :Count(0), TotalMicroseconds(0), MaxMicroseconds(0), IsFullScan(false) {}
+};
+
+
+/** A process-wide registry of every SQL statement executed through it.
+ *
+ *  It times every execution, and the first time it sees a statement it
+ *  asks SQLite how it's going to run it, so you can find statements that
+ *  don't use the indexes. Statements are told apart by their text, so bind
+ *  your values instead of formatting them into the statement.
+ *
+ *  All functions are thread-safe.
+*/
+class SqlProfiler
+{
+public:
+
+    /** Executes the prepared query and records how long it took.
+     *  \throws An exception if the query fails, like DatabaseUtils::ExecuteQuery
+    */
+    static void Execute(QSqlQuery &);
+
+    /** Returns the stats of all statements, sorted by total time descending. */
+    static QList<SqlStatementStats> GetStatements();
+
+    /** Returns a human-readable report of the top statements by total time,
+     *  followed by every statement that scans a whole table.
+    */
+    static QString GetReport(int top = 15);
+
+    /** Forgets all the statements. */
+    static void Reset();
+
+};
+
+
+}
+
+#endif // GRYPTO_SQLPROFILER_H
@@ -0,0 +1,56 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "sqlstatementcache.h"
+#include <gutil/exception.h>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+using namespace std;
+USING_NAMESPACE_GUTIL;
+
+namespace Grypt{
+
+
+SqlStatementCache::SqlStatementCache(const QString &connection_name)
+    :m_connection(connection_name)
+{}
+
+SqlStatementCache::~SqlStatementCache()
+{}
+
+QSqlQuery &SqlStatementCache::Prepare(const QString &sql)
+{
+    auto iter = m_statements.find(sql);
+    if(iter != m_statements.end()){
+        // Release any results from the last execution
+        (*iter)->finish();
+        return **iter;
+    }
+
+    shared_ptr<QSqlQuery> q(new QSqlQuery(QSqlDatabase::database(m_connection)));
+    if(!q->prepare(sql))
+        throw Exception<>(QString("Unable to prepare statement: %1")
+                          .arg(q->lastError().text()).toUtf8());
+    m_statements.insert(sql, q);
+    return *q;
+}
+
+void SqlStatementCache::Clear()
+{
+    m_statements.clear();
+}
+
+
+}
@@ -0,0 +1,61 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_SQLSTATEMENTCACHE_H
+#define GRYPTO_SQLSTATEMENTCACHE_H
+
+#include <QString>
+#include <QHash>
+#include <memory>
+
+class QSqlQuery;
+
+namespace Grypt{
+
+
+/** Keeps prepared statements for one database connection, so statements
+ *  that run in a loop are only compiled once.
+ *
+ *  Only use it for statements whose results you finish with before
+ *  preparing the same statement again, and destroy it before you
+ *  remove the connection. It is not thread-safe; use one per connection.
+*/
+class SqlStatementCache
+{
+    QString m_connection;
+    QHash<QString, std::shared_ptr<QSqlQuery>> m_statements;
+public:
+
+    explicit SqlStatementCache(const QString &connection_name);
+    ~SqlStatementCache();
+
+    /** Returns the statement prepared with the given sql, which is prepared
+     *  the first time you ask for it. Set its values with bindValue() by
+     *  position, because values from the last execution are still bound.
+     *  \throws An exception if the statement can't be prepared
+    */
+    QSqlQuery &Prepare(const QString &sql);
+
+    /** Releases all the prepared statements. */
+    void Clear();
+
+    /** The number of statements in the cache. */
+    int Count() const{ return m_statements.count(); }
+
+};
+
+
+}
+
+#endif // GRYPTO_SQLSTATEMENTCACHE_H
@@ -0,0 +1,30 @@
+#-------------------------------------------------
+#
+# Benchmarks for the data access layer
+#
+#-------------------------------------------------
+
+QT       += sql testlib
+
+QT       -= gui
+
+TOP_DIR = ../../../../..
+
+QMAKE_CXXFLAGS += -std=c++11
+DEFINES += GUTIL_CORE_QT_ADAPTERS
+
+TARGET = tst_benchmarktest
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+INCLUDEPATH += $$TOP_DIR/include $$TOP_DIR/gutil/include
+LIBS += -L$$TOP_DIR/lib -L$$TOP_DIR/gutil/lib \
+    -lgrypto_core \
+    -lGUtil \
+    -lGUtilQt \
+    -lGUtilCryptoPP \
+    -lcryptopp
+
+SOURCES += tst_benchmarktest.cpp
+DEFINES += SRCDIR=\\\"$$PWD/\\\"
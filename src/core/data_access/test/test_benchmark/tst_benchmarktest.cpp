@@ -0,0 +1,609 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include <grypto_passworddatabase.h>
+#include <grypto_entry.h>
+#include <grypto_compactentry.h>
+#include <grypto_idhash.h>
+#include <grypto_bytearena.h>
+#include <gutil/cryptopp_rng.h>
+#include <QString>
+#include <QHash>
+#include <QFile>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QtTest>
+#include <vector>
+#include <algorithm>
+#include <random>
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+using namespace std;
+USING_NAMESPACE_GRYPTO;
+
+/** The benchmarks run once for each vault size in this comma-separated list.
+ *  The default leaves out the million-entry vault, because it takes a while to build.
+*/
+#define SCALES_VARIABLE         "GRYPTO_BENCH_SCALES"
+#define DEFAULT_SCALES          "1000,100000"
+
+/** The file sizes to use for the file benchmarks, in bytes. Add 1073741824
+ *  to try a 1GB file.
+*/
+#define FILE_SIZES_VARIABLE     "GRYPTO_BENCH_FILE_SIZES"
+#define DEFAULT_FILE_SIZES      "1048576,104857600"
+
+// The vaults are made of folders with this many children each
+#define FOLDER_WIDTH    100
+
+// The number of entries to add in the burst benchmark
+#define BURST_SIZE      1000
+
+#define TEST_PASSWORD   "password...shhh"
+#define WORKING_COPY    "bench_working_copy.sqlite"
+#define SAVEAS_PATH     "bench_saveas.sqlite"
+#define XML_PATH        "bench_export.xml"
+#define FILE_PATH       "bench_file.dat"
+#define EXPORT_PATH     "bench_file_export.dat"
+
+static GUtil::CryptoPP::RNG __cryptopp_rng;
+static GUtil::RNG_Initializer __rng_init(&__cryptopp_rng);
+
+
+static QList<int> __read_list(const char *var, const char *def)
+{
+    QList<int> ret;
+    QByteArray val = qgetenv(var);
+    for(const QByteArray &s : (val.isEmpty() ? QByteArray(def) : val).split(','))
+        ret.append(s.trimmed().toInt());
+    return ret;
+}
+
+static QString __vault_path(int entries)
+{
+    return QString("bench_%1.sqlite").arg(entries);
+}
+
+// Builds a vault with the given number of entries, where the root has one folder
+//  for every FOLDER_WIDTH entries
+static void __build_vault(const QString &path, int entries, const Credentials &creds)
+{
+    PasswordDatabase db(path);
+    db.Open(creds);
+    for(int i = 0; i < entries; i += FOLDER_WIDTH){
+        QList<Entry> batch;
+        Entry folder;
+        folder.SetId(EntryId::NewId());
+        folder.SetName(QString("Folder %1").arg(i));
+        batch.append(folder);
+
+        for(int j = 1; j < FOLDER_WIDTH && i + j < entries; ++j){
+            Entry e;
+            e.SetId(EntryId::NewId());
+            e.SetParentId(folder.GetId());
+            e.SetName(QString("Entry %1").arg(i + j));
+            e.SetDescription("A typical description");
+            e.SetModifyDate(QDateTime::currentDateTime());
+
+            SecretValue v;
+            v.SetName("Password");
+            v.SetValue("hunter2");
+            e.Values().append(v);
+            batch.append(e);
+        }
+        db.AddEntries(batch, false);
+    }
+    db.WaitForThreadIdle();
+}
+
+// Reads the id and crypttext of every entry, which is what Open() indexes
+static QList<QPair<EntryId, QByteArray>> __read_entry_rows(const QString &path)
+{
+    QList<QPair<EntryId, QByteArray>> ret;
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "bench_rows");
+        db.setDatabaseName(path);
+        db.setConnectOptions("QSQLITE_OPEN_READONLY");
+        if(!db.open())
+            qFatal("Unable to open the vault");
+        QSqlQuery q("SELECT ID,Data FROM Entry", db);
+        while(q.next())
+            ret.append(QPair<EntryId, QByteArray>(q.value(0).toByteArray(), q.value(1).toByteArray()));
+    }
+    QSqlDatabase::removeDatabase("bench_rows");
+    return ret;
+}
+
+// The index as it was, with a heap allocation for every crypttext
+typedef QHash<EntryId, QByteArray> old_index_t;
+
+// The index as it is now, with the crypttext packed into an arena
+struct new_index_t{
+    ByteArena arena;
+    IdHash<EntryId, ByteArena::Slice> hash;
+};
+
+static void __build_index(old_index_t &idx, const QList<QPair<EntryId, QByteArray>> &rows)
+{
+    idx.reserve(rows.length());
+    for(const auto &p : rows){
+        // Copy the data, as if we just read it from the database
+        idx.insert(p.first, QByteArray(p.second.constData(), p.second.length()));
+    }
+}
+
+static void __build_index(new_index_t &idx, const QList<QPair<EntryId, QByteArray>> &rows)
+{
+    idx.hash.reserve(rows.length());
+    for(const auto &p : rows)
+        idx.hash.insert(p.first, idx.arena.Intern(p.second));
+}
+
+// Makes an entry with the display fields that the model holds, like the
+//  ones in the vaults we build
+static Entry __display_entry(int i)
+{
+    Entry e;
+    e.SetId(EntryId::NewId());
+    e.SetParentId(EntryId::NewId());
+    e.SetName(QString("Entry %1").arg(i));
+    e.SetDescription("A typical description");
+    e.SetModifyDate(QDateTime::currentDateTime());
+    return e;
+}
+
+// Returns the resident set size in bytes, or -1 if we can't tell
+static qint64 __resident_bytes()
+{
+#ifdef Q_OS_LINUX
+    QFile f("/proc/self/statm");
+    if(f.open(QFile::ReadOnly)){
+        const QList<QByteArray> fields = f.readAll().split(' ');
+        if(1 < fields.length())
+            return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return -1;
+}
+
+static void __write_file(const QString &path, qint64 size)
+{
+    QFile f(path);
+    QVERIFY(f.open(QFile::WriteOnly | QFile::Truncate));
+    QByteArray chunk(1024 * 1024, 'x');
+    for(qint64 written = 0; written < size; written += chunk.length())
+        f.write(chunk.constData(), qMin<qint64>(chunk.length(), size - written));
+}
+
+
+/** Benchmarks the data access layer at different scales.
+ *
+ *  By default the results are written to benchmark_results.xml in the QtTest
+ *  XML format, which lists one BenchmarkResult per test and data row. Pass
+ *  your own -o options to override this (i.e. "-o results.csv,csv").
+*/
+class BenchmarkTest : public QObject
+{
+    Q_OBJECT
+    Credentials creds;
+    QList<int> m_scales;
+    QList<int> m_fileSizes;
+
+public:
+    BenchmarkTest();
+
+private Q_SLOTS:
+    void initTestCase();
+    void bench_open_data(){ _add_scale_rows(); }
+    void bench_open();
+    void bench_warm_up_data(){ _add_scale_rows(); }
+    void bench_warm_up();
+    void bench_add_entry_burst_data(){ _add_scale_rows(); }
+    void bench_add_entry_burst();
+    void bench_move_entries_wide_data(){ _add_scale_rows(); }
+    void bench_move_entries_wide();
+    void bench_find_entries_by_parent_id_data();
+    void bench_find_entries_by_parent_id();
+    void bench_save_as_data(){ _add_scale_rows(); }
+    void bench_save_as();
+    void bench_add_file_data(){ _add_file_size_rows(); }
+    void bench_add_file();
+    void bench_export_file_data(){ _add_file_size_rows(); }
+    void bench_export_file();
+    void bench_export_to_xml_data(){ _add_scale_rows(); }
+    void bench_export_to_xml();
+    void bench_delete_orphans_data(){ _add_scale_rows(); }
+    void bench_delete_orphans();
+    void bench_index_lookup_data();
+    void bench_index_lookup();
+    void bench_index_build_data(){ _add_index_rows(); }
+    void bench_index_build();
+    void bench_index_memory_data(){ _add_index_rows(); }
+    void bench_index_memory();
+    void bench_entry_memory_data(){ _add_entry_rows(); }
+    void bench_entry_memory();
+    void cleanupTestCase();
+
+private:
+    void _add_scale_rows();
+    void _add_file_size_rows();
+    void _add_index_rows();
+    void _add_entry_rows();
+
+    // Returns a fresh copy of the vault that the benchmark may modify
+    QString _working_copy(int entries);
+};
+
+BenchmarkTest::BenchmarkTest()
+    :m_scales(__read_list(SCALES_VARIABLE, DEFAULT_SCALES)),
+      m_fileSizes(__read_list(FILE_SIZES_VARIABLE, DEFAULT_FILE_SIZES))
+{
+    creds.Password = TEST_PASSWORD;
+}
+
+void BenchmarkTest::initTestCase()
+{
+    // The vaults are kept between runs, because the big ones take a while to build
+    for(int n : m_scales){
+        if(!QFile::exists(__vault_path(n))){
+            qDebug("Building a vault with %d entries...", n);
+            __build_vault(__vault_path(n), n, creds);
+        }
+    }
+}
+
+void BenchmarkTest::_add_scale_rows()
+{
+    QTest::addColumn<int>("entries");
+    for(int n : m_scales)
+        QTest::newRow(QString("%1 entries").arg(n).toUtf8().constData()) << n;
+}
+
+void BenchmarkTest::_add_file_size_rows()
+{
+    QTest::addColumn<qint64>("file_size");
+    for(qint64 sz : m_fileSizes)
+        QTest::newRow(QString("%1 MB").arg(sz / (1024 * 1024)).toUtf8().constData()) << sz;
+}
+
+void BenchmarkTest::_add_index_rows()
+{
+    QTest::addColumn<int>("entries");
+    QTest::addColumn<bool>("new_index");
+    for(int n : m_scales){
+        QTest::newRow(QString("%1 entries, old index").arg(n).toUtf8().constData()) << n << false;
+        QTest::newRow(QString("%1 entries, new index").arg(n).toUtf8().constData()) << n << true;
+    }
+}
+
+void BenchmarkTest::_add_entry_rows()
+{
+    QTest::addColumn<int>("entries");
+    QTest::addColumn<bool>("compact");
+    for(int n : m_scales){
+        QTest::newRow(QString("%1 entries, Entry").arg(n).toUtf8().constData()) << n << false;
+        QTest::newRow(QString("%1 entries, CompactEntry").arg(n).toUtf8().constData()) << n << true;
+    }
+}
+
+QString BenchmarkTest::_working_copy(int entries)
+{
+    QFile::remove(WORKING_COPY);
+    if(!QFile::copy(__vault_path(entries), WORKING_COPY))
+        qFatal("Unable to copy the vault");
+    return WORKING_COPY;
+}
+
+void BenchmarkTest::bench_open()
+{
+    QFETCH(int, entries);
+    QBENCHMARK{
+        PasswordDatabase db(__vault_path(entries));
+        db.Open(creds);
+    }
+}
+
+void BenchmarkTest::bench_warm_up()
+{
+    QFETCH(int, entries);
+    PasswordDatabase db(__vault_path(entries));
+    db.Open(creds);
+
+    // Decrypts every entry, as the UI does when it loads the whole tree
+    QBENCHMARK{
+        QVERIFY(entries == db.FindEntrySubtree().length());
+    }
+}
+
+void BenchmarkTest::bench_add_entry_burst()
+{
+    QFETCH(int, entries);
+    PasswordDatabase db(_working_copy(entries));
+    db.Open(creds);
+    QBENCHMARK{
+        for(int i = 0; i < BURST_SIZE; ++i){
+            Entry e;
+            e.SetName(QString("Burst %1").arg(i));
+            db.AddEntry(e);
+        }
+        db.WaitForThreadIdle();
+    }
+}
+
+void BenchmarkTest::bench_move_entries_wide()
+{
+    QFETCH(int, entries);
+    PasswordDatabase db(_working_copy(entries));
+    db.Open(creds);
+
+    // The root is the widest folder; move its first child to the end
+    const int width = db.CountEntriesByParentId(EntryId::Null());
+    QBENCHMARK{
+        db.MoveEntries(EntryId::Null(), 0, 0, EntryId::Null(), width);
+        db.WaitForThreadIdle();
+    }
+}
+
+void BenchmarkTest::bench_find_entries_by_parent_id_data()
+{
+    QTest::addColumn<int>("entries");
+    QTest::addColumn<bool>("root");
+    for(int n : m_scales){
+        QTest::newRow(QString("%1 entries, root").arg(n).toUtf8().constData()) << n << true;
+        QTest::newRow(QString("%1 entries, folder").arg(n).toUtf8().constData()) << n << false;
+    }
+}
+
+void BenchmarkTest::bench_find_entries_by_parent_id()
+{
+    QFETCH(int, entries);
+    QFETCH(bool, root);
+    PasswordDatabase db(__vault_path(entries));
+    db.Open(creds);
+
+    EntryId pid;
+    if(!root)
+        pid = db.FindEntriesByParentId(EntryId::Null())[0].GetId();
+
+    QBENCHMARK{
+        db.FindEntriesByParentId(pid);
+    }
+}
+
+void BenchmarkTest::bench_save_as()
+{
+    QFETCH(int, entries);
+    PasswordDatabase db(__vault_path(entries));
+    db.Open(creds);
+    QBENCHMARK{
+        db.SaveAs(SAVEAS_PATH, creds);
+    }
+    QFile::remove(SAVEAS_PATH);
+}
+
+void BenchmarkTest::bench_add_file()
+{
+    QFETCH(qint64, file_size);
+    __write_file(FILE_PATH, file_size);
+
+    PasswordDatabase db(_working_copy(m_scales.first()));
+    db.Open(creds);
+    QBENCHMARK{
+        db.AddFile(FileId::NewId(), FILE_PATH);
+        db.WaitForThreadIdle();
+    }
+    QFile::remove(FILE_PATH);
+}
+
+void BenchmarkTest::bench_export_file()
+{
+    QFETCH(qint64, file_size);
+    __write_file(FILE_PATH, file_size);
+
+    PasswordDatabase db(_working_copy(m_scales.first()));
+    db.Open(creds);
+    const FileId fid = FileId::NewId();
+    db.AddFile(fid, FILE_PATH);
+    db.WaitForThreadIdle();
+
+    QBENCHMARK{
+        db.ExportFile(fid, EXPORT_PATH);
+        db.WaitForThreadIdle();
+    }
+    QVERIFY(QFileInfo(EXPORT_PATH).size() == file_size);
+    QFile::remove(FILE_PATH);
+    QFile::remove(EXPORT_PATH);
+}
+
+void BenchmarkTest::bench_export_to_xml()
+{
+    QFETCH(int, entries);
+    PasswordDatabase db(__vault_path(entries));
+    db.Open(creds);
+    QBENCHMARK{
+        db.ExportToXml(XML_PATH);
+        db.WaitForThreadIdle();
+    }
+    QFile::remove(XML_PATH);
+}
+
+void BenchmarkTest::bench_delete_orphans()
+{
+    QFETCH(int, entries);
+    PasswordDatabase db(_working_copy(entries));
+    db.Open(creds);
+
+    // Delete every tenth folder, which orphans its children
+    const QList<Entry> folders = db.FindEntriesByParentId(EntryId::Null());
+    for(int i = folders.length() - 1; i >= 0; i -= 10)
+        db.DeleteEntry(folders[i].GetId());
+    db.WaitForThreadIdle();
+
+    // This is destructive, so it only runs once
+    QBENCHMARK_ONCE{
+        db.DeleteOrphans();
+        db.WaitForThreadIdle();
+    }
+}
+
+void BenchmarkTest::bench_index_lookup_data()
+{
+    QTest::addColumn<int>("entries");
+    QTest::addColumn<bool>("flat");
+    for(int n : m_scales){
+        QTest::newRow(QString("%1 entries, QHash").arg(n).toUtf8().constData()) << n << false;
+        QTest::newRow(QString("%1 entries, IdHash").arg(n).toUtf8().constData()) << n << true;
+    }
+}
+
+// Compares the lookup speed of the index's hash with a QHash, using a random
+//  order of lookups to defeat the cache
+void BenchmarkTest::bench_index_lookup()
+{
+    QFETCH(int, entries);
+    QFETCH(bool, flat);
+
+    vector<EntryId> ids(entries);
+    for(EntryId &id : ids)
+        id = EntryId::NewId();
+
+    vector<int> order(entries);
+    for(int i = 0; i < entries; ++i)
+        order[i] = i;
+    shuffle(order.begin(), order.end(), mt19937(entries));
+
+    qint64 sum = 0;
+    if(flat){
+        IdHash<EntryId, int> h;
+        for(int i = 0; i < entries; ++i)
+            h.insert(ids[i], i);
+        QBENCHMARK{
+            for(int i : order)
+                sum += h.find(ids[i]).value();
+        }
+    }
+    else{
+        QHash<EntryId, int> h;
+        for(int i = 0; i < entries; ++i)
+            h.insert(ids[i], i);
+        QBENCHMARK{
+            for(int i : order)
+                sum += h.find(ids[i]).value();
+        }
+    }
+    QVERIFY(0 < sum);
+}
+
+// Compares the time it takes Open() to build the old and new index from the
+//  vault's rows. The rows are read up front, so only the index is timed.
+void BenchmarkTest::bench_index_build()
+{
+    QFETCH(int, entries);
+    QFETCH(bool, new_index);
+    const QList<QPair<EntryId, QByteArray>> rows = __read_entry_rows(__vault_path(entries));
+    QVERIFY(entries == rows.length());
+
+    QBENCHMARK{
+        if(new_index){
+            new_index_t idx;
+            __build_index(idx, rows);
+        }
+        else{
+            old_index_t idx;
+            __build_index(idx, rows);
+        }
+    }
+}
+
+// Reports how much the resident memory grows when building the old and new
+//  index. Freed memory from earlier tests gets reused, so for exact numbers
+//  run each row in its own process (i.e. bench_index_memory:"100000 entries, old index").
+void BenchmarkTest::bench_index_memory()
+{
+#ifdef Q_OS_LINUX
+    QFETCH(int, entries);
+    QFETCH(bool, new_index);
+    const QList<QPair<EntryId, QByteArray>> rows = __read_entry_rows(__vault_path(entries));
+
+    const qint64 before = __resident_bytes();
+    qint64 bytes;
+    if(new_index){
+        new_index_t idx;
+        __build_index(idx, rows);
+        QVERIFY(entries == idx.hash.count());
+        bytes = __resident_bytes() - before;
+    }
+    else{
+        old_index_t idx;
+        __build_index(idx, rows);
+        QVERIFY(entries == idx.count());
+        bytes = __resident_bytes() - before;
+    }
+    QTest::setBenchmarkResult(bytes, QTest::BytesAllocated);
+#else
+    QSKIP("Resident memory is only measured on Linux");
+#endif
+}
+
+// Reports how much the resident memory grows when holding the model's entries
+//  as Entry, the way it used to, and as CompactEntry. As with the index, run
+//  each row in its own process for exact numbers.
+void BenchmarkTest::bench_entry_memory()
+{
+#ifdef Q_OS_LINUX
+    QFETCH(int, entries);
+    QFETCH(bool, compact);
+
+    const qint64 before = __resident_bytes();
+    qint64 bytes;
+    if(compact){
+        vector<CompactEntry> v;
+        v.reserve(entries);
+        for(int i = 0; i < entries; ++i)
+            v.push_back(CompactEntry(__display_entry(i)));
+        bytes = __resident_bytes() - before;
+    }
+    else{
+        vector<Entry> v;
+        v.reserve(entries);
+        for(int i = 0; i < entries; ++i)
+            v.push_back(__display_entry(i));
+        bytes = __resident_bytes() - before;
+    }
+    QTest::setBenchmarkResult(bytes, QTest::BytesAllocated);
+#else
+    QSKIP("Resident memory is only measured on Linux");
+#endif
+}
+
+void BenchmarkTest::cleanupTestCase()
+{
+    QFile::remove(WORKING_COPY);
+}
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    BenchmarkTest tc;
+
+    // Unless told otherwise, write machine-readable results next to the usual output
+    QStringList args = app.arguments();
+    if(!args.contains("-o"))
+        args << "-o" << "benchmark_results.xml,xml" << "-o" << "-,txt";
+    return QTest::qExec(&tc, args);
+}
+
+#include "tst_benchmarktest.moc"
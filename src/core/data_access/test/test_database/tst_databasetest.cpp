@@ -15,10 +15,27 @@ limitations under the License.*/
 #include <grypto_passworddatabase.h>
 #include <grypto_xmlconverter.h>
 #include <grypto_entry.h>
+#include <grypto_compactentry.h>
+#include <grypto_idhash.h>
+#include <grypto_bytearena.h>
+#include <grypto_workermetrics.h>
+#include <grypto_tracer.h>
+#include <grypto_sqlprofiler.h>
+#include <grypto_sqlstatementcache.h>
+#include <grypto_keyderivation.h>
+#include <grypto_filecryptopool.h>
+#include <grypto_entryquery.h>
+#include <grypto_securearena.h>
 #include <gutil/cryptopp_rng.h>
 #include <gutil/databaseutils.h>
 #include <QString>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
 #include <QtTest>
+#include <functional>
 using namespace std;
 USING_NAMESPACE_GRYPTO;
 
@@ -50,10 +67,32 @@ private Q_SLOTS:
     void test_entry_insert();
     void test_entry_delete();
     void test_entry_update();
+    void test_entry_update_churn();
     void test_entry_move_basic();
     void test_entry_move_up_same_parent();
     void test_entry_move_down_same_parent();
     void test_entry_favorites();
+    void test_entry_subtree();
+    void test_compact_entry();
+    void test_index_containers();
+    void test_entry_query();
+    void test_secure_arena();
+    void test_add_entries();
+    void test_worker_metrics();
+    void test_tracer();
+    void test_sql_profiler();
+    void test_apply_changes();
+    void test_kdf_calibration();
+    void test_secure_lock();
+    void test_file_crypto_pool();
+    void test_portable_safe();
+    void test_xml_export_files();
+    void test_xml_export_memory();
+    void test_xml_import_invalid();
+    void test_upgrade_3_0();
+    void test_backup_restore();
+    void test_hot_backup();
+    void test_sync();
     void cleanupTestCase();
 
 private:
@@ -78,6 +117,9 @@ DatabaseTest::DatabaseTest()
     :db(0)
 {
     creds.Password = TEST_PASSWORD;
+
+    // Don't spend half a second unlocking in every test
+    KeyDerivation::SetTargetMilliseconds(20);
 }
 
 void DatabaseTest::initTestCase()
@@ -324,6 +366,43 @@ void DatabaseTest::test_entry_update()
     QVERIFY(__compare_entries(e, e2));
 }
 
+void DatabaseTest::test_entry_update_churn()
+{
+    _cleanup_database();
+    _init_database();
+
+    // Replacing the entries over and over leaves most of the crypttext arena
+    //  dead, so the index has to compact it along the way
+    QList<Entry> entries;
+    for(int i = 0; i < 50; ++i){
+        Entry e;
+        e.SetName(QString("entry %1").arg(i));
+        db->AddEntry(e);
+        entries.append(e);
+    }
+    for(int round = 0; round < 30; ++round){
+        for(Entry &e : entries){
+            e.SetDescription(QString("round %1 ").arg(round).repeated(100));
+            db->UpdateEntry(e);
+        }
+    }
+    db->WaitForThreadIdle();
+
+    for(const Entry &e : entries)
+        QVERIFY(__compare_entries(e, db->FindEntry(e.GetId())));
+
+    // Removing entries releases their crypttext, and the rest is intact
+    for(int i = 0; i < entries.length(); i += 2)
+        db->DeleteEntry(entries[i].GetId());
+    db->WaitForThreadIdle();
+    for(int i = 1; i < entries.length(); i += 2){
+        const Entry e = db->FindEntry(entries[i].GetId());
+        QVERIFY(e.GetName() == entries[i].GetName());
+        QVERIFY(e.GetDescription() == entries[i].GetDescription());
+        QVERIFY(e.GetRow() == i / 2);
+    }
+}
+
 void DatabaseTest::test_entry_move_basic()
 {
     _cleanup_database();
@@ -653,6 +732,1099 @@ void DatabaseTest::test_entry_favorites()
     QVERIFY(favs[1].GetFavoriteIndex() == 2);
 }
 
+void DatabaseTest::test_entry_subtree()
+{
+    _cleanup_database();
+    _init_database();
+
+    Entry   e0,       e1;
+    Entry e2, e3,   e4;
+    db->AddEntry(e0);
+    db->AddEntry(e1);
+    e2.SetParentId(e0.GetId());
+    e3.SetParentId(e0.GetId());
+    e4.SetParentId(e1.GetId());
+    db->AddEntry(e2);
+    db->AddEntry(e3);
+    db->AddEntry(e4);
+
+    // The children come back with their child counts
+    QList<QPair<Entry, int>> children = db->FindEntriesAndChildCountsByParentId(EntryId::Null());
+    QVERIFY(children.length() == 2);
+    QVERIFY(children[0].first.GetId() == e0.GetId());
+    QVERIFY(children[0].second == 2);
+    QVERIFY(children[1].first.GetId() == e1.GetId());
+    QVERIFY(children[1].second == 1);
+
+    children = db->FindEntriesAndChildCountsByParentId(e0.GetId());
+    QVERIFY(children.length() == 2);
+    QVERIFY(children[0].first.GetId() == e2.GetId());
+    QVERIFY(children[0].second == 0);
+    QVERIFY(children[1].first.GetId() == e3.GetId());
+
+    // The subtree is in depth-first order
+    QList<QPair<Entry, int>> subtree = db->FindEntrySubtree();
+    QVERIFY(subtree.length() == 5);
+    QVERIFY(subtree[0].first.GetId() == e0.GetId());
+    QVERIFY(subtree[0].second == 2);
+    QVERIFY(subtree[1].first.GetId() == e2.GetId());
+    QVERIFY(subtree[2].first.GetId() == e3.GetId());
+    QVERIFY(subtree[3].first.GetId() == e1.GetId());
+    QVERIFY(subtree[3].second == 1);
+    QVERIFY(subtree[4].first.GetId() == e4.GetId());
+    QVERIFY(subtree[4].second == 0);
+
+    subtree = db->FindEntrySubtree(e1.GetId());
+    QVERIFY(subtree.length() == 1);
+    QVERIFY(subtree[0].first.GetId() == e4.GetId());
+}
+
+void DatabaseTest::test_compact_entry()
+{
+    Entry e;
+    e.SetId(EntryId::NewId());
+    e.SetParentId(EntryId::NewId());
+    e.SetRow(3);
+    e.SetName("Bank \u00fcberweisung");
+    e.SetDescription("My checking account");
+    e.SetFavoriteIndex(1);
+    e.SetModifyDate(QDateTime::currentDateTime());
+    e.SetFileId(FileId::NewId());
+    e.SetFileName("statement.pdf");
+
+    CompactEntry ce(e);
+    QVERIFY(ce.GetId() == e.GetId());
+    QVERIFY(ce.GetParentId() == e.GetParentId());
+    QVERIFY(ce.GetRow() == 3);
+    QVERIFY(ce.GetName() == e.GetName());
+    QVERIFY(ce.GetDescription() == e.GetDescription());
+    QVERIFY(ce.GetFileName() == e.GetFileName());
+    QVERIFY(ce.GetFileId() == e.GetFileId());
+    QVERIFY(ce.IsFavorite());
+    QVERIFY(ce.GetModifyDate() == e.GetModifyDate());
+
+    // The fixed-size fields can be changed in place
+    CompactEntry copy = ce;
+    copy.SetRow(0);
+    copy.SetFavoriteIndex(-1);
+    QVERIFY(copy.GetRow() == 0 && ce.GetRow() == 3);
+    QVERIFY(!copy.IsFavorite());
+    QVERIFY(copy.ToEntry().GetName() == e.GetName());
+    QVERIFY(CompactEntry().GetName().isEmpty());
+    QVERIFY(!CompactEntry().GetModifyDate().isValid());
+
+    // The object is one pointer, and its only allocation is the fixed header
+    //  followed by the UTF-8 text, with nothing else on the heap
+    QVERIFY(sizeof(CompactEntry) == sizeof(void *));
+    const int header_size = CompactEntry().AllocatedSize();
+    QVERIFY(header_size <= (int)(2 * sizeof(EntryId) + sizeof(FileId) + 40));
+    QVERIFY(ce.AllocatedSize() == header_size +
+            e.GetName().toUtf8().length() +
+            e.GetDescription().toUtf8().length() +
+            e.GetFileName().toUtf8().length());
+}
+
+void DatabaseTest::test_index_containers()
+{
+    // The hash behaves like a QHash
+    const int count = 10000;
+    QList<EntryId> ids;
+    IdHash<EntryId, int> h;
+    for(int i = 0; i < count; ++i){
+        ids.append(EntryId::NewId());
+        h.insert(ids.back(), i);
+    }
+    int *first = &h[ids[0]];
+    QVERIFY(h.count() == count);
+    for(int i = 0; i < count; i += 2)
+        QVERIFY(1 == h.remove(ids[i]));
+    QVERIFY(h.count() == count / 2);
+    for(int i = 0; i < count; ++i){
+        QVERIFY(h.contains(ids[i]) == (1 == i % 2));
+        QVERIFY(h.value(ids[i], -1) == (i % 2 ? i : -1));
+    }
+    int visited = 0;
+    for(auto iter = h.begin(); iter != h.end(); ++iter, ++visited)
+        QVERIFY(ids[*iter] == iter.key());
+    QVERIFY(visited == count / 2);
+
+    // References to values survive rehashing
+    h[ids[0]] = 0;
+    first = &h[ids[0]];
+    for(int i = 0; i < count; ++i)
+        h[EntryId::NewId()] = i;
+    QVERIFY(first == &h[ids[0]]);
+
+    // Slices stay valid after compaction, even if the arena is gone
+    ByteArena::Slice s1, s2;
+    {
+        ByteArena arena;
+        s1 = arena.Intern(QByteArray("hello"));
+        s2 = arena.Intern(QByteArray(ByteArena::ChunkSize, 'x'));
+        QVERIFY(s1.IsInArena() && s1.Data() == "hello");
+        arena.Release(s2);
+        arena.Release(s1);
+        s1 = arena.Intern(QByteArray("world"));
+        QVERIFY(arena.ShouldCompact());
+        arena.Compact();
+        s1 = arena.Intern(s1);
+        QVERIFY(arena.LiveBytes() == 5 && arena.DeadBytes() == 0);
+    }
+    QVERIFY(s1.Data() == "world");
+    QVERIFY(s2.Length() == ByteArena::ChunkSize);
+}
+
+void DatabaseTest::test_entry_query()
+{
+    // Parsing
+    EntryQuery q = EntryQuery::Parse("bank name:\"my login\" fav:yes file:pdf modified:>=2015-01-01");
+    QVERIFY(q.IsValid());
+    QVERIFY(q.Terms == QStringList("bank"));
+    QVERIFY(q.NameTerms == QStringList("my login"));
+    QVERIFY(q.Favorite == EntryQuery::Yes);
+    QVERIFY(q.HasFile == EntryQuery::Yes && q.FileExtension == "pdf");
+    QVERIFY(q.ModifiedFrom == QDateTime(QDate(2015, 1, 1)).toMSecsSinceEpoch());
+    QVERIFY(q.ModifiedUntil == -1);
+    QVERIFY(EntryQuery::Parse("").IsEmpty());
+    QVERIFY(!EntryQuery::Parse("color:red").IsValid());
+    QVERIFY(!EntryQuery::Parse("fav:").IsValid());
+    QVERIFY(!EntryQuery::Parse("modified:yesterday").IsValid());
+
+    // A small tree: bank -> {login, statement (favorite, has a file)}, mail
+    const QDateTime old_date(QDate(2014, 6, 1));
+    const QDateTime new_date(QDate(2015, 6, 1));
+    Entry bank, login, statement, mail;
+    for(Entry *e : {&bank, &login, &statement, &mail})
+        e->SetId(EntryId::NewId());
+    bank.SetName("Bank");
+    bank.SetModifyDate(old_date);
+    login.SetName("Login");
+    login.SetParentId(bank.GetId());
+    login.SetModifyDate(old_date);
+    statement.SetName("Statement");
+    statement.SetDescription("monthly bank statement");
+    statement.SetParentId(bank.GetId());
+    statement.SetFavoriteIndex(0);
+    statement.SetFileId(FileId::NewId());
+    statement.SetFileName("june.pdf");
+    statement.SetModifyDate(new_date);
+    mail.SetName("Mail");
+    mail.SetModifyDate(new_date);
+
+    EntryIndex index;
+    for(const Entry &e : {bank, login, statement, mail})
+        index.Insert(CompactEntry(e));
+    index.Finalize();
+    QVERIFY(index.Count() == 4);
+
+    auto execute = [&](const QString &s){
+        return index.Execute(EntryQuery::Parse(s));
+    };
+    auto has = [](const QVector<EntryId> &ids, const Entry &e){
+        return EntryIndex::Contains(ids, e.GetId());
+    };
+
+    QVector<EntryId> res = execute("bank");
+    QVERIFY(res.count() == 2 && has(res, bank) && has(res, statement));
+    res = execute("fav:yes");
+    QVERIFY(res.count() == 1 && has(res, statement));
+    res = execute("fav:no file:no");
+    QVERIFY(res.count() == 3 && !has(res, statement));
+    res = execute("file:pdf");
+    QVERIFY(res.count() == 1 && has(res, statement));
+    res = execute("modified:<2015-01-01");
+    QVERIFY(res.count() == 2 && has(res, bank) && has(res, login));
+    res = execute("parent:bank");
+    QVERIFY(res.count() == 2 && has(res, login) && has(res, statement));
+    QVERIFY(execute("parent:mail").isEmpty());
+
+    QVERIFY(index.ParentId(login.GetId()) == bank.GetId());
+    res = index.Descendants(bank.GetId());
+    QVERIFY(res.count() == 2 && res.contains(login.GetId()) && res.contains(statement.GetId()));
+
+    // Updates and removals keep the index sorted and the results correct
+    login.SetFavoriteIndex(1);
+    login.SetModifyDate(new_date);
+    index.Update(CompactEntry(login));
+    res = execute("fav:yes modified:2015-06-01");
+    QVERIFY(res.count() == 2 && has(res, login) && has(res, statement));
+
+    mail.SetParentId(bank.GetId());
+    index.Update(CompactEntry(mail));
+    QVERIFY(execute("parent:bank").count() == 3);
+
+    index.Remove(statement.GetId());
+    QVERIFY(index.Count() == 3);
+    QVERIFY(execute("file:yes").isEmpty());
+    QVERIFY(execute("statement").isEmpty());
+    res = execute("parent:bank");
+    QVERIFY(res.count() == 2 && has(res, login) && has(res, mail));
+
+    // Removing something that isn't there does nothing
+    index.Remove(statement.GetId());
+    QVERIFY(index.Count() == 3);
+}
+
+void DatabaseTest::test_secure_arena()
+{
+    SecureArena arena;
+    QVERIFY(arena.BytesInUse() == 0);
+    QVERIFY(arena.Allocate(0) == nullptr);
+
+    // Blocks are rounded up to their size class and come back zeroed
+    QVERIFY(SecureArena::BlockSize(1) == SecureArena::MinBlockSize);
+    QVERIFY(SecureArena::BlockSize(100) == 128);
+    QVERIFY(SecureArena::BlockSize(SecureArena::MaxBlockSize) == SecureArena::MaxBlockSize);
+    char *p = reinterpret_cast<char *>(arena.Allocate(100));
+    QVERIFY(p != nullptr);
+    QVERIFY(arena.BytesInUse() == 128);
+    for(int i = 0; i < 128; ++i)
+        QVERIFY(0 == p[i]);
+
+    // Freeing wipes the block, and the same block is handed out next
+    memset(p, 0xAA, 128);
+    arena.Free(p, 100);
+    QVERIFY(arena.BytesInUse() == 0);
+    char *p2 = reinterpret_cast<char *>(arena.Allocate(128));
+    QVERIFY(p2 == p);
+    for(int i = 0; i < 128; ++i)
+        QVERIFY(0 == p2[i]);
+    arena.Free(p2, 128);
+
+    // When a size class runs out of blocks the arena maps another slab
+    QList<char *> blocks;
+    for(int i = 0; i < 20; ++i){
+        blocks.append(reinterpret_cast<char *>(arena.Allocate(SecureArena::MaxBlockSize)));
+        memset(blocks.back(), i + 1, SecureArena::MaxBlockSize);
+    }
+    QVERIFY(arena.BytesInUse() == 20 * SecureArena::MaxBlockSize);
+    QVERIFY(blocks.toSet().count() == 20);
+    for(int i = 0; i < 20; ++i)
+        QVERIFY(blocks[i][0] == i + 1 && blocks[i][SecureArena::MaxBlockSize - 1] == i + 1);
+    for(char *b : blocks)
+        arena.Free(b, SecureArena::MaxBlockSize);
+    QVERIFY(arena.BytesInUse() == 0);
+
+    // Large blocks get their own mapping
+    const size_t big = 3 * SecureArena::MaxBlockSize + 1;
+    p = reinterpret_cast<char *>(arena.Allocate(big));
+    QVERIFY(arena.BytesInUse() == SecureArena::BlockSize(big));
+    QVERIFY(SecureArena::BlockSize(big) >= big);
+    QVERIFY(0 == p[0] && 0 == p[big - 1]);
+    arena.Free(p, big);
+    QVERIFY(arena.BytesInUse() == 0);
+
+    // The buffer keeps its contents when it grows, and Clear() keeps the capacity
+    const size_t in_use = SecureArena::Instance().BytesInUse();
+    {
+        SecureBuffer sb;
+        QVERIFY(sb.Length() == 0 && sb.Capacity() == 0);
+        QByteArray data(1000, 'x');
+        for(int i = 0; i < 10; ++i)
+            sb.Append(data.constData(), data.length());
+        QVERIFY(sb.Length() == 10000);
+        QVERIFY(sb.Capacity() >= 10000);
+        QVERIFY(QByteArray(sb.ConstData(), sb.Length()) == QByteArray(10000, 'x'));
+        QVERIFY(SecureArena::Instance().BytesInUse() == in_use + sb.Capacity());
+
+        const size_t cap = sb.Capacity();
+        sb.Clear();
+        QVERIFY(sb.Length() == 0 && sb.Capacity() == cap);
+        QVERIFY(0 == sb.ConstData()[0]);
+    }
+    QVERIFY(SecureArena::Instance().BytesInUse() == in_use);
+}
+
+void DatabaseTest::test_add_entries()
+{
+    const int root_count = db->FindEntriesByParentId(EntryId::Null()).length();
+
+    QList<Entry> entries;
+    Entry folder;
+    folder.SetId(EntryId::NewId());
+    folder.SetName("bulk folder");
+    entries.append(folder);
+    for(int i = 0; i < 3; ++i){
+        Entry e;
+        e.SetId(EntryId::NewId());
+        e.SetParentId(folder.GetId());
+        e.SetName(QString("bulk child %1").arg(i));
+        e.SetRow(0);    // Rows are ignored
+        SecretValue v;
+        v.SetName("password");
+        v.SetValue(QString("secret %1").arg(i));
+        e.Values().append(v);
+        entries.append(e);
+    }
+
+    // A missing parent fails before anything is added
+    QList<Entry> bad_entries;
+    Entry orphan;
+    orphan.SetParentId(EntryId::NewId());
+    bad_entries.append(orphan);
+    bool exception_hit = false;
+    try{
+        db->AddEntries(bad_entries);
+    }
+    catch(const GUtil::Exception<> &){
+        exception_hit = true;
+    }
+    QVERIFY(exception_hit);
+
+    db->AddEntries(entries, false);
+    QVERIFY(entries[0].GetRow() == root_count);
+
+    // Make sure they were written to disk in the right order
+    _close_database();
+    _init_database();
+    QVERIFY(db->FindEntriesByParentId(EntryId::Null()).length() == root_count + 1);
+    QList<Entry> children = db->FindEntriesByParentId(folder.GetId());
+    QVERIFY(children.length() == 3);
+    for(int i = 0; i < 3; ++i){
+        QVERIFY(children[i].GetRow() == i);
+        QVERIFY(__compare_entries(children[i], entries[i + 1]));
+    }
+}
+
+void DatabaseTest::test_worker_metrics()
+{
+    LatencyHistogram h;
+    for(quint64 us : {0, 1, 3, 1000})
+        h.Record(us);
+    LatencyHistogram::Snapshot hs = h.GetSnapshot();
+    QVERIFY(hs.Count == 4);
+    QVERIFY(hs.MaxMicroseconds == 1000);
+    QVERIFY(hs.Percentile(25) == 0);
+    QVERIFY(hs.Percentile(75) == 3);
+    QVERIFY(hs.Percentile(100) == 1000);
+
+    // The last bucket starts at 2^30 us, which is about 18 minutes
+    h.Record((quint64)1 << 40);
+    QVERIFY(h.GetSnapshot().Buckets[LatencyHistogram::BucketCount - 1] == 1);
+    QVERIFY(LatencyHistogram::FormatMicroseconds(850) == "850us");
+    QVERIFY(LatencyHistogram::FormatMicroseconds(1500) == "1.5ms");
+    QVERIFY(LatencyHistogram::FormatMicroseconds(2500000) == "2.50s");
+
+    db->ResetWorkerMetrics();
+    Entry e;
+    e.SetName("metrics entry");
+    db->AddEntry(e);
+    FileId fid = FileId::NewId();
+    db->AddFile(fid, QByteArray(1024 * 1024, 'x'));
+    db->DeleteFile(fid);
+    db->WaitForThreadIdle();
+
+    WorkerMetrics m = db->GetWorkerMetrics();
+    QVERIFY(m.CommandsQueued == 3);
+    QVERIFY(m.QueueDepth == 0);
+    QVERIFY(1 <= m.MaxQueueDepth && m.MaxQueueDepth <= 3);
+    QVERIFY(m.FileEncryption.Bytes == 1024 * 1024);
+    QVERIFY(m.FileEncryption.MegabytesPerSecond() > 0);
+    QVERIFY(m.Commands.length() == 3);
+    for(const WorkerMetrics::CommandMetrics &c : m.Commands){
+        QVERIFY(c.Name == "AddEntry" || c.Name == "AddFile" || c.Name == "DeleteFile");
+        QVERIFY(c.Execution.Count == 1 && c.QueueWait.Count == 1);
+        QVERIFY(c.Failures == 0);
+    }
+    QVERIFY(m.ToString().contains("AddFile"));
+}
+
+void DatabaseTest::test_tracer()
+{
+    {
+        TraceSpan span("test", "disabled");
+        QVERIFY(!span.IsRecording());
+    }
+
+    Tracer::Start("test_trace.json");
+    {
+        TraceSpan span("test", "enabled");
+        QVERIFY(span.IsRecording());
+        span.AddArg("quote", "\"hi\"");
+
+        Entry e;
+        e.SetName("traced entry");
+        db->AddEntry(e);
+        db->FindEntriesByParentId(EntryId::Null());
+        db->WaitForThreadIdle();
+    }
+    Tracer::Stop();
+    QVERIFY(!Tracer::IsEnabled());
+
+    QFile f("test_trace.json");
+    QVERIFY(f.open(QFile::ReadOnly));
+    QJsonParseError err;
+    QJsonDocument doc = QJsonDocument::fromJson(f.readAll(), &err);
+    QVERIFY(QJsonParseError::NoError == err.error);
+
+    QSet<QString> names;
+    for(const QJsonValue &v : doc.object()["traceEvents"].toArray()){
+        QJsonObject o = v.toObject();
+        names.insert(o["name"].toString());
+        if(o["name"].toString() == "enabled")
+            QVERIFY(o["args"].toObject()["quote"].toString() == "\"hi\"");
+    }
+    QVERIFY(names.contains("enabled"));
+    QVERIFY(names.contains("AddEntry"));
+    QVERIFY(names.contains("ExecuteQuery"));
+    QVERIFY(names.contains("EncryptEntry"));
+    QVERIFY(names.contains("FindEntriesByParentId"));
+    QVERIFY(!names.contains("disabled"));
+
+    f.close();
+    QVERIFY(f.remove());
+}
+
+void DatabaseTest::test_sql_profiler()
+{
+    const QString conn_str = "test_sql_profiler";
+    {
+        QSqlDatabase pdb = QSqlDatabase::addDatabase("QSQLITE", conn_str);
+        pdb.setDatabaseName(":memory:");
+        QVERIFY(pdb.open());
+        QSqlQuery q(pdb);
+        QVERIFY(q.exec("CREATE TABLE T (ID INTEGER, Name TEXT)"));
+        QVERIFY(q.exec("CREATE INDEX idx_T_ID ON T (ID)"));
+
+        SqlProfiler::Reset();
+        SqlStatementCache statements(conn_str);
+        QSqlQuery &q_insert = statements.Prepare("INSERT INTO T (ID,Name) VALUES (?,?)");
+        for(int i = 0; i < 10; ++i){
+            QSqlQuery &q_same = statements.Prepare("INSERT INTO T (ID,Name) VALUES (?,?)");
+            QVERIFY(&q_same == &q_insert);
+            q_same.bindValue(0, i);
+            q_same.bindValue(1, QString::number(i));
+            SqlProfiler::Execute(q_same);
+        }
+        QVERIFY(statements.Count() == 1);
+
+        QSqlQuery &q_indexed = statements.Prepare("SELECT Name FROM T WHERE ID=?");
+        q_indexed.bindValue(0, 5);
+        SqlProfiler::Execute(q_indexed);
+        QVERIFY(q_indexed.next());
+        QVERIFY(q_indexed.value(0).toString() == "5");
+
+        QSqlQuery &q_scan = statements.Prepare("SELECT ID FROM T WHERE Name=?");
+        q_scan.bindValue(0, "5");
+        SqlProfiler::Execute(q_scan);
+        QVERIFY(q_scan.next());
+        QVERIFY(q_scan.value(0).toInt() == 5);
+
+        QList<SqlStatementStats> stats = SqlProfiler::GetStatements();
+        QVERIFY(stats.length() == 3);
+        for(const SqlStatementStats &st : stats){
+            if(st.Sql.startsWith("INSERT")){
+                QVERIFY(st.Count == 10);
+                QVERIFY(!st.IsFullScan);
+            }
+            else if(st.Sql.contains("WHERE ID=?")){
+                QVERIFY(st.Count == 1);
+                QVERIFY(!st.QueryPlan.isEmpty());
+                QVERIFY(!st.IsFullScan);
+            }
+            else{
+                QVERIFY(st.Count == 1);
+                QVERIFY(st.IsFullScan);
+            }
+        }
+
+        const QString report = SqlProfiler::GetReport();
+        QVERIFY(report.contains("Full table scans"));
+        QVERIFY(report.contains("[SCAN] SELECT ID FROM T WHERE Name=?"));
+        QVERIFY(!report.contains("[SCAN] SELECT Name FROM T WHERE ID=?"));
+
+        SqlProfiler::Reset();
+        QVERIFY(SqlProfiler::GetStatements().isEmpty());
+    }
+    QSqlDatabase::removeDatabase(conn_str);
+
+    // The database goes through the profiler too
+    Entry e;
+    e.SetName("profiled entry");
+    db->AddEntry(e);
+    db->WaitForThreadIdle();
+    bool found_insert = false;
+    for(const SqlStatementStats &st : SqlProfiler::GetStatements())
+        found_insert = found_insert || st.Sql.startsWith("INSERT INTO Entry");
+    QVERIFY(found_insert);
+}
+
+void DatabaseTest::test_apply_changes()
+{
+    Entry folder;
+    folder.SetName("apply folder");
+    QList<Entry> children;
+    for(int i = 0; i < 3; ++i){
+        Entry e;
+        e.SetName(QString("apply child %1").arg(i));
+        children.append(e);
+    }
+    db->AddEntry(folder);
+    for(Entry &e : children)
+        e.SetParentId(folder.GetId());
+    db->AddEntries(children);
+
+    // Nothing changes if one of the changes is invalid
+    {
+        QList<Entry> added;
+        QList<Entry> updated{Entry()};
+        updated[0].SetId(EntryId::NewId());
+        bool exception_hit = false;
+        try{
+            db->ApplyChanges(added, updated, {children[0].GetId()});
+        }
+        catch(const GUtil::Exception<> &){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+        QVERIFY(db->CountEntriesByParentId(folder.GetId()) == 3);
+    }
+
+    // Delete the first child, rename the second and add a new child with a grandchild
+    Entry renamed = children[1];
+    renamed.SetName("apply renamed");
+    renamed.SetFavoriteIndex(0);
+    QList<Entry> updated{renamed};
+
+    QList<Entry> added;
+    Entry new_child;
+    new_child.SetId(EntryId::NewId());
+    new_child.SetParentId(folder.GetId());
+    new_child.SetName("apply new child");
+    SecretValue sv;
+    sv.SetName("Password");
+    sv.SetValue("hunter2");
+    new_child.Values().append(sv);
+    added.append(new_child);
+    Entry grandchild;
+    grandchild.SetId(EntryId::NewId());
+    grandchild.SetParentId(new_child.GetId());
+    grandchild.SetName("apply grandchild");
+    added.append(grandchild);
+
+    db->ApplyChanges(added, updated, {children[0].GetId()}, false);
+    QVERIFY(added[0].GetRow() == 2);
+    QVERIFY(added[1].GetRow() == 0);
+
+    auto check = [&]{
+        QList<Entry> c = db->FindEntriesByParentId(folder.GetId());
+        QVERIFY(c.length() == 3);
+        QVERIFY(c[0].GetName() == "apply renamed" && c[0].GetRow() == 0);
+        QVERIFY(c[0].IsFavorite());
+        QVERIFY(c[1].GetId() == children[2].GetId() && c[1].GetRow() == 1);
+        QVERIFY(__compare_entries(c[2], added[0]));
+        QVERIFY(c[2].GetRow() == 2);
+        QVERIFY(db->FindEntriesByParentId(new_child.GetId()).length() == 1);
+        QVERIFY(db->FindFavoriteIds().contains(renamed.GetId()));
+    };
+    check();
+
+    // Make sure it was all written to disk
+    db->WaitForThreadIdle();
+    _close_database();
+    _init_database();
+    check();
+
+    // You can't add below a grandchild of an entry that is being deleted
+    {
+        Entry e;
+        e.SetId(EntryId::NewId());
+        e.SetParentId(grandchild.GetId());
+        QList<Entry> bad_added{e}, no_updates;
+        bool exception_hit = false;
+        try{
+            db->ApplyChanges(bad_added, no_updates, {new_child.GetId()}, false);
+        }
+        catch(const GUtil::Exception<> &){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+        QVERIFY(db->FindEntriesByParentId(new_child.GetId()).length() == 1);
+    }
+
+    // Repeated deletes, and deletes below another deleted entry, are done once
+    {
+        QList<Entry> no_adds, no_updates;
+        db->ApplyChanges(no_adds, no_updates,
+                         {grandchild.GetId(), new_child.GetId(), new_child.GetId()}, false);
+        QList<Entry> c = db->FindEntriesByParentId(folder.GetId());
+        QVERIFY(c.length() == 2);
+        QVERIFY(c[1].GetId() == children[2].GetId() && c[1].GetRow() == 1);
+        db->WaitForThreadIdle();
+        _close_database();
+        _init_database();
+        QVERIFY(db->CountEntriesByParentId(folder.GetId()) == 2);
+    }
+}
+
+void DatabaseTest::test_kdf_calibration()
+{
+    const char *kdf_filepath = "testdb_kdf.sqlite";
+    const char *kdf_saveas_filepath = "testdb_kdf2.sqlite";
+    QFile::remove(kdf_filepath);
+    QFile::remove(kdf_saveas_filepath);
+
+    // Calibration picks at least the minimum iterations, in round numbers
+    KdfBenchmark b = KeyDerivation::Calibrate(20);
+    QVERIFY(0 < b.IterationsPerSecond);
+    QVERIFY(KeyDerivation::MinimumIterations <= b.Parameters.Iterations);
+    QVERIFY(0 == b.Parameters.Iterations % 1000);
+    QVERIFY(0 == KeyDerivation::Calibrate(0).Parameters.Iterations);
+
+    // Stretching replaces the password, unless there's nothing to do
+    const byte salt[] = {1, 2, 3, 4};
+    KdfParameters params;
+    QVERIFY(0 == strcmp(KeyDerivation::Stretch(creds, params, salt, sizeof(salt)).Password.ConstData(),
+                        TEST_PASSWORD));
+    params.Iterations = 1000;
+    Credentials stretched = KeyDerivation::Stretch(creds, params, salt, sizeof(salt));
+    QVERIFY(stretched.Type == creds.Type);
+    QVERIFY(0 != strcmp(stretched.Password.ConstData(), TEST_PASSWORD));
+    QVERIFY(0 == strcmp(KeyDerivation::Stretch(creds, params, salt, sizeof(salt)).Password.ConstData(),
+                        stretched.Password.ConstData()));
+
+    // A new vault is calibrated, and remembers its parameters
+    quint32 iterations;
+    {
+        PasswordDatabase kdf_db(kdf_filepath);
+        kdf_db.Open(creds);
+        iterations = kdf_db.GetKdfBenchmark().Parameters.Iterations;
+        QVERIFY(KeyDerivation::MinimumIterations <= iterations);
+        QVERIFY(20 == kdf_db.GetKdfBenchmark().TargetMilliseconds);
+        QVERIFY(kdf_db.CheckCredentials(creds));
+
+        Credentials bad_creds;
+        bad_creds.Password = "wrong password";
+        QVERIFY(!kdf_db.CheckCredentials(bad_creds));
+    }
+    {
+        PasswordDatabase kdf_db(kdf_filepath);
+        kdf_db.Open(creds);
+        QVERIFY(iterations == kdf_db.GetKdfBenchmark().Parameters.Iterations);
+        QVERIFY(0 < kdf_db.GetKdfBenchmark().UnlockMilliseconds);
+
+        // Save as recalibrates, and we can open the copy
+        kdf_db.SaveAs(kdf_saveas_filepath, creds);
+        QVERIFY(20 == kdf_db.GetKdfBenchmark().TargetMilliseconds);
+        QVERIFY(kdf_db.CheckCredentials(creds));
+    }
+    {
+        PasswordDatabase kdf_db(kdf_saveas_filepath);
+        kdf_db.Open(creds);
+        QVERIFY(KeyDerivation::MinimumIterations <= kdf_db.GetKdfBenchmark().Parameters.Iterations);
+    }
+
+    QVERIFY(QFile::remove(kdf_filepath));
+    QVERIFY(QFile::remove(kdf_saveas_filepath));
+}
+
+void DatabaseTest::test_secure_lock()
+{
+    const char *lock_filepath = "testdb_lock.sqlite";
+    QFile::remove(lock_filepath);
+    {
+        PasswordDatabase lock_db(lock_filepath);
+        lock_db.Open(creds);
+
+        Entry e;
+        e.SetName("locked entry");
+        e.SetDescription("some secret");
+        lock_db.AddEntry(e);
+        QVERIFY(!lock_db.IsLocked());
+
+        // Nothing can be decrypted while locked
+        lock_db.Lock();
+        QVERIFY(lock_db.IsLocked());
+        bool exception_hit = false;
+        try{
+            lock_db.FindEntry(e.GetId());
+        }
+        catch(...){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+
+        // Nothing can be changed while locked, and the index is left alone
+        auto fails_while_locked = [](function<void()> f){
+            try{ f(); }
+            catch(const GUtil::Exception<> &){ return true; }
+            return false;
+        };
+        QVERIFY(fails_while_locked([&]{ lock_db.DeleteEntry(e.GetId()); }));
+        QVERIFY(fails_while_locked([&]{ lock_db.AddFavoriteEntry(e.GetId()); }));
+        QVERIFY(fails_while_locked([&]{ lock_db.SetFavoriteEntries(QList<EntryId>() << e.GetId()); }));
+        QVERIFY(fails_while_locked([&]{ lock_db.MoveEntries(EntryId::Null(), 0, 0, EntryId::Null(), 1); }));
+        QVERIFY(fails_while_locked([&]{ lock_db.DeleteFile(FileId::NewId()); }));
+        QVERIFY(fails_while_locked([&]{
+            QList<Entry> added, updated;
+            lock_db.ApplyChanges(added, updated, QList<EntryId>() << e.GetId());
+        }));
+        QVERIFY(1 == lock_db.CountEntriesByParentId(EntryId::Null()));
+        QVERIFY(lock_db.FindFavoriteIds().isEmpty());
+
+        // We can still check the credentials without unlocking
+        Credentials bad_creds;
+        bad_creds.Password = "wrong password";
+        QVERIFY(!lock_db.CheckCredentials(bad_creds));
+        QVERIFY(lock_db.CheckCredentials(creds));
+
+        // The wrong password leaves it locked
+        QVERIFY(!lock_db.Unlock(bad_creds));
+        QVERIFY(lock_db.IsLocked());
+
+        QVERIFY(lock_db.Unlock(creds));
+        QVERIFY(!lock_db.IsLocked());
+        Entry e2 = lock_db.FindEntry(e.GetId());
+        QVERIFY(e2.GetName() == e.GetName());
+        QVERIFY(e2.GetDescription() == e.GetDescription());
+
+        // We can write again after unlocking
+        e2.SetName("unlocked entry");
+        lock_db.UpdateEntry(e2);
+        QVERIFY(lock_db.FindEntry(e.GetId()).GetName() == "unlocked entry");
+
+        // It closes cleanly while locked
+        lock_db.Lock();
+    }
+    QVERIFY(QFile::remove(lock_filepath));
+}
+
+void DatabaseTest::test_file_crypto_pool()
+{
+    // Make files of different sizes, so they finish out of order
+    QList<QByteArray> files;
+    for(int i = 0; i < 20; ++i){
+        QByteArray f((i % 5) * 100000 + 1, 0);
+        GUtil::CryptoPP::RNG().Fill((byte *)f.data(), f.length());
+        files.append(f);
+    }
+
+    // A small window makes us pop while we're still pushing
+    QList<QByteArray> encrypted;
+    {
+        FileCryptoPool pool(db->Cryptor(), FileCryptoPool::Encrypt, 3, 250000);
+        QVERIFY(3 == pool.ThreadCount());
+        QVERIFY(pool.IsEmpty());
+        for(int i = 0; i < files.length(); ++i){
+            while(pool.IsFull())
+                encrypted.append(pool.Pop().Output);
+            pool.Push(QByteArray::number(i), files[i]);
+            QVERIFY(!pool.IsEmpty());
+        }
+        while(!pool.IsEmpty())
+            encrypted.append(pool.Pop().Output);
+    }
+    QVERIFY(files.length() == encrypted.length());
+
+    // The results come back in the order we pushed them
+    {
+        FileCryptoPool pool(db->Cryptor(), FileCryptoPool::Decrypt);
+        int next = 0;
+        auto check_next = [&]{
+            FileCryptoJob job = pool.Pop();
+            QVERIFY(job.Tag == QByteArray::number(next));
+            QVERIFY(job.Output == files[next]);
+            QVERIFY((quint64)files[next].length() == job.PlaintextLength);
+            ++next;
+        };
+        for(int i = 0; i < encrypted.length(); ++i){
+            QVERIFY(encrypted[i] != files[i]);
+            while(pool.IsFull())
+                check_next();
+            pool.Push(QByteArray::number(i), encrypted[i]);
+        }
+        while(!pool.IsEmpty())
+            check_next();
+        QVERIFY(files.length() == next);
+    }
+
+    // The worker's exception comes out of Pop(), and the pool still cleans up
+    {
+        FileCryptoPool pool(db->Cryptor(), FileCryptoPool::Decrypt, 2);
+        QByteArray bad = encrypted[1];
+        bad[bad.length() / 2] = bad[bad.length() / 2] ^ 0x01;
+        pool.Push("bad", bad);
+        pool.Push("unpopped", encrypted[2]);
+        bool exception_hit = false;
+        try{
+            pool.Pop();
+        }
+        catch(...){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+    }
+}
+
+void DatabaseTest::test_portable_safe()
+{
+    const char *gps_filepath = "testdb_export.gps";
+    const char *import_filepath = "testdb_import.sqlite";
+    QFile::remove(gps_filepath);
+    QFile::remove(import_filepath);
+
+    // Export a small tree with a file in it
+    const QByteArray file_contents(300000, 'g');
+    Entry parent, child;
+    {
+        PasswordDatabase export_db("testdb_gps.sqlite");
+        export_db.Open(creds);
+
+        parent.SetName("gps parent");
+        SecretValue v;
+        v.SetName("user");
+        v.SetValue("gps value");
+        v.SetNotes("gps note");
+        v.SetIsHidden(true);
+        parent.Values().append(v);
+        export_db.AddEntry(parent);
+
+        FileId fid = FileId::NewId();
+        export_db.AddFile(fid, file_contents);
+        child.SetName("gps child");
+        child.SetParentId(parent.GetId());
+        child.SetFileId(fid);
+        child.SetFileName("attachment.bin");
+        export_db.AddEntry(child);
+
+        // Ordered favorites, which come back unordered
+        export_db.SetFavoriteEntries(QList<EntryId>() << child.GetId() << parent.GetId());
+
+        export_db.ExportToPortableSafe(gps_filepath, creds);
+        export_db.WaitForThreadIdle();
+    }
+    QVERIFY(QFile::remove("testdb_gps.sqlite"));
+
+    // Import it into a new database
+    {
+        PasswordDatabase import_db(import_filepath);
+        import_db.Open(creds);
+        import_db.ImportFromPortableSafe(gps_filepath, creds);
+        import_db.WaitForThreadIdle();
+
+        QList<Entry> roots = import_db.FindEntriesByParentId(EntryId::Null());
+        QVERIFY(1 == roots.length());
+        QVERIFY(roots[0].GetName() == "Newly imported entries");
+
+        QList<Entry> l = import_db.FindEntriesByParentId(roots[0].GetId());
+        QVERIFY(1 == l.length());
+        QVERIFY(l[0].GetName() == parent.GetName());
+        QVERIFY(l[0].GetId() != parent.GetId());
+        QVERIFY(1 == l[0].Values().length());
+        QVERIFY(l[0].Values()[0].GetName() == "user");
+        QVERIFY(l[0].Values()[0].GetValue() == "gps value");
+        QVERIFY(l[0].Values()[0].GetNotes() == "gps note");
+        QVERIFY(l[0].Values()[0].GetIsHidden());
+        QVERIFY(0 == l[0].GetFavoriteIndex());
+
+        l = import_db.FindEntriesByParentId(l[0].GetId());
+        QVERIFY(1 == l.length());
+        QVERIFY(l[0].GetName() == child.GetName());
+        QVERIFY(l[0].GetFileName() == child.GetFileName());
+        QVERIFY(!l[0].GetFileId().IsNull());
+        QVERIFY(l[0].GetFileId() != child.GetFileId());
+        QVERIFY(import_db.GetFile(l[0].GetFileId()) == file_contents);
+        QVERIFY((uint)file_contents.length() ==
+                import_db.QueryFileSummary()[l[0].GetFileId()].Size);
+        QVERIFY(0 == l[0].GetFavoriteIndex());
+        QVERIFY(2 == import_db.FindFavoriteIds().length());
+    }
+    QVERIFY(QFile::remove(gps_filepath));
+    QVERIFY(QFile::remove(import_filepath));
+}
+
+void DatabaseTest::test_xml_export_files()
+{
+    const char *xml_filepath = "testdb_export.xml";
+    const char *export_filepath = "testdb_xml_export.sqlite";
+    const char *import_filepath = "testdb_xml_import.sqlite";
+    QFile::remove(xml_filepath);
+    QFile::remove(export_filepath);
+    QFile::remove(import_filepath);
+
+    // Bigger than a compression block, and partly random so the
+    //  blocks compress to different sizes
+    QByteArray file_contents(2500000, 'x');
+    GUtil::CryptoPP::RNG().Fill((byte *)file_contents.data() + 1000000, 100000);
+
+    Entry e;
+    e.SetName("xml entry");
+    e.SetFileName("big.bin");
+    {
+        PasswordDatabase export_db(export_filepath);
+        export_db.Open(creds);
+        FileId fid = FileId::NewId();
+        export_db.AddFile(fid, file_contents);
+        e.SetFileId(fid);
+        export_db.AddEntry(e);
+
+        // Some children, to check the hierarchy survives
+        for(int i = 0; i < 3; ++i){
+            Entry child;
+            child.SetName(QString("xml child %1").arg(i));
+            child.SetParentId(e.GetId());
+            child.SetRow(i);
+            export_db.AddEntry(child);
+        }
+        export_db.ExportToXml(xml_filepath);
+        export_db.WaitForThreadIdle();
+    }
+
+    // The file is written in compressed blocks
+    {
+        QFile f(xml_filepath);
+        QVERIFY(f.open(QFile::ReadOnly));
+        const QByteArray xml = f.readAll();
+        QVERIFY(xml.contains("comp=\"2\""));
+        QVERIFY(xml.length() < file_contents.length());
+    }
+
+    {
+        PasswordDatabase import_db(import_filepath);
+        import_db.Open(creds);
+        import_db.ImportFromXml(xml_filepath);
+        import_db.WaitForThreadIdle();
+
+        QList<Entry> roots = import_db.FindEntriesByParentId(EntryId::Null());
+        QVERIFY(1 == roots.length());
+        QList<Entry> l = import_db.FindEntriesByParentId(roots[0].GetId());
+        QVERIFY(1 == l.length());
+        QVERIFY(l[0].GetName() == e.GetName());
+        QVERIFY(l[0].GetFileName() == e.GetFileName());
+        QVERIFY(import_db.GetFile(l[0].GetFileId()) == file_contents);
+
+        l = import_db.FindEntriesByParentId(l[0].GetId());
+        QVERIFY(3 == l.length());
+        for(int i = 0; i < 3; ++i){
+            QVERIFY(l[i].GetName() == QString("xml child %1").arg(i));
+            QVERIFY(l[i].GetRow() == i);
+        }
+    }
+    QVERIFY(QFile::remove(xml_filepath));
+    QVERIFY(QFile::remove(export_filepath));
+    QVERIFY(QFile::remove(import_filepath));
+}
+
+// Resets the peak resident set size, so we can see how high it goes from here
+static bool __reset_peak_resident_bytes()
+{
+#ifdef Q_OS_LINUX
+    QFile f("/proc/self/clear_refs");
+    return f.open(QFile::WriteOnly) && 1 == f.write("5");
+#else
+    return false;
+#endif
+}
+
+// Returns the peak resident set size in bytes, or -1 if we can't tell
+static qint64 __peak_resident_bytes()
+{
+#ifdef Q_OS_LINUX
+    QFile f("/proc/self/status");
+    if(f.open(QFile::ReadOnly)){
+        for(QByteArray line = f.readLine(); !line.isEmpty(); line = f.readLine()){
+            if(line.startsWith("VmHWM:"))
+                return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+        }
+    }
+#endif
+    return -1;
+}
+
+void DatabaseTest::test_xml_export_memory()
+{
+    const char *file_path = "testdb_export_memory.bin";
+    const char *xml_filepath = "testdb_export_memory.xml";
+    const char *export_filepath = "testdb_export_memory.sqlite";
+    QFile::remove(xml_filepath);
+    QFile::remove(export_filepath);
+    if(!__reset_peak_resident_bytes())
+        QSKIP("Cannot measure the peak resident memory on this system");
+
+    const int file_size = 64 * 1024 * 1024;
+    {
+        QFile f(file_path);
+        QVERIFY(f.open(QFile::WriteOnly | QFile::Truncate));
+        const QByteArray chunk(1024 * 1024, 'x');
+        for(int i = 0; i < file_size / chunk.length(); ++i)
+            QVERIFY(chunk.length() == f.write(chunk));
+    }
+
+    {
+        PasswordDatabase export_db(export_filepath);
+        export_db.Open(creds);
+        Entry e;
+        e.SetName("big file");
+        e.SetFileName("big.bin");
+        e.SetFileId(FileId::NewId());
+        export_db.AddFile(e.GetFileId(), file_path);
+        export_db.AddEntry(e);
+        export_db.WaitForThreadIdle();
+
+        __reset_peak_resident_bytes();
+        const qint64 before = __peak_resident_bytes();
+        export_db.ExportToXml(xml_filepath);
+        export_db.WaitForThreadIdle();
+        const qint64 growth = __peak_resident_bytes() - before;
+
+        // The file is read in chunks, so we never come close to holding all of it
+        QVERIFY2(growth < file_size / 4,
+                 QString("Exporting grew the peak memory by %1 bytes").arg(growth).toUtf8());
+    }
+    QVERIFY(QFile::remove(file_path));
+    QVERIFY(QFile::remove(xml_filepath));
+    QVERIFY(QFile::remove(export_filepath));
+}
+
+void DatabaseTest::test_xml_import_invalid()
+{
+    const char *xml_filepath = "testdb_invalid.xml";
+    const char *import_filepath = "testdb_invalid_import.sqlite";
+    QFile::remove(xml_filepath);
+    QFile::remove(import_filepath);
+
+    // Returns how many entries were imported from the given entries
+    auto import_entries = [&](const QByteArray &entries_xml) -> int{
+        {
+            QFile f(xml_filepath);
+            f.open(QFile::WriteOnly | QFile::Truncate);
+            f.write("<grypto_data version=\"3.1\"><entries>" + entries_xml +
+                    "</entries></grypto_data>");
+        }
+        int ret;
+        {
+            PasswordDatabase import_db(import_filepath);
+            import_db.Open(creds);
+            import_db.ImportFromXml(xml_filepath);
+            import_db.WaitForThreadIdle();
+            ret = import_db.CountAllEntries();
+        }
+        QFile::remove(import_filepath);
+        return ret;
+    };
+
+    // The root and both of its entries
+    QVERIFY(3 == import_entries("<e name=\"a\" id=\"0\" row=\"0\"/>"
+                                "<e name=\"b\" id=\"1\" pid=\"0\" row=\"0\"/>"));
+
+    // A parent that isn't defined
+    QVERIFY(0 == import_entries("<e name=\"a\" id=\"0\" row=\"0\"/>"
+                                "<e name=\"b\" id=\"1\" pid=\"5\" row=\"0\"/>"));
+
+    // A file that isn't defined
+    QVERIFY(0 == import_entries("<e name=\"a\" id=\"0\" row=\"0\" fid=\"3\" fname=\"x\"/>"));
+
+    // Parents that go around in a circle
+    QVERIFY(0 == import_entries("<e name=\"a\" id=\"0\" pid=\"1\" row=\"0\"/>"
+                                "<e name=\"b\" id=\"1\" pid=\"0\" row=\"0\"/>"));
+
+    // The same entry twice
+    QVERIFY(0 == import_entries("<e name=\"a\" id=\"0\" row=\"0\"/>"
+                                "<e name=\"b\" id=\"0\" row=\"1\"/>"));
+
+    QVERIFY(QFile::remove(xml_filepath));
+}
+
 void DatabaseTest::cleanupTestCase()
 {
     delete db;
@@ -662,6 +1834,344 @@ void DatabaseTest::cleanupTestCase()
 }
 
 
+void DatabaseTest::test_upgrade_3_0()
+{
+    const char *upgrade_filepath = "testdb_upgrade.sqlite";
+    const QString conn_str = "test_upgrade_3_0";
+    QFile::remove(upgrade_filepath);
+    {
+        PasswordDatabase v(upgrade_filepath);
+        v.Open(creds);
+        const FileId fid = FileId::NewId();
+        v.AddFile(fid, QByteArray(100, 'u'));
+        Entry e;
+        e.SetName("old entry");
+        e.SetFileId(fid);
+        e.SetFileName("old file");
+        v.AddEntry(e);
+        v.WaitForThreadIdle();
+    }
+
+    // Make it look like a 3.0.0 vault, which had no change log
+    {
+        QSqlDatabase udb = QSqlDatabase::addDatabase("QSQLITE", conn_str);
+        udb.setDatabaseName(upgrade_filepath);
+        QVERIFY(udb.open());
+        QSqlQuery q(udb);
+        QStringList triggers;
+        QVERIFY(q.exec("SELECT name FROM sqlite_master WHERE type='trigger'"));
+        while(q.next())
+            triggers.append(q.value(0).toString());
+        QVERIFY(!triggers.isEmpty());
+        for(const QString &t : triggers)
+            QVERIFY(q.exec(QString("DROP TRIGGER %1").arg(t)));
+        QVERIFY(q.exec("DROP TABLE ChangeLog"));
+        QVERIFY(q.exec("UPDATE Version SET Version='3.0.0'"));
+    }
+    QSqlDatabase::removeDatabase(conn_str);
+
+    // The wrong password leaves it as it was
+    {
+        Credentials bad_creds(creds);
+        bad_creds.Password = "wrong password";
+        PasswordDatabase v(upgrade_filepath);
+        bool exception_hit = false;
+        try{
+            v.Open(bad_creds);
+        }
+        catch(...){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+    }
+    {
+        QSqlDatabase udb = QSqlDatabase::addDatabase("QSQLITE", conn_str);
+        udb.setDatabaseName(upgrade_filepath);
+        QVERIFY(udb.open());
+        QSqlQuery q(udb);
+        QVERIFY(q.exec("SELECT Version FROM Version"));
+        QVERIFY(q.next());
+        QVERIFY(q.value(0).toString() == "3.0.0");
+    }
+    QSqlDatabase::removeDatabase(conn_str);
+
+    {
+        PasswordDatabase v(upgrade_filepath);
+        v.Open(creds);
+        QVERIFY(1 == v.CountAllEntries());
+    }
+
+    // It was upgraded, with what was there already in the change log
+    {
+        QSqlDatabase udb = QSqlDatabase::addDatabase("QSQLITE", conn_str);
+        udb.setDatabaseName(upgrade_filepath);
+        QVERIFY(udb.open());
+        QSqlQuery q(udb);
+        QVERIFY(q.exec("SELECT Version FROM Version"));
+        QVERIFY(q.next());
+        QVERIFY(q.value(0).toString() == "3.1.0");
+        QVERIFY(q.exec("SELECT COUNT(*),COUNT(DISTINCT Seq) FROM ChangeLog"));
+        QVERIFY(q.next());
+        QVERIFY(2 == q.value(0).toInt());
+        QVERIFY(2 == q.value(1).toInt());
+    }
+    QSqlDatabase::removeDatabase(conn_str);
+    QVERIFY(QFile::remove(upgrade_filepath));
+}
+
+void DatabaseTest::test_backup_restore()
+{
+    const char *vault_filepath = "testdb_backup.sqlite";
+    const char *full_filepath = "testdb_backup_full.gps";
+    const char *delta_filepath = "testdb_backup_delta.gps";
+    const char *restore_filepath = "testdb_restore.sqlite";
+    for(const char *f : {vault_filepath, full_filepath, delta_filepath, restore_filepath})
+        QFile::remove(f);
+
+    const QByteArray file1(100000, 'a'), file2(50000, 'b');
+    const FileId fid1 = FileId::NewId(), fid2 = FileId::NewId();
+    Entry kept, changed, deleted, added;
+    QString token;
+    {
+        PasswordDatabase db(vault_filepath);
+        db.Open(creds);
+
+        kept.SetName("kept");
+        db.AddEntry(kept);
+        changed.SetName("changed");
+        changed.SetParentId(kept.GetId());
+        db.AddEntry(changed);
+        deleted.SetName("deleted");
+        db.AddEntry(deleted);
+        db.AddFile(fid1, file1);
+        db.WaitForThreadIdle();
+
+        const QString full_token = db.Backup(full_filepath, creds);
+        QVERIFY(!full_token.isEmpty());
+
+        // Nothing changed, so the token is the same
+        QVERIFY(full_token == db.Backup(delta_filepath, creds, full_token));
+
+        QVERIFY(QFile::remove(delta_filepath));
+
+        changed.SetName("changed again");
+        db.UpdateEntry(changed);
+        db.DeleteEntry(deleted.GetId());
+        added.SetName("added");
+        added.SetParentId(kept.GetId());
+        db.AddEntry(added);
+        db.DeleteFile(fid1);
+        db.AddFile(fid2, file2);
+        db.WaitForThreadIdle();
+
+        token = db.Backup(delta_filepath, creds, full_token);
+        QVERIFY(token != full_token);
+
+        // A token from another vault is refused
+        bool exception_hit = false;
+        try{
+            db.Backup(delta_filepath + QString(".bad"), creds, "0000000000000000:1");
+        }
+        catch(...){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+        QFile::remove(delta_filepath + QString(".bad"));
+    }
+
+    // The delta can't be restored without the full backup before it
+    bool exception_hit = false;
+    try{
+        PasswordDatabase::RestoreBackup(restore_filepath, {delta_filepath}, creds);
+    }
+    catch(...){
+        exception_hit = true;
+    }
+    QVERIFY(exception_hit);
+    QVERIFY(!QFile::exists(restore_filepath));
+
+    PasswordDatabase::RestoreBackup(restore_filepath, {full_filepath, delta_filepath}, creds);
+    {
+        PasswordDatabase db(restore_filepath);
+        db.Open(creds);
+
+        QList<Entry> l = db.FindEntriesByParentId(EntryId::Null());
+        QVERIFY(1 == l.length());
+        QVERIFY(l[0].GetId() == kept.GetId());
+
+        l = db.FindEntriesByParentId(kept.GetId());
+        QVERIFY(2 == l.length());
+        QVERIFY(db.FindEntry(changed.GetId()).GetName() == "changed again");
+        QVERIFY(db.FindEntry(added.GetId()).GetName() == "added");
+
+        QVERIFY(db.GetFile(fid2) == file2);
+        QVERIFY(1 == db.QueryFileSummary().count());
+
+        // The restored vault carries on from the last backup's token
+        QVERIFY(token == db.Backup(delta_filepath + QString(".next"), creds, token));
+    }
+    QVERIFY(QFile::remove(delta_filepath + QString(".next")));
+
+    for(const char *f : {vault_filepath, full_filepath, delta_filepath, restore_filepath})
+        QVERIFY(QFile::remove(f));
+}
+
+
+void DatabaseTest::test_hot_backup()
+{
+    const char *vault_filepath = "testdb_hot.sqlite";
+    const char *backup_filepath = "testdb_hot_backup.sqlite";
+    QFile::remove(vault_filepath);
+    QFile::remove(backup_filepath);
+
+    const QByteArray file_contents(200000, 'h');
+    const FileId fid = FileId::NewId();
+    QList<Entry> entries;
+    {
+        PasswordDatabase db(vault_filepath);
+        db.Open(creds);
+        for(int i = 0; i < 50; ++i){
+            Entry e;
+            e.SetName(QString("hot %1").arg(i));
+            entries.append(e);
+        }
+        db.AddEntries(entries);
+        db.AddFile(fid, file_contents);
+        db.WaitForThreadIdle();
+
+        entries[0].SetName("edited");
+        db.UpdateEntry(entries[0]);
+        db.WaitForThreadIdle();
+
+        // One page at a time, so there are lots of steps
+        int last_progress = -1;
+        bool progress_backwards = false;
+        connect(&db, &PasswordDatabase::NotifyProgressUpdated, [&](int p, bool, const QString &){
+            progress_backwards = progress_backwards || p < last_progress;
+            last_progress = p;
+        });
+        db.HotBackup(backup_filepath, 1, 0);
+        QVERIFY(!progress_backwards);
+        QVERIFY(100 == last_progress);
+        QVERIFY(!QFile::exists(backup_filepath + QString(".part")));
+
+        // The vault is still usable after the backup
+        Entry e;
+        e.SetName("after backup");
+        db.AddEntry(e);
+        db.WaitForThreadIdle();
+    }
+
+    PasswordDatabase::ValidateDatabase(backup_filepath);
+    {
+        PasswordDatabase db(backup_filepath);
+        db.Open(creds);
+        QList<Entry> l = db.FindEntriesByParentId(EntryId::Null());
+        QVERIFY(entries.length() == l.length());
+        QVERIFY(db.FindEntry(entries[0].GetId()).GetName() == "edited");
+        QVERIFY(db.GetFile(fid) == file_contents);
+    }
+    QVERIFY(QFile::remove(vault_filepath));
+    QVERIFY(QFile::remove(backup_filepath));
+}
+
+
+void DatabaseTest::test_sync()
+{
+    const char *laptop_filepath = "testdb_sync_laptop.sqlite";
+    const char *server_filepath = "testdb_sync_server.sqlite";
+    QFile::remove(laptop_filepath);
+    QFile::remove(server_filepath);
+
+    const QDateTime then = QDateTime::currentDateTime().addDays(-1);
+    Entry edited, deleted, both, moved;
+    {
+        PasswordDatabase db(laptop_filepath);
+        db.Open(creds);
+        for(Entry *e : {&edited, &deleted, &both, &moved}){
+            e->SetName("original");
+            e->SetModifyDate(then);
+            db.AddEntry(*e);
+        }
+        db.WaitForThreadIdle();
+    }
+    QVERIFY(QFile::copy(laptop_filepath, server_filepath));
+
+    const QByteArray file_contents(10000, 's');
+    const FileId fid = FileId::NewId();
+    Entry added;
+    {
+        PasswordDatabase laptop(laptop_filepath);
+        laptop.Open(creds);
+        PasswordDatabase server(server_filepath);
+        server.Open(creds);
+
+        // The copies are the same, so there's nothing to do
+        PasswordDatabase::SyncResult r = laptop.Sync(server);
+        QVERIFY(0 == r.EntriesSent && 0 == r.EntriesReceived);
+        QVERIFY(0 == r.FilesSent && 0 == r.FilesReceived);
+        QVERIFY(r.Conflicts.isEmpty());
+
+        edited.SetName("edited on the laptop");
+        edited.SetModifyDate(then.addSecs(60));
+        laptop.UpdateEntry(edited);
+        laptop.AddFile(fid, file_contents);
+        laptop.MoveEntries(EntryId::Null(), 3, 3, edited.GetId(), 0);
+
+        server.DeleteEntry(deleted.GetId());
+        added.SetName("added on the server");
+        added.SetParentId(both.GetId());
+        server.AddEntry(added);
+
+        // The server's edit is newer, so it wins
+        both.SetName("laptop");
+        both.SetModifyDate(then.addSecs(60));
+        laptop.UpdateEntry(both);
+        both.SetName("server");
+        both.SetModifyDate(then.addSecs(120));
+        server.UpdateEntry(both);
+
+        r = laptop.Sync(server, r.Token);
+        QVERIFY(1 == r.Conflicts.length() && both.GetId() == r.Conflicts[0]);
+        QVERIFY(1 == r.FilesSent && 0 == r.FilesReceived);
+
+        for(PasswordDatabase *db : {&laptop, &server}){
+            QVERIFY(db->FindEntry(edited.GetId()).GetName() == "edited on the laptop");
+            QVERIFY(db->FindEntry(both.GetId()).GetName() == "server");
+            QVERIFY(db->FindEntry(added.GetId()).GetParentId() == both.GetId());
+            QVERIFY(db->FindEntry(moved.GetId()).GetParentId() == edited.GetId());
+            QVERIFY(2 == db->CountEntriesByParentId(EntryId::Null()));
+            QVERIFY(db->GetFile(fid) == file_contents);
+        }
+
+        // Now they're the same again
+        r = laptop.Sync(server, r.Token);
+        QVERIFY(0 == r.EntriesSent && 0 == r.EntriesReceived);
+        QVERIFY(0 == r.FilesSent && 0 == r.FilesReceived);
+    }
+
+    // Different vaults can't be synced
+    {
+        PasswordDatabase laptop(laptop_filepath);
+        laptop.Open(creds);
+        QFile::remove("testdb_sync_other.sqlite");
+        PasswordDatabase other("testdb_sync_other.sqlite");
+        other.Open(creds);
+        bool exception_hit = false;
+        try{
+            laptop.Sync(other);
+        }
+        catch(...){
+            exception_hit = true;
+        }
+        QVERIFY(exception_hit);
+    }
+    QVERIFY(QFile::remove("testdb_sync_other.sqlite"));
+    QVERIFY(QFile::remove(laptop_filepath));
+    QVERIFY(QFile::remove(server_filepath));
+}
+
+
 QTEST_MAIN(DatabaseTest)
 
 #include "tst_databasetest.moc"
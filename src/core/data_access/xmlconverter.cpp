@@ -16,6 +16,8 @@ limitations under the License.*/
 #include <grypto/entry.h>
 #include <gutil/databaseutils.h>
 #include <QDomDocument>
+#include <QXmlStreamWriter>
+#include <QXmlStreamReader>
 USING_NAMESPACE_GUTIL1(Qt);
 USING_NAMESPACE_GUTIL;
 
@@ -46,6 +48,8 @@ template<>QDomNode XmlConverter::AppendToXmlNode(const Entry &e, QDomNode &root,
         if(everything)
             entry_root.setAttribute("file_id", e.GetFileId().ToQByteArray().toBase64().constData());
     }
+    if(everything && e.IsFavorite())
+        entry_root.setAttribute("favorite", e.GetFavoriteIndex());
 
     foreach(const SecretValue &sv, e.Values())
     {
@@ -61,6 +65,33 @@ template<>QDomNode XmlConverter::AppendToXmlNode(const Entry &e, QDomNode &root,
     return ret;
 }
 
+template<>void XmlConverter::WriteStartElement(const Entry &e, QXmlStreamWriter &sw, bool everything)
+{
+    sw.writeStartElement(ENTRY_XML_NAME);
+    sw.writeAttribute("name", e.GetName().toUtf8().toBase64().constData());
+    sw.writeAttribute("desc", e.GetDescription().toUtf8().toBase64().constData());
+    sw.writeAttribute("modified", DatabaseUtils::ConvertDateToString(e.GetModifyDate()));
+    if(!e.GetFileId().IsNull()){
+        sw.writeAttribute("file_name", e.GetFileName().toUtf8().toBase64().constData());
+        if(everything)
+            sw.writeAttribute("file_id", e.GetFileId().ToQByteArray().toBase64().constData());
+    }
+    if(everything && e.IsFavorite())
+        sw.writeAttribute("favorite", QString::number(e.GetFavoriteIndex()));
+
+    foreach(const SecretValue &sv, e.Values())
+    {
+        sw.writeStartElement(VALUE_XML_NAME);
+        sw.writeAttribute("name", sv.GetName().toUtf8().toBase64().constData());
+        if(!sv.GetNotes().isEmpty())
+            sw.writeAttribute("note", sv.GetNotes().toUtf8().toBase64().constData());
+        if(sv.GetIsHidden())
+            sw.writeAttribute("hide", "1");
+        sw.writeAttribute("value", sv.GetValue().toUtf8().toBase64().constData());
+        sw.writeEndElement();
+    }
+}
+
 template<>Entry XmlConverter::FromXmlNode(const QDomElement &elt)
 {
     if(elt.isNull())
@@ -75,6 +106,8 @@ template<>Entry XmlConverter::FromXmlNode(const QDomElement &elt)
         ret.SetFileName(QByteArray::fromBase64(elt.attribute("file_name").toUtf8()));
     if(elt.attributes().contains("file_id"))
         ret.SetFileId(QByteArray::fromBase64(elt.attribute("file_id").toUtf8()));
+    if(elt.attributes().contains("favorite"))
+        ret.SetFavoriteIndex(elt.attribute("favorite").toInt());
 
     QDomNodeList nl = elt.childNodes();
     for(int i = 0; i < nl.count(); ++i)
@@ -102,6 +135,42 @@ template<>Entry XmlConverter::FromXmlNode(const QDomElement &elt)
     return ret;
 }
 
+template<>Entry XmlConverter::ReadStartElement(const QXmlStreamReader &sr)
+{
+    if(!sr.isStartElement() || sr.name() != ENTRY_XML_NAME)
+        throw XmlException<>("Invalid entry XML");
+
+    const QXmlStreamAttributes attrs = sr.attributes();
+    Entry ret;
+    ret.SetName(QByteArray::fromBase64(attrs.value("name").toUtf8()));
+    ret.SetDescription(QByteArray::fromBase64(attrs.value("desc").toUtf8()));
+    ret.SetModifyDate(DatabaseUtils::ConvertStringToDate(attrs.value("modified").toString()));
+    if(attrs.hasAttribute("file_name"))
+        ret.SetFileName(QByteArray::fromBase64(attrs.value("file_name").toUtf8()));
+    if(attrs.hasAttribute("file_id"))
+        ret.SetFileId(QByteArray::fromBase64(attrs.value("file_id").toUtf8()));
+    if(attrs.hasAttribute("favorite"))
+        ret.SetFavoriteIndex(attrs.value("favorite").toInt());
+    return ret;
+}
+
+template<>SecretValue XmlConverter::ReadStartElement(const QXmlStreamReader &sr)
+{
+    if(!sr.isStartElement() || sr.name() != VALUE_XML_NAME)
+        throw XmlException<>("Invalid secret value XML");
+
+    const QXmlStreamAttributes attrs = sr.attributes();
+    SecretValue ret;
+    ret.SetName(QByteArray::fromBase64(attrs.value("name").toUtf8()));
+    if(attrs.hasAttribute("note"))
+        ret.SetNotes(QByteArray::fromBase64(attrs.value("note").toUtf8()));
+    if(attrs.hasAttribute("hide"))
+        ret.SetIsHidden(attrs.value("hide").toInt() != 0);
+    if(attrs.hasAttribute("value"))
+        ret.SetValue(QString::fromUtf8(QByteArray::fromBase64(attrs.value("value").toUtf8())));
+    return ret;
+}
+
 template<>Entry XmlConverter::FromXmlString(const QByteArray &xml)
 {
     QDomDocument xdoc;
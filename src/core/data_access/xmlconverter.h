@@ -19,9 +19,12 @@ class QByteArray;
 class QDomNode;
 class QDomElement;
 class QDomDocument;
+class QXmlStreamWriter;
+class QXmlStreamReader;
 
 namespace Grypt{
 class Entry;
+class SecretValue;
 
 
 /** A static class that has functions to serialize certain objects to XML.
@@ -59,6 +62,19 @@ public:
     */
     template<class T>static QDomNode AppendToXmlNode(const T &, QDomNode &, QDomDocument &, bool everything = false);
 
+    /** A generic function to write the object to an XML stream, in the same
+     *  format as AppendToXmlNode(), without building a document in memory.
+     *  The element is left open so you can write children into it, so you
+     *  must close it with writeEndElement().
+    */
+    template<class T>static void WriteStartElement(const T &, QXmlStreamWriter &, bool everything = false);
+
+    /** A generic function to read the object from the start element that the
+     *  stream is on, in the format written by WriteStartElement(). It only reads
+     *  the element's attributes, so you still have to read the children.
+    */
+    template<class T>static T ReadStartElement(const QXmlStreamReader &);
+
 };
 
 
@@ -69,6 +85,9 @@ template<>Entry XmlConverter::FromXmlString(const QByteArray &xml);
 template<>Entry XmlConverter::FromXmlNode(const QDomElement &);
 template<>QByteArray XmlConverter::ToXmlString(const Entry &, bool, bool);
 template<>QDomNode XmlConverter::AppendToXmlNode(const Entry &, QDomNode &, QDomDocument &, bool);
+template<>void XmlConverter::WriteStartElement(const Entry &, QXmlStreamWriter &, bool);
+template<>Entry XmlConverter::ReadStartElement(const QXmlStreamReader &);
+template<>SecretValue XmlConverter::ReadStartElement(const QXmlStreamReader &);
 /** \} */
 
 }
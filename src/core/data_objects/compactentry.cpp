@@ -0,0 +1,151 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "compactentry.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+using namespace std;
+
+// Marks an invalid modify date
+#define INVALID_DATE    (-0x7fffffffffffffffLL - 1)
+
+NAMESPACE_GRYPTO;
+
+
+CompactEntry::CompactEntry()
+    :m_data(0)
+{
+    _init(Entry());
+}
+
+CompactEntry::CompactEntry(const Entry &e)
+    :m_data(0)
+{
+    _init(e);
+}
+
+CompactEntry::CompactEntry(const CompactEntry &o)
+    :m_data(0)
+{
+    _copy(o);
+}
+
+CompactEntry &CompactEntry::operator = (const CompactEntry &o)
+{
+    if(this != &o){
+        _free();
+        _copy(o);
+    }
+    return *this;
+}
+
+CompactEntry::~CompactEntry()
+{
+    _free();
+}
+
+void CompactEntry::_init(const Entry &e)
+{
+    const QByteArray text[3] = {
+        e.GetName().toUtf8(),
+        e.GetDescription().toUtf8(),
+        e.GetFileName().toUtf8()
+    };
+    int len = sizeof(header_t);
+    for(const QByteArray &t : text)
+        len += t.length();
+
+    m_data = reinterpret_cast<char *>(malloc(len));
+    if(!m_data)
+        throw bad_alloc();
+
+    header_t *h = new(m_data) header_t;
+    h->id = e.GetId();
+    h->parent_id = e.GetParentId();
+    h->file_id = e.GetFileId();
+    h->modify_date = e.GetModifyDate().isValid() ?
+                e.GetModifyDate().toMSecsSinceEpoch() : INVALID_DATE;
+    h->time_spec = e.GetModifyDate().timeSpec();
+    h->row = e.GetRow();
+    h->favorite_index = e.GetFavoriteIndex();
+
+    char *cur = m_data + sizeof(header_t);
+    for(int i = 0; i < 3; ++i){
+        h->lengths[i] = text[i].length();
+        memcpy(cur, text[i].constData(), text[i].length());
+        cur += text[i].length();
+    }
+}
+
+void CompactEntry::_copy(const CompactEntry &o)
+{
+    const int len = o.AllocatedSize();
+    m_data = reinterpret_cast<char *>(malloc(len));
+    if(!m_data)
+        throw bad_alloc();
+
+    new(m_data) header_t(*o._header());
+    memcpy(m_data + sizeof(header_t), o.m_data + sizeof(header_t), len - sizeof(header_t));
+}
+
+void CompactEntry::_free()
+{
+    if(m_data){
+        _header()->~header_t();
+        free(m_data);
+        m_data = 0;
+    }
+}
+
+QByteArray CompactEntry::_view(int field) const
+{
+    const header_t *h = _header();
+    const char *start = m_data + sizeof(header_t);
+    for(int i = 0; i < field; ++i)
+        start += h->lengths[i];
+    return QByteArray::fromRawData(start, h->lengths[field]);
+}
+
+int CompactEntry::AllocatedSize() const
+{
+    const header_t *h = _header();
+    return sizeof(header_t) + h->lengths[0] + h->lengths[1] + h->lengths[2];
+}
+
+QDateTime CompactEntry::GetModifyDate() const
+{
+    const header_t *h = _header();
+    if(INVALID_DATE == h->modify_date)
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(h->modify_date).toTimeSpec((Qt::TimeSpec)h->time_spec);
+}
+
+Entry CompactEntry::ToEntry() const
+{
+    Entry ret;
+    ret.SetId(GetId());
+    ret.SetParentId(GetParentId());
+    ret.SetRow(GetRow());
+    ret.SetName(GetName());
+    ret.SetDescription(GetDescription());
+    ret.SetFavoriteIndex(GetFavoriteIndex());
+    ret.SetModifyDate(GetModifyDate());
+    ret.SetFileId(GetFileId());
+    ret.SetFileName(GetFileName());
+    return ret;
+}
+
+
+END_NAMESPACE_GRYPTO;
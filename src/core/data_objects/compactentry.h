@@ -0,0 +1,109 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_COMPACTENTRY_H
+#define GRYPTO_COMPACTENTRY_H
+
+#include <grypto/entry.h>
+#include <QByteArray>
+
+NAMESPACE_GRYPTO;
+
+
+/** A memory-efficient, read-mostly copy of an entry's display fields.
+ *
+ *  The whole entry lives in one heap block: a fixed-size header with the ids,
+ *  row, favorite index and modify date, followed by the name, description
+ *  and file name encoded as UTF-8. A regular Entry needs a separate
+ *  allocation for each string (in UTF-16) plus one for the date, so this
+ *  is much smaller when holding many entries in memory.
+ *
+ *  There are no secret values. The fixed-size fields may be changed in place,
+ *  but to change the text you must assign a new CompactEntry.
+*/
+class CompactEntry
+{
+public:
+
+    CompactEntry();
+    explicit CompactEntry(const Entry &);
+    CompactEntry(const CompactEntry &);
+    CompactEntry &operator = (const CompactEntry &);
+    ~CompactEntry();
+
+    /** Converts back to a regular entry, which has no secret values. */
+    Entry ToEntry() const;
+
+    EntryId const &GetId() const{ return _header()->id; }
+
+    EntryId const &GetParentId() const{ return _header()->parent_id; }
+    void SetParentId(const EntryId &id){ _header()->parent_id = id; }
+
+    int GetRow() const{ return _header()->row; }
+    void SetRow(int r){ _header()->row = r; }
+
+    int GetFavoriteIndex() const{ return _header()->favorite_index; }
+    void SetFavoriteIndex(int i){ _header()->favorite_index = i; }
+    bool IsFavorite() const{ return 0 <= GetFavoriteIndex(); }
+
+    FileId const &GetFileId() const{ return _header()->file_id; }
+
+    QDateTime GetModifyDate() const;
+
+    /** These decode the UTF-8 text, so prefer the Utf8 views in tight loops. */
+    QString GetName() const{ return QString::fromUtf8(NameUtf8()); }
+    QString GetDescription() const{ return QString::fromUtf8(DescriptionUtf8()); }
+    QString GetFileName() const{ return QString::fromUtf8(FileNameUtf8()); }
+
+    /** Views of the UTF-8 text, which do not copy it. They are only valid
+     *  as long as this object is.
+    */
+    QByteArray NameUtf8() const{ return _view(0); }
+    QByteArray DescriptionUtf8() const{ return _view(1); }
+    QByteArray FileNameUtf8() const{ return _view(2); }
+
+    /** Returns the number of bytes allocated on the heap for this entry. */
+    int AllocatedSize() const;
+
+
+private:
+
+    struct header_t{
+        EntryId id;
+        EntryId parent_id;
+        FileId file_id;
+        qint64 modify_date;
+        qint32 time_spec;
+        qint32 row;
+        qint32 favorite_index;
+
+        // The byte lengths of the text fields, which follow the header
+        quint32 lengths[3];
+    };
+
+    char *m_data;
+
+    header_t *_header(){ return reinterpret_cast<header_t *>(m_data); }
+    header_t const *_header() const{ return reinterpret_cast<header_t const *>(m_data); }
+    QByteArray _view(int field) const;
+    void _init(const Entry &);
+    void _copy(const CompactEntry &);
+    void _free();
+
+};
+
+
+END_NAMESPACE_GRYPTO;
+
+#endif // GRYPTO_COMPACTENTRY_H
@@ -1,6 +1,8 @@
 
 HEADERS += \
     data_objects/entry.h \
-	data_objects/secret_value.h
+	data_objects/secret_value.h \
+    data_objects/compactentry.h
 
-SOURCES +=
+SOURCES += \
+    data_objects/compactentry.cpp
@@ -29,11 +29,30 @@ public:
         :_p_IsHidden(false)
     {}
 
+    /** Zeroes the secret strings if this is the last copy of them. */
+    ~SecretValue(){
+        _wipe(_p_Value);
+        _wipe(_p_Notes);
+    }
+
     PROPERTY(Name, QString);
     PROPERTY(Value, QString);
     PROPERTY(Notes, QString);
     PROPERTY(IsHidden, bool);
 
+
+private:
+
+    static void _wipe(QString &s){
+        // QString is implicitly shared, so only wipe it if we hold the only
+        //  reference. Calling data() on a detached string does not copy it.
+        if(s.isDetached()){
+            volatile ushort *c = reinterpret_cast<volatile ushort *>(s.data());
+            for(int i = 0; i < s.length(); ++i)
+                c[i] = 0;
+        }
+    }
+
 };
 
 
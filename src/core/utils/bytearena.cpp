@@ -0,0 +1,76 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "bytearena.h"
+#include <cstring>
+using namespace std;
+
+namespace Grypt{
+
+
+const int ByteArena::ChunkSize;
+
+ByteArena::ByteArena()
+    :m_used(0),
+      m_capacity(0),
+      m_generation(1),
+      m_liveBytes(0),
+      m_deadBytes(0)
+{}
+
+ByteArena::Slice ByteArena::Intern(const Slice &s)
+{
+    if(s.m_chunk && s.m_generation == m_generation)
+        return s;
+
+    Slice ret;
+    ret.m_length = s.m_length;
+    ret.m_generation = m_generation;
+    if(0 < s.m_length){
+        if(m_capacity - m_used < s.m_length){
+            // Start a new chunk. The old one lives on as long as slices refer to it
+            m_capacity = max(ChunkSize, s.m_length);
+            m_chunk.reset(new char[m_capacity], default_delete<char[]>());
+            m_used = 0;
+        }
+        memcpy(m_chunk.get() + m_used, s.Data().constData(), s.m_length);
+        ret.m_chunk = m_chunk;
+        ret.m_offset = m_used;
+        m_used += s.m_length;
+    }
+    m_liveBytes += s.m_length;
+    return ret;
+}
+
+void ByteArena::Release(const Slice &s)
+{
+    // Slices from an old generation no longer take up space in this one
+    if(s.m_chunk && s.m_generation == m_generation){
+        m_liveBytes -= s.m_length;
+        m_deadBytes += s.m_length;
+    }
+}
+
+void ByteArena::Compact()
+{
+    ++m_generation;
+    m_chunk.reset();
+    m_used = 0;
+    m_capacity = 0;
+    m_liveBytes = 0;
+    m_deadBytes = 0;
+}
+
+
+}
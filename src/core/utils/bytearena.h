@@ -0,0 +1,115 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_BYTEARENA_H
+#define GRYPTO_BYTEARENA_H
+
+#include <QByteArray>
+#include <memory>
+
+namespace Grypt{
+
+
+/** An append-only store for many small byte arrays, which packs them into
+ *  large shared chunks instead of allocating each one on the heap.
+ *
+ *  Chunks are reference counted by the slices that point into them, so a
+ *  slice stays valid after it is released from the arena, after compaction,
+ *  and even after the arena is destroyed. This means slices can be copied
+ *  while holding a lock and read after releasing it.
+ *
+ *  Released bytes are not reused; call Compact() when DeadBytes() gets large
+ *  to move the live slices into new chunks.
+ *
+ *  This class is not thread-safe.
+*/
+class ByteArena
+{
+public:
+
+    /** A reference to bytes that are either in an arena or stand alone.
+     *  A slice implicitly converts from a QByteArray, which makes it stand-alone
+     *  until it is interned into an arena.
+    */
+    class Slice
+    {
+        friend class ByteArena;
+        std::shared_ptr<char> m_chunk;
+        int m_offset;
+        int m_length;
+        quint32 m_generation;
+        QByteArray m_bytes;
+    public:
+        Slice() :m_offset(0), m_length(0), m_generation(0) {}
+        Slice(const QByteArray &b)
+            :m_offset(0), m_length(b.length()), m_generation(0), m_bytes(b) {}
+
+        /** Returns the bytes without copying them. The returned array is only
+         *  valid as long as this slice is.
+        */
+        QByteArray Data() const{
+            return m_chunk ? QByteArray::fromRawData(m_chunk.get() + m_offset, m_length) : m_bytes;
+        }
+
+        int Length() const{ return m_length; }
+        bool IsEmpty() const{ return 0 == m_length; }
+        bool IsInArena() const{ return (bool)m_chunk; }
+    };
+
+    /** Chunks are at least this big, but bigger slices get their own chunk. */
+    static const int ChunkSize = 1024 * 1024;
+
+    ByteArena();
+
+    /** Copies the slice into the arena, unless it's already in the current
+     *  generation of this arena.
+    */
+    Slice Intern(const Slice &);
+
+    /** Tells the arena that the slice is no longer used by the index. */
+    void Release(const Slice &);
+
+    /** Returns the number of bytes used by slices that haven't been released. */
+    qint64 LiveBytes() const{ return m_liveBytes; }
+
+    /** Returns the number of released bytes that are still taking up space. */
+    qint64 DeadBytes() const{ return m_deadBytes; }
+
+    /** Returns true if more than half of the space is dead. */
+    bool ShouldCompact() const{
+        return m_deadBytes > ChunkSize && m_deadBytes > m_liveBytes;
+    }
+
+    /** Starts a new generation, so the next Intern() of each live slice
+     *  copies it into a fresh chunk. Once every live slice is re-interned
+     *  the old chunks are freed (as soon as no copies refer to them).
+    */
+    void Compact();
+
+
+private:
+
+    std::shared_ptr<char> m_chunk;
+    int m_used;
+    int m_capacity;
+    quint32 m_generation;
+    qint64 m_liveBytes;
+    qint64 m_deadBytes;
+
+};
+
+
+}
+
+#endif // GRYPTO_BYTEARENA_H
@@ -0,0 +1,446 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "entryquery.h"
+#include <grypto/compactentry.h>
+#include <QObject>
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+namespace Grypt{
+
+
+static bool __id_less(const EntryId &lhs, const EntryId &rhs)
+{
+    return 0 > memcmp(lhs.ConstData(), rhs.ConstData(), EntryId::Size);
+}
+
+static void __sort_ids(QVector<EntryId> &ids)
+{
+    sort(ids.begin(), ids.end(), __id_less);
+}
+
+// Splits the query into terms, honoring double quotes
+static QStringList __tokenize(const QString &s, QString &error)
+{
+    QStringList ret;
+    QString cur;
+    bool in_quotes = false;
+    bool have_token = false;
+    for(const QChar &c : s){
+        if(c == '"'){
+            in_quotes = !in_quotes;
+            have_token = true;
+        }
+        else if(c.isSpace() && !in_quotes){
+            if(have_token)
+                ret.append(cur);
+            cur.clear();
+            have_token = false;
+        }
+        else{
+            cur.append(c);
+            have_token = true;
+        }
+    }
+    if(in_quotes)
+        error = QObject::tr("Unterminated quote");
+    else if(have_token)
+        ret.append(cur);
+    return ret;
+}
+
+static bool __parse_tristate(const QString &v, EntryQuery::TriState &ts)
+{
+    const QString lv = v.toLower();
+    if(lv == "yes" || lv == "true" || lv == "1")
+        ts = EntryQuery::Yes;
+    else if(lv == "no" || lv == "false" || lv == "0")
+        ts = EntryQuery::No;
+    else
+        return false;
+    return true;
+}
+
+static qint64 __start_of_day(const QDate &d)
+{
+    return QDateTime(d).toMSecsSinceEpoch();
+}
+
+static bool __parse_date_predicate(const QString &v, qint64 &from, qint64 &until)
+{
+    // A range of dates, inclusive of both days
+    int range_ind = v.indexOf("..");
+    if(-1 != range_ind){
+        QDate d1 = QDate::fromString(v.left(range_ind), Qt::ISODate);
+        QDate d2 = QDate::fromString(v.mid(range_ind + 2), Qt::ISODate);
+        if(!d1.isValid() || !d2.isValid())
+            return false;
+        from = __start_of_day(d1);
+        until = __start_of_day(d2.addDays(1));
+        return true;
+    }
+
+    QString op;
+    for(const char *o : {">=", "<=", ">", "<", "="}){
+        if(v.startsWith(o)){
+            op = o;
+            break;
+        }
+    }
+
+    QDate d = QDate::fromString(v.mid(op.length()), Qt::ISODate);
+    if(!d.isValid())
+        return false;
+
+    if(op == ">")
+        from = __start_of_day(d.addDays(1));
+    else if(op == ">=")
+        from = __start_of_day(d);
+    else if(op == "<")
+        until = __start_of_day(d);
+    else if(op == "<=")
+        until = __start_of_day(d.addDays(1));
+    else{
+        from = __start_of_day(d);
+        until = __start_of_day(d.addDays(1));
+    }
+    return true;
+}
+
+EntryQuery EntryQuery::Parse(const QString &s)
+{
+    EntryQuery ret;
+    const QStringList tokens = __tokenize(s, ret.m_error);
+    for(int i = 0; ret.IsValid() && i < tokens.length(); ++i){
+        const QString &t = tokens[i];
+        int colon = t.indexOf(':');
+        if(0 >= colon){
+            ret.Terms.append(t);
+            continue;
+        }
+
+        const QString key = t.left(colon).toLower();
+        const QString val = t.mid(colon + 1);
+        if(val.isEmpty()){
+            ret.m_error = QString(QObject::tr("Missing value for \"%1\"")).arg(key);
+        }
+        else if(key == "name"){
+            ret.NameTerms.append(val);
+        }
+        else if(key == "desc"){
+            ret.DescriptionTerms.append(val);
+        }
+        else if(key == "fav"){
+            if(!__parse_tristate(val, ret.Favorite))
+                ret.m_error = QString(QObject::tr("Expected yes or no: %1")).arg(t);
+        }
+        else if(key == "file"){
+            if(!__parse_tristate(val, ret.HasFile)){
+                // Anything that's not yes or no is a file extension
+                ret.HasFile = Yes;
+                ret.FileExtension = val.startsWith('.') ? val.mid(1) : val;
+            }
+        }
+        else if(key == "modified"){
+            if(!__parse_date_predicate(val, ret.ModifiedFrom, ret.ModifiedUntil))
+                ret.m_error = QString(QObject::tr("Invalid date (expected yyyy-MM-dd): %1")).arg(t);
+        }
+        else if(key == "parent"){
+            ret.ParentName = val;
+        }
+        else{
+            ret.m_error = QString(QObject::tr("Unknown search key: %1")).arg(key);
+        }
+    }
+    return ret;
+}
+
+bool EntryQuery::IsEmpty() const
+{
+    return Terms.isEmpty() && NameTerms.isEmpty() && DescriptionTerms.isEmpty() &&
+            Favorite == Any && HasFile == Any && ParentName.isEmpty() &&
+            -1 == ModifiedFrom && -1 == ModifiedUntil;
+}
+
+
+void EntryIndex::Clear()
+{
+    m_records.clear();
+    m_children.clear();
+    m_byName.clear();
+    m_all.clear();
+    m_favorites.clear();
+    m_withFile.clear();
+    m_byModifyDate.clear();
+}
+
+static bool __date_less(const QPair<qint64, EntryId> &lhs, const QPair<qint64, EntryId> &rhs)
+{
+    return lhs.first < rhs.first;
+}
+
+// Inserts the id in sorted order, or appends it if we sort later
+static void __insert_id(QVector<EntryId> &ids, const EntryId &id, bool keep_sorted)
+{
+    if(keep_sorted)
+        ids.insert(lower_bound(ids.begin(), ids.end(), id, __id_less), id);
+    else
+        ids.append(id);
+}
+
+static void __remove_sorted_id(QVector<EntryId> &ids, const EntryId &id)
+{
+    auto iter = lower_bound(ids.begin(), ids.end(), id, __id_less);
+    if(iter != ids.end() && *iter == id)
+        ids.erase(iter);
+}
+
+void EntryIndex::Insert(const CompactEntry &e)
+{
+    _insert(e, false);
+}
+
+void EntryIndex::_insert(const CompactEntry &e, bool keep_sorted)
+{
+    record_t r;
+    r.parent_id = e.GetParentId();
+    r.name = e.GetName();
+    r.description = e.GetDescription();
+    r.file_name = e.GetFileName();
+    r.modified = e.GetModifyDate().toMSecsSinceEpoch();
+    r.favorite = e.IsFavorite();
+    r.has_file = !e.GetFileId().IsNull();
+    m_records.insert(e.GetId(), r);
+
+    __insert_id(m_all, e.GetId(), keep_sorted);
+    m_children[r.parent_id].append(e.GetId());
+    m_byName[r.name.toLower()].append(e.GetId());
+
+    const QPair<qint64, EntryId> date(r.modified, e.GetId());
+    if(keep_sorted)
+        m_byModifyDate.insert(upper_bound(m_byModifyDate.begin(), m_byModifyDate.end(),
+                                          date, __date_less), date);
+    else
+        m_byModifyDate.append(date);
+
+    if(r.favorite)
+        __insert_id(m_favorites, e.GetId(), keep_sorted);
+    if(r.has_file)
+        __insert_id(m_withFile, e.GetId(), keep_sorted);
+}
+
+void EntryIndex::Update(const CompactEntry &e)
+{
+    Remove(e.GetId());
+    _insert(e, true);
+}
+
+void EntryIndex::Remove(const EntryId &id)
+{
+    auto iter = m_records.find(id);
+    if(iter == m_records.end())
+        return;
+    const record_t &r = *iter;
+
+    __remove_sorted_id(m_all, id);
+    if(r.favorite)
+        __remove_sorted_id(m_favorites, id);
+    if(r.has_file)
+        __remove_sorted_id(m_withFile, id);
+
+    // Only the entries with the same date need to be searched
+    const QPair<qint64, EntryId> date(r.modified, id);
+    for(auto d = lower_bound(m_byModifyDate.begin(), m_byModifyDate.end(), date, __date_less);
+        d != m_byModifyDate.end() && d->first == r.modified; ++d){
+        if(d->second == id){
+            m_byModifyDate.erase(d);
+            break;
+        }
+    }
+
+    auto c = m_children.find(r.parent_id);
+    if(c != m_children.end()){
+        c->remove(c->indexOf(id));
+        if(c->isEmpty())
+            m_children.erase(c);
+    }
+    auto n = m_byName.find(r.name.toLower());
+    if(n != m_byName.end()){
+        n->remove(n->indexOf(id));
+        if(n->isEmpty())
+            m_byName.erase(n);
+    }
+
+    // The children keep their place in m_children, in case the entry comes back
+    m_records.erase(iter);
+}
+
+EntryId EntryIndex::ParentId(const EntryId &id) const
+{
+    return m_records.value(id).parent_id;
+}
+
+QVector<EntryId> EntryIndex::Descendants(const EntryId &id) const
+{
+    QVector<EntryId> ret;
+    QVector<EntryId> stack(1, id);
+    while(!stack.isEmpty()){
+        for(const EntryId &cid : m_children.value(stack.takeLast())){
+            ret.append(cid);
+            stack.append(cid);
+        }
+    }
+    return ret;
+}
+
+void EntryIndex::Finalize()
+{
+    __sort_ids(m_all);
+    __sort_ids(m_favorites);
+    __sort_ids(m_withFile);
+    sort(m_byModifyDate.begin(), m_byModifyDate.end(), __date_less);
+}
+
+bool EntryIndex::Contains(const QVector<EntryId> &ids, const EntryId &id)
+{
+    return binary_search(ids.begin(), ids.end(), id, __id_less);
+}
+
+QVector<EntryId> EntryIndex::_subtree(const QString &parent_name) const
+{
+    QVector<EntryId> ret;
+    QVector<EntryId> stack = m_byName.value(parent_name.toLower());
+    while(!stack.isEmpty()){
+        const EntryId pid = stack.takeLast();
+        for(const EntryId &cid : m_children.value(pid)){
+            ret.append(cid);
+            stack.append(cid);
+        }
+    }
+
+    // Parents may be nested inside each other, so remove duplicates
+    __sort_ids(ret);
+    ret.erase(unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+QVector<EntryId> EntryIndex::_date_range(qint64 from, qint64 until) const
+{
+    auto cmp = [](const QPair<qint64, EntryId> &p, qint64 v){ return p.first < v; };
+    auto b = -1 == from ? m_byModifyDate.begin() :
+                          lower_bound(m_byModifyDate.begin(), m_byModifyDate.end(), from, cmp);
+    auto e = -1 == until ? m_byModifyDate.end() :
+                           lower_bound(b, m_byModifyDate.end(), until, cmp);
+
+    QVector<EntryId> ret;
+    ret.reserve(e - b);
+    for(; b < e; ++b)
+        ret.append(b->second);
+    __sort_ids(ret);
+    return ret;
+}
+
+// Returns the sorted ids that are in "all" but not in "exclude"
+static QVector<EntryId> __difference(const QVector<EntryId> &all, const QVector<EntryId> &exclude)
+{
+    QVector<EntryId> ret;
+    ret.reserve(all.count());
+    set_difference(all.begin(), all.end(), exclude.begin(), exclude.end(),
+                   back_inserter(ret), __id_less);
+    return ret;
+}
+
+bool EntryIndex::_matches_text(const record_t &r, const EntryQuery &q) const
+{
+    for(const QString &t : q.NameTerms){
+        if(!r.name.contains(t, Qt::CaseInsensitive))
+            return false;
+    }
+    for(const QString &t : q.DescriptionTerms){
+        if(!r.description.contains(t, Qt::CaseInsensitive))
+            return false;
+    }
+    for(const QString &t : q.Terms){
+        if(!r.name.contains(t, Qt::CaseInsensitive) &&
+                !r.description.contains(t, Qt::CaseInsensitive))
+            return false;
+    }
+    if(!q.FileExtension.isEmpty() &&
+            !r.file_name.endsWith("." + q.FileExtension, Qt::CaseInsensitive))
+        return false;
+    return true;
+}
+
+QVector<EntryId> EntryIndex::Execute(const EntryQuery &q) const
+{
+    QVector<EntryId> ret;
+    if(!q.IsValid())
+        return ret;
+
+    // Gather a sorted id set for each indexed predicate
+    QList<QVector<EntryId>> sets;
+    if(q.Favorite == EntryQuery::Yes)
+        sets.append(m_favorites);
+    else if(q.Favorite == EntryQuery::No)
+        sets.append(__difference(m_all, m_favorites));
+
+    if(q.HasFile == EntryQuery::Yes)
+        sets.append(m_withFile);
+    else if(q.HasFile == EntryQuery::No)
+        sets.append(__difference(m_all, m_withFile));
+
+    if(-1 != q.ModifiedFrom || -1 != q.ModifiedUntil)
+        sets.append(_date_range(q.ModifiedFrom, q.ModifiedUntil));
+
+    if(!q.ParentName.isEmpty())
+        sets.append(_subtree(q.ParentName));
+
+    // Intersect the sets, starting with the smallest
+    if(sets.isEmpty()){
+        ret = m_all;
+    }
+    else{
+        sort(sets.begin(), sets.end(), [](const QVector<EntryId> &lhs, const QVector<EntryId> &rhs){
+            return lhs.count() < rhs.count();
+        });
+        ret = sets[0];
+        for(int i = 1; i < sets.count() && !ret.isEmpty(); ++i){
+            QVector<EntryId> tmp;
+            tmp.reserve(ret.count());
+            set_intersection(ret.begin(), ret.end(), sets[i].begin(), sets[i].end(),
+                             back_inserter(tmp), __id_less);
+            ret.swap(tmp);
+        }
+    }
+
+    // Finally check the text predicates on the remaining candidates
+    if(!q.Terms.isEmpty() || !q.NameTerms.isEmpty() ||
+            !q.DescriptionTerms.isEmpty() || !q.FileExtension.isEmpty())
+    {
+        QVector<EntryId> tmp;
+        tmp.reserve(ret.count());
+        for(const EntryId &id : ret){
+            auto iter = m_records.find(id);
+            if(iter != m_records.end() && _matches_text(*iter, q))
+                tmp.append(id);
+        }
+        ret.swap(tmp);
+    }
+    return ret;
+}
+
+
+}
@@ -0,0 +1,164 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_ENTRYQUERY_H
+#define GRYPTO_ENTRYQUERY_H
+
+#include <grypto/common.h>
+#include <QStringList>
+#include <QVector>
+#include <QHash>
+
+namespace Grypt{
+
+class CompactEntry;
+
+
+/** A parsed entry query. The syntax is a list of whitespace-separated terms,
+ *  where values containing spaces may be quoted:
+ *
+ *      name:bank fav:yes file:pdf modified:>2015-01-01 parent:"Work" checking
+ *
+ *  Supported keys:
+ *   * name:TEXT      The name contains the text
+ *   * desc:TEXT      The description contains the text
+ *   * fav:yes|no     The entry is (or is not) a favorite
+ *   * file:yes|no    The entry has (or does not have) a file attachment
+ *   * file:EXT       The entry has a file attachment with the given extension
+ *   * modified:DATE  The modify date, where DATE is yyyy-MM-dd optionally preceded
+ *                    by one of >, >=, <, <=, =. A range may be given as DATE..DATE
+ *   * parent:NAME    The entry is a descendant of an entry with the given name
+ *
+ *  Terms without a key must be contained in either the name or the description.
+ *  All text comparisons are case-insensitive, and all terms must match.
+ *
+ *  Like QRegExp, a query that fails to parse is invalid and matches nothing;
+ *  use IsValid() and ErrorString() to find out what was wrong.
+*/
+class EntryQuery
+{
+public:
+
+    enum TriState{
+        Any,
+        Yes,
+        No
+    };
+
+    QStringList Terms;
+    QStringList NameTerms;
+    QStringList DescriptionTerms;
+    TriState Favorite = Any;
+    TriState HasFile = Any;
+    QString FileExtension;
+    QString ParentName;
+
+    /** The modify date range, in ms since the epoch. The lower bound
+     *  is inclusive and the upper bound is exclusive. */
+    qint64 ModifiedFrom = -1;
+    qint64 ModifiedUntil = -1;
+
+    /** Parses the query string. This never throws; check IsValid() instead. */
+    static EntryQuery Parse(const QString &);
+
+    bool IsValid() const{ return m_error.isEmpty(); }
+    QString const &ErrorString() const{ return m_error; }
+
+    /** Returns true if no terms were given (which matches everything). */
+    bool IsEmpty() const;
+
+
+private:
+
+    QString m_error;
+
+};
+
+
+/** Maintains in-memory secondary indexes over a set of entries, so that
+ *  queries can be evaluated without visiting every entry.
+ *
+ *  Each indexed predicate (favorite, has-file, modify date and parent subtree)
+ *  produces a sorted set of ids, and the sets are intersected smallest-first.
+ *  Text predicates are then checked only against the surviving candidates.
+*/
+class EntryIndex
+{
+public:
+
+    /** Removes all entries from the index. */
+    void Clear();
+
+    /** Adds the entry to the index. Call Finalize() after the last insert. */
+    void Insert(const CompactEntry &);
+
+    /** Sorts the indexes after a batch of inserts. */
+    void Finalize();
+
+    /** Adds or replaces one entry in a finalized index, keeping it sorted.
+     *  This is for keeping the index up to date as entries change, so you
+     *  don't have to build it again.
+    */
+    void Update(const CompactEntry &);
+
+    /** Removes the entry from a finalized index, if it's there. */
+    void Remove(const EntryId &);
+
+    /** Returns the entry's parent id, or a null id if it's not indexed. */
+    EntryId ParentId(const EntryId &) const;
+
+    /** Returns the ids of every entry below the given one. */
+    QVector<EntryId> Descendants(const EntryId &) const;
+
+    /** Returns the number of indexed entries. */
+    int Count() const{ return m_all.count(); }
+
+    /** Evaluates the query and returns the matching ids, sorted by id. */
+    QVector<EntryId> Execute(const EntryQuery &) const;
+
+    /** Returns true if the id is in the sorted id list. */
+    static bool Contains(const QVector<EntryId> &sorted_ids, const EntryId &);
+
+
+private:
+
+    struct record_t{
+        EntryId parent_id;
+        QString name;
+        QString description;
+        QString file_name;
+        qint64 modified;
+        bool favorite;
+        bool has_file;
+    };
+
+    QHash<EntryId, record_t> m_records;
+    QHash<EntryId, QVector<EntryId>> m_children;
+    QHash<QString, QVector<EntryId>> m_byName;
+    QVector<EntryId> m_all;
+    QVector<EntryId> m_favorites;
+    QVector<EntryId> m_withFile;
+    QVector<QPair<qint64, EntryId>> m_byModifyDate;
+
+    void _insert(const CompactEntry &, bool keep_sorted);
+    QVector<EntryId> _subtree(const QString &parent_name) const;
+    QVector<EntryId> _date_range(qint64 from, qint64 until) const;
+    bool _matches_text(const record_t &, const EntryQuery &) const;
+
+};
+
+
+}
+
+#endif // GRYPTO_ENTRYQUERY_H
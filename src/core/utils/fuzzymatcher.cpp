@@ -0,0 +1,125 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "fuzzymatcher.h"
+#include <gutil/globals.h>
+#include <cstring>
+
+namespace Grypt{
+
+
+static inline ushort __normalize_char(const QChar &c, bool ignore_case)
+{
+    return ignore_case ? c.toCaseFolded().unicode() : c.unicode();
+}
+
+FuzzyMatcher::FuzzyMatcher(const QString &pattern, bool ignore_case, int max_distance)
+    :m_length(qMin(pattern.length(), (int)MaxPatternLength)),
+      m_maxDistance(max_distance < 0 ? DefaultMaxDistance(m_length) : max_distance),
+      m_ignoreCase(ignore_case)
+{
+    memset(m_peq, 0, sizeof(m_peq));
+
+    // Set the bit for each position in the pattern where the character occurs
+    for(int i = 0; i < m_length; ++i){
+        const ushort c = __normalize_char(pattern[i], ignore_case);
+        const quint64 bit = (quint64)1 << i;
+        if(c < 256){
+            m_peq[c] |= bit;
+        }
+        else{
+            bool found = false;
+            for(auto &p : m_peqExtended){
+                if(p.first == c){
+                    p.second |= bit;
+                    found = true;
+                    break;
+                }
+            }
+            if(!found)
+                m_peqExtended.append(QPair<ushort, quint64>(c, bit));
+        }
+    }
+}
+
+int FuzzyMatcher::DefaultMaxDistance(int len)
+{
+    // Allow one typo for short patterns, and a few more as they get longer
+    if(len < 3)
+        return 0;
+    else if(len < 6)
+        return 1;
+    else if(len < 12)
+        return 2;
+    return 3;
+}
+
+quint64 FuzzyMatcher::_get_peq(ushort c) const
+{
+    if(c < 256)
+        return m_peq[c];
+
+    for(const auto &p : m_peqExtended){
+        if(p.first == c)
+            return p.second;
+    }
+    return 0;
+}
+
+int FuzzyMatcher::Distance(const QString &text) const
+{
+    if(0 == m_length)
+        return 0;
+
+    // The pattern can't fit in the text with fewer than this many edits
+    if(m_length - text.length() > m_maxDistance)
+        return -1;
+
+    // Myers' algorithm, as formulated by Hyyrö for approximate string matching.
+    //  Pv and Mv are the positive and negative vertical deltas of the current
+    //  column of the dynamic programming matrix. The top row of the matrix is
+    //  all zeroes, so a match may begin anywhere in the text.
+    const quint64 last_bit = (quint64)1 << (m_length - 1);
+    quint64 pv = ~(quint64)0;
+    quint64 mv = 0;
+    int score = m_length;
+    int best = m_length;
+
+    const QChar *data = text.constData();
+    const int text_len = text.length();
+    for(int j = 0; j < text_len && 0 < best; ++j){
+        const quint64 eq = _get_peq(__normalize_char(data[j], m_ignoreCase));
+        const quint64 xv = eq | mv;
+        const quint64 xh = (((eq & pv) + pv) ^ pv) | eq;
+        quint64 ph = mv | ~(xh | pv);
+        quint64 mh = pv & xh;
+
+        if(ph & last_bit)
+            ++score;
+        else if(mh & last_bit)
+            --score;
+
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        if(score < best)
+            best = score;
+    }
+    return best <= m_maxDistance ? best : -1;
+}
+
+
+}
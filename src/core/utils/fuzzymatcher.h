@@ -0,0 +1,83 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_FUZZYMATCHER_H
+#define GRYPTO_FUZZYMATCHER_H
+
+#include <QString>
+#include <QVector>
+#include <QPair>
+
+namespace Grypt{
+
+
+/** Finds approximate occurrences of a pattern inside of text, using Myers'
+ *  bit-parallel edit distance algorithm.
+ *
+ *  The pattern is preprocessed once in the constructor, so you should construct
+ *  one matcher per search string and reuse it for every string you test against.
+ *  Each call to Distance() is linear in the length of the text.
+ *
+ *  Only the first MaxPatternLength characters of the pattern are used.
+*/
+class FuzzyMatcher
+{
+public:
+
+    /** The maximum pattern length, which is the number of bits in the machine word. */
+    static const int MaxPatternLength = 64;
+
+    /** Constructs a matcher for the given pattern.
+     *  \param max_distance The largest edit distance that is considered a match.
+     *      If it is negative then a reasonable bound is chosen based on the pattern length.
+    */
+    explicit FuzzyMatcher(const QString &pattern,
+                          bool ignore_case = true,
+                          int max_distance = -1);
+
+    /** Returns the pattern length, after truncating to MaxPatternLength. */
+    int PatternLength() const{ return m_length; }
+
+    /** Returns the largest edit distance that counts as a match. */
+    int MaxDistance() const{ return m_maxDistance; }
+
+    /** Returns the smallest edit distance between the pattern and any substring
+     *  of the text, or -1 if that distance is greater than MaxDistance().
+     *  A return value of 0 means the pattern occurs exactly in the text.
+    */
+    int Distance(const QString &text) const;
+
+    /** Returns the default distance bound for a pattern of the given length. */
+    static int DefaultMaxDistance(int pattern_length);
+
+
+private:
+
+    int m_length;
+    int m_maxDistance;
+    bool m_ignoreCase;
+
+    // Match bit-vectors for each character in the pattern. Latin-1 characters
+    //  are looked up directly, others are looked up in the (short) extended list.
+    quint64 m_peq[256];
+    QVector<QPair<ushort, quint64>> m_peqExtended;
+
+    quint64 _get_peq(ushort) const;
+
+};
+
+
+}
+
+#endif // GRYPTO_FUZZYMATCHER_H
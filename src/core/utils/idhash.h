@@ -0,0 +1,349 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_IDHASH_H
+#define GRYPTO_IDHASH_H
+
+#include <QList>
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Grypt{
+
+
+/** An open-addressing hash table for GUtil::Id keys, which is a drop-in
+ *  replacement for the subset of the QHash interface that the index uses.
+ *
+ *  Lookups probe a flat array of one-byte control codes 16 at a time (with
+ *  SSE2 if available), and then compare keys stored next to each other in a
+ *  flat slot array. Ids are random, so the hash is just the first 8 bytes
+ *  of the id, mixed.
+ *
+ *  The values are kept in fixed-size pages that never move, so like QHash,
+ *  references to values stay valid when other keys are inserted or removed.
+ *  The index relies on this in a few places. Erased values are reset and
+ *  their storage is reused by the next insert.
+ *
+ *  This class is not thread-safe.
+*/
+template<class K, class V>
+class IdHash
+{
+    static const int GroupSize = 16;
+    static const int PageSize = 256;
+
+    // Control codes; full slots hold the low 7 bits of the hash
+    static const signed char Empty = -128;
+    static const signed char Deleted = -2;
+
+    struct slot_t{
+        K key;
+        quint32 value_index;
+    };
+
+    std::vector<signed char> m_ctrl;
+    std::vector<slot_t> m_slots;
+    std::vector<std::unique_ptr<V[]>> m_pages;
+    std::vector<quint32> m_freeValues;
+    quint32 m_valueCount;
+    int m_size;
+    int m_tombstones;
+
+public:
+
+    template<bool IS_CONST>
+    class iterator_t
+    {
+        friend class IdHash;
+        template<bool> friend class iterator_t;
+        typedef typename std::conditional<IS_CONST, IdHash const, IdHash>::type table_t;
+        typedef typename std::conditional<IS_CONST, V const, V>::type value_t;
+        table_t *m_table;
+        int m_slot;
+        iterator_t(table_t *t, int slot) :m_table(t), m_slot(slot) {}
+        void _skip(){
+            while(m_slot < (int)m_table->m_ctrl.size() && 0 > m_table->m_ctrl[m_slot])
+                ++m_slot;
+        }
+    public:
+        iterator_t() :m_table(0), m_slot(0) {}
+        iterator_t(const iterator_t<false> &o) :m_table(o.m_table), m_slot(o.m_slot) {}
+
+        K const &key() const{ return m_table->m_slots[m_slot].key; }
+        value_t &value() const{ return m_table->_value(m_table->m_slots[m_slot].value_index); }
+        value_t &operator *() const{ return value(); }
+        value_t *operator ->() const{ return &value(); }
+
+        iterator_t &operator ++(){ ++m_slot; _skip(); return *this; }
+        iterator_t operator ++(int){ iterator_t ret(*this); ++*this; return ret; }
+
+        bool operator == (const iterator_t &o) const{ return m_slot == o.m_slot; }
+        bool operator != (const iterator_t &o) const{ return m_slot != o.m_slot; }
+    };
+    typedef iterator_t<false> iterator;
+    typedef iterator_t<true> const_iterator;
+
+
+    IdHash() :m_valueCount(0), m_size(0), m_tombstones(0) {}
+    IdHash(const IdHash &o) :m_valueCount(0), m_size(0), m_tombstones(0) { *this = o; }
+    IdHash &operator = (const IdHash &o){
+        if(this != &o){
+            clear();
+            reserve(o.size());
+            for(const_iterator i = o.begin(); i != o.end(); ++i)
+                insert(i.key(), i.value());
+        }
+        return *this;
+    }
+
+    int size() const{ return m_size; }
+    int count() const{ return m_size; }
+    bool isEmpty() const{ return 0 == m_size; }
+
+    /** Removes all items and frees the memory. */
+    void clear(){
+        m_ctrl.clear();
+        m_slots.clear();
+        m_pages.clear();
+        m_freeValues.clear();
+        m_valueCount = 0;
+        m_size = 0;
+        m_tombstones = 0;
+    }
+
+    /** Makes room for n items without rehashing. */
+    void reserve(int n){
+        // Keep the load factor under 7/8
+        int cap = GroupSize;
+        while(cap * 7 / 8 < n)
+            cap <<= 1;
+        if(cap > (int)m_ctrl.size())
+            _rehash(cap);
+    }
+
+    iterator begin(){ iterator ret(this, 0); ret._skip(); return ret; }
+    iterator end(){ return iterator(this, m_ctrl.size()); }
+    const_iterator begin() const{ const_iterator ret(this, 0); ret._skip(); return ret; }
+    const_iterator end() const{ return const_iterator(this, m_ctrl.size()); }
+
+    iterator find(const K &k){
+        int slot = _find(k);
+        return -1 == slot ? end() : iterator(this, slot);
+    }
+    const_iterator find(const K &k) const{
+        int slot = _find(k);
+        return -1 == slot ? end() : const_iterator(this, slot);
+    }
+
+    bool contains(const K &k) const{ return -1 != _find(k); }
+
+    V value(const K &k, const V &default_value = V()) const{
+        int slot = _find(k);
+        return -1 == slot ? default_value : _value(m_slots[slot].value_index);
+    }
+
+    /** Inserts or replaces the value for the key. */
+    iterator insert(const K &k, const V &v){
+        int slot = _find_or_insert(k);
+        _value(m_slots[slot].value_index) = v;
+        return iterator(this, slot);
+    }
+
+    /** Returns a reference to the value, inserting a default one if necessary. */
+    V &operator [](const K &k){
+        return _value(m_slots[_find_or_insert(k)].value_index);
+    }
+
+    /** Removes the item and returns an iterator to the next one. */
+    iterator erase(iterator iter){
+        const int slot = iter.m_slot;
+        _value(m_slots[slot].value_index) = V();
+        m_freeValues.push_back(m_slots[slot].value_index);
+        m_ctrl[slot] = Deleted;
+        --m_size;
+        ++m_tombstones;
+        ++iter;
+        return iter;
+    }
+
+    /** Returns the number of items removed (0 or 1). */
+    int remove(const K &k){
+        int slot = _find(k);
+        if(-1 == slot)
+            return 0;
+        erase(iterator(this, slot));
+        return 1;
+    }
+
+    QList<K> keys() const{
+        QList<K> ret;
+        ret.reserve(m_size);
+        for(const_iterator i = begin(); i != end(); ++i)
+            ret.append(i.key());
+        return ret;
+    }
+
+
+private:
+
+    static quint64 _hash(const K &k){
+        quint64 h;
+        memcpy(&h, k.ConstData(), sizeof(h));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Returns a bit mask of the control bytes in the group that equal c
+    static quint32 _match(const signed char *group, signed char c){
+#ifdef __SSE2__
+        __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+        quint32 ret = 0;
+        for(int i = 0; i < GroupSize; ++i)
+            if(group[i] == c)
+                ret |= 1 << i;
+        return ret;
+#endif
+    }
+
+    static int _lowest_bit(quint32 mask){
+        int ret = 0;
+        while(0 == (mask & 1)){
+            mask >>= 1;
+            ++ret;
+        }
+        return ret;
+    }
+
+    V &_value(quint32 i){ return m_pages[i / PageSize][i % PageSize]; }
+    V const &_value(quint32 i) const{ return m_pages[i / PageSize][i % PageSize]; }
+
+    // Returns the slot holding the key, or -1
+    int _find(const K &k) const{
+        if(0 == m_size)
+            return -1;
+        const quint64 h = _hash(k);
+        const signed char h2 = h & 0x7f;
+        const int group_mask = m_ctrl.size() / GroupSize - 1;
+        int g = (h >> 7) & group_mask;
+        for(int step = 1;; ++step){
+            const signed char *group = &m_ctrl[g * GroupSize];
+            for(quint32 m = _match(group, h2); m; m &= m - 1){
+                const int slot = g * GroupSize + _lowest_bit(m);
+                if(m_slots[slot].key == k)
+                    return slot;
+            }
+            if(_match(group, Empty))
+                return -1;
+            g = (g + step) & group_mask;
+        }
+    }
+
+    // Returns the slot where the key is or should be inserted, without
+    //  checking whether there is room
+    int _probe_for_insert(const K &k, bool *found) const{
+        const quint64 h = _hash(k);
+        const signed char h2 = h & 0x7f;
+        const int group_mask = m_ctrl.size() / GroupSize - 1;
+        int g = (h >> 7) & group_mask;
+        int first_free = -1;
+        for(int step = 1;; ++step){
+            const signed char *group = &m_ctrl[g * GroupSize];
+            for(quint32 m = _match(group, h2); m; m &= m - 1){
+                const int slot = g * GroupSize + _lowest_bit(m);
+                if(m_slots[slot].key == k){
+                    *found = true;
+                    return slot;
+                }
+            }
+            if(-1 == first_free){
+                quint32 m = _match(group, Deleted);
+                if(m)
+                    first_free = g * GroupSize + _lowest_bit(m);
+            }
+            quint32 m = _match(group, Empty);
+            if(m){
+                *found = false;
+                return -1 == first_free ? g * GroupSize + _lowest_bit(m) : first_free;
+            }
+            g = (g + step) & group_mask;
+        }
+    }
+
+    int _find_or_insert(const K &k){
+        if((m_size + m_tombstones + 1) * 8 > (int)m_ctrl.size() * 7){
+            // Rehash in place if it's mostly tombstones, otherwise grow
+            const int needed = m_size + 1;
+            int cap = m_ctrl.empty() ? GroupSize : m_ctrl.size();
+            while(cap * 7 / 8 < needed * 2)
+                cap <<= 1;
+            _rehash(cap);
+        }
+
+        bool found;
+        const int slot = _probe_for_insert(k, &found);
+        if(!found){
+            if(Deleted == m_ctrl[slot])
+                --m_tombstones;
+            m_ctrl[slot] = _hash(k) & 0x7f;
+            m_slots[slot].key = k;
+            m_slots[slot].value_index = _new_value();
+            ++m_size;
+        }
+        return slot;
+    }
+
+    quint32 _new_value(){
+        if(!m_freeValues.empty()){
+            quint32 ret = m_freeValues.back();
+            m_freeValues.pop_back();
+            return ret;
+        }
+        if(m_valueCount == m_pages.size() * PageSize)
+            m_pages.emplace_back(new V[PageSize]);
+        return m_valueCount++;
+    }
+
+    // Rebuilds the control and slot arrays; the values don't move
+    void _rehash(int capacity){
+        std::vector<signed char> old_ctrl(capacity, Empty);
+        std::vector<slot_t> old_slots(capacity);
+        old_ctrl.swap(m_ctrl);
+        old_slots.swap(m_slots);
+        m_tombstones = 0;
+        for(int i = 0; i < (int)old_ctrl.size(); ++i){
+            if(0 <= old_ctrl[i]){
+                bool found;
+                const int slot = _probe_for_insert(old_slots[i].key, &found);
+                m_ctrl[slot] = old_ctrl[i];
+                m_slots[slot] = old_slots[i];
+            }
+        }
+    }
+
+};
+
+
+}
+
+#endif // GRYPTO_IDHASH_H
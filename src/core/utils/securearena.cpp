@@ -0,0 +1,255 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "securearena.h"
+#include <QMutexLocker>
+#include <cstring>
+#include <new>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif // Q_OS_WIN
+using namespace std;
+
+// Slabs are mapped in chunks of this size, which must hold at least
+//  one block of the largest size class
+#define SLAB_SIZE   (64 * 1024)
+
+namespace Grypt{
+
+
+const size_t SecureArena::MinBlockSize;
+const size_t SecureArena::MaxBlockSize;
+
+// A memset the compiler is not allowed to optimize away
+static void __secure_zero(void *p, size_t len)
+{
+    volatile char *c = reinterpret_cast<volatile char *>(p);
+    while(len--)
+        *c++ = 0;
+}
+
+static size_t __page_size()
+{
+#ifdef Q_OS_WIN
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwPageSize;
+#else
+    return sysconf(_SC_PAGESIZE);
+#endif // Q_OS_WIN
+}
+
+static size_t __round_to_pages(size_t len)
+{
+    static const size_t page_size = __page_size();
+    return (len + page_size - 1) / page_size * page_size;
+}
+
+// Returns the index of the smallest size class that fits the length
+static int __size_class(size_t len)
+{
+    int ret = 0;
+    for(size_t sz = SecureArena::MinBlockSize; sz < len; sz <<= 1)
+        ++ret;
+    return ret;
+}
+
+static size_t __class_size(int size_class)
+{
+    return SecureArena::MinBlockSize << size_class;
+}
+
+
+SecureArena &SecureArena::Instance()
+{
+    static SecureArena arena;
+    return arena;
+}
+
+SecureArena::SecureArena()
+    :m_freeLists(__size_class(MaxBlockSize) + 1, nullptr),
+      m_bytesInUse(0),
+      m_locked(true)
+{}
+
+SecureArena::~SecureArena()
+{
+    for(const auto &slab : m_slabs){
+        __secure_zero(slab.first, slab.second);
+        _unmap_pages(slab.first, slab.second);
+    }
+}
+
+void *SecureArena::_map_pages(size_t len)
+{
+    void *ret;
+#ifdef Q_OS_WIN
+    ret = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if(ret == NULL)
+        throw bad_alloc();
+    if(!VirtualLock(ret, len))
+        m_locked = false;
+#else
+    ret = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ret == MAP_FAILED)
+        throw bad_alloc();
+    if(0 != mlock(ret, len))
+        m_locked = false;
+#ifdef MADV_DONTDUMP
+    // Keep secrets out of core dumps too
+    madvise(ret, len, MADV_DONTDUMP);
+#endif
+#endif // Q_OS_WIN
+    return ret;
+}
+
+void SecureArena::_unmap_pages(void *p, size_t len)
+{
+#ifdef Q_OS_WIN
+    VirtualUnlock(p, len);
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munlock(p, len);
+    munmap(p, len);
+#endif // Q_OS_WIN
+}
+
+void SecureArena::_grow(int size_class)
+{
+    const size_t block_size = __class_size(size_class);
+    char *slab = reinterpret_cast<char *>(_map_pages(SLAB_SIZE));
+    m_slabs.append(QPair<void *, size_t>(slab, SLAB_SIZE));
+
+    // Thread the new blocks onto the free list
+    for(size_t offset = 0; offset + block_size <= SLAB_SIZE; offset += block_size){
+        free_block *b = reinterpret_cast<free_block *>(slab + offset);
+        b->next = m_freeLists[size_class];
+        m_freeLists[size_class] = b;
+    }
+}
+
+size_t SecureArena::BlockSize(size_t len)
+{
+    if(len > MaxBlockSize)
+        return __round_to_pages(len);
+    return __class_size(__size_class(len));
+}
+
+void *SecureArena::Allocate(size_t len)
+{
+    if(0 == len)
+        return nullptr;
+
+    void *ret;
+    const size_t block_size = BlockSize(len);
+    QMutexLocker lkr(&m_lock);
+    if(len > MaxBlockSize){
+        // Fresh mappings are already zero-filled
+        ret = _map_pages(block_size);
+    }
+    else{
+        const int size_class = __size_class(len);
+        if(nullptr == m_freeLists[size_class])
+            _grow(size_class);
+        free_block *b = m_freeLists[size_class];
+        m_freeLists[size_class] = b->next;
+        b->next = nullptr;
+        ret = b;
+    }
+    m_bytesInUse += block_size;
+    return ret;
+}
+
+void SecureArena::Free(void *p, size_t len)
+{
+    if(nullptr == p)
+        return;
+
+    const size_t block_size = BlockSize(len);
+    __secure_zero(p, block_size);
+
+    QMutexLocker lkr(&m_lock);
+    m_bytesInUse -= block_size;
+    if(len > MaxBlockSize){
+        _unmap_pages(p, block_size);
+    }
+    else{
+        const int size_class = __size_class(len);
+        free_block *b = reinterpret_cast<free_block *>(p);
+        b->next = m_freeLists[size_class];
+        m_freeLists[size_class] = b;
+    }
+}
+
+bool SecureArena::IsLocked() const
+{
+    QMutexLocker lkr(&m_lock);
+    return m_locked;
+}
+
+size_t SecureArena::BytesInUse() const
+{
+    QMutexLocker lkr(&m_lock);
+    return m_bytesInUse;
+}
+
+
+
+SecureBuffer::SecureBuffer(size_t capacity)
+    :m_data(nullptr),
+      m_length(0),
+      m_capacity(0)
+{
+    Reserve(capacity);
+}
+
+SecureBuffer::~SecureBuffer()
+{
+    SecureArena::Instance().Free(m_data, m_capacity);
+}
+
+void SecureBuffer::Reserve(size_t len)
+{
+    if(len <= m_capacity)
+        return;
+
+    SecureArena &arena = SecureArena::Instance();
+    const size_t new_capacity = SecureArena::BlockSize(len);
+    char *new_data = reinterpret_cast<char *>(arena.Allocate(new_capacity));
+    if(0 < m_length)
+        memcpy(new_data, m_data, m_length);
+    arena.Free(m_data, m_capacity);
+    m_data = new_data;
+    m_capacity = new_capacity;
+}
+
+void SecureBuffer::Append(const void *data, size_t len)
+{
+    if(m_length + len > m_capacity)
+        Reserve(2 * (m_length + len));
+    memcpy(m_data + m_length, data, len);
+    m_length += len;
+}
+
+void SecureBuffer::Clear()
+{
+    __secure_zero(m_data, m_length);
+    m_length = 0;
+}
+
+
+}
@@ -0,0 +1,129 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_SECUREARENA_H
+#define GRYPTO_SECUREARENA_H
+
+#include <QMutex>
+#include <QVector>
+#include <QPair>
+#include <cstddef>
+
+namespace Grypt{
+
+
+/** A pooled allocator for memory that holds plaintext secrets.
+ *
+ *  Memory is taken from the OS in pages which are locked into RAM (mlock or
+ *  VirtualLock), so it is never written to swap. Small blocks are carved out
+ *  of shared slabs by size class and recycled through free lists, so the hot
+ *  decrypt path doesn't touch the general heap. Every block is zeroed when it
+ *  is freed.
+ *
+ *  If the OS refuses to lock the pages (i.e. RLIMIT_MEMLOCK is too low) the
+ *  arena still works, but IsLocked() returns false.
+ *
+ *  The arena is thread-safe.
+*/
+class SecureArena
+{
+    Q_DISABLE_COPY(SecureArena)
+public:
+
+    /** The smallest and largest block sizes served from the slabs.
+     *  Larger allocations get their own locked mapping.
+    */
+    static const std::size_t MinBlockSize = 64;
+    static const std::size_t MaxBlockSize = 16384;
+
+    /** Returns the process-wide arena. */
+    static SecureArena &Instance();
+
+    SecureArena();
+    ~SecureArena();
+
+    /** Returns a zero-filled block of at least len bytes.
+     *  You must pass the same length to Free().
+    */
+    void *Allocate(std::size_t len);
+
+    /** Zeroes the block and returns it to the pool. */
+    void Free(void *, std::size_t len);
+
+    /** Returns the usable size of a block allocated with the given length. */
+    static std::size_t BlockSize(std::size_t len);
+
+    /** Returns true if all memory obtained so far is locked into RAM. */
+    bool IsLocked() const;
+
+    /** Returns the number of bytes currently handed out to callers. */
+    std::size_t BytesInUse() const;
+
+
+private:
+
+    struct free_block{ free_block *next; };
+
+    // One free list per power-of-two size class
+    QVector<free_block *> m_freeLists;
+    QVector<QPair<void *, std::size_t>> m_slabs;
+    std::size_t m_bytesInUse;
+    bool m_locked;
+    mutable QMutex m_lock;
+
+    void *_map_pages(std::size_t len);
+    void _unmap_pages(void *, std::size_t len);
+    void _grow(int size_class);
+
+};
+
+
+/** An RAII byte buffer in secure memory, which grows by reallocating within
+ *  the arena. The previous block is zeroed on every reallocation.
+*/
+class SecureBuffer
+{
+    Q_DISABLE_COPY(SecureBuffer)
+public:
+
+    explicit SecureBuffer(std::size_t capacity = 0);
+    ~SecureBuffer();
+
+    char *Data(){ return m_data; }
+    const char *ConstData() const{ return m_data; }
+    std::size_t Length() const{ return m_length; }
+    std::size_t Capacity() const{ return m_capacity; }
+
+    /** Makes sure the buffer can hold at least len bytes without reallocating. */
+    void Reserve(std::size_t len);
+
+    /** Appends the data to the end of the buffer. */
+    void Append(const void *data, std::size_t len);
+
+    /** Zeroes the contents and sets the length to 0, keeping the capacity. */
+    void Clear();
+
+
+private:
+
+    char *m_data;
+    std::size_t m_length;
+    std::size_t m_capacity;
+
+};
+
+
+}
+
+#endif // GRYPTO_SECUREARENA_H
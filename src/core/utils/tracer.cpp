@@ -0,0 +1,216 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "tracer.h"
+#include <gutil/exception.h>
+#include <QCoreApplication>
+#include <QThread>
+#include <QHash>
+#include <QFile>
+#include <mutex>
+#include <chrono>
+#include <vector>
+using namespace std;
+USING_NAMESPACE_GUTIL;
+
+namespace Grypt{
+
+
+namespace{
+
+struct event_t
+{
+    const char *category;
+    const char *name;
+    qint64 start;
+    qint64 duration;
+    int tid;
+    QList<QPair<const char *, QString>> args;
+};
+
+// Everything is guarded by the mutex, which is only taken when tracing is on
+struct tracer_state_t
+{
+    mutex lock;
+    QString path;
+    chrono::steady_clock::time_point epoch;
+    vector<event_t> events;
+    QHash< ::Qt::HANDLE, int> thread_ids;
+    QHash<int, QByteArray> thread_names;
+};
+
+tracer_state_t &__state()
+{
+    static tracer_state_t s;
+    return s;
+}
+
+// Maps the thread handles to small numbers, which are nicer to look at
+int __thread_id(tracer_state_t &s)
+{
+    const ::Qt::HANDLE h = QThread::currentThreadId();
+    auto iter = s.thread_ids.find(h);
+    if(iter == s.thread_ids.end())
+        iter = s.thread_ids.insert(h, s.thread_ids.count() + 1);
+    return *iter;
+}
+
+QByteArray __json_string(const QString &str)
+{
+    QByteArray ret("\"");
+    for(QChar c : str){
+        switch(c.unicode()){
+        case '"':  ret.append("\\\""); break;
+        case '\\': ret.append("\\\\"); break;
+        case '\n': ret.append("\\n"); break;
+        case '\r': ret.append("\\r"); break;
+        case '\t': ret.append("\\t"); break;
+        default:
+            if(c.unicode() < 0x20)
+                ret.append(QString("\\u%1").arg((int)c.unicode(), 4, 16, QChar('0')).toLatin1());
+            else
+                ret.append(QString(c).toUtf8());
+            break;
+        }
+    }
+    ret.append('"');
+    return ret;
+}
+
+}
+
+
+atomic<bool> Tracer::sm_enabled(false);
+
+void Tracer::Start(const QString &output_path)
+{
+    tracer_state_t &s = __state();
+    lock_guard<mutex> lkr(s.lock);
+    s.path = output_path;
+    s.epoch = chrono::steady_clock::now();
+    s.events.clear();
+    s.thread_ids.clear();
+    s.thread_names.clear();
+    sm_enabled.store(true);
+}
+
+bool Tracer::StartFromEnvironment()
+{
+    const QByteArray path = qgetenv(GRYPTO_TRACE_VARIABLE);
+    if(path.isEmpty())
+        return false;
+    Start(QString::fromLocal8Bit(path));
+    return true;
+}
+
+void Tracer::Stop()
+{
+    tracer_state_t &s = __state();
+    vector<event_t> events;
+    QHash<int, QByteArray> thread_names;
+    QString path;
+    {
+        lock_guard<mutex> lkr(s.lock);
+        if(!sm_enabled.load())
+            return;
+        sm_enabled.store(false);
+        events.swap(s.events);
+        thread_names.swap(s.thread_names);
+        path = s.path;
+    }
+
+    QFile f(path);
+    if(!f.open(QFile::WriteOnly | QFile::Truncate))
+        throw Exception<>(QString("Unable to write trace file: %1")
+                          .arg(f.errorString()).toUtf8());
+
+    const QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    f.write("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for(auto iter = thread_names.begin(); iter != thread_names.end(); ++iter){
+        if(!first)
+            f.write(",\n");
+        first = false;
+        f.write("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + pid +
+                ",\"tid\":" + QByteArray::number(iter.key()) +
+                ",\"args\":{\"name\":" + __json_string(iter.value()) + "}}");
+    }
+    for(const event_t &e : events){
+        if(!first)
+            f.write(",\n");
+        first = false;
+
+        QByteArray line("{\"ph\":\"X\",\"cat\":");
+        line.append(__json_string(e.category));
+        line.append(",\"name\":");
+        line.append(__json_string(e.name));
+        line.append(",\"pid\":" + pid);
+        line.append(",\"tid\":" + QByteArray::number(e.tid));
+        line.append(",\"ts\":" + QByteArray::number(e.start));
+        line.append(",\"dur\":" + QByteArray::number(e.duration));
+        if(!e.args.isEmpty()){
+            line.append(",\"args\":{");
+            for(int i = 0; i < e.args.length(); ++i){
+                if(0 < i)
+                    line.append(',');
+                line.append(__json_string(e.args[i].first));
+                line.append(':');
+                line.append(__json_string(e.args[i].second));
+            }
+            line.append('}');
+        }
+        line.append('}');
+        f.write(line);
+    }
+    f.write("\n]}\n");
+}
+
+void Tracer::SetThreadName(const char *name)
+{
+    if(!IsEnabled())
+        return;
+    tracer_state_t &s = __state();
+    lock_guard<mutex> lkr(s.lock);
+    s.thread_names.insert(__thread_id(s), name);
+}
+
+qint64 Tracer::_now()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - __state().epoch).count();
+}
+
+void Tracer::_record(const char *category, const char *name,
+                     qint64 start, qint64 end,
+                     const QList<QPair<const char *, QString>> &args)
+{
+    tracer_state_t &s = __state();
+    lock_guard<mutex> lkr(s.lock);
+
+    // The span may have started before tracing was stopped
+    if(!sm_enabled.load())
+        return;
+
+    event_t e;
+    e.category = category;
+    e.name = name;
+    e.start = start;
+    e.duration = end - start;
+    e.tid = __thread_id(s);
+    e.args = args;
+    s.events.push_back(e);
+}
+
+
+}
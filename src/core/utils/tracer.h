@@ -0,0 +1,124 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_TRACER_H
+#define GRYPTO_TRACER_H
+
+#include <QString>
+#include <QList>
+#include <QPair>
+#include <atomic>
+
+/** Set this environment variable to a file path to trace the whole run. */
+#define GRYPTO_TRACE_VARIABLE "GRYPTO_TRACE"
+
+/** Traces the enclosing scope as a span with the given category and name,
+ *  which must be string literals (or otherwise outlive the tracer).
+*/
+#define GRYPTO_TRACE_SCOPE(category, name) \
+    Grypt::TraceSpan GRYPTO_TRACE_CONCAT(__trace_span_, __LINE__)(category, name)
+
+#define GRYPTO_TRACE_CONCAT(a, b) GRYPTO_TRACE_CONCAT2(a, b)
+#define GRYPTO_TRACE_CONCAT2(a, b) a##b
+
+namespace Grypt{
+
+
+/** Records a timeline of spans, and writes it as a Chrome trace-event JSON
+ *  file that you can load in chrome://tracing or any compatible viewer.
+ *
+ *  Tracing is off by default, and a disabled span costs only one relaxed
+ *  atomic load. When it's on, spans are collected in memory and written
+ *  when you call Stop().
+ *
+ *  All functions are thread-safe.
+*/
+class Tracer
+{
+public:
+
+    /** Returns true if spans are being recorded. */
+    static bool IsEnabled(){ return sm_enabled.load(std::memory_order_relaxed); }
+
+    /** Starts recording, and discards any spans from before. The file is
+     *  written when you call Stop().
+    */
+    static void Start(const QString &output_path);
+
+    /** Starts recording if GRYPTO_TRACE is set to a file path.
+     *  \returns true if tracing was started
+    */
+    static bool StartFromEnvironment();
+
+    /** Stops recording and writes the trace file, if it was started.
+     *  \throws An exception if the file could not be written
+    */
+    static void Stop();
+
+    /** Names the calling thread in the trace. */
+    static void SetThreadName(const char *);
+
+
+private:
+    friend class TraceSpan;
+    static std::atomic<bool> sm_enabled;
+
+    static qint64 _now();
+    static void _record(const char *category, const char *name,
+                        qint64 start, qint64 end,
+                        const QList<QPair<const char *, QString>> &args);
+
+};
+
+
+/** Records the time from its construction to its destruction, if tracing
+ *  is enabled. Use the GRYPTO_TRACE_SCOPE macro to make one.
+*/
+class TraceSpan
+{
+    const char *m_category;
+    const char *m_name;
+    qint64 m_start;
+    QList<QPair<const char *, QString>> m_args;
+public:
+
+    TraceSpan(const char *category, const char *name)
+        :m_category(category), m_name(name),
+          m_start(Tracer::IsEnabled() ? Tracer::_now() : -1)
+    {}
+
+    ~TraceSpan(){
+        if(-1 != m_start)
+            Tracer::_record(m_category, m_name, m_start, Tracer::_now(), m_args);
+    }
+
+    /** Returns true if this span is being recorded, so you can skip
+     *  computing arguments when it isn't.
+    */
+    bool IsRecording() const{ return -1 != m_start; }
+
+    /** Attaches an argument to the span, which shows when you select it in
+     *  the viewer. This does nothing if the span isn't being recorded.
+    */
+    void AddArg(const char *key, const QString &value){
+        if(IsRecording())
+            m_args.append(QPair<const char *, QString>(key, value));
+    }
+
+};
+
+
+}
+
+#endif // GRYPTO_TRACER_H
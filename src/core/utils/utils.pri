@@ -1,6 +1,19 @@
 
 HEADERS += \
-    $$PWD/lockout.h
+    $$PWD/lockout.h \
+    $$PWD/fuzzymatcher.h \
+    $$PWD/entryquery.h \
+    $$PWD/securearena.h \
+    $$PWD/idhash.h \
+    $$PWD/bytearena.h \
+    $$PWD/workermetrics.h \
+    $$PWD/tracer.h
 
 SOURCES += \
-    $$PWD/lockout.cpp
+    $$PWD/lockout.cpp \
+    $$PWD/fuzzymatcher.cpp \
+    $$PWD/entryquery.cpp \
+    $$PWD/securearena.cpp \
+    $$PWD/bytearena.cpp \
+    $$PWD/workermetrics.cpp \
+    $$PWD/tracer.cpp
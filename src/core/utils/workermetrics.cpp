@@ -0,0 +1,207 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "workermetrics.h"
+#include <QTextStream>
+using namespace std;
+
+namespace Grypt{
+
+
+const int LatencyHistogram::BucketCount;
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+void LatencyHistogram::Record(quint64 us)
+{
+    int bucket = 0;
+    for(quint64 v = us; v && bucket < BucketCount - 1; v >>= 1)
+        ++bucket;
+
+    m_buckets[bucket].fetch_add(1, memory_order_relaxed);
+    m_total.fetch_add(us, memory_order_relaxed);
+
+    quint64 prev = m_max.load(memory_order_relaxed);
+    while(prev < us && !m_max.compare_exchange_weak(prev, us, memory_order_relaxed))
+    {}
+}
+
+void LatencyHistogram::Reset()
+{
+    for(int i = 0; i < BucketCount; ++i)
+        m_buckets[i].store(0, memory_order_relaxed);
+    m_total.store(0, memory_order_relaxed);
+    m_max.store(0, memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::GetSnapshot() const
+{
+    // The counts may be slightly off from each other if someone is recording
+    //  at the same time, but that's fine for diagnostics. The count is
+    //  taken from the buckets so at least the percentiles add up.
+    Snapshot ret;
+    ret.Buckets.resize(BucketCount);
+    for(int i = 0; i < BucketCount; ++i){
+        ret.Buckets[i] = m_buckets[i].load(memory_order_relaxed);
+        ret.Count += ret.Buckets[i];
+    }
+    ret.TotalMicroseconds = m_total.load(memory_order_relaxed);
+    ret.MaxMicroseconds = m_max.load(memory_order_relaxed);
+    return ret;
+}
+
+quint64 LatencyHistogram::Snapshot::Percentile(double p) const
+{
+    if(0 == Count)
+        return 0;
+
+    const quint64 target = qMax<quint64>(1, (quint64)(Count * p / 100.0 + 0.5));
+    quint64 seen = 0;
+    for(int i = 0; i < Buckets.length(); ++i){
+        seen += Buckets[i];
+        if(seen >= target){
+            // Return the top of the bucket, but never more than the max
+            const quint64 upper = 0 == i ? 0 : ((quint64)1 << i) - 1;
+            return qMin(upper, MaxMicroseconds);
+        }
+    }
+    return MaxMicroseconds;
+}
+
+
+QString LatencyHistogram::FormatMicroseconds(double us)
+{
+    if(us < 1000)
+        return QString("%1us").arg(us, 0, 'f', 0);
+    else if(us < 1000000)
+        return QString("%1ms").arg(us / 1000, 0, 'f', 1);
+    return QString("%1s").arg(us / 1000000, 0, 'f', 2);
+}
+
+QString WorkerMetrics::ToString() const
+{
+    QString ret;
+    QTextStream s(&ret);
+    s << QString("Queue depth: %1 (max %2), %3 commands queued\n")
+         .arg(QueueDepth).arg(MaxQueueDepth).arg(CommandsQueued);
+    s << QString("File encryption: %1 MB at %2 MB/s\n")
+         .arg(FileEncryption.Bytes / (1024.0 * 1024.0), 0, 'f', 1)
+         .arg(FileEncryption.MegabytesPerSecond(), 0, 'f', 1);
+    s << QString("File decryption: %1 MB at %2 MB/s\n")
+         .arg(FileDecryption.Bytes / (1024.0 * 1024.0), 0, 'f', 1)
+         .arg(FileDecryption.MegabytesPerSecond(), 0, 'f', 1);
+    s << "\n";
+
+    s << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9\n")
+         .arg("Command", -22).arg("Count", 8).arg("Failed", 7)
+         .arg("Wait avg", 9).arg("Wait p95", 9)
+         .arg("Exec avg", 9).arg("Exec p50", 9).arg("Exec p99", 9).arg("Exec max", 9);
+    for(const CommandMetrics &c : Commands){
+        s << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9\n")
+             .arg(c.Name, -22)
+             .arg(c.Execution.Count, 8)
+             .arg(c.Failures, 7)
+             .arg(LatencyHistogram::FormatMicroseconds(c.QueueWait.MeanMicroseconds()), 9)
+             .arg(LatencyHistogram::FormatMicroseconds(c.QueueWait.Percentile(95)), 9)
+             .arg(LatencyHistogram::FormatMicroseconds(c.Execution.MeanMicroseconds()), 9)
+             .arg(LatencyHistogram::FormatMicroseconds(c.Execution.Percentile(50)), 9)
+             .arg(LatencyHistogram::FormatMicroseconds(c.Execution.Percentile(99)), 9)
+             .arg(LatencyHistogram::FormatMicroseconds(c.Execution.MaxMicroseconds), 9);
+    }
+    s.flush();
+    return ret;
+}
+
+
+WorkerMetricsCollector::WorkerMetricsCollector(const QStringList &names)
+    :m_names(names),
+      m_commands(new command_t[names.length()])
+{
+    Reset();
+}
+
+void WorkerMetricsCollector::RecordQueued(int depth)
+{
+    m_queued.fetch_add(1, memory_order_relaxed);
+    int prev = m_maxDepth.load(memory_order_relaxed);
+    while(prev < depth && !m_maxDepth.compare_exchange_weak(prev, depth, memory_order_relaxed))
+    {}
+}
+
+void WorkerMetricsCollector::RecordCommand(int type, quint64 wait_us, quint64 execution_us, bool failed)
+{
+    if(0 > type || type >= m_names.length())
+        return;
+    command_t &c = m_commands[type];
+    c.queue_wait.Record(wait_us);
+    c.execution.Record(execution_us);
+    if(failed)
+        c.failures.fetch_add(1, memory_order_relaxed);
+}
+
+void WorkerMetricsCollector::RecordEncryption(quint64 bytes, quint64 us)
+{
+    m_encryptBytes.fetch_add(bytes, memory_order_relaxed);
+    m_encryptTime.fetch_add(us, memory_order_relaxed);
+}
+
+void WorkerMetricsCollector::RecordDecryption(quint64 bytes, quint64 us)
+{
+    m_decryptBytes.fetch_add(bytes, memory_order_relaxed);
+    m_decryptTime.fetch_add(us, memory_order_relaxed);
+}
+
+WorkerMetrics WorkerMetricsCollector::GetSnapshot(int queue_depth) const
+{
+    WorkerMetrics ret;
+    for(int i = 0; i < m_names.length(); ++i){
+        WorkerMetrics::CommandMetrics c;
+        c.Execution = m_commands[i].execution.GetSnapshot();
+        if(0 == c.Execution.Count)
+            continue;
+        c.Name = m_names[i];
+        c.QueueWait = m_commands[i].queue_wait.GetSnapshot();
+        c.Failures = m_commands[i].failures.load(memory_order_relaxed);
+        ret.Commands.append(c);
+    }
+    ret.QueueDepth = queue_depth;
+    ret.MaxQueueDepth = qMax(queue_depth, m_maxDepth.load(memory_order_relaxed));
+    ret.CommandsQueued = m_queued.load(memory_order_relaxed);
+    ret.FileEncryption.Bytes = m_encryptBytes.load(memory_order_relaxed);
+    ret.FileEncryption.Microseconds = m_encryptTime.load(memory_order_relaxed);
+    ret.FileDecryption.Bytes = m_decryptBytes.load(memory_order_relaxed);
+    ret.FileDecryption.Microseconds = m_decryptTime.load(memory_order_relaxed);
+    return ret;
+}
+
+void WorkerMetricsCollector::Reset()
+{
+    for(int i = 0; i < m_names.length(); ++i){
+        m_commands[i].queue_wait.Reset();
+        m_commands[i].execution.Reset();
+        m_commands[i].failures.store(0, memory_order_relaxed);
+    }
+    m_maxDepth.store(0, memory_order_relaxed);
+    m_queued.store(0, memory_order_relaxed);
+    m_encryptBytes.store(0, memory_order_relaxed);
+    m_encryptTime.store(0, memory_order_relaxed);
+    m_decryptBytes.store(0, memory_order_relaxed);
+    m_decryptTime.store(0, memory_order_relaxed);
+}
+
+
+}
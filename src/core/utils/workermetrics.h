@@ -0,0 +1,187 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef GRYPTO_WORKERMETRICS_H
+#define GRYPTO_WORKERMETRICS_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QList>
+#include <atomic>
+#include <memory>
+
+namespace Grypt{
+
+
+/** Counts how long something takes, in power-of-two buckets of microseconds.
+ *  Recording is lock-free and only takes a few atomic increments, so it's
+ *  cheap enough to leave on all the time.
+*/
+class LatencyHistogram
+{
+public:
+
+    /** Bucket 0 counts zero; bucket i counts [2^(i-1), 2^i) microseconds.
+     *  The last bucket counts everything bigger (about 18 minutes and up).
+    */
+    static const int BucketCount = 32;
+
+    /** A consistent copy of the histogram that you can read at your leisure. */
+    struct Snapshot
+    {
+        quint64 Count;
+        quint64 TotalMicroseconds;
+        quint64 MaxMicroseconds;
+        QVector<quint64> Buckets;
+
+        Snapshot() :Count(0), TotalMicroseconds(0), MaxMicroseconds(0) {}
+
+        double MeanMicroseconds() const{
+            return 0 == Count ? 0 : (double)TotalMicroseconds / Count;
+        }
+
+        /** Returns an upper bound on the given percentile (0 to 100), which
+         *  is accurate to within a factor of two.
+        */
+        quint64 Percentile(double) const;
+    };
+
+    LatencyHistogram();
+
+    void Record(quint64 microseconds);
+    void Reset();
+    Snapshot GetSnapshot() const;
+
+    /** Formats a duration in the unit that suits it, i.e. "850us" or "1.5ms". */
+    static QString FormatMicroseconds(double);
+
+
+private:
+
+    std::atomic<quint64> m_buckets[BucketCount];
+    std::atomic<quint64> m_total;
+    std::atomic<quint64> m_max;
+
+};
+
+
+/** Measures how fast data goes through something, like the cryptor. */
+struct ThroughputMetrics
+{
+    quint64 Bytes;
+    quint64 Microseconds;
+
+    ThroughputMetrics() :Bytes(0), Microseconds(0) {}
+
+    double MegabytesPerSecond() const{
+        return 0 == Microseconds ? 0 : (Bytes / (1024.0 * 1024.0)) / (Microseconds / 1000000.0);
+    }
+};
+
+
+/** A snapshot of the background worker's metrics, returned by
+ *  PasswordDatabase::GetWorkerMetrics().
+*/
+struct WorkerMetrics
+{
+    /** The metrics for one type of background command. */
+    struct CommandMetrics
+    {
+        QString Name;
+
+        /** The number of commands that threw an exception. */
+        quint64 Failures;
+
+        /** How long the commands waited in the queue before starting. */
+        LatencyHistogram::Snapshot QueueWait;
+
+        /** How long the commands took to execute. */
+        LatencyHistogram::Snapshot Execution;
+
+        CommandMetrics() :Failures(0) {}
+    };
+
+    /** Only the command types that have run are listed. */
+    QList<CommandMetrics> Commands;
+
+    /** The number of commands in the queue when the snapshot was taken. */
+    int QueueDepth;
+
+    /** The most commands that were ever in the queue at once. */
+    int MaxQueueDepth;
+
+    /** The total number of commands queued. */
+    quint64 CommandsQueued;
+
+    /** The speed of encrypting and decrypting files. */
+    ThroughputMetrics FileEncryption;
+    ThroughputMetrics FileDecryption;
+
+    WorkerMetrics() :QueueDepth(0), MaxQueueDepth(0), CommandsQueued(0) {}
+
+    /** Formats the metrics as a human-readable table. */
+    QString ToString() const;
+};
+
+
+/** Collects the background worker's metrics. You can record from any thread,
+ *  and take a snapshot from any thread.
+*/
+class WorkerMetricsCollector
+{
+public:
+
+    /** The command names index the command types, which must be 0-based and contiguous. */
+    explicit WorkerMetricsCollector(const QStringList &command_names);
+
+    /** Records that a command was queued, and the queue depth after queueing it. */
+    void RecordQueued(int depth);
+
+    /** Records that a command finished. */
+    void RecordCommand(int type, quint64 wait_us, quint64 execution_us, bool failed);
+
+    void RecordEncryption(quint64 bytes, quint64 microseconds);
+    void RecordDecryption(quint64 bytes, quint64 microseconds);
+
+    /** Returns a snapshot of the metrics. The caller supplies the current queue depth. */
+    WorkerMetrics GetSnapshot(int queue_depth) const;
+
+    void Reset();
+
+
+private:
+
+    struct command_t{
+        LatencyHistogram queue_wait;
+        LatencyHistogram execution;
+        std::atomic<quint64> failures;
+        command_t() :failures(0) {}
+    };
+
+    const QStringList m_names;
+    std::unique_ptr<command_t[]> m_commands;
+    std::atomic<int> m_maxDepth;
+    std::atomic<quint64> m_queued;
+    std::atomic<quint64> m_encryptBytes;
+    std::atomic<quint64> m_encryptTime;
+    std::atomic<quint64> m_decryptBytes;
+    std::atomic<quint64> m_decryptTime;
+
+};
+
+
+}
+
+#endif // GRYPTO_WORKERMETRICS_H
@@ -42,6 +42,8 @@ SearchWidget::SearchWidget(QWidget *parent)
     ui->chk_alsoSecrets->installEventFilter(this);
     ui->rdo_regexp->installEventFilter(this);
     ui->rdo_wildCard->installEventFilter(this);
+    ui->rdo_fuzzy->installEventFilter(this);
+    ui->rdo_query->installEventFilter(this);
     ui->chk_start->installEventFilter(this);
     ui->de_start->installEventFilter(this);
     ui->chk_end->installEventFilter(this);
@@ -84,6 +86,12 @@ void SearchWidget::SetFilter(const FilterInfo_t &fi)
     ui->chk_onlyFavorites->setChecked(fi.ShowOnlyFavorites);
     ui->chk_onlyFiles->setChecked(fi.ShowOnlyFiles);
     ui->chk_alsoSecrets->setChecked(fi.AlsoSearchSecrets);
+    if(fi.IsValid){
+        ui->rdo_wildCard->setChecked(fi.SearchStringType == FilterInfo_t::Wildcard);
+        ui->rdo_regexp->setChecked(fi.SearchStringType == FilterInfo_t::RegExp);
+        ui->rdo_fuzzy->setChecked(fi.SearchStringType == FilterInfo_t::Fuzzy);
+        ui->rdo_query->setChecked(fi.SearchStringType == FilterInfo_t::Query);
+    }
     ui->chk_start->setChecked(!fi.StartTime.isNull());
     ui->chk_end->setChecked(!fi.EndTime.isNull());
     ui->de_start->setDateTime(fi.StartTime);
@@ -93,15 +101,21 @@ void SearchWidget::SetFilter(const FilterInfo_t &fi)
 
 FilterInfo_t SearchWidget::GetFilter() const
 {
+    FilterInfo_t::StringType type = FilterInfo_t::Wildcard;
+    if(ui->rdo_regexp->isChecked())
+        type = FilterInfo_t::RegExp;
+    else if(ui->rdo_fuzzy->isChecked())
+        type = FilterInfo_t::Fuzzy;
+    else if(ui->rdo_query->isChecked())
+        type = FilterInfo_t::Query;
+
     FilterInfo_t ret(ui->lineEdit->text().trimmed(),
                      ui->chk_filter_results->isChecked(),
                      !ui->chk_caseSensitive->isChecked(),
                      ui->chk_onlyFavorites->isChecked(),
                      ui->chk_onlyFiles->isChecked(),
                      ui->chk_alsoSecrets->isChecked(),
-                     ui->rdo_wildCard->isChecked() ?
-                         FilterInfo_t::Wildcard :
-                         FilterInfo_t::RegExp);
+                     type);
 
     if(ui->gb_time->isChecked())
     {
@@ -15,11 +15,15 @@ limitations under the License.*/
 #include "databasemodel.h"
 #include <grypto/passworddatabase.h>
 #include <grypto/entry.h>
+#include <grypto/tracer.h>
 #include <QFont>
 #include <QSet>
 #include <QMimeData>
 #include <QStringList>
 #include <QIcon>
+#include <QThread>
+#include <exception>
+#include <algorithm>
 USING_NAMESPACE_GUTIL;
 USING_NAMESPACE_GUTIL1(CryptoPP);
 using namespace std;
@@ -28,17 +32,21 @@ using namespace std;
 
 NAMESPACE_GRYPTO;
 
+/** The model only holds the fields it needs to display the tree, in compact
+ *  form. The secret values are not kept here; they are decrypted on demand
+ *  by FindEntryById().
+*/
 struct EntryContainer
 {
-    Entry entry;
+    CompactEntry entry;
     int child_count = -1;
     QList<EntryContainer *> children;
     bool deleted = false;
 
-    EntryContainer(const Entry &e)
-        :entry(e)
-    {}
+    EntryContainer(const Entry &e) :entry(e) {}
     ~EntryContainer();
+
+    void SetEntry(const Entry &e){ entry = CompactEntry(e); }
 };
 
 class AddEntryCommand : public IUndoableAction {
@@ -199,13 +207,63 @@ EntryContainer::~EntryContainer()
 }
 
 
+// Builds the container tree from a depth-first list of entries and their child counts
+static QList<EntryContainer *> __build_container_tree(const QList<QPair<Entry, int>> &subtree)
+{
+    QList<EntryContainer *> ret;
+    QHash<EntryId, EntryContainer *> index;
+    index.reserve(subtree.length());
+    for(const auto &p : subtree){
+        EntryContainer *ec = new EntryContainer(p.first);
+        ec->child_count = p.second;
+        index.insert(p.first.GetId(), ec);
+
+        // Parents always come before their children, and siblings are in row order
+        if(p.first.GetParentId().IsNull())
+            ret.append(ec);
+        else{
+            GASSERT(index.contains(p.first.GetParentId()));
+            index[p.first.GetParentId()]->children.append(ec);
+        }
+    }
+    return ret;
+}
+
+
+/** Decrypts the whole tree and builds the containers on a background thread. */
+class fetch_all_worker : public QThread
+{
+    const PasswordDatabase &m_db;
+    Cryptor m_cryptor;
+    void run(){
+        try{
+            Result = __build_container_tree(m_db.FindEntrySubtree(EntryId::Null(), m_cryptor));
+        }
+        catch(...){
+            Error = current_exception();
+        }
+    }
+public:
+    fetch_all_worker(const PasswordDatabase &db, int change_count)
+        :m_db(db), m_cryptor(db.Cryptor()), ChangeCount(change_count) {}
+    ~fetch_all_worker(){ __cleanup_entry_list(Result); }
+
+    // The model's change count when the snapshot started
+    const int ChangeCount;
+    QList<EntryContainer *> Result;
+    exception_ptr Error;
+};
+
+
 DatabaseModel::DatabaseModel(const char *f,
                              function<bool(const PasswordDatabase::ProcessInfo &)> ask_for_lock_override,
                              QObject *parent)
     :QAbstractItemModel(parent),
       m_db(f, ask_for_lock_override),
       m_undostack([&]{ emit NotifyUndoStackChanged(); }),
-      m_timeFormat(true)
+      m_rootFetched(false),
+      m_timeFormat(true),
+      m_changeCount(0)
 {
     connect(&m_db, SIGNAL(NotifyFavoritesUpdated()),
             this, SIGNAL(NotifyFavoritesUpdated()),
@@ -214,10 +272,14 @@ DatabaseModel::DatabaseModel(const char *f,
             this, SLOT(_handle_database_worker_exception(const std::shared_ptr<std::exception> &)));
     connect(&m_db, SIGNAL(NotifyProgressUpdated(int, bool, QString)),
             this, SIGNAL(NotifyProgressUpdated(int, bool, QString)));
+    connect(&m_db, SIGNAL(NotifyEntriesChanged(Grypt::PasswordDatabase::EntryChangeSet)),
+            this, SLOT(_apply_entry_changes(Grypt::PasswordDatabase::EntryChangeSet)));
 }
 
 DatabaseModel::~DatabaseModel()
 {
+    _discard_fetch_worker();
+
     // Clean up the index objects
     __cleanup_entry_list(m_root);
 }
@@ -247,10 +309,34 @@ void DatabaseModel::SaveAs(const QString &filename, const Credentials &creds)
     }
 }
 
+void DatabaseModel::Lock()
+{
+    if(IsLocked())
+        return;
+
+    // The undo commands hold whole entries, with their secrets
+    ++m_changeCount;
+    _discard_fetch_worker();
+    ClearUndoStack();
+    _install_container_tree(QList<EntryContainer *>());
+    m_db.Lock();
+}
+
+bool DatabaseModel::Unlock(const Credentials &creds)
+{
+    if(!IsLocked())
+        return CheckCredentials(creds);
+    if(!m_db.Unlock(creds))
+        return false;
+
+    fetchMore(QModelIndex());
+    return true;
+}
+
 void DatabaseModel::CheckAndRepairDatabase()
 {
     ClearUndoStack();
-    connect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_reset_model()));
+    connect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_read_only_transaction()));
     m_db.CheckAndRepairDatabase();
 }
 
@@ -285,7 +371,7 @@ QList<EntryId> DatabaseModel::FindFavoriteIds() const
     return m_db.FindFavoriteIds();
 }
 
-Entry const *DatabaseModel::GetEntryFromIndex(const QModelIndex &ind) const
+CompactEntry const *DatabaseModel::GetEntryFromIndex(const QModelIndex &ind) const
 {
     EntryContainer *ec = _get_container_from_index(ind);
     return ec  && !ec->deleted ? &ec->entry : NULL;
@@ -458,11 +544,12 @@ bool DatabaseModel::canFetchMore(const QModelIndex &par) const
 
 void DatabaseModel::fetchMore(const QModelIndex &par)
 {
+    GRYPTO_TRACE_SCOPE("model", "fetchMore");
     EntryContainer *cont = _get_container_from_index(par);
     EntryId id;
     if(cont == NULL)
     {
-        if(m_root.count() > 0)
+        if(m_rootFetched)
             return;
     }
     else
@@ -472,28 +559,28 @@ void DatabaseModel::fetchMore(const QModelIndex &par)
         id = cont->entry.GetId();
     }
 
+    _insert_fetched_children(par, m_db.FindEntriesAndChildCountsByParentId(id));
+}
+
+void DatabaseModel::_insert_fetched_children(const QModelIndex &par,
+                                             const QList<QPair<Entry, int>> &children)
+{
+    EntryContainer *cont = _get_container_from_index(par);
     QList<EntryContainer *> &lst = _get_child_list(par);
     GASSERT(lst.count() == 0);
 
-    // Fetch the data inside a try block in case we hit an exception part-way through fetching
     QList<EntryContainer *> tmplist;
-    try
-    {
-        for(Entry const &e : m_db.FindEntriesByParentId(id))
-        {
-            int cnt = m_db.CountEntriesByParentId(e.GetId());
-            tmplist.append(new EntryContainer(e));
-            tmplist.last()->child_count = cnt;
-        }
-    }
-    catch(...)
+    tmplist.reserve(children.length());
+    for(const auto &p : children)
     {
-        __cleanup_entry_list(tmplist);
-        throw;
+        tmplist.append(new EntryContainer(p.first));
+        tmplist.last()->child_count = p.second;
     }
 
     if(cont)
         cont->child_count = tmplist.count();
+    else
+        m_rootFetched = true;
 
     if(tmplist.count() > 0)
     {
@@ -510,18 +597,155 @@ void DatabaseModel::fetchMore(const QModelIndex &par)
     }
 }
 
-static void __fetch_node_recursive(QAbstractItemModel *m, const QModelIndex &ind)
+void DatabaseModel::_fetch_node_recursive(const QModelIndex &ind,
+                                          const QHash<EntryId, QList<QPair<Entry, int>>> &by_parent)
 {
-    for(int i = 0; i < m->rowCount(ind); ++i){
-        QModelIndex child = m->index(i, 0, ind);
-        m->fetchMore(child);
-        __fetch_node_recursive(m, child);
+    for(int i = 0; i < rowCount(ind); ++i){
+        QModelIndex child = index(i, 0, ind);
+        if(canFetchMore(child))
+            _insert_fetched_children(child, by_parent.value(_get_container_from_index(child)->entry.GetId()));
+        _fetch_node_recursive(child, by_parent);
     }
 }
 
+bool DatabaseModel::_is_fully_loaded() const
+{
+    if(!m_rootFetched && 0 < m_db.CountEntriesByParentId(EntryId()))
+        return false;
+    for(EntryContainer *ec : m_index){
+        if(!ec->deleted && ec->child_count != ec->children.count())
+            return false;
+    }
+    return true;
+}
+
+void DatabaseModel::_install_container_tree(const QList<EntryContainer *> &root)
+{
+    beginResetModel();
+    {
+        __cleanup_entry_list(m_root);
+        m_index.clear();
+        m_root = root;
+        m_rootFetched = !root.isEmpty();
+
+        QList<EntryContainer *> stack(root);
+        while(!stack.isEmpty()){
+            EntryContainer *ec = stack.takeLast();
+            m_index.insert(ec->entry.GetId(), ec);
+            stack.append(ec->children);
+        }
+    }
+    endResetModel();
+}
+
+// Moves the snapshot's containers into the parts of the tree that aren't loaded
+//  yet. We insert rows rather than reset the model, so the view keeps its
+//  expanded and selected items.
+void DatabaseModel::_merge_container_tree(const QModelIndex &par, QList<EntryContainer *> &snapshot)
+{
+    QList<EntryContainer *> &lst = _get_child_list(par);
+    if(!par.isValid())
+        m_rootFetched = true;
+    if(lst.isEmpty()){
+        if(snapshot.isEmpty())
+            return;
+
+        beginInsertRows(par, 0, snapshot.count() - 1);
+        {
+            EntryContainer *cont = _get_container_from_index(par);
+            if(cont)
+                cont->child_count = snapshot.count();
+
+            // The snapshot gives up its containers to the model
+            lst.swap(snapshot);
+            QList<EntryContainer *> stack(lst);
+            while(!stack.isEmpty()){
+                EntryContainer *ec = stack.takeLast();
+                m_index.insert(ec->entry.GetId(), ec);
+                stack.append(ec->children);
+            }
+        }
+        endInsertRows();
+        return;
+    }
+
+    // These rows are already loaded, so look for unloaded rows below them
+    QHash<EntryId, EntryContainer *> by_id;
+    for(EntryContainer *ec : snapshot)
+        by_id.insert(ec->entry.GetId(), ec);
+    for(int i = 0; i < lst.count(); ++i){
+        EntryContainer *ec = by_id.value(lst[i]->entry.GetId(), NULL);
+        if(ec)
+            _merge_container_tree(index(i, 0, par), ec->children);
+    }
+}
+
+void DatabaseModel::_discard_fetch_worker()
+{
+    if(m_fetchWorker){
+        m_fetchWorker->wait();
+        m_fetchWorker.reset();
+    }
+}
+
+void DatabaseModel::FetchAllEntriesAsync()
+{
+    if(m_fetchWorker)
+        return;     // The worker will notify when it's done
+
+    if(_is_fully_loaded()){
+        emit NotifyAllEntriesFetched();
+        return;
+    }
+
+    m_fetchWorker.reset(new fetch_all_worker(m_db, m_changeCount));
+    connect(m_fetchWorker.data(), SIGNAL(finished()), this, SLOT(_fetch_worker_finished()));
+    m_fetchWorker->start();
+}
+
+void DatabaseModel::_fetch_worker_finished()
+{
+    // The worker may have been discarded by a synchronous fetch
+    if(!m_fetchWorker || !m_fetchWorker->isFinished())
+        return;
+
+    QScopedPointer<fetch_all_worker> w(m_fetchWorker.take());
+    if(w->Error){
+        // We're in a queued slot, so we report the error rather than throw it
+        QString msg = tr("Unknown error");
+        try{
+            rethrow_exception(w->Error);
+        }
+        catch(const exception &ex){
+            msg = QString::fromUtf8(ex.what());
+        }
+        catch(...){}
+        emit NotifyFetchAllEntriesFailed(msg);
+        return;
+    }
+
+    if(w->ChangeCount != m_changeCount){
+        // The model changed while we were loading, so the snapshot is stale
+        FetchAllEntriesAsync();
+        return;
+    }
+
+    // The worker deletes whatever the model didn't take
+    _merge_container_tree(QModelIndex(), w->Result);
+    emit NotifyAllEntriesFetched();
+}
+
 void DatabaseModel::FetchAllEntries()
 {
-    __fetch_node_recursive(this, QModelIndex());
+    _discard_fetch_worker();
+    fetchMore();
+
+    // Get the whole tree in one call, rather than one call per node
+    QHash<EntryId, QList<QPair<Entry, int>>> by_parent;
+    for(const auto &p : m_db.FindEntrySubtree())
+        by_parent[p.first.GetParentId()].append(p);
+
+    _fetch_node_recursive(QModelIndex(), by_parent);
 }
 
 void DatabaseModel::AddEntry(Entry &e)
@@ -531,7 +755,9 @@ void DatabaseModel::AddEntry(Entry &e)
 
 void DatabaseModel::RemoveEntry(const Entry &e)
 {
-    m_undostack.Do(new DeleteEntryCommand(e, this));
+    // Fetch the whole entry, because the model only holds the display fields
+    //  and we need the secrets to be able to undo the delete
+    m_undostack.Do(new DeleteEntryCommand(FindEntryById(e.GetId()), this));
 }
 
 void DatabaseModel::UpdateEntry(const Entry &e)
@@ -541,6 +767,7 @@ void DatabaseModel::UpdateEntry(const Entry &e)
 
 void DatabaseModel::_add_entry(Entry &e, bool generate_id)
 {
+    ++m_changeCount;
     m_db.AddEntry(e, generate_id);
 
     // Don't have to do anything if the parent is not present
@@ -549,7 +776,7 @@ void DatabaseModel::_add_entry(Entry &e, bool generate_id)
 
     // Don't have to do anything if the parent's children have not been loaded
     QModelIndex par = FindIndexById(e.GetParentId());
-    if(canFetchMore(par))
+    if(canFetchMore(par) || (!par.isValid() && !m_rootFetched))
         return;
 
     if((int)e.GetRow() > rowCount(par))
@@ -582,6 +809,7 @@ void DatabaseModel::_add_entry(Entry &e, bool generate_id)
 
 void DatabaseModel::_del_entry(const EntryId &id)
 {
+    ++m_changeCount;
     m_db.DeleteEntry(id);
 
     // Don't have to do anything if the entry wasn't loaded
@@ -608,19 +836,20 @@ void DatabaseModel::_del_entry(const EntryId &id)
 
 void DatabaseModel::_edt_entry(Entry &e)
 {
+    ++m_changeCount;
     m_db.UpdateEntry(e);
 
     QModelIndex ind = FindIndexById(e.GetId());
     if(ind.isValid())
     {
-        Entry &my_entry( _get_container_from_index(ind)->entry );
-        my_entry = e;
+        _get_container_from_index(ind)->SetEntry(e);
         emit dataChanged(ind, index(ind.row(), columnCount() - 1, ind.parent()));
     }
 }
 
 void DatabaseModel::_set_favs(const QList<EntryId> &favs)
 {
+    ++m_changeCount;
     QList<EntryId> orig_favs = m_db.FindFavoriteIds();
 
     m_db.SetFavoriteEntries(favs);
@@ -641,6 +870,7 @@ void DatabaseModel::_set_favs(const QList<EntryId> &favs)
 
 void DatabaseModel::_add_fav(const EntryId &id)
 {
+    ++m_changeCount;
     m_db.AddFavoriteEntry(id);
 
     m_index[id]->entry.SetFavoriteIndex(0);
@@ -650,6 +880,7 @@ void DatabaseModel::_add_fav(const EntryId &id)
 
 void DatabaseModel::_del_fav(const EntryId &id)
 {
+    ++m_changeCount;
     m_db.RemoveFavoriteEntry(id);
 
     QList<Entry> favs = m_db.FindFavoriteEntries();
@@ -663,6 +894,7 @@ void DatabaseModel::_del_fav(const EntryId &id)
 void DatabaseModel::_mov_entries(const EntryId &pid, int r_first, int r_last,
                                  const EntryId &targ_pid, int &r_dest)
 {
+    ++m_changeCount;
     int move_cnt = r_last - r_first + 1;
     QModelIndex parent_index = FindIndexById(pid);
     QModelIndex targ_parent_index = FindIndexById(targ_pid);
@@ -768,7 +1000,7 @@ void DatabaseModel::ImportFromPortableSafe(const QString &import_filename,
 {
     ClearUndoStack();
     m_db.ImportFromPortableSafe(import_filename, creds);
-    connect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_reset_model()));
+    connect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_read_only_transaction()));
 }
 
 void DatabaseModel::ExportToXml(const QString &export_filename)
@@ -780,27 +1012,208 @@ void DatabaseModel::ImportFromXml(const QString &import_filename)
 {
     ClearUndoStack();
     m_db.ImportFromXml(import_filename);
-    connect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_reset_model()));
+    connect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_read_only_transaction()));
 }
 
 void DatabaseModel::_reset_model()
 {
-    beginResetModel();
-    __cleanup_entry_list(m_root);
-    m_index.clear();
-    endResetModel();
-
-    fetchMore();
-    FetchAllEntries();
+    ++m_changeCount;
+    _discard_fetch_worker();
+    _install_container_tree(__build_container_tree(m_db.FindEntrySubtree()));
+    m_rootFetched = true;
 }
 
-void DatabaseModel::_thread_finished_reset_model()
+void DatabaseModel::_thread_finished_read_only_transaction()
 {
-    disconnect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_reset_model()));
-    _reset_model();
+    // The model was already updated by the change notifications
+    disconnect(&m_db, SIGNAL(NotifyThreadIdle()), this, SLOT(_thread_finished_read_only_transaction()));
     emit NotifyReadOnlyTransactionFinished();
 }
 
+bool DatabaseModel::_is_attached(EntryContainer *ec) const
+{
+    // A container is only in the tree if none of its ancestors were deleted
+    while(ec){
+        if(ec->deleted)
+            return false;
+        const EntryId pid = ec->entry.GetParentId();
+        if(pid.IsNull())
+            return true;
+        ec = m_index.value(pid, NULL);
+    }
+    return false;
+}
+
+void DatabaseModel::_forget_container(EntryContainer *ec)
+{
+    QList<EntryContainer *> stack;
+    stack.append(ec);
+    while(!stack.isEmpty()){
+        EntryContainer *cur = stack.takeLast();
+        m_index.remove(cur->entry.GetId());
+        stack.append(cur->children);
+    }
+    delete ec;
+}
+
+void DatabaseModel::_remove_changed_entry(const EntryId &id)
+{
+    EntryContainer *ec = m_index.value(id, NULL);
+    if(!ec)
+        return;
+
+    if(_is_attached(ec)){
+        QModelIndex ind = FindIndexById(id);
+        QModelIndex par = ind.parent();
+        QList<EntryContainer *> &children = _get_child_list(par);
+        beginRemoveRows(par, ind.row(), ind.row());
+        {
+            children.removeAt(ind.row());
+            if(par.isValid())
+                _get_container_from_index(par)->child_count -= 1;
+            for(int i = ind.row(); i < children.count(); ++i)
+                children[i]->entry.SetRow(i);
+        }
+        endRemoveRows();
+    }
+    else if(!ec->deleted){
+        // It's inside a deleted branch, so it will be cleaned up with its ancestor
+        m_index.remove(id);
+        return;
+    }
+    _forget_container(ec);
+}
+
+void DatabaseModel::_add_changed_entry(const PasswordDatabase::EntryChange &c)
+{
+    EntryContainer *par_ec = m_index.value(c.ParentId, NULL);
+    if(!c.ParentId.IsNull() && (!par_ec || !_is_attached(par_ec)))
+        return;     // The parent isn't loaded, so it will be fetched lazily
+
+    // The root entries will all come in when they're fetched
+    if(c.ParentId.IsNull() && !m_rootFetched)
+        return;
+
+    QModelIndex par = FindIndexById(c.ParentId);
+    if(par_ec && canFetchMore(par)){
+        // The parent's children haven't been loaded yet, so just count the new one
+        par_ec->child_count += 1;
+        _emit_row_changed(par);
+        return;
+    }
+
+    // Load the new entry along with all of its descendants
+    EntryContainer *ec = new EntryContainer(m_db.FindEntry(c.Id));
+    const QList<QPair<Entry, int>> subtree = m_db.FindEntrySubtree(c.Id);
+    {
+        QHash<EntryId, EntryContainer *> index;
+        index.insert(c.Id, ec);
+        for(const auto &p : subtree){
+            EntryContainer *child = new EntryContainer(p.first);
+            child->child_count = p.second;
+            index.insert(p.first.GetId(), child);
+            index[p.first.GetParentId()]->children.append(child);
+        }
+        ec->child_count = ec->children.count();
+    }
+
+    QList<EntryContainer *> &children = _get_child_list(par);
+    int row = qBound(0, ec->entry.GetRow(), children.count());
+    beginInsertRows(par, row, row);
+    {
+        children.insert(row, ec);
+        for(int i = row; i < children.count(); ++i)
+            children[i]->entry.SetRow(i);
+        if(par_ec)
+            par_ec->child_count += 1;
+
+        QList<EntryContainer *> stack;
+        stack.append(ec);
+        while(!stack.isEmpty()){
+            EntryContainer *cur = stack.takeLast();
+            m_index.insert(cur->entry.GetId(), cur);
+            stack.append(cur->children);
+        }
+    }
+    endInsertRows();
+}
+
+void DatabaseModel::_reorder_changed_entries(const QList<PasswordDatabase::EntryChange> &moved)
+{
+    emit layoutAboutToBeChanged();
+    const QModelIndexList from = persistentIndexList();
+
+    // Update the rows and then sort each affected parent's children by row
+    QSet<EntryId> parents;
+    for(const PasswordDatabase::EntryChange &c : moved){
+        EntryContainer *ec = m_index.value(c.Id, NULL);
+        if(ec){
+            ec->entry.SetRow(c.Row);
+            parents.insert(c.ParentId);
+        }
+    }
+    for(const EntryId &pid : parents){
+        EntryContainer *par_ec = m_index.value(pid, NULL);
+        if(!pid.IsNull() && !par_ec)
+            continue;
+        QList<EntryContainer *> &children = par_ec ? par_ec->children : m_root;
+        stable_sort(children.begin(), children.end(),
+                    [](EntryContainer *lhs, EntryContainer *rhs){
+            return lhs->entry.GetRow() < rhs->entry.GetRow();
+        });
+        for(int i = 0; i < children.count(); ++i)
+            children[i]->entry.SetRow(i);
+    }
+
+    QModelIndexList to;
+    to.reserve(from.count());
+    for(const QModelIndex &ind : from){
+        EntryContainer *ec = _get_container_from_index(ind);
+        to.append(ec ? createIndex(ec->entry.GetRow(), ind.column(), (void *)ec) : QModelIndex());
+    }
+    changePersistentIndexList(from, to);
+    emit layoutChanged();
+}
+
+void DatabaseModel::_apply_entry_changes(const PasswordDatabase::EntryChangeSet &changes)
+{
+    ++m_changeCount;
+
+    for(const PasswordDatabase::EntryChange &c : changes.Removed)
+        _remove_changed_entry(c.Id);
+
+    // Moves within the same parent are reorders, otherwise we remove and re-add the entry
+    QList<PasswordDatabase::EntryChange> reordered;
+    for(const PasswordDatabase::EntryChange &c : changes.Moved){
+        EntryContainer *ec = m_index.value(c.Id, NULL);
+        if(!ec)
+            _add_changed_entry(c);
+        else if(ec->entry.GetParentId() == c.ParentId)
+            reordered.append(c);
+        else{
+            _remove_changed_entry(c.Id);
+            _add_changed_entry(c);
+        }
+    }
+    if(!reordered.isEmpty())
+        _reorder_changed_entries(reordered);
+
+    for(const PasswordDatabase::EntryChange &c : changes.Updated){
+        EntryContainer *ec = m_index.value(c.Id, NULL);
+        if(ec && !ec->deleted){
+            ec->SetEntry(m_db.FindEntry(c.Id));
+            if(_is_attached(ec))
+                _emit_row_changed(FindIndexById(c.Id));
+        }
+    }
+
+    // The parents come first, so once we've added a parent its descendants are already loaded
+    for(const PasswordDatabase::EntryChange &c : changes.Added){
+        if(!m_index.contains(c.Id))
+            _add_changed_entry(c);
+    }
+}
+
 void DatabaseModel::CancelAllBackgroundOperations()
 {
     m_db.CancelFileTasks();
@@ -878,7 +1291,7 @@ bool DatabaseModel::dropMimeData(const QMimeData *mimedata,
     }
     else if(action == Qt::CopyAction)
     {
-        Entry cpy = *GetEntryFromIndex(eind);
+        Entry cpy = FindEntryById(eind.data(EntryIdRole).value<EntryId>());
         cpy.SetParentId(data(parent, EntryIdRole).value<EntryId>());
         cpy.SetRow(row);
         cpy.SetModifyDate(QDateTime::currentDateTime());
@@ -16,8 +16,10 @@ limitations under the License.*/
 #define GRYPTO_DATABASEMODEL_H
 
 #include <grypto/passworddatabase.h>
+#include <grypto/compactentry.h>
 #include <gutil/undostack.h>
 #include <QAbstractItemModel>
+#include <QScopedPointer>
 
 namespace GUtil{ namespace CryptoPP{
 class Cryptor;
@@ -26,6 +28,7 @@ class Cryptor;
 namespace Grypt{
 
 struct EntryContainer;
+class fetch_all_worker;
 
 
 /** A lazy-loading tree model of database entries. */
@@ -58,6 +61,19 @@ public:
     /** Returns true if the database has been opened. */
     bool IsOpen() const{ return m_db.IsOpen(); }
 
+    /** Drops every entry in the model, the undo stack and the key, so there
+     *  is no plaintext left in memory. See PasswordDatabase::Lock().
+    */
+    void Lock();
+
+    /** Unlocks the database and loads the root entries again. Branches are
+     *  loaded as they're expanded, like after opening.
+     *  \returns false if the credentials are wrong
+    */
+    bool Unlock(const Credentials &);
+
+    bool IsLocked() const{ return m_db.IsLocked(); }
+
     void SaveAs(const QString &filename, const Credentials &);
 
     void CheckAndRepairDatabase();
@@ -95,8 +111,12 @@ public:
 
     /** Returns a reference to the entry held in the model, or a null pointer
      *  if the index is invalid.
+     *
+     *  The model only holds the fields needed for display, in compact form, so
+     *  the returned entry has no secret values. Use FindEntryById() to get the
+     *  whole entry.
     */
-    Entry const *GetEntryFromIndex(const QModelIndex &) const;
+    CompactEntry const *GetEntryFromIndex(const QModelIndex &) const;
 
     /** Returns true if "ancestor" is an ancestor of "child". It also
      *  returns true if the child is same as the ancestor.
@@ -108,6 +128,15 @@ public:
     */
     void WaitForBackgroundThreadIdle();
 
+    /** Returns the background thread's metrics, for diagnostics. */
+    WorkerMetrics GetWorkerMetrics() const{ return m_db.GetWorkerMetrics(); }
+
+    /** Starts the background thread's metrics over from zero. */
+    void ResetWorkerMetrics(){ m_db.ResetWorkerMetrics(); }
+
+    /** Returns how long it takes to unlock the database, and why. */
+    KdfBenchmark GetKdfBenchmark() const{ return m_db.GetKdfBenchmark(); }
+
     /** \name Undoable actions
      *  You can call Undo() and Redo() to undo and redo these actions
      *  \{
@@ -156,9 +185,17 @@ public:
     /** Imports the plaintext XML. */
     void ImportFromXml(const QString &import_filename);
 
-    /** Loads all entries from the database. */
+    /** Loads all entries from the database. This blocks until they are loaded,
+     *  so prefer FetchAllEntriesAsync() in the GUI.
+    */
     void FetchAllEntries();
 
+    /** Loads all entries on a background thread and installs them with a single
+     *  model reset, then emits NotifyAllEntriesFetched(). If everything is already
+     *  loaded, the signal is emitted immediately.
+    */
+    void FetchAllEntriesAsync();
+
     /** \name QAbstractItemModel interface
      *  \{
     */
@@ -204,6 +241,13 @@ signals:
     void NotifyProgressUpdated(int, bool, const QString &);
     void NotifyUndoStackChanged();
 
+    /** Notifies that FetchAllEntriesAsync() finished and the entire tree is loaded. */
+    void NotifyAllEntriesFetched();
+
+    /** Notifies that FetchAllEntriesAsync() failed, with the error message.
+     *  The model stays usable; the rest of the tree is loaded on demand. */
+    void NotifyFetchAllEntriesFailed(const QString &);
+
     /** This signal notifies that the last read-only transaction was finished, and the
      *  database can now be safely modified again. */
     void NotifyReadOnlyTransactionFinished();
@@ -213,22 +257,45 @@ private slots:
 
     void _handle_database_worker_exception(const std::shared_ptr<std::exception> &);
 
-    void _thread_finished_reset_model();
+    void _thread_finished_read_only_transaction();
+    void _apply_entry_changes(const Grypt::PasswordDatabase::EntryChangeSet &);
+
+    void _fetch_worker_finished();
 
 private:
 
     PasswordDatabase m_db;
     QList<EntryContainer *> m_root;
+
+    // True once the root entries were loaded, which m_root alone can't tell us
+    bool m_rootFetched;
     QHash<EntryId, EntryContainer *> m_index;
     GUtil::UndoStack m_undostack;
     bool m_timeFormat;
 
+    // Counts changes to the model, so we know if a background snapshot is stale
+    int m_changeCount;
+    QScopedPointer<fetch_all_worker> m_fetchWorker;
+
     EntryContainer *_get_container_from_index(const QModelIndex &) const;
     QList<EntryContainer *> const &_get_child_list(const QModelIndex &) const;
     QList<EntryContainer *> &_get_child_list(const QModelIndex &);
 
     void _append_referenced_files(const QModelIndex &, QSet<QByteArray> &);
 
+    void _insert_fetched_children(const QModelIndex &, const QList<QPair<Entry, int>> &);
+    void _fetch_node_recursive(const QModelIndex &,
+                               const QHash<EntryId, QList<QPair<Entry, int>>> &by_parent);
+    bool _is_fully_loaded() const;
+    void _install_container_tree(const QList<EntryContainer *> &);
+    void _merge_container_tree(const QModelIndex &, QList<EntryContainer *> &);
+    bool _is_attached(EntryContainer *) const;
+    void _forget_container(EntryContainer *);
+    void _remove_changed_entry(const EntryId &);
+    void _add_changed_entry(const PasswordDatabase::EntryChange &);
+    void _reorder_changed_entries(const QList<PasswordDatabase::EntryChange> &);
+    void _discard_fetch_worker();
+
     void _add_entry(Entry &, bool);
     void _del_entry(const EntryId &);
     void _edt_entry(Entry &);
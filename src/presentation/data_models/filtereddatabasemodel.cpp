@@ -15,15 +15,29 @@ limitations under the License.*/
 #include "filtereddatabasemodel.h"
 #include "databasemodel.h"
 #include <grypto/entry.h>
+#include <grypto/fuzzymatcher.h>
 #include <gutil/variant.h>
+#include <functional>
 USING_NAMESPACE_GUTIL1(Qt);
 USING_NAMESPACE_GUTIL;
+using namespace std;
 
 NAMESPACE_GRYPTO;
 
 
+// The state needed to match rows against a single filter
+struct FilteredDatabaseModel::filter_context_t
+{
+    QRegExp rx;
+    unique_ptr<FuzzyMatcher> fuzzy;
+};
+
+
 FilteredDatabaseModel::FilteredDatabaseModel(QObject *parent)
-    :QSortFilterProxyModel(parent)
+    :QSortFilterProxyModel(parent),
+      m_ranked(false),
+      m_queryIndexDirty(true),
+      m_acceptUnindexed(true)
 {
     setDynamicSortFilter(false);
 }
@@ -33,7 +47,33 @@ void FilteredDatabaseModel::setSourceModel(QAbstractItemModel *m)
     if(m && dynamic_cast<DatabaseModel *>(m) == NULL)
         qDebug("Refusing to set model because it's not a DatabaseModel");
     else
+    {
+        if(sourceModel()){
+            disconnect(sourceModel(), 0, this, SLOT(_source_rows_inserted(QModelIndex,int,int)));
+            disconnect(sourceModel(), 0, this, SLOT(_source_rows_about_to_be_removed(QModelIndex,int,int)));
+            disconnect(sourceModel(), 0, this, SLOT(_source_rows_moved(QModelIndex,int,int,QModelIndex,int)));
+            disconnect(sourceModel(), 0, this, SLOT(_source_data_changed(QModelIndex,QModelIndex)));
+            disconnect(sourceModel(), 0, this, SLOT(_clear_query_index()));
+        }
         QSortFilterProxyModel::setSourceModel(m);
+        _clear_query_index();
+
+        // Changes to the source model are applied to the query index one
+        //  entry at a time, so we don't have to build it again
+        if(m){
+            connect(m, SIGNAL(rowsInserted(QModelIndex,int,int)),
+                    this, SLOT(_source_rows_inserted(QModelIndex,int,int)));
+            connect(m, SIGNAL(rowsAboutToBeRemoved(QModelIndex,int,int)),
+                    this, SLOT(_source_rows_about_to_be_removed(QModelIndex,int,int)));
+            connect(m, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
+                    this, SLOT(_source_rows_moved(QModelIndex,int,int,QModelIndex,int)));
+            connect(m, SIGNAL(dataChanged(QModelIndex,QModelIndex)),
+                    this, SLOT(_source_data_changed(QModelIndex,QModelIndex)));
+
+            // The names are dropped when the model resets, i.e. when it's locked
+            connect(m, SIGNAL(modelReset()), this, SLOT(_clear_query_index()));
+        }
+    }
 }
 
 DatabaseModel *FilteredDatabaseModel::_get_database_model() const
@@ -44,29 +84,216 @@ DatabaseModel *FilteredDatabaseModel::_get_database_model() const
 void FilteredDatabaseModel::SetFilter(const FilterInfo_t &fi)
 {
     m_index.clear();
+    m_ranked = false;
+    m_queryError.clear();
+    m_acceptUnindexed = true;
 
-    if(sourceModel() && fi.IsValid)
+    if(sourceModel() && fi.IsValid &&
+            fi.SearchStringType == fi.Query && !fi.SearchString.isEmpty())
+    {
+        _apply_query(fi);
+        invalidateFilter();
+    }
+    else if(sourceModel() && fi.IsValid)
     {
-        QRegExp rx(fi.SearchString,
-                   fi.IgnoreCase ? ::Qt::CaseInsensitive : ::Qt::CaseSensitive,
-                   fi.SearchStringType == fi.Wildcard ? QRegExp::Wildcard : QRegExp::RegExp);
+        QRegExp::PatternSyntax syntax = QRegExp::FixedString;
+        if(fi.SearchStringType == fi.Wildcard)
+            syntax = QRegExp::Wildcard;
+        else if(fi.SearchStringType == fi.RegExp)
+            syntax = QRegExp::RegExp;
+
+        filter_context_t ctx;
+        ctx.rx = QRegExp(fi.SearchString,
+                         fi.IgnoreCase ? ::Qt::CaseInsensitive : ::Qt::CaseSensitive,
+                         syntax);
+
+        if(!fi.SearchString.isEmpty())
+        {
+            // A fuzzy search uses the matcher instead of the regular expression
+            if(fi.SearchStringType == fi.Fuzzy){
+                ctx.fuzzy.reset(new FuzzyMatcher(fi.SearchString, fi.IgnoreCase));
+                m_ranked = true;
+            }
+        }
 
         // Iterate through the entire model and populate the filter index
-        _update_index(QModelIndex(), rx, fi);
+        _update_index(QModelIndex(), ctx, fi, NULL);
 
-        setFilterRegExp(rx);
+        setFilterRegExp(ctx.rx);
     }
     else
     {
         invalidateFilter();
     }
+
+    // Fuzzy results are ranked by score, otherwise restore the original order
+    sort(m_ranked ? 0 : -1);
+}
+
+// A query only looks at the entries the index gives us, and their ancestors
+//  and descendants, rather than walking the whole model
+void FilteredDatabaseModel::_apply_query(const FilterInfo_t &fi)
+{
+    EntryQuery q = EntryQuery::Parse(fi.SearchString);
+    QVector<EntryId> matches;
+    if(q.IsValid()){
+        if(m_queryIndexDirty){
+            m_queryIndex.Clear();
+            _rebuild_query_index(QModelIndex());
+            m_queryIndex.Finalize();
+            m_queryIndexDirty = false;
+        }
+
+        // The pre-filters are indexed too, so they become part of the query
+        bool contradiction = false;
+        if(fi.ShowOnlyFavorites){
+            contradiction = contradiction || q.Favorite == EntryQuery::No;
+            q.Favorite = EntryQuery::Yes;
+        }
+        if(fi.ShowOnlyFiles){
+            contradiction = contradiction || q.HasFile == EntryQuery::No;
+            q.HasFile = EntryQuery::Yes;
+        }
+        if(fi.StartTime.isValid())
+            q.ModifiedFrom = qMax(q.ModifiedFrom, fi.StartTime.toMSecsSinceEpoch());
+        if(fi.EndTime.isValid()){
+            const qint64 until = fi.EndTime.toMSecsSinceEpoch() + 1;
+            q.ModifiedUntil = -1 == q.ModifiedUntil ? until : qMin(q.ModifiedUntil, until);
+        }
+        if(!contradiction)
+            matches = m_queryIndex.Execute(q);
+    }
+    else{
+        m_queryError = q.ErrorString();
+    }
+
+    // Rows that aren't in the filter index didn't match
+    m_acceptUnindexed = !fi.FilterResults;
+    for(const EntryId &id : matches){
+        m_index[id].row_matches = true;
+
+        // Show the ancestors of the matching rows, so you can get to them
+        for(EntryId pid = m_queryIndex.ParentId(id); !pid.IsNull(); pid = m_queryIndex.ParentId(pid)){
+            filtered_state_t &fs = m_index[pid];
+            if(fs.show_anyway)
+                break;
+            fs.show_anyway = true;
+        }
+    }
+
+    // Show a row if any of its ancestors matches
+    for(const EntryId &id : matches){
+        for(const EntryId &cid : m_queryIndex.Descendants(id))
+            m_index[cid].show_anyway = true;
+    }
+}
+
+void FilteredDatabaseModel::_rebuild_query_index(const QModelIndex &src_ind)
+{
+    // Building the index causes us to load the entire model
+    if(sourceModel()->canFetchMore(src_ind))
+        sourceModel()->fetchMore(src_ind);
+
+    CompactEntry const *e = _get_database_model()->GetEntryFromIndex(src_ind);
+    if(e)
+        m_queryIndex.Insert(*e);
+
+    for(int i = 0; i < sourceModel()->rowCount(src_ind); ++i)
+        _rebuild_query_index(sourceModel()->index(i, 0, src_ind));
+}
+
+// Updates or removes the entry and everything below it
+void FilteredDatabaseModel::_update_query_index(const QModelIndex &src_ind, bool remove)
+{
+    CompactEntry const *e = _get_database_model()->GetEntryFromIndex(src_ind);
+    if(!e)
+        return;
+
+    if(remove)
+        m_queryIndex.Remove(e->GetId());
+    else{
+        m_queryIndex.Update(*e);
+
+        // We can't fetch rows while the model is telling us about new ones,
+        //  so if they brought children that aren't loaded we start over
+        if(sourceModel()->canFetchMore(src_ind))
+            m_queryIndexDirty = true;
+    }
+
+    for(int i = 0; i < sourceModel()->rowCount(src_ind); ++i)
+        _update_query_index(sourceModel()->index(i, 0, src_ind), remove);
+}
+
+void FilteredDatabaseModel::_source_rows_inserted(const QModelIndex &par, int first, int last)
+{
+    if(m_queryIndexDirty)
+        return;
+    for(int i = first; i <= last; ++i)
+        _update_query_index(sourceModel()->index(i, 0, par), false);
+}
+
+void FilteredDatabaseModel::_source_rows_about_to_be_removed(const QModelIndex &par, int first, int last)
+{
+    if(m_queryIndexDirty)
+        return;
+    for(int i = first; i <= last; ++i)
+        _update_query_index(sourceModel()->index(i, 0, par), true);
+}
+
+void FilteredDatabaseModel::_source_rows_moved(const QModelIndex &src_par, int first, int last,
+                                               const QModelIndex &dest_par, int dest_row)
+{
+    // Only the moved rows' parent changes, and rows aren't indexed
+    if(m_queryIndexDirty || src_par == dest_par)
+        return;
+    for(int i = 0; i <= last - first; ++i){
+        CompactEntry const *e = _get_database_model()->
+                GetEntryFromIndex(sourceModel()->index(dest_row + i, 0, dest_par));
+        if(e)
+            m_queryIndex.Update(*e);
+    }
+}
+
+void FilteredDatabaseModel::_source_data_changed(const QModelIndex &top_left, const QModelIndex &bottom_right)
+{
+    if(m_queryIndexDirty)
+        return;
+    for(int i = top_left.row(); i <= bottom_right.row(); ++i){
+        CompactEntry const *e = _get_database_model()->
+                GetEntryFromIndex(sourceModel()->index(i, 0, top_left.parent()));
+        if(e)
+            m_queryIndex.Update(*e);
+    }
+}
+
+// Calls the function on each field that a search looks at, in order of
+//  precedence, until it returns true. The notes and secret values are only in
+//  the crypttext, so we only decrypt the entry if the user asked to search
+//  them; otherwise every keystroke would decrypt most of the vault.
+static void __for_each_search_field(DatabaseModel *m, const CompactEntry &e, bool also_secrets,
+                                    const function<bool(const QString &, int precedence)> &f)
+{
+    if(f(e.GetName(), 0) || f(e.GetDescription(), 1) || f(e.GetFileName(), 1) || !also_secrets)
+        return;
+
+    const Entry full_entry = m->FindEntryById(e.GetId());
+    for(const SecretValue &sv : full_entry.Values()){
+        if(f(sv.GetNotes(), 2) || f(sv.GetValue(), 2))
+            return;
+    }
 }
 
 // Returns true if the given row matches or a child row matches
-bool FilteredDatabaseModel::_update_index(const QModelIndex &src_ind, const QRegExp &rx, const FilterInfo_t &fi)
+bool FilteredDatabaseModel::_update_index(const QModelIndex &src_ind,
+                                          const filter_context_t &ctx,
+                                          const FilterInfo_t &fi,
+                                          int *branch_score)
 {
+    const QRegExp &rx = ctx.rx;
+    const FuzzyMatcher *fm = ctx.fuzzy.get();
     bool row_matches = false;
     bool show_anyway = !fi.FilterResults;
+    int score = -1;
     DatabaseModel *m = _get_database_model();
 
     // First figure out if a child matches
@@ -75,7 +302,7 @@ bool FilteredDatabaseModel::_update_index(const QModelIndex &src_ind, const QReg
         sourceModel()->fetchMore(src_ind);
 
     // Figure out if this row matches
-    Entry const *e = m->GetEntryFromIndex(src_ind);
+    CompactEntry const *e = m->GetEntryFromIndex(src_ind);
     if(src_ind.isValid())
     {
         // Check if the row fits the pre-filter criteria
@@ -103,21 +330,27 @@ bool FilteredDatabaseModel::_update_index(const QModelIndex &src_ind, const QReg
             // Only check the search string if the pre-filters matched
             if(rx.pattern().isEmpty())
                 show_anyway = true;
+            else if(fm)
+            {
+                // Name matches rank ahead of other matches with the same distance,
+                //  so we stop once no field further down could do better
+                __for_each_search_field(m, *e, fi.AlsoSearchSecrets,
+                                        [&](const QString &field, int precedence){
+                    if(0 <= score && score <= precedence)
+                        return true;
+                    const int d = fm->Distance(field);
+                    if(0 <= d && (0 > score || d + precedence < score))
+                        score = d + precedence;
+                    return false;
+                });
+                row_matches = 0 <= score;
+            }
             else
             {
-                row_matches =
-                        -1 != e->GetName().indexOf(rx) ||
-                        -1 != e->GetDescription().indexOf(rx) ||
-                        -1 != e->GetFileName().indexOf(rx);
-
-                for(int i = 0; !row_matches && i < e->Values().count(); ++i)
-                {
-                    row_matches = -1 != e->Values()[i].GetNotes().indexOf(rx);
-
-                    // Only search the secret values if the user elects to
-                    if(!row_matches && fi.AlsoSearchSecrets)
-                        row_matches = -1 != e->Values()[i].GetValue().indexOf(rx);
-                }
+                __for_each_search_field(m, *e, fi.AlsoSearchSecrets,
+                                        [&](const QString &field, int){
+                    return row_matches = -1 != field.indexOf(rx);
+                });
             }
         }
 
@@ -132,38 +365,76 @@ bool FilteredDatabaseModel::_update_index(const QModelIndex &src_ind, const QReg
             }
         }
 
-        m_index.insert(e->GetId(), filtered_state_t(show_anyway, row_matches));
+        m_index.insert(e->GetId(), filtered_state_t(show_anyway, row_matches, score));
     }
 
     // After updating the index with this node, descend to the child nodes
     bool show_afterwards = false;
+    int best_score = score;
     for(int i = 0; i < sourceModel()->rowCount(src_ind); ++i){
-        if(_update_index(sourceModel()->index(i, 0, src_ind), rx, fi))
+        int child_score = -1;
+        if(_update_index(sourceModel()->index(i, 0, src_ind), ctx, fi, &child_score))
             show_afterwards = true;
+        if(0 <= child_score && (0 > best_score || child_score < best_score))
+            best_score = child_score;
     }
 
-    if(src_ind.isValid() && !show_anyway && show_afterwards)
-        m_index[e->GetId()].show_anyway = true;
+    if(src_ind.isValid()){
+        filtered_state_t &fs = m_index[e->GetId()];
+        if(!show_anyway && show_afterwards)
+            fs.show_anyway = true;
+        fs.branch_score = best_score;
+    }
 
+    if(branch_score)
+        *branch_score = best_score;
     return show_anyway || show_afterwards || row_matches;
 }
 
 bool FilteredDatabaseModel::filterAcceptsRow(int src_row, const QModelIndex &src_par) const
 {
     bool ret = true;
-    if(!m_index.isEmpty())
+    if(!m_index.isEmpty() || !m_acceptUnindexed)
     {
-        Entry const *e = _get_database_model()->
+        CompactEntry const *e = _get_database_model()->
                 GetEntryFromIndex(sourceModel()->index(src_row, 0, src_par));
 
-        if(m_index.contains(e->GetId())){
-            const filtered_state_t &fs = m_index[e->GetId()];
-            ret = fs.show_anyway | fs.row_matches;
-        }
+        auto iter = m_index.find(e->GetId());
+        if(iter != m_index.end())
+            ret = iter->show_anyway | iter->row_matches;
+        else
+            ret = m_acceptUnindexed;
     }
     return ret;
 }
 
+bool FilteredDatabaseModel::lessThan(const QModelIndex &lhs, const QModelIndex &rhs) const
+{
+    if(!m_ranked)
+        return QSortFilterProxyModel::lessThan(lhs, rhs);
+
+    DatabaseModel *m = _get_database_model();
+    CompactEntry const *le = m->GetEntryFromIndex(lhs);
+    CompactEntry const *re = m->GetEntryFromIndex(rhs);
+    int ls = le ? m_index.value(le->GetId()).branch_score : -1;
+    int rs = re ? m_index.value(re->GetId()).branch_score : -1;
+
+    // Rows without a score go to the bottom, and ties keep their original order
+    if(ls != rs){
+        if(0 > ls)
+            return false;
+        else if(0 > rs)
+            return true;
+        return ls < rs;
+    }
+    return lhs.row() < rhs.row();
+}
+
+int FilteredDatabaseModel::GetMatchScore(const EntryId &id) const
+{
+    return m_ranked ? m_index.value(id).score : -1;
+}
+
 QModelIndexList FilteredDatabaseModel::GetUnfilteredRows() const
 {
     QModelIndexList ret;
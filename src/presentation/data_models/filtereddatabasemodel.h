@@ -16,12 +16,14 @@ limitations under the License.*/
 #define FILTEREDDATABASEMODEL_H
 
 #include <grypto/common.h>
+#include <grypto/entryquery.h>
 #include <QDateTime>
 #include <QSortFilterProxyModel>
 
 namespace Grypt{
 
 class DatabaseModel;
+class FuzzyMatcher;
 
 
 /** The info needed to filter entries. */
@@ -35,11 +37,23 @@ struct FilterInfo_t
     bool IgnoreCase         = true;
     bool ShowOnlyFavorites  = false;
     bool ShowOnlyFiles      = false;
+
+    /** Also search the notes and secret values, which means decrypting
+     *  every entry that doesn't match otherwise. */
     bool AlsoSearchSecrets  = false;
 
     enum StringType{
         Wildcard,
-        RegExp
+        RegExp,
+
+        /** Matches the same fields as the other searches within a small edit
+         *  distance of the search string, and ranks the results by that
+         *  distance. */
+        Fuzzy,
+
+        /** Interprets the search string with the EntryQuery syntax,
+         *  for example: name:bank fav:yes modified:>2015-01-01 */
+        Query
     } SearchStringType;
 
     QDateTime StartTime;
@@ -80,11 +94,23 @@ class FilteredDatabaseModel :
     struct filtered_state_t{
         bool show_anyway;
         bool row_matches;
-        filtered_state_t() :show_anyway(false), row_matches(false) {}
-        filtered_state_t(bool cm, bool rm) :show_anyway(cm), row_matches(rm) {}
+        int score;          // The row's own fuzzy score
+        int branch_score;   // The best fuzzy score of the row and its descendants
+        filtered_state_t() :show_anyway(false), row_matches(false), score(-1), branch_score(-1) {}
+        filtered_state_t(bool cm, bool rm, int s = -1)
+            :show_anyway(cm), row_matches(rm), score(s), branch_score(s) {}
     };
 
+    struct filter_context_t;
+
     QHash<EntryId, filtered_state_t> m_index;
+    bool m_ranked;
+    EntryIndex m_queryIndex;
+    bool m_queryIndexDirty;
+    QString m_queryError;
+
+    // False if rows that aren't in the filter index are hidden
+    bool m_acceptUnindexed;
 public:
 
     explicit FilteredDatabaseModel(QObject *parent = 0);
@@ -97,6 +123,17 @@ public:
     */
     QModelIndexList GetUnfilteredRows() const;
 
+    /** Returns the fuzzy match score of the entry, which is its edit distance from
+     *  the search string (lower is better). Returns -1 if the entry did not match
+     *  or if the current filter is not a fuzzy search.
+    */
+    int GetMatchScore(const EntryId &) const;
+
+    /** Returns the reason the last query failed to parse, or an empty string
+     *  if the current filter is not a query or it parsed successfully.
+    */
+    QString const &GetQueryError() const{ return m_queryError; }
+
 
 public slots:
 
@@ -108,12 +145,29 @@ protected:
 
     virtual bool filterAcceptsRow(int, const QModelIndex &) const;
 
+    /** When a fuzzy filter is applied, rows are sorted by their match score. */
+    virtual bool lessThan(const QModelIndex &, const QModelIndex &) const;
+
+
+private slots:
+
+    // These keep the query index up to date with the source model
+    void _source_rows_inserted(const QModelIndex &, int, int);
+    void _source_rows_about_to_be_removed(const QModelIndex &, int, int);
+    void _source_rows_moved(const QModelIndex &, int, int, const QModelIndex &, int);
+    void _source_data_changed(const QModelIndex &, const QModelIndex &);
+    void _clear_query_index(){ m_queryIndex.Clear(); m_queryIndexDirty = true; }
+
 
 private:
 
     DatabaseModel *_get_database_model() const;
 
-    bool _update_index(const QModelIndex &src_ind, const QRegExp &, const FilterInfo_t &);
+    bool _update_index(const QModelIndex &src_ind, const filter_context_t &,
+                       const FilterInfo_t &, int *branch_score);
+    void _rebuild_query_index(const QModelIndex &src_ind);
+    void _update_query_index(const QModelIndex &src_ind, bool remove);
+    void _apply_query(const FilterInfo_t &);
 
 };
 
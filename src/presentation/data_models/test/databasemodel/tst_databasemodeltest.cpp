@@ -14,6 +14,8 @@ limitations under the License.*/
 
 #include <grypto_entry.h>
 #include <grypto_databasemodel.h>
+#include <grypto_filtereddatabasemodel.h>
+#include <grypto_fuzzymatcher.h>
 #include <gutil/cryptopp_rng.h>
 #include <QString>
 #include <QtTest>
@@ -71,6 +73,11 @@ private Q_SLOTS:
     void test_move_entries_basic();
     void test_move_entries_down_same_parent();
     void test_move_entries_up_same_parent();
+    void test_model_holds_no_secrets();
+    void test_import_updates_model_in_place();
+    void test_fuzzy_matcher();
+    void test_fuzzy_ranking();
+    void test_search_secrets();
 
 private:
     void _cleanup_database(){
@@ -943,6 +950,201 @@ void DatabasemodelTest::test_move_entries_up_same_parent()
     }
 }
 
+void DatabasemodelTest::test_model_holds_no_secrets()
+{
+    _cleanup_database();
+    Entry e;
+    e.SetName("secret entry");
+    SecretValue sv;
+    sv.SetName("password");
+    sv.SetValue("hunter2");
+    sv.SetNotes("some notes");
+    e.Values().append(sv);
+    {
+        DatabaseModel dbm(DATABASE_PATH); dbm.Open(m_creds);
+        dbm.AddEntry(e);
+
+        // The model only has the display fields
+        CompactEntry const *model_entry = dbm.GetEntryFromIndex(dbm.FindIndexById(e.GetId()));
+        QVERIFY(model_entry);
+        QVERIFY(model_entry->GetName() == "secret entry");
+        QVERIFY(model_entry->ToEntry().Values().isEmpty());
+
+        // The secrets are decrypted on demand
+        QVERIFY(__compare_entries(e, dbm.FindEntryById(e.GetId())));
+
+        // Undoing a delete brings back the secrets
+        dbm.RemoveEntry(model_entry->ToEntry());
+        dbm.Undo();
+        QVERIFY(__compare_entries(e, dbm.FindEntryById(e.GetId())));
+    }
+
+    // The same goes for entries loaded from disk
+    {
+        DatabaseModel dbm(DATABASE_PATH); dbm.Open(m_creds);
+        CompactEntry const *model_entry = dbm.GetEntryFromIndex(dbm.FindIndexById(e.GetId()));
+        QVERIFY(model_entry);
+        QVERIFY(model_entry->ToEntry().Values().isEmpty());
+        QVERIFY(__compare_entries(e, dbm.FindEntryById(e.GetId())));
+    }
+}
+
+void DatabasemodelTest::test_import_updates_model_in_place()
+{
+    _cleanup_database();
+    const QString xml_path = "test_export.xml";
+    Entry e0, e1;
+    e0.SetName("parent");
+    e1.SetName("child");
+    {
+        DatabaseModel dbm(DATABASE_PATH); dbm.Open(m_creds);
+        dbm.AddEntry(e0);
+        e1.SetParentId(e0.GetId());
+        dbm.AddEntry(e1);
+        dbm.FetchAllEntries();
+        CompactEntry const *loaded_entry = dbm.GetEntryFromIndex(dbm.FindIndexById(e1.GetId()));
+        QVERIFY(loaded_entry);
+
+        dbm.ExportToXml(xml_path);
+        dbm.WaitForBackgroundThreadIdle();
+        dbm.ImportFromXml(xml_path);
+        dbm.WaitForBackgroundThreadIdle();
+        QCoreApplication::processEvents();
+
+        // The entries that were already loaded are untouched
+        QVERIFY(loaded_entry == dbm.GetEntryFromIndex(dbm.FindIndexById(e1.GetId())));
+
+        // The imported entries were inserted under a new root entry
+        QVERIFY(dbm.rowCount() == 2);
+        QModelIndex imported = dbm.index(1, 0, QModelIndex());
+        QVERIFY(dbm.rowCount(imported) == 1);
+        QModelIndex imported_parent = dbm.index(0, 0, imported);
+        QVERIFY(imported_parent.data().toString() == "parent");
+        QVERIFY(dbm.rowCount(imported_parent) == 1);
+        QVERIFY(dbm.index(0, 0, imported_parent).data().toString() == "child");
+    }
+    QFile::remove(xml_path);
+}
+
+void DatabasemodelTest::test_fuzzy_matcher()
+{
+    // An exact match scores 0 wherever it is in the text
+    FuzzyMatcher fm("bank");
+    QVERIFY(1 == fm.MaxDistance());
+    QVERIFY(0 == fm.Distance("bank"));
+    QVERIFY(0 == fm.Distance("bank account"));
+    QVERIFY(0 == fm.Distance("my bank account"));
+    QVERIFY(0 == fm.Distance("river bank"));
+    QVERIFY(0 == fm.Distance("BANK"));
+
+    // One edit anywhere in the text
+    QVERIFY(1 == fm.Distance("bamk"));
+    QVERIFY(1 == fm.Distance("my bnk account"));
+    QVERIFY(1 == fm.Distance("the bak"));
+    QVERIFY(1 == fm.Distance("ban"));
+
+    // Too many edits, or the text is too short
+    QVERIFY(-1 == fm.Distance("bnak"));
+    QVERIFY(-1 == fm.Distance("ba"));
+    QVERIFY(-1 == fm.Distance(""));
+    QVERIFY(-1 == fm.Distance("grocery"));
+
+    // Case matters if you ask it to
+    FuzzyMatcher fm_case("Bank", false);
+    QVERIFY(0 == fm_case.Distance("Bank"));
+    QVERIFY(1 == fm_case.Distance("bank"));
+
+    // The bound can be given explicitly
+    FuzzyMatcher fm_exact("bank", true, 0);
+    QVERIFY(-1 == fm_exact.Distance("bamk"));
+    QVERIFY(2 == FuzzyMatcher("bank", true, 2).Distance("bnak"));
+
+    // Characters outside of Latin-1 are matched too
+    FuzzyMatcher fm_unicode(QString::fromUtf8("\xce\xb1\xce\xb2\xce\xb3\xce\xb4"));
+    QVERIFY(0 == fm_unicode.Distance(QString::fromUtf8("x\xce\xb1\xce\xb2\xce\xb3\xce\xb4")));
+    QVERIFY(1 == fm_unicode.Distance(QString::fromUtf8("\xce\xb1\xce\xb2\xce\xb4")));
+
+    // Long patterns are truncated to the word size
+    FuzzyMatcher fm_long(QString(100, 'a'));
+    QVERIFY(FuzzyMatcher::MaxPatternLength == fm_long.PatternLength());
+    QVERIFY(0 == fm_long.Distance(QString(FuzzyMatcher::MaxPatternLength, 'a')));
+}
+
+void DatabasemodelTest::test_fuzzy_ranking()
+{
+    _cleanup_database();
+    DatabaseModel dbm(DATABASE_PATH); dbm.Open(m_creds);
+
+    // Add them in the opposite order of their rank
+    Entry desc_match, no_match, typo, exact;
+    desc_match.SetName("other");
+    desc_match.SetDescription("bnk login");
+    no_match.SetName("grocery");
+    typo.SetName("bamk account");
+    exact.SetName("my bank");
+    for(Entry *e : {&desc_match, &no_match, &typo, &exact})
+        dbm.AddEntry(*e);
+
+    FilteredDatabaseModel fm;
+    fm.setSourceModel(&dbm);
+    fm.SetFilter(FilterInfo_t("bank", true, true, false, false, false, FilterInfo_t::Fuzzy));
+
+    // Name matches rank ahead of description matches with the same distance
+    QVERIFY(0 == fm.GetMatchScore(exact.GetId()));
+    QVERIFY(1 == fm.GetMatchScore(typo.GetId()));
+    QVERIFY(2 == fm.GetMatchScore(desc_match.GetId()));
+    QVERIFY(-1 == fm.GetMatchScore(no_match.GetId()));
+
+    QVERIFY(3 == fm.rowCount());
+    QVERIFY(fm.index(0, 0).data().toString() == "my bank");
+    QVERIFY(fm.index(1, 0).data().toString() == "bamk account");
+    QVERIFY(fm.index(2, 0).data().toString() == "other");
+
+    // Without a fuzzy filter the original order comes back, and there are no scores
+    fm.SetFilter(FilterInfo_t());
+    QVERIFY(4 == fm.rowCount());
+    QVERIFY(fm.index(0, 0).data().toString() == "other");
+    QVERIFY(-1 == fm.GetMatchScore(exact.GetId()));
+}
+
+void DatabasemodelTest::test_search_secrets()
+{
+    _cleanup_database();
+    DatabaseModel dbm(DATABASE_PATH); dbm.Open(m_creds);
+
+    Entry in_value, in_notes, plain;
+    SecretValue sv;
+    sv.SetName("pin");
+    sv.SetValue("bank pin");
+    in_value.SetName("first");
+    in_value.Values().append(sv);
+    sv.SetValue("1234");
+    sv.SetNotes("from the bank");
+    in_notes.SetName("second");
+    in_notes.Values().append(sv);
+    plain.SetName("bank");
+    for(Entry *e : {&in_value, &in_notes, &plain})
+        dbm.AddEntry(*e);
+
+    // Both kinds of search look at the same fields, and only look at the
+    //  secrets if you ask them to
+    FilteredDatabaseModel fm;
+    fm.setSourceModel(&dbm);
+    for(FilterInfo_t::StringType type : {FilterInfo_t::Wildcard, FilterInfo_t::Fuzzy}){
+        fm.SetFilter(FilterInfo_t("bank", true, true, false, false, false, type));
+        QVERIFY(1 == fm.rowCount());
+        QVERIFY(fm.index(0, 0).data().toString() == "bank");
+
+        fm.SetFilter(FilterInfo_t("bank", true, true, false, false, true, type));
+        QVERIFY(3 == fm.rowCount());
+    }
+
+    // Secret matches rank behind the name
+    QVERIFY(0 == fm.GetMatchScore(plain.GetId()));
+    QVERIFY(2 == fm.GetMatchScore(in_value.GetId()));
+    QVERIFY(2 == fm.GetMatchScore(in_notes.GetId()));
+}
+
 
 QTEST_MAIN(DatabasemodelTest)
 
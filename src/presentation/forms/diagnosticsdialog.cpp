@@ -0,0 +1,130 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#include "diagnosticsdialog.h"
+#include "ui_diagnosticsdialog.h"
+#include <grypto/databasemodel.h>
+#include <grypto/sqlprofiler.h>
+#include <grypto/workermetrics.h>
+#include <QApplication>
+#include <QClipboard>
+#include <QTimerEvent>
+NAMESPACE_GRYPTO;
+
+#define REFRESH_INTERVAL 1000
+
+static QString __format_kdf(const KdfBenchmark &b)
+{
+    QString ret = QObject::tr("Unlocking took %1 with %2 key derivation iterations")
+            .arg(LatencyHistogram::FormatMicroseconds(b.UnlockMilliseconds * 1000))
+            .arg(b.Parameters.Iterations);
+    if(0 < b.IterationsPerSecond)
+        ret.append(QObject::tr(" (calibrated for %1 ms at %2 iterations/s)")
+                   .arg(b.TargetMilliseconds)
+                   .arg(b.IterationsPerSecond, 0, 'f', 0));
+    return ret;
+}
+
+
+DiagnosticsDialog::DiagnosticsDialog(DatabaseModel *dbm, QWidget *parent)
+    :QDialog(parent),
+      ui(new Ui::DiagnosticsDialog),
+      m_model(dbm)
+{
+    ui->setupUi(this);
+    ui->tableWidget->setHorizontalHeaderLabels({
+                                                   tr("Command"), tr("Count"), tr("Failed"),
+                                                   tr("Wait (avg)"), tr("Wait (p95)"),
+                                                   tr("Run (avg)"), tr("Run (p50)"),
+                                                   tr("Run (p99)"), tr("Run (max)")
+                                               });
+    connect(ui->btn_reset, SIGNAL(clicked()), this, SLOT(_reset()));
+    connect(ui->btn_copy, SIGNAL(clicked()), this, SLOT(_copy_to_clipboard()));
+
+    _refresh();
+    m_timerId = startTimer(REFRESH_INTERVAL);
+}
+
+DiagnosticsDialog::~DiagnosticsDialog()
+{
+    killTimer(m_timerId);
+    delete ui;
+}
+
+void DiagnosticsDialog::timerEvent(QTimerEvent *ev)
+{
+    if(ev->timerId() == m_timerId)
+        _refresh();
+}
+
+void DiagnosticsDialog::_refresh()
+{
+    const WorkerMetrics m = m_model->GetWorkerMetrics();
+    ui->lbl_queue->setText(tr("%1 commands waiting (max %2), %3 queued in total")
+                           .arg(m.QueueDepth).arg(m.MaxQueueDepth).arg(m.CommandsQueued));
+    ui->lbl_encryption->setText(tr("%1 MB encrypted at %2 MB/s, %3 MB decrypted at %4 MB/s")
+                                .arg(m.FileEncryption.Bytes / (1024.0 * 1024.0), 0, 'f', 1)
+                                .arg(m.FileEncryption.MegabytesPerSecond(), 0, 'f', 1)
+                                .arg(m.FileDecryption.Bytes / (1024.0 * 1024.0), 0, 'f', 1)
+                                .arg(m.FileDecryption.MegabytesPerSecond(), 0, 'f', 1));
+    ui->lbl_kdf->setText(__format_kdf(m_model->GetKdfBenchmark()));
+
+    ui->tableWidget->setRowCount(m.Commands.length());
+    for(int i = 0; i < m.Commands.length(); ++i){
+        const WorkerMetrics::CommandMetrics &c = m.Commands[i];
+        const QStringList cells{
+            c.Name,
+            QString::number(c.Execution.Count),
+            QString::number(c.Failures),
+            LatencyHistogram::FormatMicroseconds(c.QueueWait.MeanMicroseconds()),
+            LatencyHistogram::FormatMicroseconds(c.QueueWait.Percentile(95)),
+            LatencyHistogram::FormatMicroseconds(c.Execution.MeanMicroseconds()),
+            LatencyHistogram::FormatMicroseconds(c.Execution.Percentile(50)),
+            LatencyHistogram::FormatMicroseconds(c.Execution.Percentile(99)),
+            LatencyHistogram::FormatMicroseconds(c.Execution.MaxMicroseconds),
+        };
+        for(int j = 0; j < cells.length(); ++j){
+            QTableWidgetItem *item = ui->tableWidget->item(i, j);
+            if(!item){
+                item = new QTableWidgetItem;
+                if(0 < j)
+                    item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+                ui->tableWidget->setItem(i, j, item);
+            }
+            item->setText(cells[j]);
+        }
+    }
+
+    // Only touch the text if it changed, so we don't lose the scroll position
+    const QString sql_report = SqlProfiler::GetReport();
+    if(sql_report != ui->txt_sql->toPlainText())
+        ui->txt_sql->setPlainText(sql_report);
+}
+
+void DiagnosticsDialog::_reset()
+{
+    m_model->ResetWorkerMetrics();
+    SqlProfiler::Reset();
+    _refresh();
+}
+
+void DiagnosticsDialog::_copy_to_clipboard()
+{
+    QApplication::clipboard()->setText(m_model->GetWorkerMetrics().ToString() +
+                                       "\n" + __format_kdf(m_model->GetKdfBenchmark()) +
+                                       "\n\n" + SqlProfiler::GetReport());
+}
+
+
+END_NAMESPACE_GRYPTO;
@@ -0,0 +1,56 @@
+/*Copyright 2014-2015 George Karagoulis
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.*/
+
+#ifndef DIAGNOSTICSDIALOG_H
+#define DIAGNOSTICSDIALOG_H
+
+#include <QDialog>
+
+namespace Ui {
+class DiagnosticsDialog;
+}
+
+namespace Grypt{
+
+class DatabaseModel;
+
+
+/** Shows the background thread's metrics and the SQL statement profile,
+ *  and refreshes them every second.
+*/
+class DiagnosticsDialog : public QDialog
+{
+    Q_OBJECT
+public:
+    explicit DiagnosticsDialog(DatabaseModel *, QWidget *parent = 0);
+    ~DiagnosticsDialog();
+
+protected:
+    virtual void timerEvent(QTimerEvent *);
+
+private slots:
+    void _refresh();
+    void _reset();
+    void _copy_to_clipboard();
+
+private:
+    Ui::DiagnosticsDialog *ui;
+    DatabaseModel *m_model;
+    int m_timerId;
+};
+
+
+}
+
+#endif // DIAGNOSTICSDIALOG_H
@@ -4,7 +4,8 @@ FORMS += \
     forms/entry_edit.ui \
     forms/generatepassworddialog.ui \
     forms/noteseditdialog.ui \
-    $$PWD/organizefavoritesdialog.ui
+    $$PWD/organizefavoritesdialog.ui \
+    $$PWD/diagnosticsdialog.ui
 
 HEADERS += \
     forms/getpassworddialog.h \
@@ -13,7 +14,8 @@ HEADERS += \
     forms/generatepassworddialog.h \
     forms/noteseditdialog.h \
     $$PWD/organizefavoritesdialog.h \
-    $$PWD/aboutbase.h
+    $$PWD/aboutbase.h \
+    $$PWD/diagnosticsdialog.h
 
 SOURCES += \
     forms/getpassworddialog.cpp \
@@ -22,4 +24,5 @@ SOURCES += \
     forms/generatepassworddialog.cpp \
     forms/noteseditdialog.cpp \
     $$PWD/organizefavoritesdialog.cpp \
-    $$PWD/aboutbase.cpp
+    $$PWD/aboutbase.cpp \
+    $$PWD/diagnosticsdialog.cpp